@@ -11,6 +11,7 @@ SUBDIRS = \
 #    test_tor \
 #    test_crypto \
 #    test_core \
+#    test_prot \
 #    test_models
 
 torlib.subdir = src/torlib
@@ -30,6 +31,9 @@ modelslib.depends = corelib
 #test_core.subdir = tests/tests_core
 #test_core.depends = corelib torlib cryptolib protlib
 
+#test_prot.subdir = tests/tests_prot
+#test_prot.depends = protlib corelib
+
 #test_tor.subdir = tests/tests_tor
 #test_tor.depends = torlib cryptolib
 
@@ -44,6 +44,15 @@ SOURCES += \
     src/filemanager.cpp \
     src/file.cpp \
     src/hashtask.cpp \
+    src/hashservice.cpp \
+    src/treehash.cpp \
+    src/hashcache.cpp \
+    src/dirarchive.cpp \
+    src/delta.cpp \
+    src/signaturetask.cpp \
+    src/statementcache.cpp \
+    src/dirtytracker.cpp \
+    src/dbexecutor.cpp \
     src/logutil.cpp
 
 HEADERS += \
@@ -68,6 +77,15 @@ HEADERS += \
     include/ds/filemanager.h \
     include/ds/file.h \
     include/ds/hashtask.h \
+    include/ds/hashservice.h \
+    include/ds/treehash.h \
+    include/ds/hashcache.h \
+    include/ds/dirarchive.h \
+    include/ds/delta.h \
+    include/ds/signaturetask.h \
+    include/ds/statementcache.h \
+    include/ds/dirtytracker.h \
+    include/ds/dbexecutor.h \
     include/ds/logutil.h \
     include/ds/bytes.h \
     include/ds/userinfo.h
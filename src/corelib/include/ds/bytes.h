@@ -2,6 +2,8 @@
 #define BYTES_H
 
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
 #include <algorithm>
 
 namespace ds {
@@ -39,6 +41,56 @@ valueT bytesToValue(bufT& buffer) {
     return *value;
 }
 
+// Max number of bytes needed to encode valueT as a varint
+template <typename valueT>
+constexpr size_t maxVarintBytes() {
+    return ((sizeof(valueT) * 8) + 6) / 7;
+}
+
+/*! Encode an unsigned value as a little-endian base 128 varint
+ *
+ * The destination must have room for maxVarintBytes<valueT>() bytes.
+ * Returns the number of bytes written.
+ */
+template <typename valueT>
+size_t valueToVarint(valueT value, uint8_t *dst) {
+    size_t len = 0;
+    do {
+        auto byte = static_cast<uint8_t>(value & 0x7f);
+        value >>= 7;
+        if (value) {
+            byte |= 0x80;
+        }
+        dst[len++] = byte;
+    } while (value);
+
+    return len;
+}
+
+/*! Decode a varint
+ *
+ * Returns the number of bytes consumed, or 0 if the varint is
+ * truncated or does not fit in valueT.
+ */
+template <typename valueT>
+size_t varintToValue(const uint8_t *src, const size_t len, valueT& value) {
+    constexpr size_t bits = sizeof(valueT) * 8;
+    value = {};
+    const auto max = std::min(len, maxVarintBytes<valueT>());
+    for(size_t i = 0, shift = 0; i < max; ++i, shift += 7) {
+        const auto bits_value = static_cast<valueT>(src[i] & 0x7f);
+        if ((shift + 7 > bits) && (bits_value >> (bits - shift))) {
+            return 0; // Overflow
+        }
+        value |= static_cast<valueT>(bits_value << shift);
+        if ((src[i] & 0x80) == 0) {
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
 }}
 
 
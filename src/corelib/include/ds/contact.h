@@ -3,6 +3,7 @@
 
 #include <memory>
 #include <deque>
+#include <map>
 #include <set>
 
 #include <QDateTime>
@@ -180,6 +181,9 @@ public:
     void onAddmeRequest(const PeerAddmeReq& req);
     //void onReceivedMessage(const PeerMessage& msg, Conversation *conversation = {});
     void sendAck(const QString& what, const QString& status, const QString& data = {});
+
+    // Acknowledge a received message. Acks are coalesced and sent after a short delay.
+    void queueMessageAck(const QByteArray& messageId, const QString& status);
     static bool validateNick(const QString& nickName);
     void sendUserInfo();
 
@@ -228,6 +232,7 @@ private slots:
 private:
     static void bind(QSqlQuery& query, ContactData& data);
     void loadMessageQueue();
+    void onMessageQueueLoaded(const std::vector<int>& ids);
     void loadFileQueue();
     void queueTransfer(const std::shared_ptr<File>& file);
     void clearFileQueues();
@@ -235,6 +240,8 @@ private:
     void scheduleProcessOnlineLater();
     void processOnlineLater();
     void sendBlockNotification();
+    void flushMessageAcks();
+    void onMessageAck(const QByteArray& messageId, const QByteArray& status);
 
     // Sends reject message if the conversation is not the default and don't exist.
     Conversation *getRequestedOrDefaultConversation(const QByteArray& hash,
@@ -245,16 +252,19 @@ private:
     int id_ = -1; // Database id
     bool online_ = false;
     bool loadedMessageQueue_ = false;
+    bool loadingMessageQueue_ = false;
     bool loadedFileQueue_ = false;
     data_t data_;
     QString onlineIcon_ = "qrc:///images/onion-bw.svg";
     OnlineStatus onlineStatus_ = DISCONNECTED;
     bool sentAvatarPendingAck_ = false;
     bool avatarUrlChanging_ = false;
+    bool processFilesQueuePending_ = false;
 
     std::unique_ptr<Connection> connection_;
     std::deque<Message::ptr_t> messageQueue_;
-    std::deque<Message::ptr_t> unconfirmedMessageQueue_; // Waiting for ack
+    std::map<QByteArray, Message::ptr_t> unconfirmedMessages_; // Waiting for ack, by message-id
+    std::map<QString, std::vector<QByteArray>> pendingMessageAcks_; // By status
     std::deque<std::shared_ptr<File>> fileQueue_;
     std::set<std::shared_ptr<File>> transferringFileQueue_; // Currently transferring, (we have slots)
 };
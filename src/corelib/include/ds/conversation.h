@@ -44,6 +44,9 @@ public:
     Q_INVOKABLE void sendMessage(const QString& text);
     Q_INVOKABLE void sendFile(const QVariantMap& args);
 
+    // Accept all the files offered in this conversation
+    Q_INVOKABLE void acceptAllFiles();
+
     void incomingMessage(Contact *contact, const MessageData& data);
     void incomingFileOffer(Contact *contact, const PeerFileOffer& offer);
 
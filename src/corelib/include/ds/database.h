@@ -1,7 +1,9 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
+#include <memory>
 #include <stdexcept>
+#include <vector>
 
 #include <QObject>
 #include <QSettings>
@@ -10,6 +12,10 @@
 #include <QSqlError>
 #include <QSqlQuery>
 
+#include "ds/dbexecutor.h"
+#include "ds/dirtytracker.h"
+#include "ds/statementcache.h"
+
 namespace ds {
 namespace core {
 
@@ -30,7 +36,13 @@ public:
         DS_VERSION = 0
     };
 
+    static constexpr int getCurrentVersion() noexcept { return currentVersion; }
+    int getVersion();
+
     QSqlDatabase& getDb() { return db_; }
+    StatementCache& getStatements() { return *statements_; }
+    DirtyTracker& getDirtyTracker() { return *dirtyTracker_; }
+    DbExecutor& getExecutor() { return *executor_; }
 
 signals:
 
@@ -38,12 +50,24 @@ public slots:
 
 protected:
     void createDatabase();
+    void upgrade(const int fromVersion);
     void exec(const char *sql);
     void prepareData();
 
-    static constexpr int currentVersion = 1;
+    struct Migration {
+        int version; // The version after the migration
+        const char *description;
+        std::vector<const char *> statements;
+    };
+
+    static constexpr int currentVersion = 8;
+    static constexpr int createdVersion = 4; // The schema made by createDatabase()
+    static const std::vector<Migration> migrations;
     QSqlDatabase db_;
     QSettings& settings_;
+    std::unique_ptr<StatementCache> statements_;
+    std::unique_ptr<DirtyTracker> dirtyTracker_;
+    std::unique_ptr<DbExecutor> executor_;
 };
 
 }} // namespaces
@@ -0,0 +1,129 @@
+#ifndef DBEXECUTOR_H
+#define DBEXECUTOR_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <QObject>
+#include <QPointer>
+#include <QSqlDatabase>
+#include <QString>
+
+namespace ds {
+namespace core {
+
+class DirtyTracker;
+
+/*! Runs SQL on other threads than the GUI thread.
+ *
+ * The executor has one writer connection on its own thread, and a
+ * small pool of read-only connections. The database is in WAL mode,
+ * so the readers see the last committed data, and don't wait for
+ * the writers. Pending changes in the DirtyTracker are flushed when
+ * a job is queued, so the job sees them.
+ *
+ * The result, or the error, is delivered on the executor's thread
+ * (the GUI thread) if the context object still exists.
+ *
+ * An in-memory database can't be shared between connections. Then
+ * the jobs run on the database's own connection when we return to
+ * the event-loop.
+ */
+class DbExecutor : public QObject
+{
+    Q_OBJECT
+public:
+    using job_t = std::function<void (QSqlDatabase& db)>;
+    using failed_fn_t = std::function<void (const QString& reason)>;
+
+    static constexpr int defaultReaders = 2;
+
+    // The main connection must be open
+    DbExecutor(QSqlDatabase& db, DirtyTracker& dirtyTracker, const int readers);
+
+    // Waits for the queued writes. Queued reads are discarded.
+    ~DbExecutor() override;
+
+    /*! Run a query on a read-only connection.
+     *
+     * /query/ runs on a worker thread, and can only use the
+     * connection it gets. /done/ gets its result.
+     */
+    template <typename T>
+    void read(std::function<T (QSqlDatabase&)> query, QObject *context,
+              std::function<void (T)> done, failed_fn_t failed = {}) {
+        post(readers_, makeJob(false, std::move(query), context, std::move(done), std::move(failed)));
+    }
+
+    // Run a job in a transaction on the writer connection
+    template <typename T>
+    void write(std::function<T (QSqlDatabase&)> query, QObject *context,
+               std::function<void (T)> done, failed_fn_t failed = {}) {
+        post(writer_, makeJob(true, std::move(query), context, std::move(done), std::move(failed)));
+    }
+
+    // Run a job in a transaction on the writer connection. Errors are logged.
+    void write(job_t job);
+
+    bool isShared() const noexcept { return !path_.isEmpty(); }
+
+private:
+    struct Pool {
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::deque<job_t> queue;
+        std::vector<std::thread> threads;
+        bool readOnly = false;
+        bool done = false;
+    };
+
+    template <typename T>
+    job_t makeJob(const bool transaction, std::function<T (QSqlDatabase&)> query,
+                  QObject *context, std::function<void (T)> done, failed_fn_t failed) {
+        QPointer<QObject> target{context};
+        return [this, transaction, query=std::move(query), target, done=std::move(done),
+                failed=std::move(failed)](QSqlDatabase& db) {
+            try {
+                if (transaction) {
+                    begin(db);
+                }
+                auto result = std::make_shared<T>(query(db));
+                if (transaction) {
+                    commit(db);
+                }
+                deliver(target, [done, result] {
+                    done(std::move(*result));
+                });
+            } catch(const std::exception& ex) {
+                if (transaction) {
+                    db.rollback();
+                }
+                fail(target, failed, ex.what());
+            }
+        };
+    }
+
+    static void begin(QSqlDatabase& db);
+    static void commit(QSqlDatabase& db);
+    void post(Pool& pool, job_t job);
+    void run(Pool& pool, const QString& name);
+    void deliver(const QPointer<QObject>& target, std::function<void ()> fn);
+    void fail(const QPointer<QObject>& target, const failed_fn_t& failed, const QString& reason);
+    void stop(Pool& pool, const bool discard);
+    void start(Pool& pool, const int threads, const QString& name);
+
+    QSqlDatabase& db_;
+    DirtyTracker& dirtyTracker_;
+    const QString path_; // Empty for an in-memory database
+    Pool readers_;
+    Pool writer_;
+};
+
+}} // namespaces
+
+#endif // DBEXECUTOR_H
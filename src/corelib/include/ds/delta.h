@@ -0,0 +1,174 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <unordered_map>
+
+#include <QByteArray>
+#include <QFile>
+#include <QIODevice>
+#include <QString>
+
+namespace ds {
+namespace core {
+
+/*! rsync-style delta for files that are sent again after they were modified.
+ *
+ * The receiver has an earlier version of the file, the basis. It sends
+ * the signature of the basis to the sender: a weak rolling checksum and
+ * a truncated SHA-256 for each block. The sender looks for the blocks
+ * at any offset in the new file, and sends a stream of operations
+ * instead of the file's content:
+ *
+ *      LITERAL: 0x01 | varint length | data
+ *      COPY:    0x02 | varint first block | varint block count
+ *
+ * Each frame holds whole operations. The receiver rebuilds the file
+ * from the operations and the basis, and verifies it against the file
+ * hash as usual.
+ */
+class Delta {
+public:
+    static constexpr int weakBytes = 4;
+    static constexpr int strongBytes = 16;
+    static constexpr int signatureBytes = weakBytes + strongBytes;
+
+    // Smaller files are just sent
+    static constexpr qint64 minFileSize = 1024 * 256;
+
+    static constexpr qint64 minBlockSize = 1024 * 2;
+
+    // The block-size is increased until the basis fits in this many blocks
+    static constexpr qint64 maxBlocks = 1024 * 16;
+
+    // Max bytes one COPY operation, or the operations in one frame, expands to
+    static constexpr qint64 maxExpandBytes = 1024 * 1024 * 4;
+
+    // Larger basis files are not used
+    static constexpr qint64 maxBlockSize = maxExpandBytes;
+
+    enum Op : uint8_t {
+        LITERAL = 1,
+        COPY = 2
+    };
+
+    // Roughly the square root of the size, in whole KB
+    static qint64 getBlockSize(const qint64 basisSize) noexcept;
+
+    static quint32 weakChecksum(const char *data, const size_t len) noexcept;
+    static QByteArray strongHash(const char *data, const size_t len);
+
+    // Signature of the basis, read from the current position. Empty on error.
+    static QByteArray createSignature(QIODevice& basis, const qint64 blockSize);
+
+    // A non-empty list of whole block signatures
+    static bool isValidSignature(const QByteArray& signature);
+
+    /*! The weak checksum, moved one byte at the time over the data */
+    class RollingChecksum {
+    public:
+        void init(const char *data, const size_t len) noexcept;
+        void roll(const char out, const char in) noexcept;
+        quint32 value() const noexcept { return (b_ << 16) | a_; }
+
+    private:
+        quint32 a_ = {};
+        quint32 b_ = {};
+        quint32 len_ = {};
+    };
+};
+
+/*! An earlier version of an incoming file, and its signature */
+struct DeltaBasis {
+    bool isEmpty() const noexcept { return signature.isEmpty(); }
+
+    QString path;
+    qint64 size = {};
+    qint64 blockSize = {};
+    QByteArray signature;
+};
+
+/*! Encodes a file as delta operations against the receiver's signature */
+class DeltaEncoder {
+public:
+    // The source must be open for read
+    DeltaEncoder(QIODevice& source, const qint64 blockSize, const QByteArray& signature);
+
+    /*! Fill /out/ with whole operations.
+     *
+     * Returns the bytes used, or -1 if we failed to read the source.
+     * /finished/ is set when the operations for the whole file are encoded.
+     */
+    qint64 encode(char *out, const qint64 capacity, bool& finished);
+
+    // Bytes of the source that are covered by the operations returned so far
+    qint64 getEncodedBytes() const noexcept { return encoded_; }
+
+    // Source bytes sent as literals, and bytes copied from the basis
+    qint64 getLiteralBytes() const noexcept { return literalBytes_; }
+    qint64 getCopiedBytes() const noexcept { return copiedBytes_; }
+
+private:
+    bool fill();
+    int findBlock();
+    bool flushLiteral(char *out, const qint64 capacity, qint64& used);
+    bool flushCopy(char *out, const qint64 capacity, qint64& used);
+
+    QIODevice& source_;
+    const qint64 blockSize_;
+    const QByteArray signature_;
+    std::unordered_multimap<quint32, int> blocks_; // weak checksum, block
+    QByteArray buffer_;
+    int pos_ = {}; // Start of the window in buffer_
+    int literal_ = {}; // Start of the pending literal in buffer_
+    bool eof_ = false;
+    Delta::RollingChecksum rolling_;
+    bool rollingValid_ = false;
+    int copyFirst_ = {};
+    int copyCount_ = {};
+    qint64 expanded_ = {};
+    qint64 encoded_ = {};
+    qint64 literalBytes_ = {};
+    qint64 copiedBytes_ = {};
+};
+
+/*! Rebuilds a file from delta operations and the basis
+ *
+ * measure() only parses the operations, and is cheap enough for the
+ * event-loop. decode() reads the basis, and is meant for the writer
+ * thread. Both reject frames that expand to more than
+ * Delta::maxExpandBytes.
+ */
+class DeltaDecoder {
+public:
+    // The rebuilt file can't be larger than /maxSize/
+    DeltaDecoder(DeltaBasis basis, const qint64 maxSize);
+
+    bool open();
+
+    /*! Check whole operations without reading the basis.
+     *
+     * Returns the number of bytes they expand to, or -1 if they are
+     * invalid or expand to more than Delta::maxExpandBytes.
+     */
+    qint64 measure(const char *data, const size_t len) const;
+
+    // Decode whole operations, and append the data to /out/
+    bool decode(const char *data, const size_t len, QByteArray& out);
+
+    const QString& getError() const noexcept { return error_; }
+
+private:
+    bool copy(const quint64 first, const quint64 count, QByteArray& out);
+    bool fail(const QString& reason);
+
+    const DeltaBasis basis_;
+    const qint64 maxSize_;
+    QFile io_;
+    qint64 blocks_ = {};
+    qint64 rebuilt_ = {}; // Bytes decoded so far
+    QString error_;
+};
+
+}} // namespaces
+
+#endif // DELTA_H
@@ -0,0 +1,161 @@
+#ifndef DIRARCHIVE_H
+#define DIRARCHIVE_H
+
+#include <vector>
+
+#include <QByteArray>
+#include <QFile>
+#include <QIODevice>
+#include <QString>
+
+#include <sodium.h>
+
+namespace ds {
+namespace core {
+
+/*! A directory tree, sent as one stream over one channel.
+ *
+ * Stream layout:
+ *
+ *      4 bytes manifest length (big endian)
+ *      manifest
+ *      for each file in the manifest: content | SHA-256 of the content
+ *
+ * The manifest is a CBOR array with one [path, size] array per
+ * entry, sorted by path. Paths are relative to the root, with '/'
+ * as separator. Directories have size -1, so empty directories are
+ * created as well. Symlinks are not followed, and not sent.
+ *
+ * The sender hashes each entry as it's read, so the tree is read once
+ * per pass. The receiver verifies each entry as it's unpacked. The
+ * stream as a whole is hashed, offered and verified like a normal file.
+ * Since the order is stable, an unpacked tree gives the same stream.
+ */
+class DirArchive {
+public:
+    struct Entry {
+        Entry() = default;
+        Entry(QString pathVal, qint64 sizeVal)
+            : path{std::move(pathVal)}, size{sizeVal} {}
+
+        bool isDir() const noexcept { return size < 0; }
+
+        QString path;
+        qint64 size = -1;
+    };
+
+    static constexpr int hashBytes = crypto_hash_sha256_BYTES;
+    static constexpr int lengthBytes = 4;
+    static constexpr qint64 maxManifestBytes = 1024 * 1024 * 16;
+
+    // All the entries below root, in stream order
+    static std::vector<Entry> scan(const QString& root);
+
+    static QByteArray encodeManifest(const std::vector<Entry>& entries);
+
+    // Returns false if the manifest is invalid or has unsafe paths
+    static bool decodeManifest(const QByteArray& data, std::vector<Entry>& entries);
+
+    // Size of the stream for the tree at root
+    static qint64 getStreamSize(const QString& root);
+
+    // Relative, without "." or ".." components
+    static bool isSafePath(const QString& path);
+};
+
+/*! Reads a directory tree as a DirArchive stream.
+ *
+ * Random access, so it can be hashed, and a transfer can be resumed.
+ * Fails with an error if a file changes size while we read it.
+ */
+class DirArchiveReader : public QIODevice
+{
+    Q_OBJECT
+public:
+    explicit DirArchiveReader(const QString& root);
+
+    bool open(OpenMode mode) override;
+    void close() override;
+    bool isSequential() const override { return false; }
+    qint64 size() const override { return size_; }
+
+protected:
+    qint64 readData(char *data, qint64 maxlen) override;
+    qint64 writeData(const char *data, qint64 len) override;
+
+private:
+    struct Segment {
+        qint64 offset = {};
+        qint64 len = {};
+        int entry = -1; // -1 for the length and manifest
+        bool hash = false;
+    };
+
+    bool readContent(const int entry, const qint64 at, char *data, const qint64 len);
+    bool getHash(const int entry, QByteArray& hash);
+    bool openEntry(QFile& file, const int entry);
+
+    const QString root_;
+    std::vector<DirArchive::Entry> entries_;
+    QByteArray header_;
+    std::vector<Segment> segments_;
+    qint64 size_ = {};
+
+    // The entry we read from, and its hash if it's read from the start
+    QFile current_;
+    int currentEntry_ = -1;
+    crypto_hash_sha256_state hashState_ = {};
+    qint64 hashed_ = -1;
+    int hashEntry_ = -1;
+    QByteArray hash_;
+};
+
+/*! Unpacks a DirArchive stream to a directory as it's written.
+ *
+ * Write only and sequential. Each entry is verified when its hash
+ * arrives. Any error fails the write.
+ */
+class DirArchiveWriter : public QIODevice
+{
+    Q_OBJECT
+public:
+    explicit DirArchiveWriter(const QString& root);
+
+    bool open(OpenMode mode) override;
+    void close() override;
+    bool isSequential() const override { return true; }
+
+    // True when all the entries in the manifest are written and verified
+    bool isComplete() const noexcept { return state_ == State::DONE; }
+
+protected:
+    qint64 readData(char *data, qint64 maxlen) override;
+    qint64 writeData(const char *data, qint64 len) override;
+
+private:
+    enum class State {
+        LENGTH,
+        MANIFEST,
+        CONTENT,
+        HASH,
+        DONE
+    };
+
+    bool onCollected();
+    bool startNextEntry();
+    bool fail(const QString& reason);
+
+    const QString root_;
+    State state_ = State::LENGTH;
+    QByteArray pending_; // The length, manifest or hash we are collecting
+    qint64 want_ = DirArchive::lengthBytes;
+    std::vector<DirArchive::Entry> entries_;
+    size_t next_ = {};
+    QFile out_;
+    qint64 left_ = {};
+    crypto_hash_sha256_state hashState_ = {};
+};
+
+}} // namespaces
+
+#endif // DIRARCHIVE_H
@@ -0,0 +1,101 @@
+#ifndef DIRTYTRACKER_H
+#define DIRTYTRACKER_H
+
+#include <map>
+
+#include <QObject>
+#include <QSqlDatabase>
+#include <QTimer>
+#include <QVariant>
+
+namespace ds {
+namespace core {
+
+class StatementCache;
+
+/*! Write-behind for the fields changed by the objects' setters.
+ *
+ * update() don't write to the database directly. The changed fields
+ * are kept here, so that several changes to the same field only
+ * write the last value, and everything changed during one
+ * event-loop tick (or flushInterval) is written in one transaction.
+ *
+ * The objects in memory are the authoritative copy. Statements from
+ * the StatementCache flush the pending changes before they are handed
+ * out, so queries made that way see the same values as the objects.
+ * Queries made with a plain QSqlQuery must call flush() first if they
+ * depend on fields that may have changed. Call flush() after
+ * state-changes that must survive a crash.
+ *
+ * If the transaction fails, the changes are written one by one. Changes
+ * that violate a constraint are dropped. Other failures, like a busy
+ * database, keep the change queued, and it's retried later. Columns
+ * with a UNIQUE constraint must be written with write(), so that the
+ * caller gets the error.
+ */
+class DirtyTracker : public QObject
+{
+    Q_OBJECT
+public:
+    struct Stats {
+        quint64 updates = {}; // Fields set
+        quint64 written = {}; // Fields written to the database
+        quint64 flushes = {}; // Transactions
+        quint64 dropped = {}; // Fields that violated a constraint
+        quint64 retried = {}; // Failed fields kept for another attempt
+    };
+
+    // If flushInterval is 0, changes are written when we return to the event-loop
+    DirtyTracker(QSqlDatabase& db, StatementCache& statements, const int flushInterval);
+
+    // Pending changes are discarded. The Database flushes before we are deleted.
+    ~DirtyTracker() override;
+
+    static DirtyTracker& instance();
+
+    // The table and column must be string literals
+    void set(const char *table, const int id, const char *column, const QVariant& value);
+
+    // Write the field now, replacing any pending change to it. Throws on error.
+    void write(const char *table, const int id, const char *column, const QVariant& value);
+
+    // Write all the pending changes now. Errors are logged.
+    void flush();
+
+    // True if the last flush left changes that must be retried
+    bool isRetrying() const noexcept { return retrying_; }
+
+    bool isEmpty() const noexcept { return pending_.empty(); }
+    size_t getPendingCount() const noexcept { return pending_.size(); }
+    const Stats& getStats() const noexcept { return stats_; }
+
+private:
+    struct Key {
+        const char *table;
+        int id;
+        const char *column;
+
+        bool operator < (const Key& v) const noexcept;
+    };
+
+    void exec(const Key& key, const QVariant& value);
+    void writeAll(const std::map<Key, QVariant>& pending);
+    void writeEach(const std::map<Key, QVariant>& pending);
+    void retryLater(const std::map<Key, QVariant>& failed);
+    void onQuery();
+    void onTimeout();
+
+    QSqlDatabase& db_;
+    StatementCache& statements_;
+    std::map<Key, QVariant> pending_;
+    QTimer timer_;
+    const int flushInterval_;
+    bool writing_ = false;
+    bool retrying_ = false;
+    Stats stats_;
+    static DirtyTracker *instance_;
+};
+
+}} // namespaces
+
+#endif // DIRTYTRACKER_H
@@ -27,6 +27,7 @@ namespace ds {
 namespace core {
 
 class Database;
+class DbExecutor;
 
 /*! The core engine of DarkSpeak.
  *
@@ -56,6 +57,7 @@ public:
     static DsEngine& instance();
     State getState() const;
     QSqlDatabase& getDb();
+    DbExecutor& getDbExecutor();
     IdentityManager *getIdentityManager();
     ContactManager *getContactManager();
     ConversationManager *getConversationManager();
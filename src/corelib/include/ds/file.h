@@ -10,6 +10,7 @@
 
 #include "ds/conversation.h"
 #include "ds/contact.h"
+#include "ds/delta.h"
 #include "ds/identity.h"
 
 namespace ds {
@@ -57,6 +58,23 @@ public:
     };
     Q_ENUM(Direction)
 
+    // How the receiver answers an offer for a file it already knows
+    enum class ReofferAction {
+        ACCEPT,     // Answer "Received". The user decides.
+        IGNORE,     // The transfer is already accepted, or in progress
+        REJECT,     // Answer "Rejected"
+        ABORT,      // Answer "Abort"
+        COMPLETE    // Answer "Completed"
+    };
+    Q_ENUM(ReofferAction)
+
+    // A directory is sent as one DirArchive stream
+    enum FileType {
+        FT_FILE,
+        FT_DIRECTORY
+    };
+    Q_ENUM(FileType)
+
     File(QObject& parent);
     File(QObject& parent, std::unique_ptr<FileData> data);
 
@@ -64,6 +82,7 @@ public:
     Q_PROPERTY(QByteArray fileId READ getFileId CONSTANT)
     Q_PROPERTY(State state READ getState NOTIFY stateChanged)
     Q_PROPERTY(Direction direction READ getDirection CONSTANT)
+    Q_PROPERTY(FileType fileType READ getFileType CONSTANT)
     Q_PROPERTY(bool active READ isActive NOTIFY isActiveChanged)
     Q_PROPERTY(QString name READ getName WRITE setName NOTIFY nameChanged)
     Q_PROPERTY(QString path READ getPath WRITE setPath NOTIFY pathChanged)
@@ -74,6 +93,9 @@ public:
     Q_PROPERTY(qlonglong size READ getSize NOTIFY sizeChanged)
     Q_PROPERTY(float progress READ getProgress NOTIFY bytesTransferredChanged)
     Q_PROPERTY(qlonglong bytesTransferred READ getBytesTransferred NOTIFY bytesTransferredChanged)
+    Q_PROPERTY(int chunkSize READ getChunkSize NOTIFY transferStatsChanged)
+    Q_PROPERTY(qlonglong throughput READ getThroughput NOTIFY transferStatsChanged)
+    Q_PROPERTY(double hashProgress READ getHashProgress NOTIFY hashProgressChanged)
 
     Q_INVOKABLE void cancel();
     Q_INVOKABLE void accept();
@@ -87,6 +109,8 @@ public:
     State getState() const noexcept;
     void setState(const State state);
     Direction getDirection() const noexcept;
+    FileType getFileType() const noexcept;
+    bool isDirectory() const noexcept { return getFileType() == FT_DIRECTORY; }
     QString getName() const noexcept;
     void setName(const QString& name);
     QString getPath() const noexcept;
@@ -95,6 +119,14 @@ public:
     QByteArray getHash() const noexcept;
     QString getPrintableHash() const noexcept;
     void setHash(const QByteArray& hash);
+
+    // Root of the hash tree over the file. See TreeHash.
+    QByteArray getTreeHash() const noexcept;
+    void setTreeHash(const QByteArray& hash);
+
+    // Leaf hashes for the tree. Only kept for outgoing files.
+    QByteArray getLeafHashes() const noexcept;
+    void setLeafHashes(const QByteArray& leaves); // Also sets the tree hash
     QDateTime getCreated() const noexcept;
     QDateTime getFileTime() const noexcept;
     QDateTime getAckTime() const noexcept;
@@ -103,7 +135,7 @@ public:
     qlonglong getBytesTransferred() const noexcept;
     void setBytesTransferred(const qlonglong bytes);
     void addBytesTransferred(const size_t bytes);
-    void clearBytesTransferred(); // Before start transfer
+    void clearBytesTransferred(const qlonglong startAt = 0); // Before start transfer
     void setAckTime(const QDateTime& when);
     void touchAckTime();
     bool isActive() const noexcept;
@@ -116,6 +148,32 @@ public:
     void setChannel(quint32 channel);
     float getProgress() const noexcept;
 
+    // Transient statistics for an active transfer. Not stored in the database.
+    int getChunkSize() const noexcept;
+    qlonglong getThroughput() const noexcept; // Bytes per second
+    void setTransferStats(const int chunkSize, const qlonglong throughput);
+
+    // Progress while the file is hashed. Not stored in the database.
+    double getHashProgress() const noexcept;
+
+    // Hash sent by the receiver with the resume-point. Not stored in the database.
+    const QByteArray& getResumeHash() const noexcept;
+    void setResumeHash(const QByteArray& hash);
+
+    // True if the content was sent with the last offer. Not stored in the database.
+    bool wasSentInline() const noexcept { return sentInline_; }
+    void setSentInline(const bool sentInline) noexcept { sentInline_ = sentInline; }
+
+    // True if the receiver's "Completed" can be true. It only has the whole
+    // file if it came inline with the offer, or if our resume-point says
+    // that all the bytes were sent.
+    bool canAcceptCompleted() const noexcept;
+
+    // Earlier version of an incoming file, used for a delta transfer.
+    // Not stored in the database.
+    const DeltaBasis& getDeltaBasis() const noexcept;
+    void setDeltaBasis(DeltaBasis basis);
+
     /*! Add the new File to the database. */
     void addToDb();
 
@@ -135,13 +193,32 @@ public:
     void transferComplete();
     void transferFailed(const QString& reason, const State state = FS_CANCELLED);
 
+    // The connection was lost. Keep the resume-point, and queue the
+    // file so that the transfer continues when we are connected again.
+    void transferInterrupted();
+
     // Asyncroneously hash he file and verify that it i cirrect.
     // This is to validate received files before
     // the state is changed to FS_DONE
     void validateHash();
 
+    // Validate a received file with the hash calculated while it was received
+    void validateHash(const QByteArray& hash);
+
+    // Save a file that came inline with the offer, and complete it.
+    // Returns false if it could not be saved. Then it must be transferred.
+    bool completeFromContent(const QByteArray& content);
+
     static bool findUnusedName(const QString& path, QString& unusedPath);
 
+    // After a reconnect, the sender may offer a file again while the
+    // receiver is resuming it. The offer must not restart the transfer.
+    static ReofferAction getReofferAction(const State state) noexcept;
+
+    // True if an outgoing file waits for the receiver to answer the offer.
+    // The receiver's "Received", "Completed" and "Proceed" only apply then.
+    static bool isOfferPending(const State state) noexcept;
+
 signals:
     void stateChanged();
     void isActiveChanged();
@@ -152,16 +229,26 @@ signals:
     void fileTimeChanged();
     void sizeChanged();
     void bytesTransferredChanged();
+    void transferStatsChanged();
+    void hashProgressChanged();
     void transferDone(File *file, bool succeess);
 
 private:
     static QString getSelectStatement(const QString& where);
-    static ptr_t load(QObject& parent, const std::function<void(QSqlQuery&)>& prepare);
+    static ptr_t load(QObject& parent, const char *operation, const char *where,
+                      const std::function<void(QSqlQuery&)>& bind);
     void flushBytesAdded();
+    void completeIfHashMatches(const QByteArray& hash);
 
     int id_ = 0;
     std::unique_ptr<FileData> data_;
     quint32 channel_ = 0;
+    int chunkSize_ = {};
+    qlonglong throughput_ = {};
+    qlonglong hashedBytes_ = {};
+    QByteArray resumeHash_;
+    bool sentInline_ = false;
+    DeltaBasis deltaBasis_;
     qlonglong bytesAdded_ = {};
     std::unique_ptr<std::chrono::steady_clock::time_point> nextFlush_;
 };
@@ -169,11 +256,14 @@ private:
 struct FileData {
     File::State state = File::FS_CREATED;
     File::Direction direction = File::OUTGOING;
+    File::FileType fileType = File::FT_FILE;
     int identity = 0;
     int contact = 0;
     int conversation = 0;
     QByteArray fileId;
     QByteArray hash;
+    QByteArray treeHash;
+    QByteArray leafHashes;
     QString name; // The adverticed name, may be something else than then the real name
     QString path; // Full path with actual name
     qlonglong size = {};
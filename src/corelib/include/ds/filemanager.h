@@ -1,8 +1,11 @@
 #ifndef FILEMANAGER_H
 #define FILEMANAGER_H
 
+#include <map>
 #include <set>
 #include <deque>
+#include <functional>
+#include <vector>
 #include <QUuid>
 #include <QObject>
 #include <QSettings>
@@ -12,6 +15,8 @@
 #include "ds/file.h"
 #include "ds/registry.h"
 #include "ds/lru_cache.h"
+#include "ds/hashcache.h"
+#include "ds/hashservice.h"
 
 namespace ds {
 namespace core {
@@ -28,6 +33,11 @@ public:
     File::ptr_t getFileFromId(const QByteArray& fileId, const File::Direction direction);
     File::ptr_t getFileFromId(const QByteArray& fileId, const Contact& contact);
 
+    // All the files in a conversation in the given direction and state
+    std::vector<File::ptr_t> getFiles(const Conversation& conversation,
+                                      const File::Direction direction,
+                                      const File::State state);
+
     File::ptr_t addFile(std::unique_ptr<FileData> data);
 
     void receivedFileOffer(Conversation& conversation, const PeerFileOffer& offer);
@@ -36,6 +46,20 @@ public:
 
     void onFileStateChanged(const File *file);
 
+    HashService& getHashService() noexcept { return hashService_; }
+
+    // Content that came inline with an offer, until the user accepts or rejects the file
+    bool takeInlineContent(const int dbId, QByteArray& content);
+    void discardInlineContent(const int dbId);
+
+    // Limit for inline content waiting for the user. Kept in memory only.
+    static constexpr qint64 maxPendingInlineBytes = 1024 * 1024;
+
+    // If we have an earlier version of the incoming file, create its
+    // delta signature on the hash service. Calls done() when the file
+    // can be transferred.
+    void prepareDelta(const File::ptr_t& file, std::function<void()> done);
+
 signals:
     void fileAdded(const File::ptr_t& file);
     void fileDeleted(const int dbId);
@@ -45,11 +69,19 @@ public slots:
 
 private:
     void hashIt(const File::ptr_t& file);
+    bool useCachedHash(const File::ptr_t& file, const HashCache::Key& key);
+    void onHashed(const File::ptr_t& file);
+    void receivedInlineContent(const File::ptr_t& file, const QByteArray& content);
+    QString findDeltaBasis(const File& file);
 
     Registry<int, File> registry_;
     LruCache<File::ptr_t> lru_cache_{3};
     //std::set<File::ptr_t> hashing_;
     QSettings &settings_;
+    HashCache hashCache_;
+    HashService hashService_;
+    std::map<int, QByteArray> pendingInline_; // File id, content
+    qint64 pendingInlineBytes_ = {};
 };
 
 }}
@@ -0,0 +1,66 @@
+#ifndef HASHCACHE_H
+#define HASHCACHE_H
+
+#include <QByteArray>
+#include <QSqlDatabase>
+#include <QString>
+
+namespace ds {
+namespace core {
+
+/*! Persistent index of hashes for files we have sent.
+ *
+ * When the same file is sent to several contacts or conversations,
+ * we don't want to read it all again to hash it. Entries are
+ * identified by the canonical path, size, modification time and
+ * inode. If any of them change, the file is hashed again.
+ *
+ * Entries that are not used for maxAgeSecs, and entries for files
+ * that are gone, are pruned at startup. The table never keeps more
+ * than maxEntries; the least recently used entries go first.
+ */
+class HashCache
+{
+public:
+    struct Key {
+        QString path; // Canonical path
+        qint64 size = {};
+        qint64 mtime = {}; // Milliseconds since epoch
+        quint64 inode = {}; // 0 where we don't know it
+
+        bool isValid() const noexcept { return !path.isEmpty(); }
+    };
+
+    struct Entry {
+        QByteArray hash;
+        QByteArray leafHashes;
+    };
+
+    // Get the key for a file. Not valid if the file don't exist.
+    static Key getKey(const QString& path);
+
+    // Returns true if we have the hashes for the key
+    bool lookup(const Key& key, Entry& entry) const;
+
+    // Written in the background by the DbExecutor
+    void store(const Key& key, const Entry& entry);
+
+    // Prune the cache in the background
+    void pruneLater();
+
+    /*! Remove old entries, entries for files that don't exist, and
+     * the least recently used entries beyond maxEntries.
+     *
+     * \param now Seconds since the epoch
+     * \return The number of entries removed
+     * \throws Error on database errors
+     */
+    static int prune(QSqlDatabase& db, const qint64 now);
+
+    static constexpr qint64 maxAgeSecs = 60 * 60 * 24 * 90;
+    static constexpr int maxEntries = 5000;
+};
+
+}} // namespaces
+
+#endif // HASHCACHE_H
@@ -0,0 +1,46 @@
+#ifndef HASHSERVICE_H
+#define HASHSERVICE_H
+
+#include <QObject>
+#include <QRunnable>
+#include <QThreadPool>
+
+namespace ds {
+namespace core {
+
+/*! Runs the HashTask's, and other tasks that read whole files
+ *
+ * Hashing is mostly disk bound, and several large files hashed at
+ * the same time will just compete for the disk. The tasks therefore
+ * have their own thread-pool, with a low limit on how many files are
+ * hashed at once, so they don't starve other tasks in the global
+ * thread-pool either.
+ *
+ * The CPU bound parts of a task, like the leaves of a TreeHash, run
+ * in a second pool that is shared by all the tasks. The number of
+ * threads used for hashing is therefore bounded, no matter how many
+ * files are hashed.
+ */
+class HashService : public QObject
+{
+    Q_OBJECT
+public:
+    explicit HashService(QObject& parent, const int maxConcurrent = defaultMaxConcurrent);
+    ~HashService() override;
+
+    // Queue the task. We take ownership of it.
+    void start(QRunnable *task);
+
+    // For the tasks' CPU bound jobs. The jobs must not wait for each other.
+    QThreadPool& getWorkers() noexcept { return workers_; }
+
+    static constexpr int defaultMaxConcurrent = 2;
+
+private:
+    QThreadPool workers_; // Must outlive the tasks in pool_
+    QThreadPool pool_;
+};
+
+}} // namespaces
+
+#endif // HASHSERVICE_H
@@ -1,29 +1,61 @@
 #ifndef HASHTASK_H
 #define HASHTASK_H
 
+#include <chrono>
 #include <functional>
 
+#include <QFile>
 #include <QObject>
 #include <QRunnable>
+#include <QThreadPool>
+
+#include <sodium.h>
 
 #include "ds/file.h"
 
 namespace ds {
 namespace core {
 
+/*! Calculates the SHA-256 (and for outgoing files, the TreeHash) for a file.
+ *
+ * The file is mapped into memory in large windows. The file hash is
+ * calculated on the tasks thread, while the leaves in the window are
+ * hashed by the /workers/ pool. Files that can't be mapped are read.
+ *
+ * Run by the HashService.
+ */
 class HashTask : public QObject, public QRunnable {
     Q_OBJECT
 public:
-    HashTask(QObject *owner, File::ptr_t file);
+    HashTask(QObject *owner, File::ptr_t file, QThreadPool& workers);
     void run() override;
 
 signals:
+    // Leaf hashes for the file's TreeHash. Emitted before hashed() for outgoing files.
+    void leavesHashed(const QByteArray& leaves);
     void hashed(const QByteArray& hash, const QString& failReason);
 
+    // Bytes hashed so far. Emitted a few times per second.
+    void progress(const qint64 bytes);
+
 private:
+    using clock_t = std::chrono::steady_clock;
+
     QString getPath() const noexcept;
+    bool hashMapped(QFile& file, QString& failReason);
+    bool hashRead(QIODevice& file, QString& failReason);
+    bool hashSlices(const uchar *data, const qint64 offset, const qint64 len);
+    bool isCancelled() const;
+    void reportProgress(const qint64 bytes, const bool force = false);
 
     const File::ptr_t file_;
+    QThreadPool& workers_;
+    bool wantTree_ = false;
+    qint64 size_ = {};
+    qint64 leafSize_ = {};
+    crypto_hash_sha256_state state_ = {};
+    QByteArray leaves_;
+    clock_t::time_point nextProgress_ = {};
 };
 
 }}
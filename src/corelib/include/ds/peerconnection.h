@@ -2,6 +2,7 @@
 #define PEERCONNECTION_H
 
 #include <memory>
+#include <vector>
 
 #include <QUuid>
 #include <QObject>
@@ -134,6 +135,9 @@ struct PeerFileOffer : public PeerReq
     qlonglong rest;
     QString type;
     QByteArray sha512;
+    QByteArray treeHash; // Root of the TreeHash, if the peer sent it
+    bool hasContent = false; // Small files may be sent inline with the offer
+    QByteArray content;
 };
 
 struct PeerSendFile : public PeerReq
@@ -199,10 +203,41 @@ public:
     virtual bool isConnected() const noexcept = 0;
     virtual uint64_t sendUserInfo(const core::UserInfo &userInfo) = 0;
     virtual uint64_t sendMessage(const Message& message) = 0;
+
+    /*! Send several messages, in as few frames as possible.
+     *
+     * Falls back to one frame per message if the peer don't
+     * understand batches.
+     *
+     * \return The number of messages sent, from the start of /messages/.
+     *      Throws only if none of them could be sent.
+     */
+    virtual uint64_t sendMessages(const std::vector<std::shared_ptr<Message>>& messages) = 0;
+
+    /*! Acknowledge several received messages with one "Messages" ack.
+     *
+     * Falls back to one "Message" ack per message if the peer don't
+     * understand it.
+     */
+    virtual uint64_t sendMessageAcks(const QString& status, const std::vector<QByteArray>& messageIds) = 0;
     virtual uint64_t sendAvatar(const QImage& avatar) = 0;
-    virtual uint64_t offerFile(const File& file) = 0;
+    virtual uint64_t offerFile(File& file) = 0;
+
+    // Offer several files in one message, if the peer understands it.
+    // Returns the number of files offered, from the start of /files/.
+    // Throws only if none of them could be offered.
+    virtual uint64_t offerFiles(const std::vector<std::shared_ptr<File>>& files) = 0;
+
+    // How many files offerFiles() will put in one message
+    virtual size_t getMaxFilesInOffer() const noexcept = 0;
     virtual uint64_t startTransfer(File& file) = 0;
+
+    // Queue more data for a transfer. Returns the number of frames queued
+    // for the file, 0 if nothing could be queued.
     virtual uint64_t sendSome(File& file) = 0;
+
+    // If the peer can receive a directory as one archive stream
+    virtual bool canReceiveDirectories() const noexcept = 0;
     virtual void disableNotifications() = 0;
 
 signals:
@@ -214,6 +249,8 @@ signals:
     void receivedFileOffer(const PeerFileOffer& msg);
     void receivedAvatar(const PeerSetAvatarReq& avatar);
     void receivedUserInfo(const PeerUserInfo& uinfo);
+
+    // There is room in the connection for more file data
     void outputBufferEmptied();
 };
 
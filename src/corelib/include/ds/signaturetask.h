@@ -0,0 +1,33 @@
+#ifndef SIGNATURETASK_H
+#define SIGNATURETASK_H
+
+#include <QObject>
+#include <QRunnable>
+
+#include "ds/file.h"
+
+namespace ds {
+namespace core {
+
+/*! Creates the delta signature for the basis of an incoming file.
+ *
+ * The basis is read once, from start to end. Run by the HashService.
+ */
+class SignatureTask : public QObject, public QRunnable {
+    Q_OBJECT
+public:
+    SignatureTask(QObject *owner, File::ptr_t file, QString basisPath);
+    void run() override;
+
+signals:
+    // The signature is empty if it could not be created
+    void done(const QByteArray& signature, const qint64 blockSize, const qint64 basisSize);
+
+private:
+    const File::ptr_t file_;
+    const QString basisPath_;
+};
+
+}} // namespaces
+
+#endif // SIGNATURETASK_H
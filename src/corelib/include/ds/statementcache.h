@@ -0,0 +1,101 @@
+#ifndef STATEMENTCACHE_H
+#define STATEMENTCACHE_H
+
+#include <functional>
+#include <map>
+#include <memory>
+
+#include <QByteArray>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QString>
+
+namespace ds {
+namespace core {
+
+/*! Prepared statements that are used over and over again.
+ *
+ * Statements are identified by the table and an operation name, like
+ * ("file", "by-file-id") or ("contact", "name") for an update of
+ * that column. The SQL is only built and prepared the first time.
+ *
+ * get() returns a handle that owns the statement until it goes out
+ * of scope. Don't keep it around. If the same statement is requested
+ * while it's in use (for example from a recursive lookup), we prepare
+ * a temporary statement for that caller.
+ *
+ * The cache is owned by the Database, and must only be used from the
+ * thread that owns the database connection.
+ */
+class StatementCache
+{
+public:
+    struct Stats {
+        quint64 hits = {};
+        quint64 misses = {};
+        quint64 busy = {}; // Temporary statements, because the cached one was in use
+    };
+
+    class Statement
+    {
+    public:
+        Statement(Statement&& v) noexcept;
+        Statement(const Statement&) = delete;
+        Statement& operator = (const Statement&) = delete;
+        Statement& operator = (Statement&&) = delete;
+
+        // Resets the statement, so it don't hold on to the result-set
+        ~Statement();
+
+        QSqlQuery& operator * () const noexcept { return *query_; }
+        QSqlQuery *operator -> () const noexcept { return query_; }
+
+    private:
+        friend class StatementCache;
+        Statement(QSqlQuery *query, bool *inUse, std::unique_ptr<QSqlQuery> owned);
+
+        QSqlQuery *query_ = {};
+        bool *inUse_ = {};
+        std::unique_ptr<QSqlQuery> owned_;
+    };
+
+    using sql_fn_t = std::function<QString ()>;
+    using hook_t = std::function<void ()>;
+
+    explicit StatementCache(QSqlDatabase& db);
+    ~StatementCache();
+
+    static StatementCache& instance();
+
+    Statement get(const char *table, const char *operation, const char *sql);
+
+    // makeSql is only called when the statement must be prepared
+    Statement get(const char *table, const char *operation, const sql_fn_t& makeSql);
+
+    const Stats& getStats() const noexcept { return stats_; }
+
+    // Called by get() before a statement is handed out. The DirtyTracker
+    // uses it to write pending changes, so the statement see them.
+    void setBeforeGet(hook_t hook) { beforeGet_ = std::move(hook); }
+
+    // Drop all the statements. Must be called if the schema is changed.
+    void clear();
+
+private:
+    struct Entry {
+        std::unique_ptr<QSqlQuery> query;
+        bool inUse = false;
+    };
+
+    std::unique_ptr<QSqlQuery> prepare(const QString& sql);
+
+    QSqlDatabase& db_;
+    std::map<QByteArray, Entry> statements_;
+    hook_t beforeGet_;
+    Stats stats_;
+    static StatementCache *instance_;
+};
+
+}} // namespaces
+
+#endif // STATEMENTCACHE_H
@@ -0,0 +1,82 @@
+#ifndef TREEHASH_H
+#define TREEHASH_H
+
+#include <QByteArray>
+#include <QtGlobal>
+
+#include <sodium.h>
+
+namespace ds {
+namespace core {
+
+/*! Hash tree over fixed-size leaves of a file
+ *
+ * The file is split in leaves of getLeafSize() bytes (the last one
+ * may be shorter). Each leaf is hashed with SHA-256, and the leaf
+ * hashes are combined pairwise up to a single root.
+ *
+ *      leaf = SHA-256(0x00 | data)
+ *      node = SHA-256(0x01 | left | right)
+ *
+ * A node without a right sibling is promoted as is to the next level.
+ *
+ * The root is sent in the file offer. The leaf hashes are sent when
+ * the transfer starts, and lets the receiver verify each leaf as it
+ * arrives. The leaf-size is derived from the file-size, and is part
+ * of the protocol.
+ *
+ * Leaf hashes are kept as one QByteArray with hashBytes per leaf.
+ */
+class TreeHash {
+public:
+    static constexpr int hashBytes = crypto_hash_sha256_BYTES;
+
+    // Leaves are at least this large, so small files have one leaf
+    static constexpr qint64 minLeafSize = 1024 * 1024;
+
+    // The leaf-size is doubled until the file fits in this many leaves
+    static constexpr qint64 maxLeaves = 1024;
+
+    static qint64 getLeafSize(const qint64 fileSize) noexcept;
+
+    // An empty file has one empty leaf
+    static qint64 getLeafCount(const qint64 fileSize) noexcept;
+
+    static QByteArray hashLeaf(const void *data, const size_t bytes);
+    static QByteArray hashLeaf(const QByteArray& data) {
+        return hashLeaf(data.constData(), static_cast<size_t>(data.size()));
+    }
+
+    // Get the hash of one leaf from the leaf hashes
+    static QByteArray getLeaf(const QByteArray& leaves, const qint64 index);
+
+    // Root of the tree. Empty if /leaves/ is not a valid list of hashes.
+    static QByteArray getRoot(const QByteArray& leaves);
+
+    // Check that /leaves/ is complete for a file of /fileSize/ and matches /root/
+    static bool isValid(const QByteArray& leaves, const QByteArray& root,
+                        const qint64 fileSize);
+
+    /*! Hash a leaf from data that arrives in pieces */
+    class LeafHasher {
+    public:
+        LeafHasher();
+        void add(const void *data, const size_t bytes);
+
+        // Get the hash and prepare for the next leaf
+        QByteArray finish();
+
+        // Bytes added to the current leaf
+        qint64 getBytes() const noexcept { return bytes_; }
+
+    private:
+        void reset();
+
+        crypto_hash_sha256_state state_ = {};
+        qint64 bytes_ = {};
+    };
+};
+
+}} // namespaces
+
+#endif // TREEHASH_H
@@ -8,27 +8,22 @@
 #include <QImage>
 
 #include "ds/errors.h"
+#include "ds/dirtytracker.h"
 
 namespace ds {
 namespace core {
 
 
+// The change is written to the database by the DirtyTracker
 template <typename T>
 void update(T *self, const char *name, const QVariant& value) {
-    QByteArray sql{"UPDATE "};
-    sql += self->getTableName();
-    sql += " SET ";
-    sql += name;
-    sql += " =:value where id=:id";
+    DirtyTracker::instance().set(self->getTableName(), self->getId(), name, value);
+}
 
-    QSqlQuery query;
-    query.prepare(sql);
-    query.bindValue(":id", self->getId());
-    query.bindValue(":value", value);
-    if(!query.exec()) {
-        throw Error(QStringLiteral("SQL query failed: %1").arg(
-                        query.lastError().text()));
-    }
+// Written now. Use it for columns with a UNIQUE constraint, so that the caller gets the error.
+template <typename T>
+void updateNow(T *self, const char *name, const QVariant& value) {
+    DirtyTracker::instance().write(self->getTableName(), self->getId(), name, value);
 }
 
 // https://wiki.qt.io/How_to_Store_and_Retrieve_Image_on_SQLite
@@ -60,6 +55,21 @@ bool updateIf(const char *name, const T& value, T& target, Obj *self, const S& s
     return false;
 }
 
+// Like updateIf(), but the value is written before the target is changed
+template <typename T, typename Obj, typename S>
+bool updateNowIf(const char *name, const T& value, T& target, Obj *self, const S& signal) {
+    if (value != target) {
+        if (self->getId() > 0) {
+            updateNow(self, name, value);
+        }
+        target = value;
+        emit (self->*signal)();
+        return true;
+    }
+
+    return false;
+}
+
 }}
 
 #endif // UPDATE_HELPER_H
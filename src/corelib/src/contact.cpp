@@ -1,9 +1,12 @@
 ﻿
+#include <algorithm>
+#include <iterator>
 #include <memory>
 
 #include <QTimer>
 
 #include "ds/contact.h"
+#include "ds/dbexecutor.h"
 #include "ds/dsengine.h"
 #include "ds/identity.h"
 #include "ds/errors.h"
@@ -20,6 +23,23 @@ using namespace std;
 using namespace crypto;
 
 namespace  {
+
+// Limits for one MessageBatch. The byte budget is for the raw fields,
+// before base64 or CBOR encoding.
+constexpr size_t max_messages_in_batch = 64;
+constexpr size_t max_batch_bytes = 1024 * 32;
+
+// Message-id, conversation, sender, signature, date and encoding
+constexpr size_t message_overhead_bytes = 256;
+
+// How long we wait for more messages before we send a "Messages" ack
+constexpr int message_ack_delay_ms = 200;
+constexpr size_t max_message_acks = 256;
+
+size_t estimateSize(const Message& message) {
+    return static_cast<size_t>(message.getData().content.size()) * 3 + message_overhead_bytes;
+}
+
 bool comparesEqual(const QByteArray& left, const QByteArray& right) {
     if (left.size() != right.size()) {
         return false;
@@ -128,7 +148,8 @@ void Contact::setName(QString name) {
     if (name.isEmpty()) {
         name = nullptr;
     }
-    updateIf("name", name, data_->name, this, &Contact::nameChanged);
+    // ix_contact_name is unique
+    updateNowIf("name", name, data_->name, this, &Contact::nameChanged);
 }
 
 QString Contact::getNickName() const noexcept  {
@@ -282,6 +303,7 @@ Contact::ContactState Contact::getState() const noexcept
 void Contact::setState(const ContactState state)
 {
     if (updateIf("state", state, data_->state, this, &Contact::stateChanged)) {
+        DirtyTracker::instance().flush();
 
         // Just to make sure the icons and states are updated in the UI
         emit blockedChanged();
@@ -380,6 +402,7 @@ void Contact::setBlocked(bool value)
 {
     if (updateIf("blocked", value, data_->isBlocked,
              this, &Contact::blockedChanged)) {
+        DirtyTracker::instance().flush();
         if (isBlocked()) {
             if (isOnline()) {
                 sendBlockNotification();
@@ -422,9 +445,16 @@ void Contact::queueFile(const std::shared_ptr<File> &file)
 {
     loadFileQueue();
 
-    // Send offer or start transfer, depending on direction
+    // Send offer or start transfer, depending on direction.
+    // Files queued in the same round in the event-loop are handled together.
     fileQueue_.push_back(file);
-    processFilesQueue();
+    if (!processFilesQueuePending_) {
+        processFilesQueuePending_ = true;
+        QTimer::singleShot(0, this, [this]() {
+            processFilesQueuePending_ = false;
+            processFilesQueue();
+        });
+    }
 }
 
 void Contact::sendAvatar(const QImage &avatar)
@@ -440,6 +470,9 @@ void Contact::sendAvatar(const QImage &avatar)
 
 Contact::ptr_t Contact::load(const QUuid &key)
 {
+    // An earlier instance may have unsaved changes
+    DirtyTracker::instance().flush();
+
     QSqlQuery query;
 
     enum Fields {
@@ -842,48 +875,13 @@ void Contact::onReceivedAck(const PeerAck &ack)
             setSentAvatar(false);
         }
     } else if (ack.what == "Message") {
-        // The message must exist.
-        // The message must belong in an existing conversation
-        // The conversation must relate to this contact
-        // The message-state must not be MS_REJECTED
-
         const auto messageId = QByteArray::fromBase64(ack.data.value("data").toString().toUtf8());
-        if (messageId.isEmpty()) {
-            LFLOG_WARN << "Received ack with empty or invalid message-id: " << messageId.toHex();
-            return;
-        }
-
-        auto message = DsEngine::instance().getMessageManager()->getMessage(messageId, Message::OUTGOING);
-        if (!message) {
-            LFLOG_WARN << "Received ack for non-existing message " << messageId.toHex();
-            return;
-        }
-
-        if (auto conversation = message->getConversation()) {
-            if (!conversation->haveParticipant(*this)) {
-                LFLOG_WARN << "Received ack for message #" << message->getId()
-                           << " that belonds to another contacts conversation: "
-                           << conversation->getUuid().toString();
-                return;
-            }
-        } else {
-            LFLOG_WARN << "Received ack for message #" << message->getId()
-                       << " with non-existing conversation: "
-                       << conversation->getUuid().toString();
-            return;
-        }
-
-        if (message->getState() == Message::MS_REJECTED) {
-             LFLOG_DEBUG << "Received ack for already rejected message " << messageId.toHex().toHex();
-             return;
-        }
-
-        message->touchSentReceivedTime();
-
-        if (ack.status == "Received") {
-            message->setState(Message::MS_RECEIVED);
-        } else if (ack.status == "Rejected" || ack.status == "Rejected-Encoding") {
-            message->setState(Message::MS_REJECTED);
+        onMessageAck(messageId, ack.status);
+    } else if (ack.what == "Messages") {
+        const auto ids = ack.data.value("message-ids").toStringList();
+        LFLOG_TRACE << "Received ack for " << ids.size() << " messages from " << getName();
+        for(const auto& id : ids) {
+            onMessageAck(QByteArray::fromBase64(id.toUtf8()), ack.status);
         }
     } else if (ack.what == "IncomingFile") {
         // The file must exist.
@@ -925,7 +923,15 @@ void Contact::onReceivedAck(const PeerAck &ack)
         file->touchAckTime();
 
         if (ack.status == "Received") {
-            file->setState(File::FS_OFFERED);
+            // A late answer to a re-offer must not reset a transfer
+            // that the receiver has already asked us to resume.
+            if ((file->getDirection() == File::OUTGOING)
+                    && File::isOfferPending(file->getState())) {
+                file->setState(File::FS_OFFERED);
+            } else {
+                LFLOG_DEBUG << "Ignoring \"Received\" ack for file #" << file->getId()
+                            << " in state " << file->getState();
+            }
         } else if (ack.status == "Rejected") {
             file->setState(File::FS_REJECTED);
         } else if (ack.status == "Failed") {
@@ -934,15 +940,30 @@ void Contact::onReceivedAck(const PeerAck &ack)
             } else {
                 file->setState(File::FS_FAILED);
             }
+
+            if (file->getDirection() == File::INCOMING) {
+                // Don't try to resume from data the sender could not verify
+                file->clearBytesTransferred();
+            }
         } else if (ack.status == "Abort") {
             if (file->getState() == File::FS_TRANSFERRING) {
                 file->transferFailed("Cancelled/Aborted by Peer", File::FS_CANCELLED);
             } else {
                 file->setState(File::FS_CANCELLED);
             }
+        } else if (ack.status == "Completed") {
+            // The receiver has the file. It came inline with the offer, or
+            // it was received before we lost the connection.
+            if (file->canAcceptCompleted()) {
+                file->setBytesTransferred(file->getSize());
+                file->setState(File::FS_TRANSFERRING);
+                file->transferComplete();
+            } else {
+                LFLOG_WARN << "Ignoring \"Completed\" for file #" << file->getId()
+                           << " in state " << file->getState()
+                           << ". The peer can't have all of it.";
+            }
         } else if (ack.status == "Proceed" || ack.status == "Resume") {
-            // TODO: Handle REST
-
             if (file->getDirection() != File::OUTGOING) {
                 LFLOG_WARN << "Received ack/go-on for file #" << file->getId()
                            << " but the file is not outbound! Failing.";
@@ -951,10 +972,12 @@ void Contact::onReceivedAck(const PeerAck &ack)
                 return;
             }
 
-            if (file->getState() != File::FS_OFFERED) {
+            // After a broken connection, the receiver may ask us to resume
+            // before we have offered the file again.
+            if (!File::isOfferPending(file->getState())) {
                 LFLOG_WARN << "Received ack/go-on for file #" << file->getId()
-                           << " but the file is not in FS_OFFERED state (state=" << getState()
-                           << ")! Failing.";
+                           << " but the file is not in FS_OFFERED or FS_WAITING state (state="
+                           << file->getState() << ")! Failing.";
                 file->setState(File::FS_FAILED);
                 sendAck("IncomingFile", "Failed", file->getFileId().toBase64());
                 return;
@@ -969,6 +992,23 @@ void Contact::onReceivedAck(const PeerAck &ack)
                 sendAck("IncomingFile", "Failed", file->getFileId().toBase64());
                 return;
             }
+
+            const auto rest = ack.data.value("rest").toLongLong();
+            if ((rest < 0) || (rest > file->getSize())) {
+                LFLOG_WARN << "Received ack for file #" << file->getId()
+                           << " with invalid rest: " << rest;
+                file->setState(File::FS_FAILED);
+                sendAck("IncomingFile", "Failed", file->getFileId().toBase64());
+                return;
+            }
+
+            if (rest > 0) {
+                LFLOG_DEBUG << "Resuming file #" << file->getId() << " at offset " << rest;
+            }
+
+            // bytes_transferred is where OutgoingFileChannel starts reading
+            file->clearBytesTransferred(rest);
+            file->setResumeHash(ack.data.value("rest-hash").toByteArray());
             file->setChannel(channel);
             file->setState(File::FS_QUEUED);
             queueFile(file);
@@ -986,21 +1026,48 @@ void Contact::onReceivedAck(const PeerAck &ack)
 
 bool Contact::procesMessageQueue()
 {
+    // Older messages may still be loading from the database
+    if (!loadedMessageQueue_) {
+        return false;
+    }
+
     if (isOnline() && !messageQueue_.empty()) {
-        // Send one message. Wait for the socket's buffer to be clear before proceeding with the next
+        // Send as many messages as fit in one batch. Wait for the socket's
+        // buffer to be clear before proceeding with the next batch.
+        // We always take the first message, even if it exceeds the budget.
+        std::vector<Message::ptr_t> batch;
+        size_t bytes = {};
+        for(const auto& message : messageQueue_) {
+            const auto size = estimateSize(*message);
+            if (!batch.empty()
+                    && ((batch.size() >= max_messages_in_batch)
+                        || ((bytes + size) > max_batch_bytes))) {
+                break;
+            }
+            bytes += size;
+            batch.push_back(message);
+        }
 
-        // TODO: Check ready status on socket
+        size_t sent = {};
         try {
-            connection_->peer->sendMessage(*messageQueue_.front());
-            messageQueue_.front()->setState(Message::MS_SENT);
+            sent = static_cast<size_t>(connection_->peer->sendMessages(batch));
         } catch(const std::exception& ex) {
             LFLOG_WARN << "Caught exception while sending message: " << ex.what();
             return false;
         }
 
-        unconfirmedMessageQueue_.push_back(move(messageQueue_.front()));
-        messageQueue_.erase(messageQueue_.begin());
-        return true;
+        LFLOG_TRACE << "Sent " << sent << " of "
+                    << messageQueue_.size() << " queued messages to " << getName();
+
+        // Only the messages that were actually sent leave the queue
+        batch.resize(std::min(sent, batch.size()));
+        for(auto& message : batch) {
+            message->setState(Message::MS_SENT);
+            unconfirmedMessages_[message->getData().messageId] = move(message);
+        }
+        messageQueue_.erase(messageQueue_.begin(),
+                            messageQueue_.begin() + static_cast<ptrdiff_t>(batch.size()));
+        return !batch.empty();
     }
 
     return false;
@@ -1008,62 +1075,100 @@ bool Contact::procesMessageQueue()
 
 bool Contact::processFilesQueue()
 {
-    if (isOnline() && !fileQueue_.empty()) {
-        // TODO: Check ready status on socket
-        // TODO: Offer up to /n/ files in one message, to pipeline them
-        //       and to make metadata leaks less lileky to idnetify file numbers
-        //       and file sizes.
-        auto file = fileQueue_.front();
-        try {
+    if (!isOnline() || fileQueue_.empty()) {
+        return false;
+    }
+
+    // Offer as many waiting files as the peer accepts in one message,
+    // and start all the queued transfers, so that a large number of
+    // files don't cost one round-trip each.
+    const auto maxOffers = connection_->peer->getMaxFilesInOffer();
+    std::vector<std::shared_ptr<File>> offers, transfers;
+    std::deque<std::shared_ptr<File>> remaining;
+
+    for(const auto& file : fileQueue_) {
+        switch(file->getState()) {
+        case File::FS_WAITING:
+        case File::FS_OFFERED:
             if (file->getDirection() == File::OUTGOING) {
-                switch(file->getState()) {
-                case File::FS_WAITING:
-                    connection_->peer->offerFile(*file);
-                    file->setState(File::FS_OFFERED);
-                    break;
-                case File::FS_QUEUED:
-                    queueTransfer(file);
-                    break;
-                default:
-                    // The file don't belong in the queue.
-                    fileQueue_.erase(fileQueue_.begin());
-                    return processFilesQueue(); // Try again...
+                if (file->isDirectory() && !connection_->peer->canReceiveDirectories()) {
+                    LFLOG_WARN << "Cannot send directory \"" << file->getName()
+                               << "\" to contact " << getName()
+                               << ": The peer don't support directory transfers";
+                    file->setState(File::FS_FAILED);
+                } else if (offers.size() < maxOffers) {
+                    offers.push_back(file);
+                } else {
+                    remaining.push_back(file);
                 }
+            }
+            break;
+        case File::FS_QUEUED:
+            transfers.push_back(file);
+            break;
+        default:
+            // The file don't belong in the queue.
+            break;
+        }
+    }
 
-            } else /* File::INCOMING */ {
-                switch(file->getState()) {
-                case File::FS_QUEUED:
-                    queueTransfer(file);
-                    break;
-                default:
-                    // The file don't belong in the queue.
-                    fileQueue_.erase(fileQueue_.begin());
-                    return processFilesQueue(); // Try again...
-                }
+    fileQueue_ = move(remaining);
+
+    try {
+        if (!offers.empty()) {
+            const auto offered = std::min(
+                        static_cast<size_t>(connection_->peer->offerFiles(offers)),
+                        offers.size());
+            for(size_t i = 0; i < offered; ++i) {
+                offers[i]->setState(File::FS_OFFERED);
             }
-        } catch(const std::exception& ex) {
-            LFLOG_WARN << "Caught exception while sending file request: " << ex.what();
-            return false;
+
+            // Offer the rest later
+            for(auto i = offers.size(); i > offered; --i) {
+                fileQueue_.push_front(offers[i - 1]);
+            }
+            offers.resize(offered);
         }
 
-        // At this point the file may already be removed due to state change events'
-        fileQueue_.erase(find(fileQueue_.begin(), fileQueue_.end(), file));
-        return true;
+        for(auto& file : transfers) {
+            queueTransfer(file);
+        }
+    } catch(const std::exception& ex) {
+        LFLOG_WARN << "Caught exception while sending file request: " << ex.what();
+
+        // Try again later with the files that were not handled
+        for(auto it = transfers.rbegin(); it != transfers.rend(); ++it) {
+            if ((*it)->getState() == File::FS_QUEUED) {
+                fileQueue_.push_front(*it);
+            }
+        }
+        for(auto it = offers.rbegin(); it != offers.rend(); ++it) {
+            if (File::isOfferPending((*it)->getState())) {
+                fileQueue_.push_front(*it);
+            }
+        }
+        return false;
     }
 
-    return false;
+    return !offers.empty() || !transfers.empty();
 }
 
 bool Contact::processFileBlocks()
 {
-    for(auto& file : transferringFileQueue_) {
+    // Let all the outgoing transfers queue data. The peer's scheduler
+    // shares the bandwidth between them.
+
+    // transferringFileQueue_ may be modified by file state change events
+    const auto transfers = transferringFileQueue_;
+    bool sent = false;
+    for(auto& file : transfers) {
         if (!isOnline()) {
             break;
         }
 
         if (file->getState() != File::FS_TRANSFERRING) {
             transferringFileQueue_.erase(file);
-            return processFileBlocks(); // Try again
+            continue;
         }
 
         if (file->getDirection() != File::OUTGOING) {
@@ -1071,15 +1176,11 @@ bool Contact::processFileBlocks()
         }
 
         if (connection_->peer->sendSome(*file) > 0) {
-            return true;
-        }
-
-        if (file->getState() == File::FS_TRANSFERRING) {
-            break; // We could not send, and the file is not complete or failed
+            sent = true;
         }
     }
 
-    return false;
+    return sent;
 }
 
 void Contact::onReceivedMessage(const PeerMessage &msg)
@@ -1199,25 +1300,59 @@ void Contact::onOutputBufferEmptied()
 
 void Contact::loadMessageQueue()
 {
-    if (loadedMessageQueue_) {
+    if (loadedMessageQueue_ || loadingMessageQueue_) {
         return;
     }
 
-    QSqlQuery query;
-    query.prepare("SELECT m.id FROM message AS m LEFT JOIN conversation AS c ON m.conversation_id = c.id WHERE c.participants = :contact AND m.received_time IS NULL ORDER BY m.id");
-    query.bindValue(":contact", getUuid().toString());
+    loadingMessageQueue_ = true;
+    const auto contact = getUuid().toString();
 
-    if(!query.exec()) {
-        throw Error(QStringLiteral("Failed to query message-queue: %1").arg(
-                        query.lastError().text()));
-    }
+    DsEngine::instance().getDbExecutor().read<std::vector<int>>([contact](QSqlDatabase& db) {
+        QSqlQuery query{db};
+        query.prepare("SELECT m.id FROM message AS m LEFT JOIN conversation AS c ON m.conversation_id = c.id WHERE c.participants = :contact AND m.received_time IS NULL ORDER BY m.id");
+        query.bindValue(":contact", contact);
 
+        if(!query.exec()) {
+            throw Error(QStringLiteral("Failed to query message-queue: %1").arg(
+                            query.lastError().text()));
+        }
+
+        std::vector<int> ids;
+        while(query.next()) {
+            ids.push_back(query.value(0).toInt());
+        }
+        return ids;
+    }, this, [this](std::vector<int> ids) {
+        onMessageQueueLoaded(ids);
+    }, [this](const QString&) {
+        // Try again the next time we need it
+        loadingMessageQueue_ = false;
+    });
+}
+
+void Contact::onMessageQueueLoaded(const std::vector<int> &ids)
+{
     auto messageMgr = DsEngine::instance().getMessageManager();
 
-    while(query.next()) {
-        messageQueue_.push_back(messageMgr->getMessage(query.value(0).toInt()));
+    // Messages queued while we waited are already in the queue.
+    // They are newer, so they go last.
+    std::deque<Message::ptr_t> queue;
+    for(const auto id : ids) {
+        const auto queued = find_if(messageQueue_.begin(), messageQueue_.end(),
+                                    [id](const Message::ptr_t& m) {
+            return m->getId() == id;
+        });
+
+        if (queued == messageQueue_.end()) {
+            queue.push_back(messageMgr->getMessage(id));
+        }
     }
 
+    move(messageQueue_.begin(), messageQueue_.end(), back_inserter(queue));
+    messageQueue_.swap(queue);
+    loadedMessageQueue_ = true;
+    loadingMessageQueue_ = false;
+
     if (!messageQueue_.empty()) {
         LFLOG_DEBUG << "Loaded " << messageQueue_.size()
                     << " queued messages for contact "
@@ -1225,7 +1360,7 @@ void Contact::loadMessageQueue()
                     << " on identity " << getIdentity()->getName();
     }
 
-    loadedMessageQueue_ = true;
+    procesMessageQueue();
 }
 
 void Contact::loadFileQueue()
@@ -1235,11 +1370,15 @@ void Contact::loadFileQueue()
     }
 
     QSqlQuery query;
-    query.prepare("SELECT id FROM file WHERE contact_id=:cid AND ((direction=:out AND state=:waiting) OR (direction=:in AND state=:queued))");
+    // Offers that are not answered are sent again. The receiver may have
+    // answered them while we were disconnected (inline files may even be
+    // completed), and it answers again.
+    query.prepare("SELECT id FROM file WHERE contact_id=:cid AND ((direction=:out AND state IN (:waiting, :offered)) OR (direction=:in AND state=:queued))");
     query.bindValue(":cid", getId());
     query.bindValue(":out", static_cast<int>(File::OUTGOING));
     query.bindValue(":in", static_cast<int>(File::INCOMING));
     query.bindValue(":waiting", static_cast<int>(File::FS_WAITING));
+    query.bindValue(":offered", static_cast<int>(File::FS_OFFERED));
     query.bindValue(":queued", static_cast<int>(File::FS_QUEUED));
 
     if(!query.exec()) {
@@ -1321,7 +1460,7 @@ void Contact::clearFileQueues()
 
     for(auto& file : tmpTransfers) {
         if (file->getState() == File::FS_TRANSFERRING) {
-            file->transferFailed("Broken connection", File::FS_FAILED);
+            file->transferInterrupted();
         }
     }
 
@@ -1422,6 +1561,95 @@ void Contact::sendAck(const QString &what, const QString &status, const QString
     }
 }
 
+void Contact::queueMessageAck(const QByteArray &messageId, const QString &status)
+{
+    if (pendingMessageAcks_.empty()) {
+        QTimer::singleShot(message_ack_delay_ms, this, [this]() {
+            flushMessageAcks();
+        });
+    }
+
+    auto& ids = pendingMessageAcks_[status];
+    ids.push_back(messageId);
+
+    if (ids.size() >= max_message_acks) {
+        flushMessageAcks();
+    }
+}
+
+void Contact::flushMessageAcks()
+{
+    if (pendingMessageAcks_.empty()) {
+        return;
+    }
+
+    if (isOnline()) {
+        for(const auto& it : pendingMessageAcks_) {
+            try {
+                connection_->peer->sendMessageAcks(it.first, it.second);
+            } catch(const std::exception& ex) {
+                LFLOG_WARN << "Caught exception while sending message acks: " << ex.what();
+            }
+        }
+    }
+
+    pendingMessageAcks_.clear();
+}
+
+void Contact::onMessageAck(const QByteArray &messageId, const QByteArray &status)
+{
+    // The message must exist.
+    // The message must belong in an existing conversation
+    // The conversation must relate to this contact
+    // The message-state must not be MS_REJECTED
+
+    if (messageId.isEmpty()) {
+        LFLOG_WARN << "Received ack with empty or invalid message-id: " << messageId.toHex();
+        return;
+    }
+
+    Message::ptr_t message;
+
+    // Normally, the message was sent over this connection, so we know it
+    const auto unconfirmed = unconfirmedMessages_.find(messageId);
+    if (unconfirmed != unconfirmedMessages_.end()) {
+        message = move(unconfirmed->second);
+        unconfirmedMessages_.erase(unconfirmed);
+    } else {
+        message = DsEngine::instance().getMessageManager()->getMessage(messageId, Message::OUTGOING);
+        if (!message) {
+            LFLOG_WARN << "Received ack for non-existing message " << messageId.toHex();
+            return;
+        }
+
+        if (auto conversation = message->getConversation()) {
+            if (!conversation->haveParticipant(*this)) {
+                LFLOG_WARN << "Received ack for message #" << message->getId()
+                           << " that belonds to another contacts conversation: "
+                           << conversation->getUuid().toString();
+                return;
+            }
+        } else {
+            LFLOG_WARN << "Received ack for message #" << message->getId()
+                       << " with non-existing conversation.";
+            return;
+        }
+    }
+
+    if (message->getState() == Message::MS_REJECTED) {
+         LFLOG_DEBUG << "Received ack for already rejected message " << messageId.toHex();
+         return;
+    }
+
+    message->touchSentReceivedTime();
+
+    if (status == "Received") {
+        message->setState(Message::MS_RECEIVED);
+    } else if (status == "Rejected" || status == "Rejected-Encoding") {
+        message->setState(Message::MS_REJECTED);
+    }
+}
+
 bool Contact::validateNick(const QString &nickName)
 {
     if (nickName.isEmpty() || (nickName.size() > 32)) {
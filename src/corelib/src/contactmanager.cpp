@@ -41,12 +41,12 @@ Contact::ptr_t ContactManager::getContact(const QUuid &uuid)
 
 Contact::ptr_t ContactManager::getContact(const int dbId)
 {
-    QSqlQuery query;
-    query.prepare("SELECT uuid FROM contact WHERE id=:id");
-    query.bindValue(":id", dbId);
-    query.exec();
-    if (query.next()) {
-        return getContact(query.value(0).toUuid());
+    auto query = StatementCache::instance().get("contact", "uuid-by-id",
+        "SELECT uuid FROM contact WHERE id=:id");
+    query->bindValue(":id", dbId);
+    query->exec();
+    if (query->next()) {
+        return getContact(query->value(0).toUuid());
     }
 
     return {};
@@ -73,11 +73,15 @@ void Conversation::sendFile(const QVariantMap &args)
     // Convert from "file:///" to local path now
     data->path = QUrl(path).toLocalFile();
 
+    QFileInfo fi{data->path};
     if (data->name.isEmpty()) {
-        QFileInfo fi{data->path};
         data->name = fi.fileName();
     }
 
+    if (fi.isDir()) {
+        data->fileType = File::FT_DIRECTORY;
+    }
+
     data->conversation = getId();
     data->contact = getFirstParticipant()->getId();
     data->identity = getIdentityId();
@@ -86,16 +90,30 @@ void Conversation::sendFile(const QVariantMap &args)
     touchLastActivity();
 }
 
+void Conversation::acceptAllFiles()
+{
+    const auto files = DsEngine::instance().getFileManager()->getFiles(
+                *this, File::INCOMING, File::FS_OFFERED);
+
+    LFLOG_DEBUG << "Accepting " << files.size() << " files in conversation " << getName();
+
+    // The transfers are started together, and the peer gets
+    // one ack for all of them if it supports that.
+    for(const auto& file : files) {
+        file->accept();
+    }
+}
+
 void Conversation::incomingMessage(Contact *contact, const MessageData &data)
 {
     // Add to the database
     if (!DsEngine::instance().getMessageManager()->receivedMessage(*this, data)) {
-        contact->sendAck("Message", "Rejected", data.messageId.toBase64());
+        contact->queueMessageAck(data.messageId, "Rejected");
         return;
     }
 
-    // Send ack
-    contact->sendAck("Message", "Received", data.messageId.toBase64());
+    // Send ack. It is coalesced with the acks for other messages in the same burst.
+    contact->queueMessageAck(data.messageId, "Received");
 
     touchLastActivity();
 }
@@ -376,6 +394,9 @@ QString Conversation::getSelectStatement(const QString &where)
 
 Conversation::ptr_t Conversation::load(QObject &parent, const std::function<void (QSqlQuery &)> &prepare)
 {
+    // An earlier instance may have unsaved changes
+    DirtyTracker::instance().flush();
+
     QSqlQuery query;
 
     enum Fields {
@@ -1,4 +1,6 @@
 
+#include <cassert>
+
 #include <QFileInfo>
 
 #include "ds/database.h"
@@ -9,6 +11,59 @@
 namespace ds {
 namespace core {
 
+// Each migration upgrades the schema from the previous version.
+// createDatabase() makes the schema for createdVersion, and the
+// later migrations are applied to new databases as well.
+const std::vector<Database::Migration> Database::migrations = {
+    {2, "Tree hashes for files", {
+        "ALTER TABLE file ADD COLUMN `tree_hash` BLOB",
+        "ALTER TABLE file ADD COLUMN `leaf_hashes` BLOB"
+    }},
+    {3, "Hash cache", {
+        R"(CREATE TABLE "hash_cache" ( `id` INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE, `path` TEXT NOT NULL, `size` INTEGER NOT NULL, `mtime` INTEGER NOT NULL, `inode` INTEGER NOT NULL, `hash` BLOB NOT NULL, `leaf_hashes` BLOB ))",
+        R"(CREATE UNIQUE INDEX `ix_hash_cache_key` ON `hash_cache` ( `path`, `size`, `mtime`, `inode` ))"
+    }},
+    {4, "File types", {
+        "ALTER TABLE file ADD COLUMN `file_type` INTEGER NOT NULL DEFAULT 0"
+    }},
+    {5, "Indexes for the frequent lookups", {
+        R"(CREATE INDEX IF NOT EXISTS `ix_message_message_id` ON `message` ( `message_id`, `direction` ))",
+        R"(CREATE INDEX IF NOT EXISTS `ix_file_file_id` ON `file` ( `file_id`, `conversation_id` ))",
+        R"(CREATE INDEX IF NOT EXISTS `ix_file_contact_state` ON `file` ( `contact_id`, `direction`, `state` ))",
+        R"(CREATE INDEX IF NOT EXISTS `ix_conversation_updated` ON `conversation` ( `identity`, `updated` ))",
+        R"(CREATE INDEX IF NOT EXISTS `ix_contact_auto_connect` ON `contact` ( `identity`, `auto_connect` ))"
+    }},
+    {6, "Indexes for paging through conversations", {
+        R"(CREATE INDEX IF NOT EXISTS `ix_message_conversation_time` ON `message` ( `conversation_id`, `composed_time` ))",
+        R"(CREATE INDEX IF NOT EXISTS `ix_file_conversation_time` ON `file` ( `conversation_id`, `created_time` ))"
+    }},
+    // composed_time and created_time are ISO text. Qt writes local times
+    // without an offset, and times from peers may be UTC or have an offset,
+    // so they don't compare as text. sort_time is UTC seconds since the epoch.
+    {7, "Comparable times for paging through conversations", {
+        "ALTER TABLE message ADD COLUMN `sort_time` INTEGER NOT NULL DEFAULT 0",
+        "ALTER TABLE file ADD COLUMN `sort_time` INTEGER NOT NULL DEFAULT 0",
+        R"(UPDATE message SET sort_time = CAST(CASE
+            WHEN composed_time GLOB '*Z' OR composed_time GLOB '*[+-][0-9][0-9]:[0-9][0-9]'
+            THEN strftime('%s', composed_time)
+            ELSE strftime('%s', composed_time, 'utc') END AS INTEGER))",
+        R"(UPDATE file SET sort_time = CAST(CASE
+            WHEN created_time GLOB '*Z' OR created_time GLOB '*[+-][0-9][0-9]:[0-9][0-9]'
+            THEN strftime('%s', created_time)
+            ELSE strftime('%s', created_time, 'utc') END AS INTEGER))",
+        "DROP INDEX IF EXISTS `ix_message_conversation_time`",
+        "DROP INDEX IF EXISTS `ix_file_conversation_time`",
+        R"(CREATE INDEX IF NOT EXISTS `ix_message_conversation_sort` ON `message` ( `conversation_id`, `sort_time` ))",
+        R"(CREATE INDEX IF NOT EXISTS `ix_file_conversation_sort` ON `file` ( `conversation_id`, `sort_time` ))"
+    }},
+    // used is UTC seconds since the epoch, for evicting old entries
+    {8, "Pruning the hash cache", {
+        "ALTER TABLE hash_cache ADD COLUMN `used` INTEGER NOT NULL DEFAULT 0",
+        "UPDATE hash_cache SET used = CAST(strftime('%s', 'now') AS INTEGER)",
+        R"(CREATE INDEX IF NOT EXISTS `ix_hash_cache_used` ON `hash_cache` ( `used` ))"
+    }}
+};
+
 Database::Database(QSettings& settings)
     : settings_{settings}
 {
@@ -36,14 +91,16 @@ Database::Database(QSettings& settings)
 
     exec("PRAGMA foreign_keys = ON");
 
-    QSqlQuery query("SELECT * FROM ds");
-    if (!query.next()) {
-        throw Error("Missing configuration record in database");
+    // Let the DbExecutor's readers run while we write
+    if (dbpath != ":memory:") {
+        exec("PRAGMA journal_mode = WAL");
     }
 
-    const auto dbver = query.value(DS_VERSION).toInt();
+    const auto dbver = getVersion();
     LFLOG_DEBUG << "Database schema version is " << dbver;
-    if (dbver != currentVersion) {
+    if (dbver < currentVersion) {
+        upgrade(dbver);
+    } else if (dbver != currentVersion) {
         LFLOG_WARN << "Database schema version is "
                    << dbver
                    << " while I expected " << currentVersion;
@@ -51,10 +108,28 @@ Database::Database(QSettings& settings)
 
     prepareData();
 
+    statements_ = std::make_unique<StatementCache>(db_);
+    dirtyTracker_ = std::make_unique<DirtyTracker>(
+                db_, *statements_, settings_.value("dbFlushInterval", 0).toInt());
+    executor_ = std::make_unique<DbExecutor>(
+                db_, *dirtyTracker_, settings_.value("dbReaders", DbExecutor::defaultReaders).toInt());
 }
 
 Database::~Database()
 {
+    // Finish the queued writes
+    executor_.reset();
+
+    try {
+        dirtyTracker_->flush();
+    } catch(const std::exception& ex) {
+        LFLOG_ERROR << "Failed to save changes to the database: " << ex.what();
+    }
+    dirtyTracker_.reset();
+
+    // The prepared statements must be released before the connection
+    statements_.reset();
+
     // Close the database and remove the connection to make our tests happy (no warnings).
     const auto name = db_.connectionName();
     db_.close();
@@ -73,13 +148,15 @@ void Database::createDatabase()
         exec(R"(CREATE TABLE "conversation" ( `id` INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE, `identity` INTEGER NOT NULL, `type` INTEGER NOT NULL DEFAULT 0, `name` TEXT NOT NULL, `uuid` INTEGER, `hash` BLOB NOT NULL, `participants` TEXT, `topic` TEXT, `created` TEXT NOT NULL, `updated` TEXT NOT NULL, `unread` INTEGER, FOREIGN KEY(`identity`) REFERENCES `identity`(`id`) ))");
         exec(R"(CREATE TABLE "message" ( `id` INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE, `direction` INTEGER NOT NULL, `state` INTEGER NOT NULL, `conversation_id` INTEGER NOT NULL, `conversation` BLOB NOT NULL, `message_id` BLOB NOT NULL, `composed_time` INTEGER NOT NULL, `received_time` INTEGER, `content` TEXT NOT NULL, `signature` BLOB NOT NULL, `sender` BLOB NOT NULL, `encoding` INTEGER NOT NULL ))");
         exec(R"(CREATE TABLE "notification" ( `id` INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE, `status` INTEGER NOT NULL, `priority` INTEGER NOT NULL, `identity` INTEGER NOT NULL, `contact` INTEGER, `type` INTEGER NOT NULL, `timestamp` TEXT NOT NULL, `message` TEXT, `data` BLOB, `hash` BLOB ))");
-        exec(R"(CREATE TABLE "file" ( `id` INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE, `file_id` BLOB NOT NULL, `state` INTEGER, `direction` INTEGER, `identity_id` INTEGER NOT NULL, `conversation_id` INTEGER, `contact_id` INTEGER NOT NULL, `hash` BLOB, `name` TEXT NOT NULL, `path` TEXT, `size` INTEGER NOT NULL, `file_time` TEXT, `created_time` TEXT NOT NULL, `ack_time` TEXT, `bytes_transferred` INTEGER DEFAULT 0, FOREIGN KEY(`conversation_id`) REFERENCES `conversation`(`id`), FOREIGN KEY(`identity_id`) REFERENCES `identity`(`id`), FOREIGN KEY(`contact_id`) REFERENCES `contact`(`id`) ))");
+        exec(R"(CREATE TABLE "file" ( `id` INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE, `file_id` BLOB NOT NULL, `state` INTEGER, `direction` INTEGER, `identity_id` INTEGER NOT NULL, `conversation_id` INTEGER, `contact_id` INTEGER NOT NULL, `hash` BLOB, `name` TEXT NOT NULL, `path` TEXT, `size` INTEGER NOT NULL, `file_time` TEXT, `created_time` TEXT NOT NULL, `ack_time` TEXT, `bytes_transferred` INTEGER DEFAULT 0, `tree_hash` BLOB, `leaf_hashes` BLOB, `file_type` INTEGER NOT NULL DEFAULT 0, FOREIGN KEY(`conversation_id`) REFERENCES `conversation`(`id`), FOREIGN KEY(`identity_id`) REFERENCES `identity`(`id`), FOREIGN KEY(`contact_id`) REFERENCES `contact`(`id`) ))");
+        exec(R"(CREATE TABLE "hash_cache" ( `id` INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE, `path` TEXT NOT NULL, `size` INTEGER NOT NULL, `mtime` INTEGER NOT NULL, `inode` INTEGER NOT NULL, `hash` BLOB NOT NULL, `leaf_hashes` BLOB ))");
         exec(R"(CREATE UNIQUE INDEX `ix_contact_hash` ON `contact` ( `identity`, `hash` ))");
         exec(R"(CREATE UNIQUE INDEX `ix_contact_name` ON `contact` ( `identity`, `name` ))");
         exec(R"(CREATE UNIQUE INDEX `ix_message_id` ON `message` (`conversation_id` ,`id` ))");
+        exec(R"(CREATE UNIQUE INDEX `ix_hash_cache_key` ON `hash_cache` ( `path`, `size`, `mtime`, `inode` ))");
         QSqlQuery query(db_);
         query.prepare("INSERT INTO ds (version) VALUES (:version)");
-        query.bindValue(":version", currentVersion);
+        query.bindValue(":version", createdVersion);
         if(!query.exec()) {
             throw Error("Failed to initialize database");
         }
@@ -92,6 +169,60 @@ void Database::createDatabase()
     db_.commit();
 }
 
+void Database::upgrade(const int fromVersion)
+{
+    assert(migrations.back().version == currentVersion);
+
+    LFLOG_NOTICE << "Upgrading the database schema from version " << fromVersion
+                 << " to " << currentVersion;
+
+    for(const auto& migration : migrations) {
+        if (migration.version <= fromVersion) {
+            continue;
+        }
+
+        LFLOG_DEBUG << "Migrating the database to version " << migration.version
+                    << ": " << migration.description;
+
+        // Each migration is committed with its version, so an interrupted
+        // upgrade continues from the last one that completed.
+        db_.transaction();
+
+        try {
+            for(const auto sql : migration.statements) {
+                exec(sql);
+            }
+
+            QSqlQuery query(db_);
+            query.prepare("UPDATE ds SET version=:version");
+            query.bindValue(":version", migration.version);
+            if(!query.exec()) {
+                throw Error("Failed to update the database version");
+            }
+
+        } catch(const std::exception&) {
+            db_.rollback();
+            throw;
+        }
+
+        if (!db_.commit()) {
+            throw Error(QStringLiteral("Failed to commit the database migration: %1")
+                        .arg(db_.lastError().text()));
+        }
+    }
+}
+
+int Database::getVersion()
+{
+    QSqlQuery query(db_);
+    query.exec("SELECT * FROM ds");
+    if (!query.next()) {
+        throw Error("Missing configuration record in database");
+    }
+
+    return query.value(DS_VERSION).toInt();
+}
+
 void Database::exec(const char *sql)
 {
     QSqlQuery query(db_);
@@ -103,13 +234,15 @@ void Database::exec(const char *sql)
 
 void Database::prepareData()
 {
+    // bytes_transferred is kept, so the transfers can be resumed
+
     {   // Set outgoing files that was being transferred, when we last quit, to waiting state
         QSqlQuery query(db_);
         query.prepare("UPDATE file SET state=:waiting WHERE direction=:out AND state IN(:transferring, :offered, :queued)");
         query.bindValue(":waiting", static_cast<int>(File::FS_WAITING));
         query.bindValue(":out", static_cast<int>(File::OUTGOING));
         query.bindValue(":transferring", static_cast<int>(File::FS_TRANSFERRING));
-        query.bindValue(":queued", static_cast<int>(File::FS_TRANSFERRING));
+        query.bindValue(":queued", static_cast<int>(File::FS_QUEUED));
         query.bindValue(":offered", static_cast<int>(File::FS_OFFERED));
         query.exec();
         if (query.lastError().type() != QSqlError::NoError) {
@@ -0,0 +1,191 @@
+#include <algorithm>
+
+#include <QSqlError>
+#include <QSqlQuery>
+
+#include "ds/dbexecutor.h"
+#include "ds/dirtytracker.h"
+#include "ds/errors.h"
+
+#include "logfault/logfault.h"
+
+using namespace std;
+
+namespace ds {
+namespace core {
+
+namespace {
+
+QString getSharedPath(const QSqlDatabase& db)
+{
+    const auto path = db.databaseName();
+    return (path == QStringLiteral(":memory:")) ? QString{} : path;
+}
+
+} // anonymous namespace
+
+DbExecutor::DbExecutor(QSqlDatabase &db, DirtyTracker &dirtyTracker, const int readers)
+    : db_{db}, dirtyTracker_{dirtyTracker}, path_{getSharedPath(db)}
+{
+    if (!isShared()) {
+        LFLOG_DEBUG << "The database is in memory. Queued queries use the main connection.";
+        return;
+    }
+
+    readers_.readOnly = true;
+    start(readers_, max(readers, 1), QStringLiteral("ds-reader"));
+    start(writer_, 1, QStringLiteral("ds-writer"));
+}
+
+DbExecutor::~DbExecutor()
+{
+    stop(readers_, true);
+    stop(writer_, false);
+}
+
+void DbExecutor::write(DbExecutor::job_t job)
+{
+    post(writer_, [job=move(job)](QSqlDatabase& db) {
+        try {
+            begin(db);
+            job(db);
+            commit(db);
+        } catch(const std::exception& ex) {
+            db.rollback();
+            LFLOG_ERROR << "Database write failed: " << ex.what();
+        }
+    });
+}
+
+void DbExecutor::begin(QSqlDatabase &db)
+{
+    if (!db.transaction()) {
+        throw Error(QStringLiteral("Failed to start transaction: %1").arg(
+                        db.lastError().text()));
+    }
+}
+
+void DbExecutor::commit(QSqlDatabase &db)
+{
+    if (!db.commit()) {
+        throw Error(QStringLiteral("Failed to commit: %1").arg(
+                        db.lastError().text()));
+    }
+}
+
+void DbExecutor::post(DbExecutor::Pool &pool, DbExecutor::job_t job)
+{
+    // The job's connection must see the changes we have not saved yet
+    dirtyTracker_.flush();
+
+    if (!isShared()) {
+        QMetaObject::invokeMethod(this, [this, job=move(job)] {
+            job(db_);
+        }, Qt::QueuedConnection);
+        return;
+    }
+
+    {
+        lock_guard<mutex> lock{pool.mutex};
+        pool.queue.push_back(move(job));
+    }
+    pool.cond.notify_one();
+}
+
+void DbExecutor::run(DbExecutor::Pool &pool, const QString &name)
+{
+    {
+        auto db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), name);
+        db.setDatabaseName(path_);
+        if (pool.readOnly) {
+            db.setConnectOptions(QStringLiteral("QSQLITE_OPEN_READONLY"));
+        }
+
+        // If we can't open it, the jobs fail when they use the connection
+        if (!db.open()) {
+            LFLOG_ERROR << "Failed to open database connection " << name
+                        << ": " << db.lastError().text();
+        } else if (!pool.readOnly) {
+            QSqlQuery query{db};
+            query.exec("PRAGMA foreign_keys = ON");
+        }
+
+        while(true) {
+            job_t job;
+            {
+                unique_lock<mutex> lock{pool.mutex};
+                pool.cond.wait(lock, [&pool] {
+                    return !pool.queue.empty() || pool.done;
+                });
+
+                if (pool.queue.empty()) {
+                    break;
+                }
+
+                job = move(pool.queue.front());
+                pool.queue.pop_front();
+            }
+
+            job(db);
+        }
+
+        db.close();
+    }
+
+    QSqlDatabase::removeDatabase(name);
+}
+
+void DbExecutor::deliver(const QPointer<QObject> &target, std::function<void ()> fn)
+{
+    QMetaObject::invokeMethod(this, [target, fn=move(fn)] {
+        if (!target) {
+            return;
+        }
+
+        try {
+            fn();
+        } catch(const std::exception& ex) {
+            LFLOG_ERROR << "Caught exception from database callback: " << ex.what();
+        }
+    }, Qt::QueuedConnection);
+}
+
+void DbExecutor::fail(const QPointer<QObject> &target, const DbExecutor::failed_fn_t &failed,
+                      const QString &reason)
+{
+    LFLOG_WARN << "Database query failed: " << reason;
+    if (failed) {
+        deliver(target, [failed, reason] {
+            failed(reason);
+        });
+    }
+}
+
+void DbExecutor::stop(DbExecutor::Pool &pool, const bool discard)
+{
+    {
+        lock_guard<mutex> lock{pool.mutex};
+        if (discard) {
+            pool.queue.clear();
+        }
+        pool.done = true;
+    }
+
+    pool.cond.notify_all();
+    for(auto& thread : pool.threads) {
+        thread.join();
+    }
+    pool.threads.clear();
+}
+
+void DbExecutor::start(DbExecutor::Pool &pool, const int threads, const QString &name)
+{
+    for(int i = 0; i < threads; ++i) {
+        const auto connection = QStringLiteral("%1-%2").arg(name).arg(i);
+        pool.threads.emplace_back([this, &pool, connection] {
+            run(pool, connection);
+        });
+    }
+}
+
+}} // namespaces
@@ -0,0 +1,458 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#include <QtEndian>
+
+#include <sodium.h>
+
+#include "ds/bytes.h"
+#include "ds/delta.h"
+
+#include "logfault/logfault.h"
+
+using namespace std;
+
+namespace ds {
+namespace core {
+
+namespace {
+
+// How much of the source we read at the time
+constexpr qint64 read_buffer_bytes = 1024 * 1024;
+
+constexpr qint64 max_literal_header_bytes = 1 + maxVarintBytes<quint64>();
+constexpr qint64 max_copy_op_bytes = 1 + (maxVarintBytes<quint64>() * 2);
+
+} // anonymous namespace
+
+qint64 Delta::getBlockSize(const qint64 basisSize) noexcept
+{
+    const auto root = static_cast<qint64>(sqrt(static_cast<double>(max(basisSize, qint64{0}))));
+    const auto needed = max(root, (basisSize + maxBlocks - 1) / maxBlocks);
+    return max(qint64{minBlockSize}, ((needed + 1023) / 1024) * 1024);
+}
+
+quint32 Delta::weakChecksum(const char *data, const size_t len) noexcept
+{
+    RollingChecksum checksum;
+    checksum.init(data, len);
+    return checksum.value();
+}
+
+QByteArray Delta::strongHash(const char *data, const size_t len)
+{
+    uint8_t hash[crypto_hash_sha256_BYTES] = {};
+    crypto_hash_sha256(hash, reinterpret_cast<const uint8_t *>(data), len);
+    return QByteArray{reinterpret_cast<const char *>(hash), strongBytes};
+}
+
+QByteArray Delta::createSignature(QIODevice &basis, const qint64 blockSize)
+{
+    QByteArray signature;
+    QByteArray weak(weakBytes, 0);
+    while(!basis.atEnd()) {
+        const auto block = basis.read(blockSize);
+        if (block.isEmpty()) {
+            LFLOG_DEBUG << "Failed to read the basis for the delta signature: "
+                        << basis.errorString();
+            return {};
+        }
+
+        const auto len = static_cast<size_t>(block.size());
+        qToBigEndian(weakChecksum(block.constData(), len), weak.data());
+        signature += weak;
+        signature += strongHash(block.constData(), len);
+    }
+
+    return signature;
+}
+
+bool Delta::isValidSignature(const QByteArray &signature)
+{
+    return !signature.isEmpty()
+            && ((signature.size() % signatureBytes) == 0)
+            && ((signature.size() / signatureBytes) <= maxBlocks);
+}
+
+void Delta::RollingChecksum::init(const char *data, const size_t len) noexcept
+{
+    a_ = b_ = {};
+    len_ = static_cast<quint32>(len);
+    for(size_t i = 0; i < len; ++i) {
+        const quint32 value = static_cast<uint8_t>(data[i]);
+        a_ += value;
+        b_ += static_cast<quint32>(len - i) * value;
+    }
+    a_ &= 0xffff;
+    b_ &= 0xffff;
+}
+
+void Delta::RollingChecksum::roll(const char out, const char in) noexcept
+{
+    const quint32 outValue = static_cast<uint8_t>(out);
+    a_ = (a_ - outValue + static_cast<uint8_t>(in)) & 0xffff;
+    b_ = (b_ - (len_ * outValue) + a_) & 0xffff;
+}
+
+DeltaEncoder::DeltaEncoder(QIODevice &source, const qint64 blockSize, const QByteArray &signature)
+    : source_{source}, blockSize_{blockSize}, signature_{signature}
+{
+    assert(Delta::isValidSignature(signature));
+    const auto count = signature.size() / Delta::signatureBytes;
+    blocks_.reserve(static_cast<size_t>(count));
+    for(int i = 0; i < count; ++i) {
+        blocks_.emplace(qFromBigEndian<quint32>(signature.constData() + (i * Delta::signatureBytes)), i);
+    }
+}
+
+qint64 DeltaEncoder::encode(char *out, const qint64 capacity, bool &finished)
+{
+    assert(capacity > max_copy_op_bytes);
+
+    qint64 used = {};
+    expanded_ = {};
+    finished = false;
+
+    while(true) {
+        if (!fill()) {
+            return -1;
+        }
+
+        const auto avail = static_cast<qint64>(buffer_.size() - pos_);
+        if (avail == 0) {
+            assert(eof_);
+            finished = flushLiteral(out, capacity, used) && flushCopy(out, capacity, used);
+            return used;
+        }
+
+        // The frame is full, or will expand to enough data for now
+        if (((pos_ - literal_) >= (capacity - used - max_literal_header_bytes))
+                || (expanded_ >= Delta::maxExpandBytes)) {
+            if (flushLiteral(out, capacity, used)) {
+                flushCopy(out, capacity, used);
+            }
+            return used;
+        }
+
+        // The tail can't match a whole block
+        if (avail < blockSize_) {
+            if (!flushCopy(out, capacity, used)) {
+                return used;
+            }
+            pos_ = buffer_.size();
+            rollingValid_ = false;
+            continue;
+        }
+
+        if (!rollingValid_) {
+            rolling_.init(buffer_.constData() + pos_, static_cast<size_t>(blockSize_));
+            rollingValid_ = true;
+        }
+
+        const auto block = findBlock();
+        if (block >= 0) {
+            if (!flushLiteral(out, capacity, used)) {
+                return used;
+            }
+
+            if (copyCount_ && (copyFirst_ + copyCount_ == block)
+                    && (((copyCount_ + 1) * blockSize_) <= Delta::maxExpandBytes)) {
+                ++copyCount_;
+            } else {
+                if (!flushCopy(out, capacity, used)) {
+                    return used;
+                }
+                copyFirst_ = block;
+                copyCount_ = 1;
+            }
+
+            pos_ += static_cast<int>(blockSize_);
+            literal_ = pos_;
+            rollingValid_ = false;
+            continue;
+        }
+
+        // No match. The first byte in the window is literal data.
+        if (!flushCopy(out, capacity, used)) {
+            return used;
+        }
+
+        if (avail > blockSize_) {
+            rolling_.roll(buffer_.at(pos_), buffer_.at(pos_ + static_cast<int>(blockSize_)));
+        } else {
+            rollingValid_ = false;
+        }
+        ++pos_;
+    }
+}
+
+bool DeltaEncoder::fill()
+{
+    while(!eof_ && ((buffer_.size() - pos_) <= blockSize_)) {
+
+        // Drop the data we have encoded
+        if (literal_ > 0) {
+            buffer_.remove(0, literal_);
+            pos_ -= literal_;
+            literal_ = 0;
+        }
+
+        const auto want = max(read_buffer_bytes, blockSize_ * 2);
+        const auto old = buffer_.size();
+        buffer_.resize(old + static_cast<int>(want));
+        const auto bytes = source_.read(buffer_.data() + old, want);
+        if (bytes < 0) {
+            buffer_.resize(old);
+            return false;
+        }
+
+        buffer_.resize(old + static_cast<int>(bytes));
+        eof_ = (bytes == 0) || source_.atEnd();
+    }
+
+    return true;
+}
+
+int DeltaEncoder::findBlock()
+{
+    const auto range = blocks_.equal_range(rolling_.value());
+    if (range.first == range.second) {
+        return -1;
+    }
+
+    const auto strong = Delta::strongHash(buffer_.constData() + pos_, static_cast<size_t>(blockSize_));
+    int found = -1;
+    for(auto it = range.first; it != range.second; ++it) {
+        const auto offset = (it->second * Delta::signatureBytes) + Delta::weakBytes;
+        if (memcmp(signature_.constData() + offset, strong.constData(), Delta::strongBytes) == 0) {
+
+            // Prefer the block that extends the pending copy
+            if (copyCount_ && (it->second == (copyFirst_ + copyCount_))) {
+                return it->second;
+            }
+            if (found < 0) {
+                found = it->second;
+            }
+        }
+    }
+
+    return found;
+}
+
+bool DeltaEncoder::flushLiteral(char *out, const qint64 capacity, qint64 &used)
+{
+    while(pos_ > literal_) {
+        const auto room = capacity - used - max_literal_header_bytes;
+        if (room <= 0) {
+            return false;
+        }
+
+        const auto len = min(room, static_cast<qint64>(pos_ - literal_));
+        auto dst = reinterpret_cast<uint8_t *>(out + used);
+        dst[0] = Delta::LITERAL;
+        used += 1 + static_cast<qint64>(valueToVarint(static_cast<quint64>(len), dst + 1));
+        memcpy(out + used, buffer_.constData() + literal_, static_cast<size_t>(len));
+        used += len;
+        literal_ += static_cast<int>(len);
+        encoded_ += len;
+        expanded_ += len;
+        literalBytes_ += len;
+    }
+
+    return true;
+}
+
+bool DeltaEncoder::flushCopy(char *out, const qint64 capacity, qint64 &used)
+{
+    if (!copyCount_) {
+        return true;
+    }
+
+    if ((capacity - used) < max_copy_op_bytes) {
+        return false;
+    }
+
+    auto dst = reinterpret_cast<uint8_t *>(out + used);
+    size_t len = 1;
+    dst[0] = Delta::COPY;
+    len += valueToVarint(static_cast<quint64>(copyFirst_), dst + len);
+    len += valueToVarint(static_cast<quint64>(copyCount_), dst + len);
+    used += static_cast<qint64>(len);
+
+    const auto bytes = copyCount_ * blockSize_;
+    encoded_ += bytes;
+    expanded_ += bytes;
+    copiedBytes_ += bytes;
+    copyCount_ = 0;
+    return true;
+}
+
+DeltaDecoder::DeltaDecoder(DeltaBasis basis, const qint64 maxSize)
+    : basis_{move(basis)}, maxSize_{maxSize}, io_{basis_.path}
+{
+}
+
+bool DeltaDecoder::open()
+{
+    if (!Delta::isValidSignature(basis_.signature) || (basis_.blockSize <= 0)) {
+        return fail("Invalid signature");
+    }
+
+    blocks_ = basis_.signature.size() / Delta::signatureBytes;
+    if (blocks_ != ((basis_.size + basis_.blockSize - 1) / basis_.blockSize)) {
+        return fail("The signature does not match the basis");
+    }
+
+    if (!io_.open(QIODevice::ReadOnly)) {
+        return fail(QStringLiteral("Failed to open the basis: %1").arg(io_.errorString()));
+    }
+
+    if (io_.size() != basis_.size) {
+        return fail("The basis file changed");
+    }
+
+    return true;
+}
+
+qint64 DeltaDecoder::measure(const char *data, const size_t len) const
+{
+    const auto blocks = static_cast<quint64>(blocks_);
+    auto src = reinterpret_cast<const uint8_t *>(data);
+    auto left = len;
+    qint64 expanded = {};
+    while(left > 0) {
+        const auto op = *src++;
+        --left;
+
+        if (op == Delta::LITERAL) {
+            quint64 bytes = {};
+            const auto used = varintToValue(src, left, bytes);
+            if (!used || (bytes > (left - used))) {
+                return -1;
+            }
+            src += used + bytes;
+            left -= used + bytes;
+            expanded += static_cast<qint64>(bytes);
+        } else if (op == Delta::COPY) {
+            quint64 first = {}, count = {};
+            auto used = varintToValue(src, left, first);
+            if (used) {
+                src += used;
+                left -= used;
+                used = varintToValue(src, left, count);
+            }
+            if (!used || (count == 0) || (first >= blocks) || (count > (blocks - first))) {
+                return -1;
+            }
+            src += used;
+            left -= used;
+
+            // The last block of the basis may be short
+            const auto begin = static_cast<qint64>(first) * basis_.blockSize;
+            const auto end = min(static_cast<qint64>(first + count) * basis_.blockSize, basis_.size);
+            expanded += end - begin;
+        } else {
+            return -1;
+        }
+
+        if (expanded > Delta::maxExpandBytes) {
+            return -1;
+        }
+    }
+
+    return expanded;
+}
+
+bool DeltaDecoder::decode(const char *data, const size_t len, QByteArray &out)
+{
+    const auto expanded = measure(data, len);
+    if (expanded < 0) {
+        return fail("Invalid operations, or they expand to too much data");
+    }
+
+    if (expanded > (maxSize_ - rebuilt_)) {
+        return fail("The rebuilt file is larger than the offered file");
+    }
+    rebuilt_ += expanded;
+
+    auto src = reinterpret_cast<const uint8_t *>(data);
+    auto left = len;
+    while(left > 0) {
+        const auto op = *src++;
+        --left;
+
+        if (op == Delta::LITERAL) {
+            quint64 bytes = {};
+            const auto used = varintToValue(src, left, bytes);
+            if (!used || (bytes > (left - used))) {
+                return fail("Invalid literal");
+            }
+            src += used;
+            left -= used;
+            out.append(reinterpret_cast<const char *>(src), static_cast<int>(bytes));
+            src += bytes;
+            left -= bytes;
+        } else if (op == Delta::COPY) {
+            quint64 first = {}, count = {};
+            auto used = varintToValue(src, left, first);
+            if (used) {
+                src += used;
+                left -= used;
+                used = varintToValue(src, left, count);
+            }
+            if (!used) {
+                return fail("Invalid copy");
+            }
+            src += used;
+            left -= used;
+
+            if (!copy(first, count, out)) {
+                return false;
+            }
+        } else {
+            return fail("Unknown operation");
+        }
+    }
+
+    return true;
+}
+
+bool DeltaDecoder::copy(const quint64 first, const quint64 count, QByteArray &out)
+{
+    const auto blocks = static_cast<quint64>(blocks_);
+    if ((count == 0) || (first >= blocks) || (count > (blocks - first))
+            || (count > static_cast<quint64>(Delta::maxExpandBytes / basis_.blockSize))) {
+        return fail("Invalid block reference");
+    }
+
+    for(auto block = first; block < (first + count); ++block) {
+        const auto offset = static_cast<qint64>(block) * basis_.blockSize;
+        const auto len = min(basis_.blockSize, basis_.size - offset);
+        const auto at = out.size();
+        out.resize(at + static_cast<int>(len));
+        if (!io_.seek(offset) || (io_.read(out.data() + at, len) != len)) {
+            return fail(QStringLiteral("Failed to read the basis: %1").arg(io_.errorString()));
+        }
+
+        // The basis may have been modified since we made the signature
+        const auto expected = basis_.signature.constData()
+                + (static_cast<qint64>(block) * Delta::signatureBytes) + Delta::weakBytes;
+        const auto hash = Delta::strongHash(out.constData() + at, static_cast<size_t>(len));
+        if (memcmp(hash.constData(), expected, Delta::strongBytes) != 0) {
+            return fail("The basis file changed");
+        }
+    }
+
+    return true;
+}
+
+bool DeltaDecoder::fail(const QString &reason)
+{
+    LFLOG_WARN << "Delta for \"" << basis_.path << "\": " << reason;
+    error_ = reason;
+    return false;
+}
+
+}} // namespaces
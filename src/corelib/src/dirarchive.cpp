@@ -0,0 +1,464 @@
+
+#include <algorithm>
+#include <cassert>
+
+#include <QCborArray>
+#include <QCborValue>
+#include <QDir>
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QtEndian>
+
+#include "ds/dirarchive.h"
+
+#include "logfault/logfault.h"
+
+using namespace std;
+
+namespace ds {
+namespace core {
+
+namespace {
+
+constexpr qint64 read_buffer_bytes = 1024 * 1024;
+
+QByteArray finalHash(crypto_hash_sha256_state& state) {
+    QByteArray hash(DirArchive::hashBytes, 0);
+    crypto_hash_sha256_final(&state, reinterpret_cast<uint8_t *>(hash.data()));
+    return hash;
+}
+
+} // anonymous namespace
+
+vector<DirArchive::Entry> DirArchive::scan(const QString &root)
+{
+    const QDir dir{root};
+    vector<Entry> entries;
+    QDirIterator it{root, QDir::AllEntries | QDir::NoDotAndDotDot | QDir::Hidden
+                | QDir::NoSymLinks, QDirIterator::Subdirectories};
+    while(it.hasNext()) {
+        it.next();
+        const auto info = it.fileInfo();
+        if (info.isDir()) {
+            entries.emplace_back(dir.relativeFilePath(info.filePath()), -1);
+        } else if (info.isFile()) {
+            entries.emplace_back(dir.relativeFilePath(info.filePath()), info.size());
+        }
+    }
+
+    sort(entries.begin(), entries.end(), [](const Entry& left, const Entry& right) {
+        return left.path < right.path;
+    });
+
+    return entries;
+}
+
+QByteArray DirArchive::encodeManifest(const vector<Entry> &entries)
+{
+    QCborArray manifest;
+    for(const auto& entry : entries) {
+        manifest.append(QCborArray{entry.path, entry.size});
+    }
+
+    return manifest.toCborValue().toCbor();
+}
+
+bool DirArchive::decodeManifest(const QByteArray &data, vector<Entry> &entries)
+{
+    QCborParserError error;
+    const auto manifest = QCborValue::fromCbor(data, &error);
+    if ((error.error != QCborError::NoError) || !manifest.isArray()) {
+        return false;
+    }
+
+    entries.clear();
+    for(const auto& value : manifest.toArray()) {
+        const auto entry = value.toArray();
+        if ((entry.size() != 2) || !entry.at(0).isString() || !entry.at(1).isInteger()) {
+            return false;
+        }
+
+        const auto path = entry.at(0).toString();
+        const auto size = entry.at(1).toInteger();
+        if (!isSafePath(path) || (size < -1)) {
+            LFLOG_WARN << "Invalid entry in directory manifest: \"" << path << "\"";
+            return false;
+        }
+
+        entries.emplace_back(path, size);
+    }
+
+    return true;
+}
+
+qint64 DirArchive::getStreamSize(const QString &root)
+{
+    const auto entries = scan(root);
+    qint64 size = lengthBytes + encodeManifest(entries).size();
+    for(const auto& entry : entries) {
+        if (!entry.isDir()) {
+            size += entry.size + hashBytes;
+        }
+    }
+
+    return size;
+}
+
+bool DirArchive::isSafePath(const QString &path)
+{
+    if (path.isEmpty() || path.startsWith('/') || path.contains('\\') || path.contains(':')) {
+        return false;
+    }
+
+    for(const auto& part : path.split('/')) {
+        if (part.isEmpty() || (part == ".") || (part == "..")) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+DirArchiveReader::DirArchiveReader(const QString &root)
+    : root_{root}
+{
+}
+
+bool DirArchiveReader::open(QIODevice::OpenMode mode)
+{
+    if (mode != ReadOnly) {
+        setErrorString("DirArchiveReader is read only");
+        return false;
+    }
+
+    if (!QFileInfo{root_}.isDir()) {
+        setErrorString(QStringLiteral("Not a directory: %1").arg(root_));
+        return false;
+    }
+
+    entries_ = DirArchive::scan(root_);
+    const auto manifest = DirArchive::encodeManifest(entries_);
+    if (manifest.size() > DirArchive::maxManifestBytes) {
+        setErrorString("Too many files in the directory");
+        return false;
+    }
+
+    header_.resize(DirArchive::lengthBytes);
+    qToBigEndian(static_cast<quint32>(manifest.size()), header_.data());
+    header_ += manifest;
+
+    segments_.clear();
+    segments_.push_back({0, header_.size(), -1, false});
+    size_ = header_.size();
+    for(size_t i = 0; i < entries_.size(); ++i) {
+        const auto& entry = entries_[i];
+        if (entry.isDir()) {
+            continue;
+        }
+
+        // An empty file only has its hash
+        if (entry.size > 0) {
+            segments_.push_back({size_, entry.size, static_cast<int>(i), false});
+            size_ += entry.size;
+        }
+        segments_.push_back({size_, DirArchive::hashBytes, static_cast<int>(i), true});
+        size_ += DirArchive::hashBytes;
+    }
+
+    return QIODevice::open(mode);
+}
+
+void DirArchiveReader::close()
+{
+    current_.close();
+    currentEntry_ = hashEntry_ = -1;
+    QIODevice::close();
+}
+
+qint64 DirArchiveReader::readData(char *data, qint64 maxlen)
+{
+    qint64 done = {};
+    auto at = pos();
+    while((done < maxlen) && (at < size_)) {
+
+        // The last segment that starts at or before /at/
+        auto it = upper_bound(segments_.begin(), segments_.end(), at,
+                              [](const qint64 offset, const Segment& segment) {
+            return offset < segment.offset;
+        });
+        const auto& segment = *--it;
+        const auto into = at - segment.offset;
+        const auto bytes = min(maxlen - done, segment.len - into);
+
+        if (segment.entry < 0) {
+            memcpy(data + done, header_.constData() + into, static_cast<size_t>(bytes));
+        } else if (segment.hash) {
+            QByteArray hash;
+            if (!getHash(segment.entry, hash)) {
+                return -1;
+            }
+            memcpy(data + done, hash.constData() + into, static_cast<size_t>(bytes));
+        } else if (!readContent(segment.entry, into, data + done, bytes)) {
+            return -1;
+        }
+
+        done += bytes;
+        at += bytes;
+    }
+
+    return done;
+}
+
+qint64 DirArchiveReader::writeData(const char *data, qint64 len)
+{
+    Q_UNUSED(data)
+    Q_UNUSED(len)
+    return -1;
+}
+
+bool DirArchiveReader::readContent(const int entry, const qint64 at, char *data, const qint64 len)
+{
+    if (currentEntry_ != entry) {
+        current_.close();
+        currentEntry_ = -1;
+        if (!openEntry(current_, entry)) {
+            return false;
+        }
+        currentEntry_ = entry;
+        crypto_hash_sha256_init(&hashState_);
+        hashed_ = 0;
+    }
+
+    if ((current_.pos() != at) && !current_.seek(at)) {
+        setErrorString(current_.errorString());
+        return false;
+    }
+
+    if (current_.read(data, len) != len) {
+        setErrorString(QStringLiteral("Failed to read \"%1\". Did it change?").arg(current_.fileName()));
+        return false;
+    }
+
+    // We can only hash the entry if we read all of it in sequence
+    if (hashed_ == at) {
+        crypto_hash_sha256_update(&hashState_, reinterpret_cast<const uint8_t *>(data),
+                                  static_cast<size_t>(len));
+        hashed_ += len;
+    } else {
+        hashed_ = -1;
+    }
+
+    return true;
+}
+
+bool DirArchiveReader::getHash(const int entry, QByteArray &hash)
+{
+    if (entry == hashEntry_) {
+        hash = hash_;
+        return true;
+    }
+
+    const auto size = entries_[static_cast<size_t>(entry)].size;
+    if ((entry == currentEntry_) && (hashed_ == size)) {
+        hash_ = finalHash(hashState_);
+        hashed_ = -1;
+    } else {
+        // We did not read it all in sequence. Hash it from the disk.
+        QFile file;
+        if (!openEntry(file, entry)) {
+            return false;
+        }
+
+        crypto_hash_sha256_state state = {};
+        crypto_hash_sha256_init(&state);
+        qint64 bytes = {};
+        while(bytes < size) {
+            const auto buffer = file.read(min(read_buffer_bytes, size - bytes));
+            if (buffer.isEmpty()) {
+                setErrorString(QStringLiteral("Failed to read \"%1\"").arg(file.fileName()));
+                return false;
+            }
+            crypto_hash_sha256_update(&state, reinterpret_cast<const uint8_t *>(buffer.constData()),
+                                      static_cast<size_t>(buffer.size()));
+            bytes += buffer.size();
+        }
+        hash_ = finalHash(state);
+    }
+
+    hashEntry_ = entry;
+    hash = hash_;
+    return true;
+}
+
+bool DirArchiveReader::openEntry(QFile &file, const int entry)
+{
+    const auto& e = entries_[static_cast<size_t>(entry)];
+    file.setFileName(root_ + "/" + e.path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        setErrorString(QStringLiteral("Failed to open \"%1\": %2")
+                       .arg(file.fileName(), file.errorString()));
+        return false;
+    }
+
+    if (file.size() != e.size) {
+        setErrorString(QStringLiteral("\"%1\" changed size").arg(file.fileName()));
+        return false;
+    }
+
+    return true;
+}
+
+DirArchiveWriter::DirArchiveWriter(const QString &root)
+    : root_{root}
+{
+}
+
+bool DirArchiveWriter::open(QIODevice::OpenMode mode)
+{
+    if (mode != WriteOnly) {
+        setErrorString("DirArchiveWriter is write only");
+        return false;
+    }
+
+    if (!QDir{}.mkpath(root_)) {
+        setErrorString(QStringLiteral("Failed to create \"%1\"").arg(root_));
+        return false;
+    }
+
+    return QIODevice::open(mode);
+}
+
+void DirArchiveWriter::close()
+{
+    out_.close();
+    QIODevice::close();
+}
+
+qint64 DirArchiveWriter::readData(char *data, qint64 maxlen)
+{
+    Q_UNUSED(data)
+    Q_UNUSED(maxlen)
+    return -1;
+}
+
+qint64 DirArchiveWriter::writeData(const char *data, qint64 len)
+{
+    auto left = len;
+    while(left > 0) {
+        switch(state_) {
+        case State::LENGTH:
+        case State::MANIFEST:
+        case State::HASH: {
+            const auto bytes = min(left, want_ - pending_.size());
+            pending_.append(data, static_cast<int>(bytes));
+            data += bytes;
+            left -= bytes;
+            if ((pending_.size() == want_) && !onCollected()) {
+                return -1;
+            }
+        } break;
+        case State::CONTENT: {
+            const auto bytes = min(left, left_);
+            if (out_.write(data, bytes) != bytes) {
+                fail(QStringLiteral("Failed to write \"%1\": %2")
+                     .arg(out_.fileName(), out_.errorString()));
+                return -1;
+            }
+            crypto_hash_sha256_update(&hashState_, reinterpret_cast<const uint8_t *>(data),
+                                      static_cast<size_t>(bytes));
+            data += bytes;
+            left -= bytes;
+            left_ -= bytes;
+            if (left_ == 0) {
+                state_ = State::HASH;
+                want_ = DirArchive::hashBytes;
+            }
+        } break;
+        case State::DONE:
+            fail("Unexpected data after the last entry");
+            return -1;
+        }
+    }
+
+    return len;
+}
+
+bool DirArchiveWriter::onCollected()
+{
+    const auto collected = pending_;
+    pending_.clear();
+
+    switch(state_) {
+    case State::LENGTH:
+        want_ = qFromBigEndian<quint32>(collected.constData());
+        if ((want_ == 0) || (want_ > DirArchive::maxManifestBytes)) {
+            return fail("Invalid manifest length");
+        }
+        state_ = State::MANIFEST;
+        return true;
+
+    case State::MANIFEST:
+        if (!DirArchive::decodeManifest(collected, entries_)) {
+            return fail("Invalid manifest");
+        }
+
+        for(const auto& entry : entries_) {
+            if (entry.isDir() && !QDir{root_}.mkpath(entry.path)) {
+                return fail(QStringLiteral("Failed to create directory \"%1\"").arg(entry.path));
+            }
+        }
+
+        LFLOG_DEBUG << "Unpacking " << entries_.size() << " entries to \"" << root_ << "\"";
+        return startNextEntry();
+
+    case State::HASH:
+        out_.close();
+        if (finalHash(hashState_) != collected) {
+            return fail(QStringLiteral("\"%1\" does not match its hash").arg(out_.fileName()));
+        }
+        return startNextEntry();
+
+    default:
+        assert(false);
+        return fail("Unexpected state");
+    }
+}
+
+bool DirArchiveWriter::startNextEntry()
+{
+    while((next_ < entries_.size()) && entries_[next_].isDir()) {
+        ++next_;
+    }
+
+    if (next_ == entries_.size()) {
+        state_ = State::DONE;
+        return true;
+    }
+
+    const auto& entry = entries_[next_++];
+    const auto path = root_ + "/" + entry.path;
+    if (!QDir{}.mkpath(QFileInfo{path}.absolutePath())) {
+        return fail(QStringLiteral("Failed to create directory for \"%1\"").arg(entry.path));
+    }
+
+    out_.setFileName(path);
+    if (!out_.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        return fail(QStringLiteral("Failed to open \"%1\": %2").arg(path, out_.errorString()));
+    }
+
+    crypto_hash_sha256_init(&hashState_);
+    left_ = entry.size;
+    state_ = left_ ? State::CONTENT : State::HASH;
+    want_ = DirArchive::hashBytes;
+    return true;
+}
+
+bool DirArchiveWriter::fail(const QString &reason)
+{
+    LFLOG_WARN << "Failed to unpack to \"" << root_ << "\": " << reason;
+    setErrorString(reason);
+    out_.close();
+    return false;
+}
+
+}} // namespaces
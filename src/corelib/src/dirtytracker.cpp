@@ -0,0 +1,247 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include <QSqlError>
+#include <QSqlQuery>
+
+#include "ds/dirtytracker.h"
+#include "ds/errors.h"
+#include "ds/statementcache.h"
+
+#include "logfault/logfault.h"
+
+using namespace std;
+
+namespace ds {
+namespace core {
+
+DirtyTracker *DirtyTracker::instance_;
+
+namespace {
+
+// Don't hammer a busy or broken database
+constexpr int retry_interval_ms = 2000;
+
+constexpr int sqlite_constraint = 19;
+
+// Constraint errors will fail again, no matter how many times we try
+struct ConstraintError : public Error
+{
+    explicit ConstraintError(const QString& what) : Error(what) {}
+};
+
+bool isConstraintError(const QSqlError& error)
+{
+    // SQLITE_CONSTRAINT, or one of it's extended result codes
+    bool ok = false;
+    const auto code = error.nativeErrorCode().toInt(&ok);
+    return ok && ((code & 0xff) == sqlite_constraint);
+}
+
+// Our own statements come from the cache as well. They must not flush.
+class WritingGuard
+{
+public:
+    explicit WritingGuard(bool& writing) : writing_{writing} { writing_ = true; }
+    ~WritingGuard() { writing_ = false; }
+
+private:
+    bool& writing_;
+};
+
+} // anonymous namespace
+
+bool DirtyTracker::Key::operator <(const DirtyTracker::Key &v) const noexcept
+{
+    if (id != v.id) {
+        return id < v.id;
+    }
+
+    if (const auto cmp = strcmp(table, v.table)) {
+        return cmp < 0;
+    }
+
+    return strcmp(column, v.column) < 0;
+}
+
+DirtyTracker::DirtyTracker(QSqlDatabase &db, StatementCache &statements, const int flushInterval)
+    : db_{db}, statements_{statements}, flushInterval_{flushInterval}
+{
+    assert(!instance_);
+    instance_ = this;
+
+    timer_.setSingleShot(true);
+    connect(&timer_, &QTimer::timeout, this, &DirtyTracker::onTimeout);
+
+    statements_.setBeforeGet([this] {
+        onQuery();
+    });
+}
+
+DirtyTracker::~DirtyTracker()
+{
+    if (!pending_.empty()) {
+        LFLOG_WARN << "Discarding " << pending_.size() << " unsaved changes";
+    }
+
+    LFLOG_DEBUG << "Write-behind: " << stats_.updates << " updates, "
+                << stats_.written << " written in "
+                << stats_.flushes << " transactions, "
+                << stats_.dropped << " dropped, "
+                << stats_.retried << " retried.";
+
+    statements_.setBeforeGet({});
+
+    assert(instance_ == this);
+    instance_ = {};
+}
+
+DirtyTracker &DirtyTracker::instance()
+{
+    assert(instance_);
+    return *instance_;
+}
+
+void DirtyTracker::set(const char *table, const int id, const char *column, const QVariant &value)
+{
+    assert(id > 0);
+    pending_[{table, id, column}] = value;
+    ++stats_.updates;
+
+    if (!timer_.isActive()) {
+        timer_.start(flushInterval_);
+    }
+}
+
+void DirtyTracker::write(const char *table, const int id, const char *column, const QVariant &value)
+{
+    assert(id > 0);
+    const Key key{table, id, column};
+    {
+        WritingGuard guard{writing_};
+        exec(key, value);
+    }
+    pending_.erase(key);
+    ++stats_.updates;
+    ++stats_.written;
+}
+
+void DirtyTracker::flush()
+{
+    timer_.stop();
+    retrying_ = false;
+
+    if (pending_.empty()) {
+        return;
+    }
+
+    decltype(pending_) pending;
+    pending.swap(pending_);
+
+    if (!db_.transaction()) {
+        LFLOG_WARN << "Failed to start transaction: " << db_.lastError().text()
+                   << ". Keeping " << pending.size() << " changes for later.";
+        retryLater(pending);
+        return;
+    }
+
+    WritingGuard guard{writing_};
+    try {
+        writeAll(pending);
+    } catch(const std::exception& ex) {
+        db_.rollback();
+        LFLOG_WARN << "Failed to write " << pending.size()
+                   << " changes in one transaction: " << ex.what()
+                   << ". Writing them one by one.";
+        writeEach(pending);
+    }
+}
+
+void DirtyTracker::exec(const DirtyTracker::Key &key, const QVariant &value)
+{
+    auto query = statements_.get(key.table, key.column, [&key] {
+        return QStringLiteral("UPDATE %1 SET %2 =:value where id=:id")
+                .arg(QLatin1String{key.table}, QLatin1String{key.column});
+    });
+
+    query->bindValue(":id", key.id);
+    query->bindValue(":value", value);
+    if(!query->exec()) {
+        const auto error = query->lastError();
+        const auto what = QStringLiteral("SQL query failed: %1").arg(error.text());
+        if (isConstraintError(error)) {
+            throw ConstraintError(what);
+        }
+        throw Error(what);
+    }
+}
+
+void DirtyTracker::writeAll(const std::map<Key, QVariant> &pending)
+{
+    for(const auto& it : pending) {
+        exec(it.first, it.second);
+    }
+
+    if (!db_.commit()) {
+        throw Error(QStringLiteral("Failed to commit changes: %1").arg(
+                        db_.lastError().text()));
+    }
+
+    stats_.written += pending.size();
+    ++stats_.flushes;
+}
+
+void DirtyTracker::writeEach(const std::map<Key, QVariant> &pending)
+{
+    decltype(pending_) failed;
+    for(const auto& it : pending) {
+        const auto& key = it.first;
+        try {
+            exec(key, it.second);
+            ++stats_.written;
+        } catch(const ConstraintError& ex) {
+            LFLOG_ERROR << "Dropping change to " << key.table << '.' << key.column
+                        << " for #" << key.id << ": " << ex.what();
+            ++stats_.dropped;
+        } catch(const std::exception& ex) {
+            LFLOG_WARN << "Failed to write change to " << key.table << '.' << key.column
+                       << " for #" << key.id << ": " << ex.what();
+            failed.insert(it);
+        }
+    }
+
+    ++stats_.flushes;
+
+    if (!failed.empty()) {
+        retryLater(failed);
+    }
+}
+
+void DirtyTracker::retryLater(const std::map<Key, QVariant> &failed)
+{
+    // Changes made since we swapped are newer
+    pending_.insert(failed.begin(), failed.end());
+    stats_.retried += failed.size();
+    retrying_ = true;
+    timer_.start(std::max(flushInterval_, retry_interval_ms));
+}
+
+void DirtyTracker::onQuery()
+{
+    // While we wait to retry, queries don't trigger new attempts.
+    if (!writing_ && !retrying_) {
+        flush();
+    }
+}
+
+void DirtyTracker::onTimeout()
+{
+    try {
+        flush();
+    } catch(const std::exception& ex) {
+        LFLOG_ERROR << "Failed to save changes to the database: " << ex.what();
+    }
+}
+
+}} // namespaces
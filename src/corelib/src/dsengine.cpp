@@ -73,6 +73,12 @@ QSqlDatabase& DsEngine::getDb()
     return database_->getDb();
 }
 
+DbExecutor &DsEngine::getDbExecutor()
+{
+    assert(database_);
+    return database_->getExecutor();
+}
+
 IdentityManager *DsEngine::getIdentityManager()
 {
     return identityManager_;
@@ -255,6 +261,12 @@ void DsEngine::close()
             LFLOG_ERROR << "Error when shutting down Tor Manager: " << ex.what();
         }
     }
+
+    try {
+        database_->getDirtyTracker().flush();
+    } catch (const std::exception& ex) {
+        LFLOG_ERROR << "Failed to save changes to the database: " << ex.what();
+    }
 }
 
 void DsEngine::start()
@@ -7,13 +7,15 @@
 #include "ds/crypto.h"
 #include "ds/file.h"
 #include "ds/hashtask.h"
+#include "ds/treehash.h"
+#include "ds/dirarchive.h"
 
 #include <sodium.h>
 
 
+#include <QDir>
 #include <QFile>
 #include <QFileInfo>
-#include <QThreadPool>
 #include <QUrl>
 #include <QDesktopServices>
 //#include <QStringLiteral>
@@ -47,6 +49,7 @@ void File::cancel()
     }
 
     setState(FS_CANCELLED);
+    DsEngine::instance().getFileManager()->discardInlineContent(getId());
 
     LFLOG_DEBUG << "Cancelled file #" << getId() << " " << getPath();
 
@@ -69,7 +72,11 @@ void File::accept()
 
     LFLOG_DEBUG << "Accepted file #" << getId() << " " << getPath();
 
-    queueForTransfer();
+    QByteArray content;
+    if (!DsEngine::instance().getFileManager()->takeInlineContent(getId(), content)
+            || !completeFromContent(content)) {
+        queueForTransfer();
+    }
     getConversation()->touchLastActivity();
 }
 
@@ -80,6 +87,7 @@ void File::reject()
     }
 
     setState(FS_REJECTED);
+    DsEngine::instance().getFileManager()->discardInlineContent(getId());
 
     LFLOG_DEBUG << "Rejected file #" << getId() << " " << getPath();
 
@@ -121,6 +129,7 @@ void File::setState(const File::State state)
 {
     if (updateIf("state", state, data_->state, this, &File::stateChanged)) {
         flushBytesAdded();
+        DirtyTracker::instance().flush();
         DsEngine::instance().getFileManager()->onFileStateChanged(this);
     }
 }
@@ -130,6 +139,11 @@ File::Direction File::getDirection() const noexcept
     return data_->direction;
 }
 
+File::FileType File::getFileType() const noexcept
+{
+    return data_->fileType;
+}
+
 QString File::getName() const noexcept
 {
     return data_->name;
@@ -170,6 +184,27 @@ void File::setHash(const QByteArray &hash)
     updateIf("hash", hash, data_->hash, this, &File::hashChanged);
 }
 
+QByteArray File::getTreeHash() const noexcept
+{
+    return data_->treeHash;
+}
+
+void File::setTreeHash(const QByteArray &hash)
+{
+    updateIf("tree_hash", hash, data_->treeHash, this, &File::hashChanged);
+}
+
+QByteArray File::getLeafHashes() const noexcept
+{
+    return data_->leafHashes;
+}
+
+void File::setLeafHashes(const QByteArray &leaves)
+{
+    updateIf("leaf_hashes", leaves, data_->leafHashes, this, &File::hashChanged);
+    setTreeHash(TreeHash::getRoot(leaves));
+}
+
 QDateTime File::getCreated() const noexcept
 {
     return data_->createdTime;
@@ -225,11 +260,11 @@ void File::addBytesTransferred(const size_t bytes)
     }
 }
 
-void File::clearBytesTransferred()
+void File::clearBytesTransferred(const qlonglong startAt)
 {
     bytesAdded_ = {};
     nextFlush_.reset();
-    setBytesTransferred(0);
+    setBytesTransferred(startAt);
 }
 
 void File::setAckTime(const QDateTime &when)
@@ -294,6 +329,61 @@ float File::getProgress() const noexcept
     return status;
 }
 
+int File::getChunkSize() const noexcept
+{
+    return chunkSize_;
+}
+
+qlonglong File::getThroughput() const noexcept
+{
+    return throughput_;
+}
+
+const QByteArray &File::getResumeHash() const noexcept
+{
+    return resumeHash_;
+}
+
+void File::setResumeHash(const QByteArray &hash)
+{
+    resumeHash_ = hash;
+}
+
+bool File::canAcceptCompleted() const noexcept
+{
+    return (getDirection() == OUTGOING)
+            && isOfferPending(getState())
+            && (sentInline_ || (getBytesTransferred() >= getSize()));
+}
+
+const DeltaBasis &File::getDeltaBasis() const noexcept
+{
+    return deltaBasis_;
+}
+
+void File::setDeltaBasis(DeltaBasis basis)
+{
+    deltaBasis_ = move(basis);
+}
+
+double File::getHashProgress() const noexcept
+{
+    if (!getSize()) {
+        return 0.0;
+    }
+
+    return static_cast<double>(hashedBytes_) / static_cast<double>(getSize());
+}
+
+void File::setTransferStats(const int chunkSize, const qlonglong throughput)
+{
+    if ((chunkSize_ != chunkSize) || (throughput_ != throughput)) {
+        chunkSize_ = chunkSize;
+        throughput_ = throughput;
+        emit transferStatsChanged();
+    }
+}
+
 Contact *File::getContact() const
 {
     return DsEngine::instance().getContactManager()->getContact(getContactId()).get();
@@ -303,9 +393,9 @@ void File::addToDb()
 {
     QSqlQuery query;
     query.prepare("INSERT INTO file ("
-                  "state, direction, identity_id, conversation_id, contact_id, hash, file_id, name, path, size, file_time, created_time, ack_time, bytes_transferred"
+                  "state, direction, identity_id, conversation_id, contact_id, hash, file_id, name, path, size, file_time, created_time, ack_time, bytes_transferred, tree_hash, leaf_hashes, file_type, sort_time"
                   ") VALUES ("
-                  ":state, :direction, :identity_id, :conversation_id, :contact_id, :hash, :file_id, :name, :path, :size, :file_time, :created_time, :ack_time, :bytes_transferred"
+                  ":state, :direction, :identity_id, :conversation_id, :contact_id, :hash, :file_id, :name, :path, :size, :file_time, :created_time, :ack_time, :bytes_transferred, :tree_hash, :leaf_hashes, :file_type, :sort_time"
                   ")");
 
     if (!data_->createdTime.isValid()) {
@@ -315,7 +405,9 @@ void File::addToDb()
     if (data_->direction == File::OUTGOING) {
         QFile file{data_->path};
         if (data_->size == 0) {
-            data_->size = file.size();
+            data_->size = (data_->fileType == FT_DIRECTORY)
+                    ? DirArchive::getStreamSize(data_->path)
+                    : file.size();
         }
 
         if (!data_->fileTime.isValid()) {
@@ -342,6 +434,10 @@ void File::addToDb()
     query.bindValue(":created_time", data_->createdTime);
     query.bindValue(":ack_time", data_->ackTime);
     query.bindValue(":bytes_transferred", data_->bytesTransferred);
+    query.bindValue(":tree_hash", data_->treeHash);
+    query.bindValue(":leaf_hashes", data_->leafHashes);
+    query.bindValue(":file_type", static_cast<int>(data_->fileType));
+    query.bindValue(":sort_time", data_->createdTime.toSecsSinceEpoch());
     if(!query.exec()) {
         throw Error(QStringLiteral("Failed to save File: %1").arg(
                         query.lastError().text()));
@@ -369,16 +465,15 @@ void File::deleteFromDb()
 
 File::ptr_t File::load(QObject &parent, const int dbId)
 {
-    return load(parent, [dbId](QSqlQuery& query) {
-        query.prepare(getSelectStatement("id=:id"));
+    return load(parent, "select-by-id", "id=:id", [dbId](QSqlQuery& query) {
         query.bindValue(":id", dbId);
     });
 }
 
 File::ptr_t File::load(QObject &parent, int conversation, const QByteArray &hash)
 {
-    return load(parent, [conversation, &hash](QSqlQuery& query) {
-        query.prepare(getSelectStatement("hash=:hash AND conversation_id=:cid"));
+    return load(parent, "select-by-hash", "hash=:hash AND conversation_id=:cid",
+                [conversation, &hash](QSqlQuery& query) {
         query.bindValue(":hash", hash);
         query.bindValue(":cid", conversation);
     });
@@ -389,7 +484,24 @@ void File::asynchCalculateHash(File::hash_cb_t callback)
     setState(File::FS_HASHING);
 
     auto self = DsEngine::instance().getFileManager()->getFile(getId());
-    auto task = make_unique<HashTask>(this, self);
+    auto task = make_unique<HashTask>(this, self,
+        DsEngine::instance().getFileManager()->getHashService().getWorkers());
+
+    hashedBytes_ = {};
+    emit hashProgressChanged();
+
+    connect(task.get(), &HashTask::progress,
+            this, [this](const qint64 bytes) {
+        hashedBytes_ = bytes;
+        emit hashProgressChanged();
+    }, Qt::QueuedConnection);
+
+    connect(task.get(), &HashTask::leavesHashed,
+            this, [this](const QByteArray& leaves) {
+        if (getState() == FS_HASHING) {
+            setLeafHashes(leaves);
+        }
+    }, Qt::QueuedConnection);
 
     // Prevent the file from going out of scope while hashing
     // put a smartpointer to it in the lambda
@@ -407,50 +519,56 @@ void File::asynchCalculateHash(File::hash_cb_t callback)
         DsEngine::instance().getFileManager()->touch(self);
     }, Qt::QueuedConnection);
 
-    QThreadPool::globalInstance()->start(task.release());
+    DsEngine::instance().getFileManager()->getHashService().start(task.release());
 }
 
 QString File::getSelectStatement(const QString &where)
 {
-    return QStringLiteral("SELECT id, file_id, state, direction, identity_id, conversation_id, contact_id, hash, name, path, size, file_time, created_time, ack_time, bytes_transferred FROM file WHERE %1")
+    return QStringLiteral("SELECT id, file_id, state, direction, identity_id, conversation_id, contact_id, hash, name, path, size, file_time, created_time, ack_time, bytes_transferred, tree_hash, leaf_hashes, file_type FROM file WHERE %1")
             .arg(where);
 }
 
-File::ptr_t File::load(QObject &parent, const std::function<void (QSqlQuery &)> &prepare)
+File::ptr_t File::load(QObject &parent, const char *operation, const char *where,
+                       const std::function<void (QSqlQuery &)> &bind)
 {
-    QSqlQuery query;
-
     enum Fields {
-        id, file_id, state, direction, identity_id, conversation_id, contact_id, hash, name, path, size, file_time, created_time, ack_time, bytes_transferred
+        id, file_id, state, direction, identity_id, conversation_id, contact_id, hash, name, path, size, file_time, created_time, ack_time, bytes_transferred, tree_hash, leaf_hashes, file_type
     };
 
-    prepare(query);
+    // An earlier instance may have unsaved changes. The cache flushes them.
+    auto query = StatementCache::instance().get("file", operation, [where] {
+        return getSelectStatement(where);
+    });
+    bind(*query);
 
-    if(!query.exec()) {
+    if(!query->exec()) {
         throw Error(QStringLiteral("Failed to fetch file: %1").arg(
-                        query.lastError().text()));
+                        query->lastError().text()));
     }
 
-    if (!query.next()) {
+    if (!query->next()) {
         throw NotFoundError(QStringLiteral("file not found!"));
     }
 
     auto ptr = make_shared<File>(parent);
-    ptr->id_ = query.value(id).toInt();
-    ptr->data_->fileId = query.value(file_id).toByteArray();
-    ptr->data_->state = static_cast<State>(query.value(state).toInt());
-    ptr->data_->direction = static_cast<Direction>(query.value(direction).toInt());
-    ptr->data_->identity = query.value(identity_id).toInt();
-    ptr->data_->conversation = query.value(conversation_id).toInt();
-    ptr->data_->contact = query.value(contact_id).toInt();
-    ptr->data_->hash = query.value(hash).toByteArray();
-    ptr->data_->name = query.value(name).toString();
-    ptr->data_->path = query.value(path).toString();
-    ptr->data_->size = query.value(size).toLongLong();
-    ptr->data_->fileTime = query.value(file_time).toDateTime();
-    ptr->data_->createdTime = query.value(created_time).toDateTime();
-    ptr->data_->ackTime = query.value(ack_time).toDateTime();
-    ptr->data_->bytesTransferred = query.value(bytes_transferred).toLongLong();
+    ptr->id_ = query->value(id).toInt();
+    ptr->data_->fileId = query->value(file_id).toByteArray();
+    ptr->data_->state = static_cast<State>(query->value(state).toInt());
+    ptr->data_->direction = static_cast<Direction>(query->value(direction).toInt());
+    ptr->data_->identity = query->value(identity_id).toInt();
+    ptr->data_->conversation = query->value(conversation_id).toInt();
+    ptr->data_->contact = query->value(contact_id).toInt();
+    ptr->data_->hash = query->value(hash).toByteArray();
+    ptr->data_->name = query->value(name).toString();
+    ptr->data_->path = query->value(path).toString();
+    ptr->data_->size = query->value(size).toLongLong();
+    ptr->data_->fileTime = query->value(file_time).toDateTime();
+    ptr->data_->createdTime = query->value(created_time).toDateTime();
+    ptr->data_->ackTime = query->value(ack_time).toDateTime();
+    ptr->data_->bytesTransferred = query->value(bytes_transferred).toLongLong();
+    ptr->data_->treeHash = query->value(tree_hash).toByteArray();
+    ptr->data_->leafHashes = query->value(leaf_hashes).toByteArray();
+    ptr->data_->fileType = static_cast<FileType>(query->value(file_type).toInt());
 
     return ptr;
 }
@@ -464,16 +582,41 @@ void File::flushBytesAdded()
     }
 }
 
+void File::transferInterrupted()
+{
+    if (getState() != FS_TRANSFERRING) {
+        return;
+    }
+
+    // Make the resume-point durable
+    flushBytesAdded();
+
+    LFLOG_NOTICE << "Transfer of file #" << getId()
+                 << " at path \"" << getPath()
+                 << "\" was interrupted after " << getBytesTransferred()
+                 << " bytes. It will be resumed.";
+
+    setState(getDirection() == INCOMING ? FS_QUEUED : FS_WAITING);
+}
+
 void File::queueForTransfer()
 {
     assert(getDirection() == INCOMING);
     assert(getState() == FS_OFFERED || getState() == FS_QUEUED);
     setState(FS_QUEUED);
-    if (auto contact = getContact()) {
-        // FIXME: shared_from_this() don't work from the file instance
-        contact->queueFile(
-                    DsEngine::instance().getFileManager()->getFile(getId()));
-    }
+
+    // FIXME: shared_from_this() don't work from the file instance
+    auto self = DsEngine::instance().getFileManager()->getFile(getId());
+
+    // The transfer is queued when we know if we can receive a delta
+    DsEngine::instance().getFileManager()->prepareDelta(self, [self] {
+        if (self->getState() != FS_QUEUED) {
+            return;
+        }
+        if (auto contact = self->getContact()) {
+            contact->queueFile(self);
+        }
+    });
 }
 
 void File::transferComplete()
@@ -481,13 +624,19 @@ void File::transferComplete()
     assert (getState() == FS_TRANSFERRING || getState() == FS_HASHING);
 
     if (getDirection() == INCOMING) {
+        deltaBasis_ = {};
+
         QFile tmpFile{getDownloadPath()};
         if (!tmpFile.exists()) {
             transferFailed(QStringLiteral("Temporary file dissapeared: ") + getDownloadPath());
             return;
         }
 
-        if (!tmpFile.rename(getPath())) {
+        // QFile can't rename a directory if it has to copy it
+        const auto renamed = isDirectory()
+                ? QDir{}.rename(getDownloadPath(), getPath())
+                : tmpFile.rename(getPath());
+        if (!renamed) {
             transferFailed(QStringLiteral("Failed to rename: ")
                            + getDownloadPath()
                            + " to " + getPath());
@@ -582,18 +731,74 @@ void File::validateHash()
                 transferFailed(failReason);
             }
         } else if (getState() == FS_HASHING) {
-            // Binary compare hashes
-            if ((hash.size() == data_->hash.size())
-                    && (memcmp(hash.constData(), data_->hash.constData(),
-                               static_cast<size_t>(hash.size())) == 0)) {
-                transferComplete();
-            } else {
-                transferFailed("Hash from peer and hash from received file mismatch");
-            }
+            completeIfHashMatches(hash);
         }
     });
 }
 
+void File::validateHash(const QByteArray &hash)
+{
+    assert(getDirection() == INCOMING);
+    assert(getState() == FS_TRANSFERRING);
+    assert(!data_->hash.isEmpty());
+
+    LFLOG_DEBUG << "Validating hash for file #" << getId() << " calculated during the transfer";
+
+    completeIfHashMatches(hash);
+}
+
+void File::completeIfHashMatches(const QByteArray &hash)
+{
+    // Binary compare hashes
+    if ((hash.size() == data_->hash.size())
+            && (memcmp(hash.constData(), data_->hash.constData(),
+                       static_cast<size_t>(hash.size())) == 0)) {
+        transferComplete();
+    } else {
+        transferFailed("Hash from peer and hash from received file mismatch");
+    }
+}
+
+bool File::completeFromContent(const QByteArray &content)
+{
+    assert(getDirection() == INCOMING);
+
+    QString path;
+    if (!findUnusedName(getPath(), path)) {
+        return false;
+    }
+
+    if (getPath() != path) {
+        setPath(path);
+        setName(QFileInfo{path}.fileName());
+    }
+
+    QFile io{getDownloadPath()};
+    if (!io.open(QIODevice::WriteOnly | QIODevice::Truncate)
+            || (io.write(content) != content.size())) {
+        LFLOG_ERROR << "Failed to save inline content for file #" << getId()
+                    << " to \"" << getDownloadPath() << "\": " << io.errorString();
+        return false;
+    }
+    io.close();
+
+    LFLOG_DEBUG << "File #" << getId() << " was received inline with the offer";
+
+    setBytesTransferred(content.size());
+    setState(FS_TRANSFERRING);
+    transferComplete();
+
+    // If the contact is offline, the sender offers the file again when
+    // we are connected, and we answer "Completed" then.
+    if (getState() == FS_DONE) {
+        if (auto contact = getContact()) {
+            contact->sendAck("IncomingFile", "Completed", getFileId().toBase64());
+        }
+    }
+
+    return true;
+}
+
 bool File::findUnusedName(const QString &path, QString& unusedPath)
 {
     QFileInfo target(path);
@@ -620,4 +825,27 @@ bool File::findUnusedName(const QString &path, QString& unusedPath)
     return false;
 }
 
+File::ReofferAction File::getReofferAction(const File::State state) noexcept
+{
+    switch(state) {
+    case FS_REJECTED:
+        return ReofferAction::REJECT;
+    case FS_CANCELLED:
+        return ReofferAction::ABORT;
+    case FS_DONE:
+        return ReofferAction::COMPLETE;
+    case FS_QUEUED:
+    case FS_TRANSFERRING:
+    case FS_HASHING:
+        return ReofferAction::IGNORE;
+    default:
+        return ReofferAction::ACCEPT;
+    }
+}
+
+bool File::isOfferPending(const File::State state) noexcept
+{
+    return (state == FS_WAITING) || (state == FS_OFFERED);
+}
+
 }} // namespaces
@@ -1,9 +1,16 @@
 
 #include <QDir>
+#include <QFileInfo>
+#include <QSqlError>
 #include <QSqlQuery>
 #include <QStandardPaths>
 
 #include "include/ds/filemanager.h"
+#include "ds/dirtytracker.h"
+#include "ds/signaturetask.h"
+#include "ds/statementcache.h"
+
+#include <sodium.h>
 
 #include "logfault/logfault.h"
 
@@ -12,10 +19,25 @@ using namespace std;
 namespace ds {
 namespace core {
 
+namespace {
+
+QByteArray sha256(const QByteArray& data) {
+    QByteArray hash(crypto_hash_sha256_BYTES, 0);
+    crypto_hash_sha256(reinterpret_cast<uint8_t *>(hash.data()),
+                       reinterpret_cast<const uint8_t *>(data.constData()),
+                       static_cast<unsigned long long>(data.size()));
+    return hash;
+}
+
+} // anonymous namespace
+
 FileManager::FileManager(QObject &parent, QSettings &settings)
     : QObject{&parent}, settings_{settings}
+    , hashService_{*this, settings.value("maxConcurrentHashes",
+                                        HashService::defaultMaxConcurrent).toInt()}
 {
     // TODO: Load non-hashed files and start hashing them.
+    hashCache_.pruneLater();
 }
 
 File::ptr_t FileManager::getFile(const int dbId)
@@ -33,13 +55,13 @@ File::ptr_t FileManager::getFile(const int dbId)
 
 File::ptr_t FileManager::getFile(const QByteArray &hash, Conversation &conversation)
 {
-    QSqlQuery query;
-    query.prepare("SELECT id FROM file WHERE hash=:hash AND conversation_id=:cid");
-    query.bindValue(":hash", hash);
-    query.bindValue(":cid", conversation.getId());
-    query.exec();
-    if (query.next()) {
-        return getFile(query.value(0).toInt());
+    auto query = StatementCache::instance().get("file", "id-by-hash",
+        "SELECT id FROM file WHERE hash=:hash AND conversation_id=:cid");
+    query->bindValue(":hash", hash);
+    query->bindValue(":cid", conversation.getId());
+    query->exec();
+    if (query->next()) {
+        return getFile(query->value(0).toInt());
     }
 
     return {};
@@ -47,29 +69,54 @@ File::ptr_t FileManager::getFile(const QByteArray &hash, Conversation &conversat
 
 File::ptr_t FileManager::getFileFromId(const QByteArray &fileId, Conversation &conversation)
 {
-    QSqlQuery query;
-    query.prepare("SELECT id FROM file WHERE file_id=:fid AND conversation_id=:cid");
-    query.bindValue(":fid", fileId);
-    query.bindValue(":cid", conversation.getId());
-    query.exec();
-
-    if (query.next()) {
-        return getFile(query.value(0).toInt());
+    auto query = StatementCache::instance().get("file", "id-by-file-id-conversation",
+        "SELECT id FROM file WHERE file_id=:fid AND conversation_id=:cid");
+    query->bindValue(":fid", fileId);
+    query->bindValue(":cid", conversation.getId());
+    query->exec();
+
+    if (query->next()) {
+        return getFile(query->value(0).toInt());
     }
 
     return {};
 }
 
-File::ptr_t FileManager::getFileFromId(const QByteArray &fileId, const File::Direction direction)
+std::vector<File::ptr_t> FileManager::getFiles(const Conversation &conversation,
+                                               const File::Direction direction,
+                                               const File::State state)
 {
-    QSqlQuery query;
-    query.prepare("SELECT id FROM file WHERE file_id=:fid AND direction=:direction");
-    query.bindValue(":fid", fileId);
-    query.bindValue(":direction", static_cast<int>(direction));
-    query.exec();
+    auto query = StatementCache::instance().get("file", "ids-by-state",
+        "SELECT id FROM file WHERE conversation_id=:cid AND direction=:direction AND state=:state ORDER BY id");
+    query->bindValue(":cid", conversation.getId());
+    query->bindValue(":direction", static_cast<int>(direction));
+    query->bindValue(":state", static_cast<int>(state));
+
+    if(!query->exec()) {
+        throw Error(QStringLiteral("Failed to query files: %1").arg(
+                        query->lastError().text()));
+    }
+
+    std::vector<File::ptr_t> files;
+    while(query->next()) {
+        if (auto file = getFile(query->value(0).toInt())) {
+            files.push_back(move(file));
+        }
+    }
 
-    if (query.next()) {
-        return getFile(query.value(0).toInt());
+    return files;
+}
+
+File::ptr_t FileManager::getFileFromId(const QByteArray &fileId, const File::Direction direction)
+{
+    auto query = StatementCache::instance().get("file", "id-by-file-id-direction",
+        "SELECT id FROM file WHERE file_id=:fid AND direction=:direction");
+    query->bindValue(":fid", fileId);
+    query->bindValue(":direction", static_cast<int>(direction));
+    query->exec();
+
+    if (query->next()) {
+        return getFile(query->value(0).toInt());
     }
 
     return {};
@@ -77,14 +124,14 @@ File::ptr_t FileManager::getFileFromId(const QByteArray &fileId, const File::Dir
 
 File::ptr_t FileManager::getFileFromId(const QByteArray &fileId, const Contact &contact)
 {
-    QSqlQuery query;
-    query.prepare("SELECT id FROM file WHERE file_id=:fid AND contact_id=:cid");
-    query.bindValue(":fid", fileId);
-    query.bindValue(":cid", contact.getId());
-    query.exec();
-
-    if (query.next()) {
-        return getFile(query.value(0).toInt());
+    auto query = StatementCache::instance().get("file", "id-by-file-id-contact",
+        "SELECT id FROM file WHERE file_id=:fid AND contact_id=:cid");
+    query->bindValue(":fid", fileId);
+    query->bindValue(":cid", contact.getId());
+    query->exec();
+
+    if (query->next()) {
+        return getFile(query->value(0).toInt());
     }
 
     return {};
@@ -111,15 +158,30 @@ void FileManager::receivedFileOffer(Conversation& conversation, const PeerFileOf
     // Check if we have the file.
     try {
         if (auto file = getFileFromId(offer.fileId, conversation)) {
-            if (file->getState() == File::FS_REJECTED) {
+            switch(File::getReofferAction(file->getState())) {
+            case File::ReofferAction::REJECT:
                 offer.peer->sendAck("IncomingFile", "Rejected", offer.fileId.toBase64());
-            } else if (file->getState() == File::FS_DONE) {
+                break;
+            case File::ReofferAction::ABORT:
+                offer.peer->sendAck("IncomingFile", "Abort", offer.fileId.toBase64());
+                break;
+            case File::ReofferAction::COMPLETE:
                 offer.peer->sendAck("IncomingFile", "Completed", offer.fileId.toBase64());
-            } else if (file->getState() == File::FS_QUEUED) {
-                file->queueForTransfer();
-            } else {
+                break;
+            case File::ReofferAction::IGNORE:
+                // Our Proceed is on its way, or the transfer is running
+                LFLOG_DEBUG << "Ignoring new offer for file #" << file->getId()
+                            << " in state " << file->getState();
+                break;
+            case File::ReofferAction::ACCEPT:
                 offer.peer->sendAck("IncomingFile", "Received", offer.fileId.toBase64());
                 file->setState(File::FS_OFFERED);
+
+                // We may have lost the content from the first offer
+                if (offer.hasContent) {
+                    receivedInlineContent(file, offer.content);
+                }
+                break;
             }
 
             return;
@@ -155,14 +217,126 @@ void FileManager::receivedFileOffer(Conversation& conversation, const PeerFileOf
     data->fileId = offer.fileId;
     data->size = offer.size;
     data->hash = offer.sha512;
+    data->treeHash = offer.treeHash;
+    if (offer.type == QStringLiteral("directory")) {
+        data->fileType = File::FT_DIRECTORY;
+    }
 
-    if (addFile(move(data))) {
+    if (auto file = addFile(move(data))) {
         offer.peer->sendAck("IncomingFile", "Received", offer.fileId.toBase64());
+        if (offer.hasContent) {
+            receivedInlineContent(file, offer.content);
+        }
     } else {
         offer.peer->sendAck("IncomingFile", "Failed", offer.fileId.toBase64());
     }
 }
 
+void FileManager::receivedInlineContent(const File::ptr_t &file, const QByteArray &content)
+{
+    if ((content.size() != file->getSize()) || (sha256(content) != file->getHash())) {
+        LFLOG_WARN << "Ignoring inline content for file #" << file->getId()
+                   << ". It does not match the offer.";
+        return;
+    }
+
+    if (settings_.value("autoAcceptInlineFiles", false).toBool()) {
+        LFLOG_DEBUG << "Auto-accepting inline file #" << file->getId();
+        if (file->completeFromContent(content)) {
+            return;
+        }
+    }
+
+    discardInlineContent(file->getId());
+    if ((pendingInlineBytes_ + content.size()) > maxPendingInlineBytes) {
+        LFLOG_DEBUG << "Too much inline content is waiting. File #" << file->getId()
+                    << " will be transferred if it is accepted.";
+        return;
+    }
+
+    pendingInline_[file->getId()] = content;
+    pendingInlineBytes_ += content.size();
+}
+
+bool FileManager::takeInlineContent(const int dbId, QByteArray &content)
+{
+    const auto it = pendingInline_.find(dbId);
+    if (it == pendingInline_.end()) {
+        return false;
+    }
+
+    content = move(it->second);
+    pendingInlineBytes_ -= content.size();
+    pendingInline_.erase(it);
+    return true;
+}
+
+void FileManager::discardInlineContent(const int dbId)
+{
+    QByteArray content;
+    takeInlineContent(dbId, content);
+}
+
+void FileManager::prepareDelta(const File::ptr_t &file, std::function<void ()> done)
+{
+    if (!file->getDeltaBasis().isEmpty()
+            || file->isDirectory()
+            || (file->getBytesTransferred() > 0)
+            || (file->getSize() < Delta::minFileSize)
+            || !settings_.value("deltaTransfers", true).toBool()) {
+        done();
+        return;
+    }
+
+    const auto basisPath = findDeltaBasis(*file);
+    if (basisPath.isEmpty()) {
+        done();
+        return;
+    }
+
+    LFLOG_DEBUG << "Creating delta signature for file #" << file->getId()
+                << " from \"" << basisPath << "\"";
+
+    auto task = make_unique<SignatureTask>(file.get(), file, basisPath);
+    connect(task.get(), &SignatureTask::done,
+            file.get(), [file, basisPath, done=move(done)](const QByteArray& signature,
+            const qint64 blockSize, const qint64 basisSize) {
+        if (Delta::isValidSignature(signature)) {
+            file->setDeltaBasis({basisPath, basisSize, blockSize, signature});
+        }
+        done();
+    }, Qt::QueuedConnection);
+
+    hashService_.start(task.release());
+}
+
+QString FileManager::findDeltaBasis(const File &file)
+{
+    // The latest version we received of a file with the same name
+    auto query = StatementCache::instance().get("file", "delta-basis",
+        "SELECT path FROM file WHERE contact_id=:cid AND name=:name "
+        "AND direction=:direction AND state=:state AND file_type=:type AND id<>:id "
+        "ORDER BY id DESC LIMIT 1");
+    query->bindValue(":cid", file.getContactId());
+    query->bindValue(":name", file.getName());
+    query->bindValue(":direction", static_cast<int>(File::INCOMING));
+    query->bindValue(":state", static_cast<int>(File::FS_DONE));
+    query->bindValue(":type", static_cast<int>(File::FT_FILE));
+    query->bindValue(":id", file.getId());
+
+    if (!query->exec() || !query->next()) {
+        return {};
+    }
+
+    const auto path = query->value(0).toString();
+    const QFileInfo info{path};
+    if (!info.isFile() || (info.size() < Delta::minFileSize)) {
+        return {};
+    }
+
+    return path;
+}
+
 void FileManager::touch(const File::ptr_t &file)
 {
     lru_cache_.touch(file);
@@ -175,7 +349,15 @@ void FileManager::onFileStateChanged(const File *file)
 
 void FileManager::hashIt(const File::ptr_t &file)
 {
-    file->asynchCalculateHash([file](const QByteArray& hash, const QString& failReason){
+    // The key is taken before we read the file. If the file is
+    // modified while we hash it, the key will not match later.
+    // A directory's key don't change with its content, so it's not cached.
+    const auto key = file->isDirectory() ? HashCache::Key{} : HashCache::getKey(file->getPath());
+    if (!file->isDirectory() && useCachedHash(file, key)) {
+        return;
+    }
+
+    file->asynchCalculateHash([this, file, key](const QByteArray& hash, const QString& failReason){
         if (hash.isEmpty()) {
             LFLOG_DEBUG << "Failed to hash file #" << file->getId() << " " << file->getPath()
                         << ": " << failReason;
@@ -184,11 +366,9 @@ void FileManager::hashIt(const File::ptr_t &file)
             if (file->getState() == File::FS_HASHING) {
                 LFLOG_DEBUG << "Calculted hash for file #" << file->getId() << " " << file->getPath();
                 file->setHash(hash);
-                file->setState(File::FS_WAITING);
-                if (auto contact = file->getContact()) {
-                    contact->queueFile(file);
-                } else {
-                    LFLOG_WARN << "Failed to obtain contact for file " << file->getId() << " " << file->getPath();
+                onHashed(file);
+                if (!file->isDirectory()) {
+                    hashCache_.store(key, {hash, file->getLeafHashes()});
                 }
             } else {
                 LFLOG_WARN << "Calculted hash for file #" << file->getId() << " " << file->getPath()
@@ -198,6 +378,28 @@ void FileManager::hashIt(const File::ptr_t &file)
     });
 }
 
+bool FileManager::useCachedHash(const File::ptr_t &file, const HashCache::Key &key)
+{
+    HashCache::Entry entry;
+    if (!hashCache_.lookup(key, entry)) {
+        return false;
+    }
+
+    LFLOG_DEBUG << "Using cached hash for file #" << file->getId() << " " << file->getPath();
+    file->setHash(entry.hash);
+    file->setLeafHashes(entry.leafHashes);
+    onHashed(file);
+    return true;
+}
 
+void FileManager::onHashed(const File::ptr_t &file)
+{
+    file->setState(File::FS_WAITING);
+    if (auto contact = file->getContact()) {
+        contact->queueFile(file);
+    } else {
+        LFLOG_WARN << "Failed to obtain contact for file " << file->getId() << " " << file->getPath();
+    }
+}
 
 }} // namespaces
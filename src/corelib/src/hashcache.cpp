@@ -0,0 +1,180 @@
+#include <vector>
+
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QVariant>
+
+#ifdef Q_OS_UNIX
+#   include <sys/stat.h>
+#endif
+
+#include "ds/dbexecutor.h"
+#include "ds/dsengine.h"
+#include "ds/errors.h"
+#include "ds/hashcache.h"
+
+#include "logfault/logfault.h"
+
+namespace ds {
+namespace core {
+
+namespace {
+
+void exec(QSqlQuery& query, const char *what)
+{
+    if(!query.exec()) {
+        throw Error(QStringLiteral("Failed to %1 hash cache: %2").arg(
+                        QLatin1String(what), query.lastError().text()));
+    }
+}
+
+// Remove the least recently used entries beyond maxEntries
+int evictOverflow(QSqlDatabase& db)
+{
+    QSqlQuery query{db};
+    query.prepare("DELETE FROM hash_cache WHERE id IN "
+                  "(SELECT id FROM hash_cache ORDER BY used DESC, id DESC LIMIT -1 OFFSET :max)");
+    query.bindValue(":max", HashCache::maxEntries);
+    exec(query, "evict from");
+    return query.numRowsAffected();
+}
+
+} // anonymous namespace
+
+HashCache::Key HashCache::getKey(const QString &path)
+{
+    const QFileInfo fi{path};
+    Key key;
+    key.path = fi.canonicalFilePath();
+    if (key.path.isEmpty() || !fi.isFile()) {
+        return {};
+    }
+
+    key.size = fi.size();
+    key.mtime = fi.lastModified().toMSecsSinceEpoch();
+
+#ifdef Q_OS_UNIX
+    struct stat st = {};
+    if (::stat(QFile::encodeName(key.path).constData(), &st) == 0) {
+        key.inode = static_cast<quint64>(st.st_ino);
+    }
+#endif
+
+    return key;
+}
+
+bool HashCache::lookup(const HashCache::Key &key, HashCache::Entry &entry) const
+{
+    if (!key.isValid()) {
+        return false;
+    }
+
+    QSqlQuery query;
+    query.prepare("SELECT hash, leaf_hashes FROM hash_cache WHERE path=:path AND size=:size AND mtime=:mtime AND inode=:inode");
+    query.bindValue(":path", key.path);
+    query.bindValue(":size", key.size);
+    query.bindValue(":mtime", key.mtime);
+    query.bindValue(":inode", static_cast<qint64>(key.inode));
+
+    if(!query.exec()) {
+        throw Error(QStringLiteral("Failed to query hash cache: %1").arg(
+                        query.lastError().text()));
+    }
+
+    if (!query.next()) {
+        return false;
+    }
+
+    entry.hash = query.value(0).toByteArray();
+    entry.leafHashes = query.value(1).toByteArray();
+    if (entry.hash.isEmpty()) {
+        return false;
+    }
+
+    const auto now = QDateTime::currentSecsSinceEpoch();
+    const auto path = key.path;
+    DsEngine::instance().getDbExecutor().write([path, now](QSqlDatabase& db) {
+        QSqlQuery query{db};
+        query.prepare("UPDATE hash_cache SET used=:used WHERE path=:path");
+        query.bindValue(":used", now);
+        query.bindValue(":path", path);
+        exec(query, "update");
+    });
+
+    return true;
+}
+
+void HashCache::store(const HashCache::Key &key, const HashCache::Entry &entry)
+{
+    if (!key.isValid() || entry.hash.isEmpty()) {
+        return;
+    }
+
+    // Nobody waits for this, so it's written on the executor's thread
+    const auto now = QDateTime::currentSecsSinceEpoch();
+    DsEngine::instance().getDbExecutor().write([key, entry, now](QSqlDatabase& db) {
+
+        // Anything we have for this path is outdated
+        QSqlQuery query{db};
+        query.prepare("DELETE FROM hash_cache WHERE path=:path");
+        query.bindValue(":path", key.path);
+        exec(query, "delete from");
+
+        query.prepare("INSERT INTO hash_cache (path, size, mtime, inode, hash, leaf_hashes, used) "
+                      "VALUES (:path, :size, :mtime, :inode, :hash, :leaf_hashes, :used)");
+        query.bindValue(":path", key.path);
+        query.bindValue(":size", key.size);
+        query.bindValue(":mtime", key.mtime);
+        query.bindValue(":inode", static_cast<qint64>(key.inode));
+        query.bindValue(":hash", entry.hash);
+        query.bindValue(":leaf_hashes", entry.leafHashes);
+        query.bindValue(":used", now);
+        exec(query, "add to");
+
+        LFLOG_TRACE << "Added \"" << key.path << "\" to the hash cache";
+        evictOverflow(db);
+    });
+}
+
+void HashCache::pruneLater()
+{
+    const auto now = QDateTime::currentSecsSinceEpoch();
+    DsEngine::instance().getDbExecutor().write([now](QSqlDatabase& db) {
+        const auto removed = prune(db, now);
+        LFLOG_DEBUG << "Pruned " << removed << " entries from the hash cache";
+    });
+}
+
+int HashCache::prune(QSqlDatabase &db, const qint64 now)
+{
+    int removed = 0;
+
+    QSqlQuery query{db};
+    query.prepare("DELETE FROM hash_cache WHERE used < :oldest");
+    query.bindValue(":oldest", now - maxAgeSecs);
+    exec(query, "expire entries in");
+    removed += query.numRowsAffected();
+
+    std::vector<qint64> gone;
+    query.prepare("SELECT id, path FROM hash_cache");
+    exec(query, "list");
+    while(query.next()) {
+        if (!QFileInfo::exists(query.value(1).toString())) {
+            gone.push_back(query.value(0).toLongLong());
+        }
+    }
+
+    query.prepare("DELETE FROM hash_cache WHERE id=:id");
+    for(const auto id : gone) {
+        query.bindValue(":id", id);
+        exec(query, "delete from");
+        removed += query.numRowsAffected();
+    }
+
+    return removed + evictOverflow(db);
+}
+
+}} // namespaces
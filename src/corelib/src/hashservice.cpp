@@ -0,0 +1,33 @@
+#include <QThread>
+
+#include "ds/hashservice.h"
+
+#include "logfault/logfault.h"
+
+namespace ds {
+namespace core {
+
+HashService::HashService(QObject &parent, const int maxConcurrent)
+    : QObject{&parent}
+{
+    pool_.setMaxThreadCount(std::max(1, maxConcurrent));
+
+    // The tasks themselves use one core each
+    workers_.setMaxThreadCount(std::max(1, QThread::idealThreadCount() - 1));
+
+    LFLOG_DEBUG << "Hashing up to " << pool_.maxThreadCount() << " files at once, with "
+                << workers_.maxThreadCount() << " worker threads";
+}
+
+HashService::~HashService()
+{
+    // Don't start anything new while we are going down
+    pool_.clear();
+}
+
+void HashService::start(QRunnable *task)
+{
+    pool_.start(task);
+}
+
+}} // namespaces
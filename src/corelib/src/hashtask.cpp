@@ -1,7 +1,17 @@
+#include <algorithm>
+#include <future>
+#include <memory>
+#include <vector>
 
-#include <array>
+#ifdef Q_OS_UNIX
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#endif
 
 #include "ds/hashtask.h"
+#include "ds/treehash.h"
+#include "ds/dirarchive.h"
+#include "ds/task.h"
 
 #include "logfault/logfault.h"
 
@@ -10,48 +20,92 @@ using namespace std;
 namespace ds {
 namespace core {
 
-HashTask::HashTask(QObject *owner, File::ptr_t file)
- : QObject{owner}, file_{move(file)} {}
+namespace {
+
+// How much of the file we map at once. Rounded to whole leaves.
+constexpr qint64 map_window_bytes = 1024 * 1024 * 64;
+
+// The file hash is updated with this much at the time, so we can
+// check for cancellation and report progress.
+constexpr qint64 slice_bytes = 1024 * 1024;
+
+// Used when the file can't be mapped
+constexpr qint64 read_buffer_bytes = 1024 * 1024;
+
+constexpr auto progress_interval = chrono::milliseconds(250);
+
+void adviseSequential(QFile& file) {
+#ifdef Q_OS_LINUX
+    posix_fadvise(file.handle(), 0, 0, POSIX_FADV_SEQUENTIAL);
+#else
+    Q_UNUSED(file)
+#endif
+}
+
+void adviseSequential(uchar *data, const qint64 len) {
+#ifdef Q_OS_UNIX
+    posix_madvise(data, static_cast<size_t>(len), POSIX_MADV_SEQUENTIAL);
+#else
+    Q_UNUSED(data)
+    Q_UNUSED(len)
+#endif
+}
+
+} // anonymous namespace
+
+HashTask::HashTask(QObject *owner, File::ptr_t file, QThreadPool& workers)
+ : QObject{owner}, file_{move(file)}, workers_{workers} {}
 
 void HashTask::run() {
     try {
-        QFile file(getPath());
-        if (!file.open(QIODevice::ReadOnly)) {
+        // A directory is hashed as the stream we send
+        unique_ptr<QIODevice> device;
+        if (file_->isDirectory()) {
+            device = make_unique<DirArchiveReader>(getPath());
+        } else {
+            device = make_unique<QFile>(getPath());
+        }
+
+        if (!device->open(QIODevice::ReadOnly)) {
             emit hashed({}, "Failed to open file");
             return;
         }
 
-        crypto_hash_sha256_state state = {};
-        crypto_hash_sha256_init(&state);
+        auto file = qobject_cast<QFile *>(device.get());
+        if (file) {
+            adviseSequential(*file);
+        }
 
-        std::array<uint8_t, 1024 * 8> buffer = {};
-        while(!file.isOpen()) {
-            if (file_->getState() != File::FS_HASHING) {
-                LFLOG_WARN << "File #" << file_->getId()
-                           << " changed state during hashing. Aborting!";
+        // The tree is only needed when we send the file
+        wantTree_ = file_->getDirection() == File::OUTGOING;
+        size_ = device->size();
+        leafSize_ = TreeHash::getLeafSize(size_);
+        nextProgress_ = clock_t::now() + progress_interval;
 
-                emit hashed({}, "Aborted");
-                file.close();
-                return;
-            }
+        if (file_->isDirectory() && (size_ != file_->getSize())) {
+            emit hashed({}, "The directory changed");
+            return;
+        }
 
-            const auto bytes_read = file.read(reinterpret_cast<char *>(buffer.data()),
-                                              static_cast<qint64>(buffer.size()));
-            if (bytes_read > 0) {
-                crypto_hash_sha256_update(&state, buffer.data(),
-                                          static_cast<size_t>(bytes_read));
-            } else if (bytes_read == 0) {
-                file.close();
-            } else {
-                emit hashed({}, "Read failed");
-                file.close();
-                return;
-            }
+        QString failReason;
+        if (!file || (!hashMapped(*file, failReason) && failReason.isEmpty())) {
+            hashRead(*device, failReason);
+        }
+
+        if (!failReason.isEmpty()) {
+            emit hashed({}, failReason);
+            return;
+        }
+
+        reportProgress(size_, true);
+
+        if (wantTree_) {
+            emit leavesHashed(leaves_);
         }
 
         QByteArray out;
         out.resize(crypto_hash_sha256_BYTES);
-        crypto_hash_sha256_final(&state, reinterpret_cast<uint8_t *>(out.data()));
+        crypto_hash_sha256_final(&state_, reinterpret_cast<uint8_t *>(out.data()));
         emit hashed(out, {});
     } catch(const std::exception& ex) {
         LFLOG_WARN << "Caught exception from task: " << ex.what();
@@ -59,6 +113,166 @@ void HashTask::run() {
     }
 }
 
+// Returns false with an empty failReason if the file can't be mapped.
+bool HashTask::hashMapped(QFile &file, QString &failReason)
+{
+    if (size_ == 0) {
+        return false;
+    }
+
+    crypto_hash_sha256_init(&state_);
+    leaves_.clear();
+
+    const auto window = leafSize_ * max(qint64{1}, map_window_bytes / leafSize_);
+    const auto workers = max(1, workers_.maxThreadCount());
+
+    for(qint64 offset = 0; offset < size_; offset += window) {
+        const auto len = min(window, size_ - offset);
+        auto data = file.map(offset, len);
+        if (!data) {
+            if (offset == 0) {
+                LFLOG_DEBUG << "Cannot map \"" << getPath() << "\": "
+                            << file.errorString() << ". Reading it instead.";
+            } else {
+                failReason = "Failed to map file";
+            }
+            return false;
+        }
+
+        adviseSequential(data, len);
+
+        // Divide the leaves in this window between the workers
+        vector<future<QByteArray>> leaves;
+        if (wantTree_) {
+            const auto numLeaves = (len + leafSize_ - 1) / leafSize_;
+            const auto perWorker = (numLeaves + workers - 1) / workers;
+            for(qint64 first = 0; first < numLeaves; first += perWorker) {
+                const auto last = min(numLeaves, first + perWorker);
+                auto job = make_shared<packaged_task<QByteArray ()>>([this, data, len, first, last] {
+                    QByteArray hashes;
+                    for(auto i = first; i < last; ++i) {
+                        const auto start = i * leafSize_;
+                        hashes += TreeHash::hashLeaf(data + start,
+                                                     static_cast<size_t>(min(leafSize_, len - start)));
+                    }
+                    return hashes;
+                });
+                leaves.push_back(job->get_future());
+                workers_.start(new Task{[job] {
+                    (*job)();
+                }});
+            }
+        }
+
+        const auto ok = hashSlices(data, offset, len);
+
+        // The workers must be done before we unmap the data
+        for(auto& hashes : leaves) {
+            leaves_ += hashes.get();
+        }
+
+        file.unmap(data);
+
+        if (!ok) {
+            failReason = "Aborted";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool HashTask::hashRead(QIODevice &file, QString &failReason)
+{
+    crypto_hash_sha256_init(&state_);
+    leaves_.clear();
+
+    if (!file.seek(0)) {
+        failReason = "Read failed";
+        return false;
+    }
+
+    TreeHash::LeafHasher leafHasher;
+    QByteArray buffer;
+    qint64 offset = {};
+    while(true) {
+        if (isCancelled()) {
+            failReason = "Aborted";
+            return false;
+        }
+
+        buffer = file.read(read_buffer_bytes);
+        if (buffer.isEmpty()) {
+            if (!file.atEnd()) {
+                failReason = "Read failed";
+                return false;
+            }
+            break;
+        }
+
+        crypto_hash_sha256_update(&state_, reinterpret_cast<const uint8_t *>(buffer.constData()),
+                                  static_cast<size_t>(buffer.size()));
+
+        if (wantTree_) {
+            auto data = buffer.constData();
+            auto len = static_cast<qint64>(buffer.size());
+            while(len > 0) {
+                const auto bytes = min(len, leafSize_ - leafHasher.getBytes());
+                leafHasher.add(data, static_cast<size_t>(bytes));
+                data += bytes;
+                len -= bytes;
+                if (leafHasher.getBytes() == leafSize_) {
+                    leaves_ += leafHasher.finish();
+                }
+            }
+        }
+
+        offset += buffer.size();
+        reportProgress(offset);
+    }
+
+    if (wantTree_ && (leaves_.isEmpty() || leafHasher.getBytes())) {
+        leaves_ += leafHasher.finish();
+    }
+
+    return true;
+}
+
+bool HashTask::hashSlices(const uchar *data, const qint64 offset, const qint64 len)
+{
+    for(qint64 pos = 0; pos < len; pos += slice_bytes) {
+        if (isCancelled()) {
+            return false;
+        }
+
+        const auto bytes = min(slice_bytes, len - pos);
+        crypto_hash_sha256_update(&state_, data + pos, static_cast<size_t>(bytes));
+        reportProgress(offset + pos + bytes);
+    }
+
+    return true;
+}
+
+bool HashTask::isCancelled() const
+{
+    if (file_->getState() != File::FS_HASHING) {
+        LFLOG_WARN << "File #" << file_->getId()
+                   << " changed state during hashing. Aborting!";
+        return true;
+    }
+
+    return false;
+}
+
+void HashTask::reportProgress(const qint64 bytes, const bool force)
+{
+    const auto now = clock_t::now();
+    if (force || (now >= nextProgress_)) {
+        nextProgress_ = now + progress_interval;
+        emit progress(bytes);
+    }
+}
+
 QString HashTask::getPath() const noexcept {
 
     // Incoming files are verified before they are renamed to their
@@ -1,8 +1,10 @@
 #include <random>
+#include <vector>
 
 #include "ds/dsengine.h"
 #include "ds/identity.h"
 #include "ds/errors.h"
+#include "ds/statementcache.h"
 #include "ds/update_helper.h"
 #include "ds/dscert.h"
 #include "ds/base58.h"
@@ -192,16 +194,22 @@ void Identity::onProcessOnlineLater()
 
 void Identity::connectContacts()
 {
-    QSqlQuery query;
-    query.prepare("SELECT uuid FROM contact WHERE identity=:id AND auto_connect=1");
-    query.bindValue(":id", getId());
-    if(!query.exec()) {
+    // auto_connect is written behind. The cached statement see pending changes.
+    auto query = StatementCache::instance().get("contact", "uuid-by-auto-connect",
+        "SELECT uuid FROM contact WHERE identity=:id AND auto_connect=1");
+    query->bindValue(":id", getId());
+    if(!query->exec()) {
         throw Error(QStringLiteral("Failed to fetch contact from hash: %1").arg(
-                        query.lastError().text()));
+                        query->lastError().text()));
+    }
+
+    std::vector<QUuid> uuids;
+    while (query->next()) {
+        uuids.push_back(query->value(0).toUuid());
     }
 
-    while (query.next()) {
-        auto contact = DsEngine::instance().getContactManager()->getContact(query.value(0).toUuid());
+    for(const auto& contactUuid : uuids) {
+        auto contact = DsEngine::instance().getContactManager()->getContact(contactUuid);
 
         // Connect to contacts with random delays to make it a tiny bit harder for
         // NSA, German intelligence and GRU to deduce what's going on,
@@ -381,7 +389,8 @@ QString Identity::getName() const noexcept  {
 }
 
 void Identity::setName(const QString &name) {
-    if (updateIf("name", name, data_.name, this, &Identity::nameChanged)) {
+    // The name is unique
+    if (updateNowIf("name", name, data_.name, this, &Identity::nameChanged)) {
         forAllContacts([](const Contact::ptr_t& contact){
             if (contact->isOnline()) {
                 contact->sendUserInfo();
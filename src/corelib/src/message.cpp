@@ -87,22 +87,23 @@ Message::State Message::getState() const noexcept
 void Message::setState(Message::State state)
 {
     if (updateIf("state", state, state_, this, &Message::stateChanged)) {
+        DirtyTracker::instance().flush();
         DsEngine::instance().getMessageManager()->onMessageStateChanged(shared_from_this());
     }
 }
 
 Conversation *Message::getConversation() const
 {
-    QSqlQuery query;
-    query.prepare("SELECT uuid FROM conversation WHERE id=:id");
-    query.bindValue(":id", getConversationId());
-    if(!query.exec()) {
+    auto query = StatementCache::instance().get("conversation", "uuid-by-id",
+        "SELECT uuid FROM conversation WHERE id=:id");
+    query->bindValue(":id", getConversationId());
+    if(!query->exec()) {
         throw Error(QStringLiteral("Failed to fetch conversation from id: %1").arg(
-                        query.lastError().text()));
+                        query->lastError().text()));
     }
 
-    if (query.next()) {
-        return DsEngine::instance().getConversationManager()->getConversation(query.value(0).toUuid()).get();
+    if (query->next()) {
+        return DsEngine::instance().getConversationManager()->getConversation(query->value(0).toUuid()).get();
     }
 
     return {};
@@ -147,9 +148,9 @@ void Message::addToDb()
     QSqlQuery query;
 
     query.prepare("INSERT INTO message ("
-                  "direction, state, conversation_id, conversation, message_id, composed_time, received_time, content, signature, sender, encoding"
+                  "direction, state, conversation_id, conversation, message_id, composed_time, received_time, content, signature, sender, encoding, sort_time"
                   ") VALUES ("
-                  ":direction, :state, :conversation_id, :conversation, :message_id, :composed_time, :received_time, :content, :signature, :sender, :encoding"
+                  ":direction, :state, :conversation_id, :conversation, :message_id, :composed_time, :received_time, :content, :signature, :sender, :encoding, :sort_time"
                   ")");
     assert(data_);
     assert(data_->composedTime.isValid());
@@ -165,6 +166,7 @@ void Message::addToDb()
     query.bindValue(":signature", data_->signature);
     query.bindValue(":sender", data_->sender);
     query.bindValue(":encoding", data_->encoding);
+    query.bindValue(":sort_time", data_->composedTime.toSecsSinceEpoch());
 
 
     if(!query.exec()) {
@@ -193,21 +195,21 @@ void Message::deleteFromDb()
 
 Message::ptr_t Message::load(QObject &parent, int dbId)
 {
-    QSqlQuery query;
-
     enum Fields {
         direction, state,  conversation_id, conversation, message_id, composed_time, received_time, content, signature, sender, encoding
     };
 
-    query.prepare("SELECT direction, state, conversation_id, conversation, message_id, composed_time, received_time, content, signature, sender, encoding FROM message where id=:id ");
-    query.bindValue(":id", dbId);
+    // An earlier instance may have unsaved changes. The cache flushes them.
+    auto query = StatementCache::instance().get("message", "select-by-id",
+        "SELECT direction, state, conversation_id, conversation, message_id, composed_time, received_time, content, signature, sender, encoding FROM message where id=:id ");
+    query->bindValue(":id", dbId);
 
-    if(!query.exec()) {
+    if(!query->exec()) {
         throw Error(QStringLiteral("Failed to fetch Message: %1").arg(
-                        query.lastError().text()));
+                        query->lastError().text()));
     }
 
-    if (!query.next()) {
+    if (!query->next()) {
         throw NotFoundError(QStringLiteral("Message not found!"));
     }
 
@@ -215,17 +217,17 @@ Message::ptr_t Message::load(QObject &parent, int dbId)
     ptr->data_ = make_unique<MessageData>();
 
     ptr->id_ = dbId;
-    ptr->direction_ = static_cast<Direction>(query.value(direction).toInt());
-    ptr->state_ = static_cast<State>(query.value(state).toInt());
-    ptr->conversationId_ = query.value(conversation_id).toInt();
-    ptr->data_->conversation = query.value(conversation).toByteArray();
-    ptr->data_->messageId = query.value(message_id).toByteArray();
-    ptr->data_->composedTime = query.value(composed_time).toDateTime();
-    ptr->sentReceivedTime_ = query.value(received_time).toDateTime();
-    ptr->data_->content = query.value(content).toString();
-    ptr->data_->signature = query.value(signature).toByteArray();
-    ptr->data_->sender = query.value(sender).toByteArray();
-    ptr->data_->encoding = static_cast<Encoding>(query.value(encoding).toInt());
+    ptr->direction_ = static_cast<Direction>(query->value(direction).toInt());
+    ptr->state_ = static_cast<State>(query->value(state).toInt());
+    ptr->conversationId_ = query->value(conversation_id).toInt();
+    ptr->data_->conversation = query->value(conversation).toByteArray();
+    ptr->data_->messageId = query->value(message_id).toByteArray();
+    ptr->data_->composedTime = query->value(composed_time).toDateTime();
+    ptr->sentReceivedTime_ = query->value(received_time).toDateTime();
+    ptr->data_->content = query->value(content).toString();
+    ptr->data_->signature = query->value(signature).toByteArray();
+    ptr->data_->sender = query->value(sender).toByteArray();
+    ptr->data_->encoding = static_cast<Encoding>(query->value(encoding).toInt());
 
     return ptr;
 }
@@ -30,17 +30,17 @@ Message::ptr_t MessageManager::getMessage(int dbId)
 Message::ptr_t MessageManager::getMessage(const QByteArray &messageId,
                                           const int conversationId)
 {
-    QSqlQuery query;
-    query.prepare("SELECT id FROM message WHERE conversation_id=:cid and message_id=:mid");
-    query.bindValue(":cid", conversationId);
-    query.bindValue(":mid", messageId);
-    if(!query.exec()) {
+    auto query = StatementCache::instance().get("message", "id-by-message-id-conversation",
+        "SELECT id FROM message WHERE conversation_id=:cid and message_id=:mid");
+    query->bindValue(":cid", conversationId);
+    query->bindValue(":mid", messageId);
+    if(!query->exec()) {
         throw Error(QStringLiteral("Failed to fetch Message from hash: %1").arg(
-                        query.lastError().text()));
+                        query->lastError().text()));
     }
 
-    if (query.next()) {
-        return getMessage(query.value(0).toInt());
+    if (query->next()) {
+        return getMessage(query->value(0).toInt());
     }
 
     return {};
@@ -48,17 +48,17 @@ Message::ptr_t MessageManager::getMessage(const QByteArray &messageId,
 
 Message::ptr_t MessageManager::getMessage(const QByteArray &messageId, const Message::Direction direction)
 {
-    QSqlQuery query;
-    query.prepare("SELECT id FROM message WHERE message_id=:mid and direction=:direction");
-    query.bindValue(":mid", messageId);
-    query.bindValue(":direction", static_cast<int>(direction));
-    if(!query.exec()) {
+    auto query = StatementCache::instance().get("message", "id-by-message-id-direction",
+        "SELECT id FROM message WHERE message_id=:mid and direction=:direction");
+    query->bindValue(":mid", messageId);
+    query->bindValue(":direction", static_cast<int>(direction));
+    if(!query->exec()) {
         throw Error(QStringLiteral("Failed to fetch Message from hash: %1").arg(
-                        query.lastError().text()));
+                        query->lastError().text()));
     }
 
-    if (query.next()) {
-        return getMessage(query.value(0).toInt());
+    if (query->next()) {
+        return getMessage(query->value(0).toInt());
     }
 
     return {};
@@ -0,0 +1,52 @@
+#include <QFile>
+
+#include "ds/delta.h"
+#include "ds/signaturetask.h"
+
+#include "logfault/logfault.h"
+
+using namespace std;
+
+namespace ds {
+namespace core {
+
+SignatureTask::SignatureTask(QObject *owner, File::ptr_t file, QString basisPath)
+    : QObject{owner}, file_{move(file)}, basisPath_{move(basisPath)} {}
+
+void SignatureTask::run()
+{
+    try {
+        QFile basis{basisPath_};
+        if (!basis.open(QIODevice::ReadOnly)) {
+            LFLOG_DEBUG << "Cannot open the delta basis \"" << basisPath_
+                        << "\": " << basis.errorString();
+            emit done({}, {}, {});
+            return;
+        }
+
+        const auto size = basis.size();
+        const auto blockSize = Delta::getBlockSize(size);
+        if (blockSize > Delta::maxBlockSize) {
+            emit done({}, {}, {});
+            return;
+        }
+
+        const auto signature = Delta::createSignature(basis, blockSize);
+
+        // The basis must not change while we read it
+        if (basis.size() != size) {
+            emit done({}, {}, {});
+            return;
+        }
+
+        LFLOG_DEBUG << "Created delta signature for file #" << file_->getId()
+                    << " with " << (signature.size() / Delta::signatureBytes)
+                    << " blocks of " << blockSize << " bytes from \"" << basisPath_ << "\"";
+        emit done(signature, blockSize, size);
+    } catch(const std::exception& ex) {
+        LFLOG_ERROR << "Caught exception while creating delta signature: " << ex.what();
+        emit done({}, {}, {});
+    }
+}
+
+}} // namespaces
@@ -0,0 +1,120 @@
+#include <cassert>
+
+#include <QSqlError>
+
+#include "ds/errors.h"
+#include "ds/statementcache.h"
+
+#include "logfault/logfault.h"
+
+using namespace std;
+
+namespace ds {
+namespace core {
+
+StatementCache *StatementCache::instance_;
+
+StatementCache::Statement::Statement(QSqlQuery *query, bool *inUse, unique_ptr<QSqlQuery> owned)
+    : query_{query}, inUse_{inUse}, owned_{move(owned)}
+{
+}
+
+StatementCache::Statement::Statement(StatementCache::Statement &&v) noexcept
+    : query_{v.query_}, inUse_{v.inUse_}, owned_{move(v.owned_)}
+{
+    v.query_ = {};
+    v.inUse_ = {};
+}
+
+StatementCache::Statement::~Statement()
+{
+    if (query_) {
+        query_->finish();
+    }
+
+    if (inUse_) {
+        *inUse_ = false;
+    }
+}
+
+StatementCache::StatementCache(QSqlDatabase &db)
+    : db_{db}
+{
+    assert(!instance_);
+    instance_ = this;
+}
+
+StatementCache::~StatementCache()
+{
+    LFLOG_DEBUG << "Statement cache: " << stats_.hits << " hits, "
+                << stats_.misses << " misses, "
+                << stats_.busy << " busy, "
+                << statements_.size() << " statements.";
+
+    assert(instance_ == this);
+    instance_ = {};
+}
+
+StatementCache &StatementCache::instance()
+{
+    assert(instance_);
+    return *instance_;
+}
+
+StatementCache::Statement StatementCache::get(const char *table, const char *operation, const char *sql)
+{
+    return get(table, operation, [sql] {
+        return QString{sql};
+    });
+}
+
+StatementCache::Statement StatementCache::get(const char *table, const char *operation,
+                                              const StatementCache::sql_fn_t &makeSql)
+{
+    if (beforeGet_) {
+        beforeGet_();
+    }
+
+    QByteArray key{table};
+    key += ':';
+    key += operation;
+
+    auto& entry = statements_[key];
+    if (entry.query) {
+        if (entry.inUse) {
+            ++stats_.busy;
+            auto query = prepare(makeSql());
+            auto ptr = query.get();
+            return {ptr, nullptr, move(query)};
+        }
+        ++stats_.hits;
+    } else {
+        entry.query = prepare(makeSql());
+        ++stats_.misses;
+    }
+
+    entry.inUse = true;
+    return {entry.query.get(), &entry.inUse, {}};
+}
+
+void StatementCache::clear()
+{
+    for(const auto& it : statements_) {
+        assert(!it.second.inUse);
+    }
+
+    statements_.clear();
+}
+
+unique_ptr<QSqlQuery> StatementCache::prepare(const QString &sql)
+{
+    auto query = make_unique<QSqlQuery>(db_);
+    if (!query->prepare(sql)) {
+        throw Error(QStringLiteral("Failed to prepare SQL statement \"%1\": %2").arg(
+                        sql, query->lastError().text()));
+    }
+
+    return query;
+}
+
+}} // namespaces
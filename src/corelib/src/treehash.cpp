@@ -0,0 +1,122 @@
+
+#include <array>
+
+#include "ds/treehash.h"
+
+using namespace std;
+
+namespace ds {
+namespace core {
+
+namespace {
+
+constexpr uint8_t leaf_prefix = 0x00;
+constexpr uint8_t node_prefix = 0x01;
+
+QByteArray hashNode(const char *left, const char *right)
+{
+    crypto_hash_sha256_state state = {};
+    crypto_hash_sha256_init(&state);
+    crypto_hash_sha256_update(&state, &node_prefix, 1);
+    crypto_hash_sha256_update(&state, reinterpret_cast<const uint8_t *>(left),
+                              TreeHash::hashBytes);
+    crypto_hash_sha256_update(&state, reinterpret_cast<const uint8_t *>(right),
+                              TreeHash::hashBytes);
+
+    QByteArray out(TreeHash::hashBytes, 0);
+    crypto_hash_sha256_final(&state, reinterpret_cast<uint8_t *>(out.data()));
+    return out;
+}
+
+} // anonymous namespace
+
+qint64 TreeHash::getLeafSize(const qint64 fileSize) noexcept
+{
+    auto leafSize = minLeafSize;
+    while((leafSize * maxLeaves) < fileSize) {
+        leafSize *= 2;
+    }
+    return leafSize;
+}
+
+qint64 TreeHash::getLeafCount(const qint64 fileSize) noexcept
+{
+    if (fileSize <= 0) {
+        return 1;
+    }
+
+    const auto leafSize = getLeafSize(fileSize);
+    return (fileSize + leafSize - 1) / leafSize;
+}
+
+QByteArray TreeHash::hashLeaf(const void *data, const size_t bytes)
+{
+    LeafHasher hasher;
+    hasher.add(data, bytes);
+    return hasher.finish();
+}
+
+QByteArray TreeHash::getLeaf(const QByteArray &leaves, const qint64 index)
+{
+    return leaves.mid(static_cast<int>(index * hashBytes), hashBytes);
+}
+
+QByteArray TreeHash::getRoot(const QByteArray &leaves)
+{
+    if (leaves.isEmpty() || (leaves.size() % hashBytes)) {
+        return {};
+    }
+
+    auto level = leaves;
+    while(level.size() > hashBytes) {
+        QByteArray next;
+        for(int i = 0; i < level.size(); i += hashBytes * 2) {
+            if ((i + hashBytes) < level.size()) {
+                next += hashNode(level.constData() + i, level.constData() + i + hashBytes);
+            } else {
+                next += level.mid(i, hashBytes);
+            }
+        }
+        level = next;
+    }
+
+    return level;
+}
+
+bool TreeHash::isValid(const QByteArray &leaves, const QByteArray &root, const qint64 fileSize)
+{
+    if (leaves.size() != (getLeafCount(fileSize) * hashBytes)) {
+        return false;
+    }
+
+    const auto calculated = getRoot(leaves);
+    return !calculated.isEmpty() && (calculated == root);
+}
+
+TreeHash::LeafHasher::LeafHasher()
+{
+    reset();
+}
+
+void TreeHash::LeafHasher::add(const void *data, const size_t bytes)
+{
+    crypto_hash_sha256_update(&state_, reinterpret_cast<const uint8_t *>(data), bytes);
+    bytes_ += static_cast<qint64>(bytes);
+}
+
+QByteArray TreeHash::LeafHasher::finish()
+{
+    QByteArray out(hashBytes, 0);
+    crypto_hash_sha256_final(&state_, reinterpret_cast<uint8_t *>(out.data()));
+    reset();
+    return out;
+}
+
+void TreeHash::LeafHasher::reset()
+{
+    crypto_hash_sha256_init(&state_);
+    crypto_hash_sha256_update(&state_, &leaf_prefix, 1);
+    bytes_ = {};
+}
+
+}} // namespaces
@@ -2,9 +2,11 @@
 #define MESSAGEMODEL_H
 
 #include <deque>
+#include <unordered_map>
 
 #include <QSettings>
 #include <QAbstractListModel>
+#include <QSqlDatabase>
 
 #include "ds/identity.h"
 #include "ds/message.h"
@@ -14,6 +16,20 @@
 namespace ds {
 namespace models {
 
+/*! The messages and files in a conversation, newest first.
+ *
+ * The rows are loaded a page at the time, starting with the newest,
+ * and older pages are loaded by fetchMore(). The pages are read with
+ * keyset pagination on (sort_time, type, id), so it don't matter how
+ * far back we are in the conversation. sort_time is the message's
+ * composed time or the file's created time in UTC seconds, so the
+ * two tables compare, whatever time-zone the times were written in.
+ * The times are rounded to minutes, so ties are common.
+ *
+ * Each row has a sequence number that decreases from the first row
+ * to the last. The index maps messages and files to their sequence
+ * number, and the row is found with a binary search.
+ */
 class MessagesModel : public QAbstractListModel
 {
     Q_OBJECT
@@ -38,6 +54,7 @@ private:
 
         int id;
         Type type_ = MESSAGE;
+        qint64 seq = {};
         mutable std::shared_ptr<core::MessageContent> data_;
         mutable core::File::ptr_t file_;
     };
@@ -46,11 +63,30 @@ private:
         H_ID = Qt::UserRole, H_CONTENT, H_COMPOSED, H_DIRECTION, H_RECEIVED, H_STATE, H_TYPE, H_FILE, H_STATE_NAME
     };
 public:
+    static constexpr int pageSize = 100;
+
+    // The oldest row we have loaded
+    struct Cursor {
+        qint64 time = {}; // sort_time
+        Type type = MESSAGE;
+        int id = {}; // 0 before the first page
+
+        bool isValid() const noexcept { return id > 0; }
+    };
 
     using rows_t = std::deque<Row>;
 
+    struct Page {
+        rows_t rows;
+        Cursor cursor;
+        bool last = false;
+    };
+
     MessagesModel(QObject& parent);
 
+    // Read the page after /cursor/, or the newest page if the cursor is not valid
+    static Page queryPage(QSqlDatabase& db, const int conversationId, const Cursor& cursor);
+
     Q_INVOKABLE void setConversation(core::Conversation *conversation);
 
     // QAbstractItemModel interface
@@ -59,6 +95,8 @@ public:
     int rowCount(const QModelIndex &parent = {}) const override;
     QHash<int, QByteArray> roleNames() const override;
     Qt::ItemFlags flags(const QModelIndex &index) const override;
+    bool canFetchMore(const QModelIndex &parent) const override;
+    void fetchMore(const QModelIndex &parent) override;
 
 signals:
     void dataChangedLater();
@@ -74,7 +112,15 @@ private slots:
     void onFileStateChanged(const core::File *file);
 
 private:
-    void queryRows(rows_t& rows);
+    static qint64 getKey(const int id, const Type type) noexcept {
+        return (static_cast<qint64>(id) << 1) | type;
+    }
+
+    void queryRows();
+    void onPageLoaded(Page page);
+    void addNewest(Row row);
+    void removeRow(const int id, const Type type);
+    int findRow(const int id, const Type type) const;
     void load(Row& row) const;
     std::shared_ptr<core::MessageContent> loadData(const int id) const;
     std::shared_ptr<core::MessageContent> loadData(const core::Message& message) const;
@@ -83,7 +129,14 @@ private:
     QString getStateName(const Row& r) const;
 
     mutable rows_t rows_;
-    core::Conversation::ptr_t conversation_;    
+    std::unordered_map<qint64, qint64> index_; // key, seq
+    qint64 newestSeq_ = {};
+    qint64 oldestSeq_ = {};
+    Cursor cursor_;
+    bool fetching_ = false;
+    bool loadedAll_ = false;
+    core::Conversation::ptr_t conversation_;
+    quint64 generation_ = {}; // Ignore rows loaded for an earlier conversation
 };
 
 }} // namespaces
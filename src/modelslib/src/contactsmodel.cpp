@@ -2,6 +2,7 @@
 
 #include "ds/contactsmodel.h"
 #include "ds/dsengine.h"
+#include "ds/dirtytracker.h"
 #include "ds/errors.h"
 #include "ds/model_util.h"
 #include "ds/base58.h"
@@ -138,6 +139,9 @@ void ContactsModel::queryRows(rows_t &rows)
     if (!identity_) {
         return;
     }
+    // The order depends on fields that may not be saved yet
+    DirtyTracker::instance().flush();
+
     QSqlQuery query;
     query.prepare("SELECT uuid FROM contact WHERE identity=:identity ORDER BY LOWER(NAME)");
     query.bindValue(":identity", identity_->getId());
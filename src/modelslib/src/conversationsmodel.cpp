@@ -1,5 +1,6 @@
 #include "ds/conversationsmodel.h"
 #include "ds/dsengine.h"
+#include "ds/dirtytracker.h"
 #include "ds/errors.h"
 #include "ds/model_util.h"
 #include "ds/strategy.h"
@@ -223,6 +224,9 @@ void ConversationsModel::queryRows(ConversationsModel::rows_t &rows)
         return;
     }
 
+    // The order depends on fields that may not be saved yet
+    DirtyTracker::instance().flush();
+
     QSqlQuery query;
     query.prepare("SELECT uuid FROM conversation WHERE identity=:identity ORDER BY updated DESC");
     query.bindValue(":identity", identity_->getId());
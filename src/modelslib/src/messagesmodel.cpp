@@ -1,6 +1,10 @@
+#include <algorithm>
+#include <limits>
 
 #include "ds/messagesmodel.h"
 #include "ds/dsengine.h"
+#include "ds/dbexecutor.h"
+#include "ds/dirtytracker.h"
 #include "ds/dscert.h"
 
 #include <QSqlQuery>
@@ -51,11 +55,17 @@ void MessagesModel::setConversation(Conversation *conversation)
     conversation_ = conversation ? conversation->shared_from_this() : nullptr;
 
     beginResetModel();
-
     rows_.clear();
-    queryRows(rows_);
-
+    index_.clear();
+    newestSeq_ = {};
+    oldestSeq_ = {};
+    cursor_ = {};
+    fetching_ = false;
+    loadedAll_ = false;
+    ++generation_;
     endResetModel();
+
+    queryRows();
 }
 
 int MessagesModel::rowCount(const QModelIndex &parent) const
@@ -127,17 +137,25 @@ Qt::ItemFlags MessagesModel::flags(const QModelIndex&) const
     return Qt::ItemIsSelectable | Qt::ItemIsEnabled;
 }
 
+bool MessagesModel::canFetchMore(const QModelIndex &parent) const
+{
+    return !parent.isValid() && conversation_ && !loadedAll_ && !fetching_;
+}
+
+void MessagesModel::fetchMore(const QModelIndex &parent)
+{
+    if (canFetchMore(parent)) {
+        queryRows();
+    }
+}
+
 void MessagesModel::onMessageAdded(const Message::ptr_t &message)
 {
     if (!conversation_ || (conversation_->getId() != message->getConversationId())) {
         return; // Irrelevant
     }
 
-    // Always add at the end
-    const int rowid = static_cast<int>(rows_.size());
-    beginInsertRows({}, rowid, rowid);
-    rows_.push_back({message->getId(), loadData(*message)});
-    endInsertRows();
+    addNewest({message->getId(), loadData(*message)});
 }
 
 void MessagesModel::onMessageDeleted(const Message::ptr_t &message)
@@ -146,16 +164,7 @@ void MessagesModel::onMessageDeleted(const Message::ptr_t &message)
         return; // Irrelevant
     }
 
-    const int messageId = message->getId();
-    int rowid = 0;
-    for(auto it = rows_.begin(); it != rows_.end(); ++it, ++rowid) {
-        if (it->type_ == MESSAGE && it->id == messageId) {
-            beginRemoveRows({}, rowid, rowid);
-            rows_.erase(it);
-            endRemoveRows();
-            return;
-        }
-    }
+    removeRow(message->getId(), MESSAGE);
 }
 
 void MessagesModel::onMessageReceivedDateChanged(const Message::ptr_t &message)
@@ -174,12 +183,7 @@ void MessagesModel::onFileAdded(const File::ptr_t &file)
         return; // Irrelevant
     }
 
-    // Always add at the end
-    const int rowid = static_cast<int>(rows_.size());
-
-    beginInsertRows({}, rowid, rowid);
-    rows_.push_back({file->getId(), file});
-    endInsertRows();
+    addNewest({file->getId(), file});
 }
 
 void MessagesModel::onFileDeleted(const int dbId)
@@ -188,15 +192,7 @@ void MessagesModel::onFileDeleted(const int dbId)
         return; // Irrelevant
     }
 
-    int rowid = 0;
-    for(auto it = rows_.begin(); it != rows_.end(); ++it, ++rowid) {
-        if (it->type_ == FILE && it->id == dbId) {
-            beginRemoveRows({}, rowid, rowid);
-            rows_.erase(it);
-            endRemoveRows();
-            return;
-        }
-    }
+    removeRow(dbId, FILE);
 }
 
 void MessagesModel::onFileStateChanged(const File *file)
@@ -204,35 +200,162 @@ void MessagesModel::onFileStateChanged(const File *file)
      onFileChanged(file, H_STATE);
 }
 
-void MessagesModel::queryRows(MessagesModel::rows_t &rows)
+void MessagesModel::queryRows()
 {
     if (!conversation_) {
         return;
     }
 
-    QSqlQuery query;
-    //query.prepare("SELECT id FROM message WHERE conversation_id=:cid ORDER BY id");
-    query.prepare(
-        "SELECT 0 as type, id, composed_time AS created FROM message WHERE conversation_id=:cid "
+    const auto cid = conversation_->getId();
+    const auto generation = generation_;
+    const auto cursor = cursor_;
+    fetching_ = true;
+
+    DsEngine::instance().getDbExecutor().read<Page>([cid, cursor](QSqlDatabase& db) {
+        return queryPage(db, cid, cursor);
+    }, this, [this, generation](Page page) {
+        if (generation == generation_) {
+            onPageLoaded(move(page));
+        }
+    }, [this, generation](const QString&) {
+        if (generation == generation_) {
+            fetching_ = false;
+        }
+    });
+}
+
+MessagesModel::Page MessagesModel::queryPage(QSqlDatabase &db, const int conversationId,
+                                             const MessagesModel::Cursor &cursor)
+{
+    // Each branch is limited first, so that the indexes on
+    // (conversation_id, sort_time) can be used to find the page.
+    static const QString sql = QStringLiteral(
+        "SELECT type, id, sort_time FROM ( "
+        "SELECT * FROM (SELECT 0 AS type, id, sort_time FROM message "
+        "WHERE conversation_id=:cid%1 ORDER BY sort_time DESC, id DESC LIMIT :limit) "
         "UNION ALL "
-        "SELECT 1 as type, id, created_time AS created FROM file WHERE conversation_id=:cid "
-        "ORDER BY created ");
-    query.bindValue(":cid", conversation_->getId());
+        "SELECT * FROM (SELECT 1 AS type, id, sort_time FROM file "
+        "WHERE conversation_id=:cid%2 ORDER BY sort_time DESC, id DESC LIMIT :limit) "
+        ") ORDER BY sort_time DESC, type DESC, id DESC LIMIT :limit");
+
+    // Rows with the same time as the cursor are ordered files first, then by id
+    const auto messageAfter = cursor.isValid() ? QStringLiteral(
+        " AND sort_time <= :time AND (sort_time < :time OR id < :mid)") : QString{};
+    const auto fileAfter = cursor.isValid() ? QStringLiteral(
+        " AND sort_time <= :time AND (sort_time < :time OR id < :fid)") : QString{};
+
+    QSqlQuery query{db};
+    if (!query.prepare(sql.arg(messageAfter, fileAfter))) {
+        throw Error(QStringLiteral("Failed to prepare the page query: %1").arg(
+                        query.lastError().text()));
+    }
+    query.bindValue(":cid", conversationId);
+    query.bindValue(":limit", pageSize);
+    if (cursor.isValid()) {
+        query.bindValue(":time", cursor.time);
+        query.bindValue(":mid", (cursor.type == FILE)
+                        ? numeric_limits<qint64>::max()
+                        : qint64{cursor.id});
+        query.bindValue(":fid", (cursor.type == FILE) ? cursor.id : 0);
+    }
 
     if(!query.exec()) {
-        throw Error(QStringLiteral("Failed to add Conversation: %1").arg(
+        throw Error(QStringLiteral("Failed to query Conversation: %1").arg(
                         query.lastError().text()));
     }
 
-    enum Fiels { type, id };
+    enum Fields { type, id, sort_time };
 
-    // Populate
+    Page page;
     while(query.next()) {
-        rows.emplace_back(query.value(id).toInt(),
-                          static_cast<Type>(query.value(type).toInt()));
+        page.cursor.type = static_cast<Type>(query.value(type).toInt());
+        page.cursor.id = query.value(id).toInt();
+        page.cursor.time = query.value(sort_time).toLongLong();
+        page.rows.emplace_back(page.cursor.id, page.cursor.type);
+    }
+    page.last = page.rows.size() < static_cast<size_t>(pageSize);
+    if (page.rows.empty()) {
+        page.cursor = cursor;
+    }
+    return page;
+}
+
+void MessagesModel::onPageLoaded(MessagesModel::Page page)
+{
+    fetching_ = false;
+    loadedAll_ = page.last;
+    cursor_ = page.cursor;
+
+    // Skip the rows that were added while we waited
+    rows_t rows;
+    for(auto& row : page.rows) {
+        const auto key = getKey(row.id, row.type_);
+        if (index_.find(key) == index_.end()) {
+            row.seq = --oldestSeq_;
+            index_[key] = row.seq;
+            rows.push_back(move(row));
+        }
     }
 
-    LFLOG_DEBUG << "Loaded " << rows.size() << " rows with messages and/or files";
+    if (!rows.empty()) {
+        const int first = static_cast<int>(rows_.size());
+        beginInsertRows({}, first, first + static_cast<int>(rows.size()) - 1);
+        move(rows.begin(), rows.end(), back_inserter(rows_));
+        endInsertRows();
+    }
+
+    LFLOG_DEBUG << "Loaded " << rows.size() << " rows with messages and/or files. "
+                << rows_.size() << " rows in total"
+                << (loadedAll_ ? " (all)." : ".");
+}
+
+void MessagesModel::addNewest(MessagesModel::Row row)
+{
+    const auto key = getKey(row.id, row.type_);
+    if (index_.find(key) != index_.end()) {
+        return; // Already loaded
+    }
+
+    row.seq = ++newestSeq_;
+    index_[key] = row.seq;
+
+    beginInsertRows({}, 0, 0);
+    rows_.push_front(move(row));
+    endInsertRows();
+}
+
+void MessagesModel::removeRow(const int id, const MessagesModel::Type type)
+{
+    const auto rowid = findRow(id, type);
+    if (rowid < 0) {
+        return;
+    }
+
+    beginRemoveRows({}, rowid, rowid);
+    rows_.erase(rows_.begin() + rowid);
+    index_.erase(getKey(id, type));
+    endRemoveRows();
+}
+
+int MessagesModel::findRow(const int id, const MessagesModel::Type type) const
+{
+    const auto it = index_.find(getKey(id, type));
+    if (it == index_.end()) {
+        return -1;
+    }
+
+    // The sequence numbers decrease from the first row to the last
+    const auto seq = it->second;
+    const auto row = lower_bound(rows_.begin(), rows_.end(), seq, [](const Row& r, const qint64 s) {
+        return r.seq > s;
+    });
+
+    if ((row == rows_.end()) || (row->seq != seq)) {
+        LFLOG_WARN << "The index is out of sync with the rows for " << id;
+        return -1;
+    }
+
+    return static_cast<int>(row - rows_.begin());
 }
 
 void MessagesModel::load(MessagesModel::Row &row) const
@@ -249,6 +372,7 @@ std::shared_ptr<MessageContent> MessagesModel::loadData(const int id) const
     // TODO: Try to get it from the message cache
 
     // Read from database
+    DirtyTracker::instance().flush();
     QSqlQuery query;
 
     enum Fields {
@@ -297,30 +421,31 @@ void MessagesModel::onMessageChanged(const Message::ptr_t &message, const int ro
         return; // Irrelevant
     }
 
-    const int messageId = message->getId();
-    int rowid = 0;
-    for(auto it = rows_.begin(); it != rows_.end(); ++it, ++rowid) {
-        if (it->type_ == MESSAGE && it->id == messageId) {
-
-            if (role == H_STATE) {
-                it->data_->state = message->getState();
-            } else if (role == H_RECEIVED) {
-                it->data_->sentReceivedTime = message->getSentReceivedTime();
-            }
-
-            LFLOG_TRACE << "Emitting dataChanged for message " << message->getId()
-                        << " for role " << role
-                        << " on row " << rowid;
-
-            const auto where = index(rowid);
-            if (role == H_STATE) {
-                emit dataChanged(where, where, {H_STATE, H_STATE_NAME});
-            } else {
-                emit dataChanged(where, where, {role});
-            }
-            return;
+    const auto rowid = findRow(message->getId(), MESSAGE);
+    if (rowid < 0) {
+        return;
+    }
+
+    // If it's not loaded yet, it's loaded with the new values when it is shown
+    auto& row = rows_.at(static_cast<size_t>(rowid));
+    if (row.data_) {
+        if (role == H_STATE) {
+            row.data_->state = message->getState();
+        } else if (role == H_RECEIVED) {
+            row.data_->sentReceivedTime = message->getSentReceivedTime();
         }
     }
+
+    LFLOG_TRACE << "Emitting dataChanged for message " << message->getId()
+                << " for role " << role
+                << " on row " << rowid;
+
+    const auto where = index(rowid);
+    if (role == H_STATE) {
+        emit dataChanged(where, where, {H_STATE, H_STATE_NAME});
+    } else {
+        emit dataChanged(where, where, {role});
+    }
 }
 
 void MessagesModel::onFileChanged(const File *file, const int role)
@@ -330,22 +455,20 @@ void MessagesModel::onFileChanged(const File *file, const int role)
     }
 
     const int fileId = file->getId();
-    int rowid = 0;
-    for(auto it = rows_.begin(); it != rows_.end(); ++it, ++rowid) {
-        if (it->type_ == FILE && it->id == fileId) {
-
-            LFLOG_TRACE << "Emitting dataChanged for file " << fileId
-                        << " for role " << role
-                        << " on row " << rowid;
-
-            const auto where = index(rowid);
-            if (role == H_STATE) {
-                emit dataChanged(where, where, {H_STATE, H_STATE_NAME});
-            } else {
-                emit dataChanged(where, where, {role});
-            }
-            return;
-        }
+    const auto rowid = findRow(fileId, FILE);
+    if (rowid < 0) {
+        return;
+    }
+
+    LFLOG_TRACE << "Emitting dataChanged for file " << fileId
+                << " for role " << role
+                << " on row " << rowid;
+
+    const auto where = index(rowid);
+    if (role == H_STATE) {
+        emit dataChanged(where, where, {H_STATE, H_STATE_NAME});
+    } else {
+        emit dataChanged(where, where, {role});
     }
 }
 
@@ -0,0 +1,69 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace ds {
+namespace prot {
+
+/*! Pool of re-usable byte buffers.
+ *
+ * Buffers keep their capacity (and size) when they are returned,
+ * so after a short warm-up the send and receive paths can build
+ * frames without allocating memory from the heap.
+ *
+ * Not thread-safe. Each connection owns one pool.
+ */
+class BufferPool {
+public:
+    using ptr_t = std::shared_ptr<BufferPool>;
+    using buffer_t = std::vector<uint8_t>;
+
+    BufferPool(const size_t maxBuffers = 32, const size_t maxCapacity = 1024 * 1024 * 2)
+        : maxBuffers_{maxBuffers}, maxCapacity_{maxCapacity} {}
+
+    // Get a buffer with exactly /bytes/ size.
+    // The content of the buffer is undefined.
+    buffer_t take(const size_t bytes) {
+        buffer_t buffer;
+        if (!free_.empty()) {
+            buffer = std::move(free_.back());
+            free_.pop_back();
+            ++reused_;
+        } else {
+            ++allocated_;
+        }
+
+        // We don't clear() returned buffers, so resize() only
+        // initializes memory if the buffer must grow.
+        buffer.resize(bytes);
+        return buffer;
+    }
+
+    void give(buffer_t&& buffer) {
+        if ((buffer.capacity() == 0)
+                || (buffer.capacity() > maxCapacity_)
+                || (free_.size() >= maxBuffers_)) {
+            return; // Just let it go
+        }
+
+        free_.push_back(std::move(buffer));
+    }
+
+    size_t available() const noexcept { return free_.size(); }
+    uint64_t getAllocatedCount() const noexcept { return allocated_; }
+    uint64_t getReusedCount() const noexcept { return reused_; }
+
+private:
+    std::vector<buffer_t> free_;
+    const size_t maxBuffers_;
+    const size_t maxCapacity_;
+    uint64_t allocated_ = {};
+    uint64_t reused_ = {};
+};
+
+}} // namespaces
+
+#endif // BUFFERPOOL_H
@@ -0,0 +1,103 @@
+#ifndef CHUNKSIZER_H
+#define CHUNKSIZER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace ds {
+namespace prot {
+
+/*! Adaptive chunk-size for file-transfers.
+ *
+ * Picks the size of each file chunk, and how many chunks we queue
+ * on the connection at once, from the rate the connection's output
+ * buffer is drained. A fast circuit gets large chunks and a few of
+ * them in flight, so we don't spend our time in the event-loop. A
+ * slow circuit gets small chunks, so control messages don't have
+ * to wait behind a large chunk.
+ */
+class ChunkSizer {
+public:
+    using clock_t = std::chrono::steady_clock;
+
+    ChunkSizer(const size_t maxChunkSize = 1024 * 64)
+        : maxChunkSize_{maxChunkSize} {}
+
+    void setMaxChunkSize(const size_t maxChunkSize) {
+        maxChunkSize_ = std::max(maxChunkSize, size_t{minChunkSize});
+        chunkSize_ = std::min(chunkSize_, maxChunkSize_);
+    }
+
+    /*! Adjust to the measured drain-rate of the connection.
+     *
+     * \param drainRate Bytes per second. 0 if it is not yet known.
+     * \return true if the chunk-size or the number of chunks in flight changed.
+     */
+    bool update(const double drainRate) {
+        if (drainRate <= 0) {
+            return false;
+        }
+
+        const auto oldChunkSize = chunkSize_;
+        const auto oldInFlight = chunksInFlight_;
+
+        // Grow or shrink in steps of 2x, so a single odd sample does not make us jump around.
+        const auto wanted = static_cast<size_t>(drainRate * targetChunkSeconds);
+        if ((wanted > (chunkSize_ * 2)) && (chunkSize_ < maxChunkSize_)) {
+            chunkSize_ = std::min(chunkSize_ * 2, maxChunkSize_);
+        } else if ((wanted < (chunkSize_ / 2)) && (chunkSize_ > minChunkSize)) {
+            // Largest power of two below the current size, to stay aligned with disk blocks
+            size_t smaller = minChunkSize;
+            while ((smaller * 2) < chunkSize_) {
+                smaller *= 2;
+            }
+            chunkSize_ = smaller;
+        }
+
+        const auto inFlight = static_cast<size_t>(drainRate * targetBacklogSeconds) / chunkSize_;
+        chunksInFlight_ = std::max<size_t>(1, std::min(inFlight, size_t{maxChunksInFlight}));
+
+        return (oldChunkSize != chunkSize_) || (oldInFlight != chunksInFlight_);
+    }
+
+    // Account for bytes handed over to the connection
+    void addSent(const size_t bytes) {
+        const auto now = clock_t::now();
+        if (windowStart_ == clock_t::time_point{}) {
+            windowStart_ = now;
+        }
+
+        windowBytes_ += bytes;
+        const auto elapsed = std::chrono::duration<double>(now - windowStart_).count();
+        if (elapsed >= 1.0) {
+            throughput_ = static_cast<uint64_t>(windowBytes_ / elapsed);
+            windowBytes_ = {};
+            windowStart_ = now;
+        }
+    }
+
+    size_t getChunkSize() const noexcept { return chunkSize_; }
+    size_t getChunksInFlight() const noexcept { return chunksInFlight_; }
+
+    // Bytes per second sent for this transfer, updated about once a second
+    uint64_t getThroughput() const noexcept { return throughput_; }
+
+    static constexpr size_t minChunkSize = 1024 * 4;
+    static constexpr size_t maxChunksInFlight = 8;
+    static constexpr double targetChunkSeconds = 0.05;
+    static constexpr double targetBacklogSeconds = 0.25;
+
+private:
+    size_t maxChunkSize_;
+    size_t chunkSize_ = 1024 * 8;
+    size_t chunksInFlight_ = 1;
+    clock_t::time_point windowStart_;
+    size_t windowBytes_ = {};
+    uint64_t throughput_ = {};
+};
+
+}} // namespaces
+
+#endif // CHUNKSIZER_H
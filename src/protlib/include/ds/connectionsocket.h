@@ -1,12 +1,16 @@
 #ifndef CONNECTIONSOCKET_H
 #define CONNECTIONSOCKET_H
 
+#include <chrono>
+#include <deque>
 #include <memory>
+#include <cstring>
 
 #include <QTcpSocket>
 #include <QUuid>
 
 #include "ds/memoryview.h"
+#include "ds/bufferpool.h"
 
 namespace ds {
 namespace prot {
@@ -18,6 +22,7 @@ class ConnectionSocket : public QTcpSocket
 public:
     using ptr_t = std::shared_ptr<ConnectionSocket>;
     using data_t = crypto::MemoryView<uint8_t>;
+    using buffer_t = BufferPool::buffer_t;
 
     ConnectionSocket(QByteArray host = {}, quint16 port = {}, const QUuid& uuid = {});
     ~ConnectionSocket();
@@ -26,14 +31,27 @@ public:
         return uuid;
     }
 
+    // Queue a buffer for sending. The socket takes ownership of the
+    // buffer and returns it to the pool when it has been written.
+    void write(buffer_t&& buffer);
+
     template <typename T>
     void write(const T& data) {
-        const char *p = reinterpret_cast<const char *>(data.data());
-        const qint64 bytes = data.size();
-        outData.append(p, bytes);
-        sendMore();
+        auto buffer = bufferPool_->take(static_cast<size_t>(data.size()));
+        memcpy(buffer.data(), data.data(), buffer.size());
+        write(std::move(buffer));
     }
 
+    BufferPool& getBufferPool() noexcept { return *bufferPool_; }
+    const BufferPool::ptr_t& getBufferPoolPtr() const noexcept { return bufferPool_; }
+
+    // Bytes queued by us, but not yet handed over to the socket
+    size_t getOutputQueueBytes() const noexcept { return outQueueBytes_; }
+
+    // Moving average of the rate our output is written to the network,
+    // in bytes per second. Idle periods are not counted. 0 until we have a sample.
+    double getDrainRate() const noexcept { return drainRate_; }
+
     void wantBytes(size_t bytesRequested);
 
     void connectToDefaultHost();
@@ -53,14 +71,33 @@ private slots:
     void onSocketFailed(SocketError socketError);
 
 private:
+    void readInput();
     void processInput();
+    size_t contiguousInput() const noexcept;
+    void copyInput(uint8_t *dst, size_t bytes) const;
+    void consumeInput(size_t bytes);
+    void recycleInput();
     void sendMore();
+    void updateDrainRate(const qint64 bytes);
 
     QUuid uuid;
-    QByteArray outData;
-    QByteArray inData;
+    BufferPool::ptr_t bufferPool_ = std::make_shared<BufferPool>();
+    std::deque<buffer_t> outQueue_;
+    size_t outOffset_ = {}; // Bytes already written from outQueue_.front()
+    size_t outQueueBytes_ = {};
+    qint64 maxSocketBacklog_ = 1024 * 64; // Don't let QTcpSocket buffer more than this
+    std::chrono::steady_clock::time_point drainStart_;
+    qint64 drainBytes_ = {};
+    double drainRate_ = {};
+    std::deque<buffer_t> inChunks_; // Ring of fixed size chunks we read into
+    std::vector<buffer_t> retiredChunks_; // Consumed, but possibly still referenced
+    size_t inHead_ = {}; // Read offset in inChunks_.front()
+    size_t inTail_ = {}; // Write offset in inChunks_.back()
+    size_t inBytes_ = {};
+    const size_t inChunkSize_ = 1024 * 16;
+    bool processingInput_ = false;
     size_t bytesWanted_ = {};
-    size_t maxInDataSize = 1024 * 265;
+    size_t maxInDataSize = 1024 * 1024 * 3; // Must have room for a v2 frame and some backlog
     const QByteArray host_;
     const quint16 port_;
 };
@@ -0,0 +1,65 @@
+#ifndef CONTROLCODEC_H
+#define CONTROLCODEC_H
+
+#include <QByteArray>
+#include <QCborMap>
+#include <QCborValue>
+#include <QString>
+
+namespace ds {
+namespace prot {
+
+/*! Encoding of the messages on the control channel (channel #0)
+ *
+ * Messages are built and read as a QCborMap, using the Json names
+ * as keys. Binary fields are QByteArray's, and the type is an
+ * integer (Type).
+ *
+ * On the wire, a message is either:
+ *  - Json, the original format. Binary fields are base64 encoded,
+ *    and some numbers are sent as strings.
+ *  - CBOR, a compact map with integer keys and type, raw byte-strings
+ *    and integers. Only sent to peers that announce the "cbor" feature.
+ *
+ * Incoming messages are decoded from either format.
+ */
+class ControlCodec {
+public:
+    enum class Type {
+        UNKNOWN = 0,
+        ADD_ME = 1,
+        ACK = 2,
+        MESSAGE = 3,
+        INCOMING_FILE = 4,
+        SET_AVATAR = 5,
+        USER_INFO = 6,
+        FEATURES = 7,
+        MESSAGE_BATCH = 8,
+        INCOMING_FILES = 9,
+        FILE_HASHES = 10,
+        FILE_SIGNATURES = 11
+    };
+
+    enum class Encoding {
+        JSON,
+        CBOR
+    };
+
+    // Create an empty message of the given type
+    static QCborMap create(const Type type);
+
+    static Type getType(const QCborMap& msg);
+    static QString getTypeName(const Type type);
+
+    static QByteArray encode(const QCborMap& msg, const Encoding encoding);
+
+    // Decode from Json or CBOR. Throws Error if the data is not a valid message.
+    static QCborMap decode(const char *data, const size_t size);
+
+    // Value as text, the way it was sent in Json.
+    static QString toText(const QCborValue& value);
+};
+
+}} // namespaces
+
+#endif // CONTROLCODEC_H
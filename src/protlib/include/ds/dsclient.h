@@ -1,11 +1,51 @@
 #ifndef DSCLIENT_H
 #define DSCLIENT_H
 
+#include <chrono>
+#include <map>
+#include <memory>
+
 #include "ds/peer.h"
 
 namespace ds {
 namespace prot {
 
+/*! The peers we use protocol version 1 with for a while.
+ *
+ * Old versions of DarkSpeak drop the connection when they get a Hello
+ * with a version they don't know. A connection can also drop for other
+ * reasons, like a broken Tor circuit, so we only fall back to version 1
+ * after several drops in a row while we wait for the Olleh, or if the
+ * peer answers a newer Hello with a version 1 Olleh.
+ *
+ * One instance is shared by the outgoing connections of a protocol manager.
+ */
+class LegacyPeers
+{
+public:
+    using ptr_t = std::shared_ptr<LegacyPeers>;
+    using clock_t = std::chrono::steady_clock;
+
+    // True if we should say a version 1 Hello to /address/
+    bool isLegacy(const QByteArray& address);
+
+    // The peer answered our Hello with an Olleh
+    void onOlleh(const QByteArray& address, const uint8_t helloVersion, const uint8_t ollehVersion);
+
+    // The connection was dropped before the peer answered our Hello
+    void onDropped(const QByteArray& address, const uint8_t helloVersion);
+
+private:
+    struct Entry {
+        size_t drops = {};
+        clock_t::time_point legacyUntil = {}; // Unset until we fall back
+    };
+
+    void setLegacy(const QByteArray& address, Entry& entry);
+
+    std::map<QByteArray, Entry> peers_;
+};
+
 /*! Client implementation of the DarkSpeak protocol
  *
  */
@@ -21,7 +61,8 @@ public:
         ENCRYPTED_STREAM
     };
 
-    DsClient(ConnectionSocket::ptr_t connection, core::ConnectData connectionData);
+    DsClient(ConnectionSocket::ptr_t connection, core::ConnectData connectionData,
+             LegacyPeers::ptr_t legacyPeers);
 
 private slots:
     void advance();
@@ -33,8 +74,11 @@ private:
     void getHelloReply(const data_t& data);
     void startConnectRetryTimer();
     void initConnections();
+    void onDisconnectedWhileNegotiating();
 
     State state_ = State::CONNECTED;
+    LegacyPeers::ptr_t legacyPeers_;
+    uint8_t helloVersion_ = 1;
     size_t maxReconnects_ = 20;
     size_t numReconnects_ = {};
     size_t reconnectDelayMilliseconds_ = 20000;
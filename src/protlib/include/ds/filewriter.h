@@ -0,0 +1,107 @@
+#ifndef FILEWRITER_H
+#define FILEWRITER_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include <QByteArray>
+#include <QFile>
+#include <QIODevice>
+#include <QObject>
+
+namespace ds {
+namespace prot {
+
+/*! Writes the data for an incoming file on its own thread
+ *
+ * The Peer's thread runs the event-loop for all the connections and
+ * the UI, so it should not wait for the disk. The data is queued
+ * here, and written and flushed in batches by the writer thread.
+ *
+ * The queue is bounded. When it grows above highWatermark, isBehind()
+ * returns true, and the channel asks the sender to pause. drained() is
+ * emitted when the queue is below lowWatermark again. If the sender
+ * don't pause, write() blocks when maxQueuedBytes are queued.
+ *
+ * The device must be open for write, and is only used by the writer
+ * thread until the FileWriter is deleted. It's normally a QFile, but
+ * can be anything that unpacks the data, like a DirArchiveWriter.
+ *
+ * If there is a decoder, each chunk is passed through it on the writer
+ * thread before it is written. That's where a delta transfer reads
+ * the basis.
+ */
+class FileWriter : public QObject
+{
+    Q_OBJECT
+public:
+    static constexpr size_t lowWatermark = 1024 * 1024 * 2;
+    static constexpr size_t highWatermark = 1024 * 1024 * 8;
+    static constexpr size_t maxQueuedBytes = 1024 * 1024 * 32;
+
+    // Flush to the OS when this much is written
+    static constexpr qint64 flushBytes = 1024 * 1024 * 4;
+
+    // Rebuilds the data to write from a queued chunk. Returns false on error.
+    using decoder_t = std::function<bool (const QByteArray& chunk, QByteArray& out,
+                                          QString& error)>;
+
+    explicit FileWriter(QIODevice& device, decoder_t decoder = {});
+
+    // Discards whatever is still queued unless finish() was called
+    ~FileWriter() override;
+
+    // Reserve disk-space for the file, without changing its size.
+    // Best effort. Call before the first write().
+    void preallocate(const qint64 size);
+
+    /*! Queue a copy of the data. Returns false if the writer has failed.
+     *
+     * /weight/ is what the chunk counts as in the queue, if the decoder
+     * makes it larger. 0 means /bytes/.
+     */
+    bool write(const void *data, const size_t bytes, const size_t weight = 0);
+
+    // Write the rest of the queue, flush and close the file.
+    void finish();
+
+    bool isBehind() const;
+    size_t getQueuedBytes() const;
+
+signals:
+    void drained();
+    void finished();
+    void failed(const QString& reason);
+
+private:
+    void run();
+
+    QString getName() const;
+
+    QIODevice& device_;
+    QFile *const file_; // If the device is a file
+    const decoder_t decoder_;
+    QByteArray decoded_; // Only used by the writer thread
+    mutable std::mutex mutex_;
+    std::condition_variable cond_;
+    struct Chunk {
+        QByteArray data;
+        size_t weight = {};
+    };
+
+    std::deque<Chunk> queue_;
+    size_t queuedBytes_ = {};
+    qint64 unflushed_ = {};
+    bool behind_ = false;
+    bool finishing_ = false;
+    bool failed_ = false;
+    bool done_ = false;
+    std::thread thread_;
+};
+
+}} // namespaces
+
+#endif // FILEWRITER_H
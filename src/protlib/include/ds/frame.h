@@ -0,0 +1,95 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <cstdint>
+#include <memory>
+
+#include "ds/memoryview.h"
+#include "ds/bufferpool.h"
+
+namespace ds {
+namespace prot {
+
+/*! A plaintext frame under construction.
+ *
+ * The buffer is taken from the connections buffer-pool, and has
+ * room for the frame-header in front of the payload. Callers
+ * write (or read from disk) directly into payload(), and send()
+ * fills in the header in place before the frame is encrypted
+ * into another pooled buffer that is handed over to the socket.
+ */
+class Frame {
+public:
+    using mview_t = crypto::MemoryView<uint8_t>;
+
+    Frame() = default;
+    Frame(BufferPool::ptr_t pool, const size_t headerBytes, const size_t payloadBytes)
+        : pool_{std::move(pool)}, headerBytes_{headerBytes}
+        , buffer_{pool_->take(headerBytes + payloadBytes)} {}
+    Frame(const Frame&) = delete;
+    Frame(Frame&&) = default;
+    Frame& operator = (const Frame&) = delete;
+    Frame& operator = (Frame&& v) {
+        if (this != &v) {
+            release();
+            pool_ = std::move(v.pool_);
+            headerBytes_ = v.headerBytes_;
+            buffer_ = std::move(v.buffer_);
+            compressed_ = v.compressed_;
+        }
+        return *this;
+    }
+
+    ~Frame() {
+        release();
+    }
+
+    // A new frame from the same pool, with the same room for the header
+    Frame alike(const size_t payloadBytes) const {
+        return {pool_, headerBytes_, payloadBytes};
+    }
+
+    mview_t header() {
+        return {buffer_.data(), headerBytes_};
+    }
+
+    mview_t payload() {
+        return {buffer_.data() + headerBytes_, buffer_.size() - headerBytes_};
+    }
+
+    // Shrink or grow the payload, for example after a short read.
+    void resize(const size_t payloadBytes) {
+        buffer_.resize(headerBytes_ + payloadBytes);
+    }
+
+    // The complete frame, header and payload
+    mview_t view() {
+        return {buffer_.data(), buffer_.size()};
+    }
+
+    const BufferPool::buffer_t& buffer() const noexcept {
+        return buffer_;
+    }
+
+    // The payload is compressed (v2 frame flag)
+    bool isCompressed() const noexcept { return compressed_; }
+    void setCompressed(const bool compressed) noexcept { compressed_ = compressed; }
+
+    // Return the buffer to the pool
+    void release() {
+        if (pool_ && buffer_.capacity()) {
+            pool_->give(std::move(buffer_));
+            buffer_ = {};
+        }
+    }
+
+private:
+    BufferPool::ptr_t pool_;
+    size_t headerBytes_ = {};
+    BufferPool::buffer_t buffer_;
+    bool compressed_ = false;
+};
+
+}} // namespaces
+
+#endif // FRAME_H
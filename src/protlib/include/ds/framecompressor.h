@@ -0,0 +1,106 @@
+#ifndef FRAMECOMPRESSOR_H
+#define FRAMECOMPRESSOR_H
+
+#include <map>
+
+#include <QtGlobal>
+
+#include "ds/frame.h"
+
+namespace ds {
+namespace prot {
+
+/*! Optional deflate compression of frame payloads.
+ *
+ * Payloads are compressed before encryption, and only on connections
+ * where both sides announce the "deflate" feature (frame format v2).
+ *
+ * Each file channel is probed on its first frame of a reasonable size. If
+ * the data looks random (already compressed media, encrypted archives),
+ * the channel is switched off. A channel that keeps getting poor results
+ * is switched off as well. A switched off channel is probed again after
+ * a number of skipped frames, as a file can contain both kinds of data.
+ *
+ * The control channel carries unrelated payloads (messages, avatars,
+ * inline files), so each of its payloads is probed on its own, and it is
+ * never switched off.
+ */
+class FrameCompressor {
+public:
+    struct Stats {
+        uint64_t compressedFrames = {};
+        uint64_t skippedFrames = {};
+        uint64_t bytesIn = {}; // Before compression, for compressed frames
+        uint64_t bytesOut = {}; // After compression
+        uint64_t decompressedFrames = {};
+        double cpuMs = {}; // Time spent compressing and decompressing
+
+        // Compressed size relative to the original. 1.0 if nothing was compressed.
+        double getRatio() const noexcept {
+            return bytesIn ? static_cast<double>(bytesOut) / static_cast<double>(bytesIn) : 1.0;
+        }
+    };
+
+    FrameCompressor(const int level = 1)
+        : level_{level} {}
+
+    /*! Compress the payload of the frame, if it's worthwhile.
+     *
+     * \param frame Frame to compress. On success, it is replaced with
+     *      a new frame with the compressed payload.
+     * \return true if the frame was compressed.
+     */
+    bool compress(Frame& frame, const quint32 channel);
+
+    /*! Decompress a payload
+     *
+     * \param frame Receives the decompressed payload
+     * \param payload Compressed data
+     * \param maxBytes Max size of the decompressed payload
+     * \return View of the decompressed payload
+     * \throws Error if the data is invalid or too large.
+     */
+    Frame::mview_t decompress(Frame& frame, const Frame::mview_t& payload,
+                              const quint32 channel, const size_t maxBytes);
+
+    Stats getStats(const quint32 channel) const;
+    Stats getTotals() const;
+    void forget(const quint32 channel);
+
+    // Estimated Shannon entropy, in bits per byte, of the first /maxBytes/.
+    static double probeEntropy(const uint8_t *data, const size_t size,
+                               const size_t maxBytes = 1024 * 4);
+
+    // Payloads smaller than this are not worth the effort
+    static constexpr size_t minPayloadBytes = 256;
+
+    // Random or already compressed data is close to 8 bits per byte
+    static constexpr double maxEntropy = 7.5;
+
+    // Give up on a channel after this many frames in a row that don't shrink enough
+    static constexpr unsigned maxPoorResults = 4;
+
+    // Probe a switched off channel again after this many frames. Doubles
+    // each time the probe fails, up to maxReprobeFrames.
+    static constexpr unsigned minReprobeFrames = 32;
+    static constexpr unsigned maxReprobeFrames = 1024;
+
+private:
+    struct Channel {
+        bool probed = false;
+        bool enabled = true;
+        unsigned poorResults = {};
+        unsigned reprobeInterval = minReprobeFrames;
+        unsigned framesUntilReprobe = {};
+        Stats stats;
+    };
+
+    void disable(Channel& ch);
+
+    const int level_;
+    std::map<quint32, Channel> channels_;
+};
+
+}} // namespaces
+
+#endif // FRAMECOMPRESSOR_H
@@ -0,0 +1,87 @@
+#ifndef FRAMESCHEDULER_H
+#define FRAMESCHEDULER_H
+
+#include <chrono>
+#include <deque>
+#include <map>
+
+#include <QtGlobal>
+
+#include "ds/frame.h"
+
+namespace ds {
+namespace prot {
+
+/*! Decides the order plaintext frames are encrypted and sent in.
+ *
+ * The encrypted stream must be written in the same order as the
+ * frames are encrypted, so we queue frames before encryption.
+ *
+ * Channel 0 (control messages) has strict priority. The file
+ * channels share the remaining bandwidth with deficit round-robin,
+ * so a large transfer does not starve the others.
+ */
+class FrameScheduler {
+public:
+    using clock_t = std::chrono::steady_clock;
+
+    struct Item {
+        Frame frame;
+        quint32 channel = {};
+        bool final = false;
+        quint32 requests = 1; // Request ids the frame uses. One per item in a batch.
+        clock_t::time_point queued;
+    };
+
+    struct ChannelStats {
+        size_t queuedFrames = {};
+        size_t queuedBytes = {};
+        uint64_t sentFrames = {};
+        uint64_t sentBytes = {};
+        double avgWaitMs = {}; // Moving average of the time a frame waits in the queue
+        double maxWaitMs = {};
+    };
+
+    FrameScheduler(const size_t quantum = 1024 * 64)
+        : quantum_{quantum} {}
+
+    // The request id is assigned when the frame is popped, so the ids are in wire order
+    void push(Frame&& frame, const quint32 channel, const bool final,
+              const quint32 requests = 1);
+
+    /*! Get the next frame to send.
+     *
+     * \param allowData If false, only control frames are returned.
+     * \return false if there is nothing to send.
+     */
+    bool pop(Item& item, const bool allowData);
+
+    bool empty() const noexcept;
+    bool hasQueued(const quint32 channel) const;
+    ChannelStats getStats(const quint32 channel) const;
+    const std::map<quint32, ChannelStats>& getStats() const noexcept { return stats_; }
+
+    // Forget the statistics for a channel that is no longer in use
+    void forget(const quint32 channel);
+
+    // Drop everything that is queued
+    void clear();
+
+private:
+    struct Queue {
+        std::deque<Item> items;
+        size_t deficit = {};
+    };
+
+    void take(Queue& queue, Item& item);
+
+    std::map<quint32, Queue> queues_;
+    std::map<quint32, ChannelStats> stats_;
+    std::deque<quint32> active_; // Data channels with queued frames, in round-robin order
+    bool newTurn_ = true;
+    const size_t quantum_;
+};
+
+}} // namespaces
+
+#endif // FRAMESCHEDULER_H
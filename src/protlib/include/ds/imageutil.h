@@ -2,13 +2,14 @@
 #define IMAGEUTIL_H
 
 #include <QImage>
-#include <QJsonObject>
+#include <QCborMap>
 
 namespace ds {
 namespace prot {
 
-QJsonObject toJson(const QImage& image);
-QImage toQimage(const QJsonObject& object);
+// Add the image as height, width and r, g, b planes to a control message
+void addImage(QCborMap& msg, const QImage& image);
+QImage toQimage(const QCborMap& msg);
 
 }} // namespaces
 
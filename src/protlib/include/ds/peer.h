@@ -3,9 +3,18 @@
 
 #include <array>
 #include <cassert>
+#include <chrono>
+#include <set>
+#include <vector>
+
+#include <QCborMap>
 
 #include "ds/protocolmanager.h"
 #include "ds/connectionsocket.h"
+#include "ds/frame.h"
+#include "ds/framescheduler.h"
+#include "ds/framecompressor.h"
+#include "ds/controlcodec.h"
 #include "ds/peerconnection.h"
 #include "ds/file.h"
 
@@ -22,6 +31,11 @@ public:
     using data_t = crypto::MemoryView<uint8_t>;
     using stream_state_t = crypto_secretstream_xchacha20poly1305_state;
     static constexpr size_t crypt_bytes = crypto_secretstream_xchacha20poly1305_ABYTES;
+
+    // Highest version of the frame format we support.
+    // Version 1: Encrypted 2 byte length | Encrypted header and payload (max 64 KB)
+    // Version 2: 4 byte length | One AEAD with flags, varint channel, varint id and payload
+    static constexpr uint8_t protocol_version = 2;
     enum class InState {
         DISABLED,
         CHUNK_SIZE,
@@ -76,6 +90,8 @@ public:
         mview_t signature;
     };
 
+    using Frame = prot::Frame;
+
     class Channel {
     public:
         using ptr_t = std::shared_ptr<Channel>;
@@ -114,11 +130,34 @@ public slots:
     virtual void authorize(bool /*authorize*/) override {}
 
     // Send a request to a connected peer over the encrypted stream
-    // Returns a unique id for the request (within the scope of this peer)
-    uint64_t send(const QJsonDocument& json);
+    // Returns a non-zero sequence number for the queued frame. The request
+    // id on the wire is assigned when the frame is sent, so the ids are in order.
+    uint64_t send(const QCborMap& msg);
 
     // Final is true for the last block of a file-transfer to indicate EOF.
-    uint64_t send(const void *data, const size_t bytes, const quint32 channel, const bool final = false);
+    // A batch of /requests/ items gets one request id per item.
+    uint64_t send(const void *data, const size_t bytes, const quint32 channel,
+                  const bool final = false, const quint32 requests = 1);
+
+    // Get a pooled frame with room for /payloadBytes/ bytes of payload.
+    Frame createFrame(const size_t payloadBytes);
+
+    // Encrypt and send a frame. The frame's buffer is returned to the pool.
+    uint64_t send(Frame& frame, const quint32 channel, const bool final = false,
+                  const quint32 requests = 1);
+
+    // Queue depth, wait time and traffic for an outgoing channel
+    FrameScheduler::ChannelStats getChannelStats(const quint32 channel) const;
+    FrameCompressor::Stats getCompressionStats(const quint32 channel) const;
+
+    // The frame format negotiated in Hello/Olleh
+    uint8_t getProtocolVersion() const noexcept { return protocolVersion_; }
+
+    // The largest payload that fits in one frame with the negotiated version
+    size_t getMaxFramePayload() const noexcept;
+
+    // True if the peer understands "Pause" and "Continue" for incoming files
+    bool canPauseTransfers() const noexcept;
 
 signals:
     void incomingPeer(const std::shared_ptr<PeerConnection>& peer);
@@ -131,16 +170,47 @@ private slots:
 protected:
     void onReceivedData(const quint32 channel, const quint64 id,
                         const mview_t& data, const bool final);
-    void onReceivedJson(const quint64 id, const mview_t& data);
+    void onReceivedControl(const quint64 id, const mview_t& data);
+    void emitAddme(const quint64 id, const QCborMap& msg);
+    void emitAck(const quint64 id, const QCborMap& msg);
+    void emitMessage(const quint64 id, const QCborMap& msg);
+    void emitMessageBatch(const quint64 id, const QCborMap& msg);
+    void emitFileOffer(const quint64 id, const QCborMap& msg);
+    void emitFileOffers(const quint64 id, const QCborMap& msg);
+    void emitAvatar(const quint64 id, const QCborMap& msg);
+    void emitUserInfo(const quint64 id, const QCborMap& msg);
+    void onReceivedFeatures(const QCborMap& msg);
+    void onReceivedFileHashes(const QCborMap& msg);
+    void onReceivedFileSignatures(const QCborMap& msg);
+    void dropPeerSignatures(const quint32 channelId);
+    void onReceivedFlowControl(const QCborMap& msg);
+    void sendFeatures();
+    QCborMap toMessageMap(const core::Message& message) const;
+    size_t sendBatch(const ControlCodec::Type type, const QString& key, const QCborArray& items);
+    QCborMap toFileOfferMap(core::File& file) const;
+    void flushFileAcks();
     void enableEncryptedStream();
     void wantChunkSize();
     void wantChunkData(const size_t bytes);
     void processStream(const data_t& data);
     void prepareEncryption(stream_state_t& state, mview_t& header, mview_t& key);
     void prepareDecryption(stream_state_t& state, const mview_t& header, const mview_t& key);
-    void decrypt(mview_t& data, const mview_t& ciphertext, bool& final);
+    void decrypt(mview_t& data, const mview_t& ciphertext, bool& final,
+                 const mview_t& additionalData = {});
+    BufferPool::buffer_t sealFrameV1(Frame& frame, const quint32 channel,
+                                     const quint64 requestId, const unsigned char tag);
+    BufferPool::buffer_t sealFrameV2(Frame& frame, const quint32 channel,
+                                     const quint64 requestId, const unsigned char tag);
+    void pump();
+    bool tryPump();
+    mview_t openFrameV1(Frame& frame, const data_t& ciphertext,
+                        quint32& channel, quint64& id, bool& final);
+    mview_t openFrameV2(Frame& frame, const data_t& ciphertext,
+                        quint32& channel, quint64& id, bool& final);
+    void setProtocolVersion(const uint8_t version);
     QByteArray safePayload(const mview_t& data);
-    quint32 createChannel(const core::File& file);
+    quint32 createChannel(const core::File& file, const bool allowResume = false,
+                          const bool allowDelta = false);
     uint64_t startReceive(core::File& file);
     uint64_t startSend(core::File& file);
     void useConnection(ConnectionSocket *cc);
@@ -150,10 +220,25 @@ protected:
     core::ConnectData connectionData_;
     stream_state_t stateIn = {};
     stream_state_t stateOut = {};
-    quint64 request_id_ = {}; // Counter for outgoing requests
+    quint64 request_id_ = {}; // Counter for outgoing requests, assigned as they are sent
+    quint64 queued_ = {}; // Counter for frames handed to the scheduler
+    uint8_t protocolVersion_ = 1;
+    std::array<uint8_t, 4> inFrameLen_ = {}; // Authenticated length of the v2 frame we are reading
     quint32 nextInchannel_ = 1;
     std::map<quint32, Channel::ptr_t> outChannels_;
     std::map<quint32, Channel::ptr_t> inChannels_;
+    FrameScheduler scheduler_;
+    FrameCompressor compressor_;
+    std::set<QString> peerFeatures_; // From the peers "Features" message
+    std::set<quint32> pausedChannels_; // Outgoing channels the receiver has paused
+    qint64 inlineFileBytes_ = {}; // Largest file we can send inline with the offer
+    struct PeerSignature {
+        quint32 channel = {};
+        core::DeltaBasis basis;
+        std::chrono::steady_clock::time_point received;
+    };
+    std::map<QByteArray, PeerSignature> peerSignatures_; // The receiver's signatures, by file id
+    std::vector<std::pair<QString, QCborMap>> pendingFileAcks_; // Status, parameters
     bool notificationsDisabled_ = false;
 
     // PeerConnection interface
@@ -168,10 +253,15 @@ public:
     bool isConnected() const noexcept override;
     uint64_t sendUserInfo(const core::UserInfo &userInfo) override;
     uint64_t sendMessage(const core::Message &message) override;
+    uint64_t sendMessages(const std::vector<core::Message::ptr_t>& messages) override;
+    uint64_t sendMessageAcks(const QString& status, const std::vector<QByteArray>& messageIds) override;
     uint64_t sendAvatar(const QImage& avatar) override;
-    uint64_t offerFile(const core::File& file) override;
+    uint64_t offerFile(core::File& file) override;
+    uint64_t offerFiles(const std::vector<core::File::ptr_t>& files) override;
+    size_t getMaxFilesInOffer() const noexcept override;
     uint64_t startTransfer(core::File& file) override;
     uint64_t sendSome(core::File& file) override;
+    bool canReceiveDirectories() const noexcept override;
     void disableNotifications() override;
 };
 
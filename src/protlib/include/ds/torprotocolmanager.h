@@ -41,6 +41,9 @@ protected:
 
     std::map<QUuid, TorServiceInterface::ptr_t> services_;
 
+    // Shared by the services' outgoing connections
+    LegacyPeers::ptr_t legacyPeers_ = std::make_shared<LegacyPeers>();
+
     // ProtocolManager interface
 public slots:
     uint64_t sendAddme(const core::AddmeReq& req) override;
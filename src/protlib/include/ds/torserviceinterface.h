@@ -11,6 +11,7 @@
 #include "ds/torsocketlistener.h"
 #include "ds/connectionsocket.h"
 #include "ds/dscert.h"
+#include "ds/dsclient.h"
 #include "ds/peer.h"
 
 namespace ds {
@@ -45,7 +46,8 @@ public:
 
     TorServiceInterface(crypto::DsCert::ptr_t cert,
                         const QByteArray& address,
-                        const QUuid& identityId);
+                        const QUuid& identityId,
+                        LegacyPeers::ptr_t legacyPeers);
     virtual ~TorServiceInterface() override = default;
 
     /*! Start a service.
@@ -95,6 +97,7 @@ private:
     std::map<QUuid, Peer::ptr_t> peers_;
     const QString address_;
     const QUuid identityId_;
+    LegacyPeers::ptr_t legacyPeers_;
 };
 
 }} //namespaces
@@ -38,7 +38,11 @@ SOURCES += \
     src/torsocketlistener.cpp \
     src/peer.cpp \
     src/dsserver.cpp \
-     src/imageutil.cpp
+     src/imageutil.cpp \
+    src/framescheduler.cpp \
+    src/controlcodec.cpp \
+    src/framecompressor.cpp \
+    src/filewriter.cpp
 
 HEADERS += \
     include/ds/torprotocolmanager.h \
@@ -48,7 +52,14 @@ HEADERS += \
     include/ds/torsocketlistener.h \
     include/ds/peer.h \
     include/ds/dsserver.h \
-    include/ds/imageutil.h
+    include/ds/imageutil.h \
+    include/ds/bufferpool.h \
+    include/ds/chunksizer.h \
+    include/ds/frame.h \
+    include/ds/framescheduler.h \
+    include/ds/controlcodec.h \
+    include/ds/framecompressor.h \
+    include/ds/filewriter.h
 
 
 INCLUDEPATH += $$PWD/include \
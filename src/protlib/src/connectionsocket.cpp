@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cassert>
 
 #include "include/ds/connectionsocket.h"
 #include "logfault/logfault.h"
@@ -29,16 +31,16 @@ ConnectionSocket::ConnectionSocket(QByteArray host,
 //            this, SLOT(onSocketFailed(SocketError)));
 
     connect(this, &ConnectionSocket::readyRead, this, [this]() {
-        inData += readAll();
+        readInput();
         processInput();
     });
 
     connect(this, &ConnectionSocket::bytesWritten,
             this, [this](qint64 bytes) {
 
-        Q_UNUSED(bytes)
+        updateDrainRate(bytes);
 
-        if (outData.isEmpty()) {
+        if (outQueue_.empty()) {
             emit outputBufferEmptied();
         } else {
             sendMore();
@@ -56,7 +58,12 @@ ConnectionSocket::~ConnectionSocket()
 void ConnectionSocket::wantBytes(size_t bytesRequested)
 {
     bytesWanted_ = bytesRequested;
-    processInput();
+
+    // If we are called from a haveBytes() handler, the loop in
+    // processInput() will deliver the next slice when the handler returns.
+    if (!processingInput_) {
+        processInput();
+    }
 }
 
 void ConnectionSocket::connectToDefaultHost()
@@ -88,48 +95,194 @@ void ConnectionSocket::onSocketFailed(SocketError socketError)
     emit socketFailed(uuid, socketError);
 }
 
+void ConnectionSocket::readInput()
+{
+    while(true) {
+        if (inChunks_.empty() || (inTail_ == inChunks_.back().size())) {
+            inChunks_.push_back(bufferPool_->take(inChunkSize_));
+            inTail_ = 0;
+        }
+
+        auto& chunk = inChunks_.back();
+        const auto bytes = read(reinterpret_cast<char *>(chunk.data() + inTail_),
+                                static_cast<qint64>(chunk.size() - inTail_));
+        if (bytes <= 0) {
+            return;
+        }
+
+        inTail_ += static_cast<size_t>(bytes);
+        inBytes_ += static_cast<size_t>(bytes);
+    }
+}
+
 void ConnectionSocket::processInput()
 {
-    if (bytesWanted_ && (static_cast<size_t>(inData.size()) >= bytesWanted_)) {
-        const data_t data{inData.data(), bytesWanted_};
+    processingInput_ = true;
+
+    while (bytesWanted_ && (inBytes_ >= bytesWanted_)) {
+        const auto bytes = bytesWanted_;
+        buffer_t scratch;
+        data_t data;
 
-        QByteArray my_data;
-        if (bytesWanted_ == static_cast<size_t>(inData.size())) {
-            my_data.swap(inData);
-            assert(inData.isEmpty());
+        if (contiguousInput() >= bytes) {
+            // The common case. Just point into the chunk.
+            data.assign(inChunks_.front().data() + inHead_, bytes);
         } else {
-            my_data = inData.left(static_cast<int>(bytesWanted_));
-            inData.remove(0, static_cast<int>(bytesWanted_));
+            // The data spans chunks. Linearize it.
+            scratch = bufferPool_->take(bytes);
+            copyInput(scratch.data(), bytes);
+            data.assign(scratch.data(), bytes);
         }
 
-        // We may be called recursively, so InData must be updated before we emit
+        // The handler will normally ask for more bytes, so the state
+        // must be updated before we emit.
+        consumeInput(bytes);
         bytesWanted_ = 0;
-        emit haveBytes(my_data);
+        emit haveBytes(data);
+
+        bufferPool_->give(move(scratch));
+        recycleInput();
     }
 
+    processingInput_ = false;
+
     // This should never happen, but just in case...
-    if (static_cast<size_t>(inData.size()) > maxInDataSize) {
+    if (inBytes_ > maxInDataSize) {
         LFLOG_ERROR << "To much data ("
-                   << inData.size()
+                   << inBytes_
                    << ") in incoming buffer on " << getUuid().toString();
         close();
     }
 }
 
-void ConnectionSocket::sendMore()
+size_t ConnectionSocket::contiguousInput() const noexcept
+{
+    if (inChunks_.empty()) {
+        return 0;
+    }
+
+    const auto end = (inChunks_.size() == 1) ? inTail_ : inChunks_.front().size();
+    return end - inHead_;
+}
+
+void ConnectionSocket::copyInput(uint8_t *dst, size_t bytes) const
+{
+    assert(bytes <= inBytes_);
+    auto offset = inHead_;
+    for(size_t i = 0; bytes; ++i) {
+        assert(i < inChunks_.size());
+        const auto& chunk = inChunks_.at(i);
+        const auto end = (i + 1 == inChunks_.size()) ? inTail_ : chunk.size();
+        const auto segment = min(bytes, end - offset);
+        memcpy(dst, chunk.data() + offset, segment);
+        dst += segment;
+        bytes -= segment;
+        offset = 0;
+    }
+}
+
+void ConnectionSocket::consumeInput(size_t bytes)
+{
+    assert(bytes <= inBytes_);
+    inBytes_ -= bytes;
+
+    while(bytes) {
+        const auto segment = min(bytes, contiguousInput());
+        inHead_ += segment;
+        bytes -= segment;
+
+        if (inChunks_.size() > 1 && (inHead_ == inChunks_.front().size())) {
+            // A slice we are about to emit may point into this chunk,
+            // so it can't go back to the pool until the handler is done.
+            retiredChunks_.push_back(move(inChunks_.front()));
+            inChunks_.pop_front();
+            inHead_ = 0;
+        }
+    }
+
+    if (inBytes_ == 0 && (inChunks_.size() == 1)) {
+        // Start over at the beginning of the chunk
+        inHead_ = inTail_ = 0;
+    }
+}
+
+void ConnectionSocket::recycleInput()
+{
+    for(auto& chunk : retiredChunks_) {
+        bufferPool_->give(move(chunk));
+    }
+    retiredChunks_.clear();
+}
+
+void ConnectionSocket::write(buffer_t &&buffer)
 {
-    if (outData.isEmpty()) {
+    if (buffer.empty()) {
         return;
     }
 
-    auto written = QTcpSocket::write(outData);
-    if (written > 0) {
-        if (written == outData.size()) {
-            outData.clear();
-        } else {
-            outData.remove(0, static_cast<int>(written));
+    if (drainStart_ == chrono::steady_clock::time_point{}) {
+        // We were idle. Start a new measurement.
+        drainStart_ = chrono::steady_clock::now();
+        drainBytes_ = 0;
+    }
+
+    outQueueBytes_ += buffer.size();
+    outQueue_.push_back(std::move(buffer));
+    sendMore();
+}
+
+void ConnectionSocket::sendMore()
+{
+    // QTcpSocket copies everything we write into it's own buffer, so we
+    // only feed it enough to keep the pipe busy. The rest stays in
+    // our pooled buffers until bytesWritten() asks for more.
+    while (!outQueue_.empty() && (bytesToWrite() < maxSocketBacklog_)) {
+        auto& buffer = outQueue_.front();
+        assert(outOffset_ < buffer.size());
+        const auto remaining = buffer.size() - outOffset_;
+
+        const auto written = QTcpSocket::write(
+                    reinterpret_cast<const char *>(buffer.data() + outOffset_),
+                    static_cast<qint64>(remaining));
+
+        if (written <= 0) {
+            return;
+        }
+
+        outOffset_ += static_cast<size_t>(written);
+        outQueueBytes_ -= static_cast<size_t>(written);
+
+        if (outOffset_ == buffer.size()) {
+            bufferPool_->give(std::move(buffer));
+            outQueue_.pop_front();
+            outOffset_ = 0;
         }
     }
 }
 
+void ConnectionSocket::updateDrainRate(const qint64 bytes)
+{
+    if (drainStart_ == chrono::steady_clock::time_point{}) {
+        return;
+    }
+
+    drainBytes_ += bytes;
+
+    const auto now = chrono::steady_clock::now();
+    const auto elapsed = chrono::duration<double>(now - drainStart_).count();
+    const bool idle = outQueue_.empty() && (bytesToWrite() == 0);
+
+    if ((elapsed >= 0.1) || (idle && (elapsed > 0))) {
+        const auto sample = static_cast<double>(drainBytes_) / elapsed;
+        drainRate_ = drainRate_ > 0 ? (drainRate_ * 0.7) + (sample * 0.3) : sample;
+        drainBytes_ = 0;
+        drainStart_ = now;
+    }
+
+    if (idle) {
+        // Don't count the time we have nothing to send
+        drainStart_ = {};
+    }
+}
+
 }}
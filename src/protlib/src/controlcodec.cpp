@@ -0,0 +1,366 @@
+
+#include <array>
+#include <map>
+
+#include <QCborArray>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#include "ds/errors.h"
+#include "include/ds/controlcodec.h"
+
+#include "logfault/logfault.h"
+
+using namespace std;
+
+namespace ds {
+namespace prot {
+
+using namespace core;
+
+namespace {
+
+enum class Kind {
+    TEXT,
+    BYTES, // base64 in Json
+    NUMBER,
+    NUMBER_AS_TEXT, // Sent as a string in Json
+    LIST
+};
+
+struct Field {
+    int key;
+    const char *name;
+    Kind kind;
+};
+
+// The integer keys are part of the wire format. Never change or re-use them.
+const array<Field, 39> fields = {{
+    {1, "type", Kind::NUMBER},
+    {2, "what", Kind::TEXT},
+    {3, "status", Kind::TEXT},
+    {4, "nick", Kind::TEXT},
+    {5, "message", Kind::TEXT},
+    {6, "address", Kind::TEXT},
+    {7, "conversation", Kind::BYTES},
+    {8, "message-id", Kind::BYTES},
+    {9, "date", Kind::TEXT},
+    {10, "content", Kind::TEXT},
+    {11, "encoding", Kind::TEXT},
+    {12, "from", Kind::BYTES},
+    {13, "signature", Kind::BYTES},
+    {14, "file-id", Kind::BYTES},
+    {15, "name", Kind::TEXT},
+    {16, "size", Kind::NUMBER_AS_TEXT},
+    {17, "rest", Kind::NUMBER_AS_TEXT},
+    {18, "file-type", Kind::TEXT},
+    {19, "sha256", Kind::BYTES},
+    {20, "nick-name", Kind::TEXT},
+    {21, "height", Kind::NUMBER},
+    {22, "width", Kind::NUMBER},
+    {23, "r", Kind::BYTES},
+    {24, "g", Kind::BYTES},
+    {25, "b", Kind::BYTES},
+    {26, "data", Kind::TEXT},
+    {27, "channel", Kind::NUMBER_AS_TEXT},
+    {28, "features", Kind::LIST},
+    {29, "messages", Kind::LIST},
+    {30, "message-ids", Kind::LIST},
+    {31, "files", Kind::LIST},
+    {32, "rest-hash", Kind::BYTES},
+    {33, "tree-hash", Kind::BYTES},
+    {34, "leaf-size", Kind::NUMBER_AS_TEXT},
+    {35, "leaf-hashes", Kind::BYTES},
+    {36, "file-content", Kind::BYTES},
+    {37, "inline-file-bytes", Kind::NUMBER_AS_TEXT},
+    {38, "block-size", Kind::NUMBER_AS_TEXT},
+    {39, "signatures", Kind::BYTES},
+}};
+
+const array<const char *, 12> type_names = {{
+    "", "AddMe", "Ack", "Message", "IncomingFile", "SetAvatar", "UserInfo", "Features",
+    "MessageBatch", "IncomingFiles", "FileHashes", "FileSignatures"
+}};
+
+const Field *findField(const QString& name) {
+    static const auto lookup = [] {
+        map<QString, const Field *> m;
+        for(const auto& f : fields) {
+            m[f.name] = &f;
+        }
+        return m;
+    }();
+
+    const auto it = lookup.find(name);
+    return it == lookup.end() ? nullptr : it->second;
+}
+
+const Field *findField(const qint64 key) {
+    static const auto lookup = [] {
+        map<qint64, const Field *> m;
+        for(const auto& f : fields) {
+            m[f.key] = &f;
+        }
+        return m;
+    }();
+
+    const auto it = lookup.find(key);
+    return it == lookup.end() ? nullptr : it->second;
+}
+
+ControlCodec::Type toType(const QString& name) {
+    for(size_t i = 1; i < type_names.size(); ++i) {
+        if (name == type_names[i]) {
+            return static_cast<ControlCodec::Type>(i);
+        }
+    }
+    return ControlCodec::Type::UNKNOWN;
+}
+
+QJsonObject toJsonObject(const QCborMap& msg);
+QCborMap fromJsonObject(const QJsonObject& object);
+QCborMap toWireMap(const QCborMap& msg);
+QCborMap fromWireMap(const QCborMap& map);
+
+QJsonValue toJsonValue(const Field *field, const QCborValue& value) {
+    if (value.isByteArray()) {
+        return QString{value.toByteArray().toBase64()};
+    }
+
+    if (value.isInteger() && field && (field->kind == Kind::NUMBER_AS_TEXT)) {
+        return QString::number(value.toInteger());
+    }
+
+    if (value.isMap()) {
+        return toJsonObject(value.toMap());
+    }
+
+    if (value.isArray()) {
+        QJsonArray array;
+        for(const auto& v : value.toArray()) {
+            array.append(toJsonValue(field, v));
+        }
+        return array;
+    }
+
+    return value.toJsonValue();
+}
+
+QCborValue fromJsonValue(const Field *field, const QJsonValue& value) {
+    if (value.isObject()) {
+        return fromJsonObject(value.toObject());
+    }
+
+    if (value.isArray()) {
+        QCborArray array;
+        for(const auto& v : value.toArray()) {
+            array.append(fromJsonValue(field, v));
+        }
+        return array;
+    }
+
+    if (field) {
+        switch(field->kind) {
+        case Kind::BYTES:
+            return QByteArray::fromBase64(value.toString().toUtf8());
+        case Kind::NUMBER_AS_TEXT:
+            if (value.isString()) {
+                return value.toString().toLongLong();
+            }
+            return static_cast<qint64>(value.toDouble());
+        case Kind::NUMBER:
+            return static_cast<qint64>(value.toDouble());
+        case Kind::TEXT:
+        case Kind::LIST:
+            break;
+        }
+    }
+
+    return QCborValue::fromJsonValue(value);
+}
+
+QJsonObject toJsonObject(const QCborMap& msg) {
+    QJsonObject json;
+    for(auto it = msg.constBegin(); it != msg.constEnd(); ++it) {
+        const auto name = it.key().toString();
+        if (name == "type") {
+            json.insert(name, ControlCodec::getTypeName(static_cast<ControlCodec::Type>(it.value().toInteger())));
+            continue;
+        }
+
+        json.insert(name, toJsonValue(findField(name), it.value()));
+    }
+
+    return json;
+}
+
+QCborMap fromJsonObject(const QJsonObject& object) {
+    QCborMap msg;
+    for(auto it = object.constBegin(); it != object.constEnd(); ++it) {
+        if (it.key() == "type") {
+            msg.insert(QStringLiteral("type"), static_cast<qint64>(toType(it.value().toString())));
+            continue;
+        }
+        msg.insert(it.key(), fromJsonValue(findField(it.key()), it.value()));
+    }
+
+    return msg;
+}
+
+// Nested maps and lists of maps use integer keys as well
+QCborValue toWireValue(const QCborValue& value) {
+    if (value.isMap()) {
+        return toWireMap(value.toMap());
+    }
+
+    if (value.isArray()) {
+        QCborArray array;
+        for(const auto& v : value.toArray()) {
+            array.append(toWireValue(v));
+        }
+        return array;
+    }
+
+    return value;
+}
+
+QCborValue fromWireValue(const QCborValue& value) {
+    if (value.isMap()) {
+        return fromWireMap(value.toMap());
+    }
+
+    if (value.isArray()) {
+        QCborArray array;
+        for(const auto& v : value.toArray()) {
+            array.append(fromWireValue(v));
+        }
+        return array;
+    }
+
+    return value;
+}
+
+QCborMap toWireMap(const QCborMap& msg) {
+    QCborMap cbor;
+    for(auto it = msg.constBegin(); it != msg.constEnd(); ++it) {
+        const auto name = it.key().toString();
+        if (const auto field = findField(name)) {
+            cbor.insert(field->key, toWireValue(it.value()));
+        } else {
+            cbor.insert(name, toWireValue(it.value()));
+        }
+    }
+
+    return cbor;
+}
+
+QCborMap fromWireMap(const QCborMap& map) {
+    QCborMap msg;
+    for(auto it = map.constBegin(); it != map.constEnd(); ++it) {
+        if (it.key().isInteger()) {
+            if (const auto field = findField(it.key().toInteger())) {
+                msg.insert(QString{field->name}, fromWireValue(it.value()));
+            } else {
+                // Probably from a newer version
+                LFLOG_TRACE << "Ignoring unknown CBOR key " << it.key().toInteger();
+            }
+        } else {
+            msg.insert(it.key().toString(), fromWireValue(it.value()));
+        }
+    }
+
+    return msg;
+}
+
+QByteArray encodeJson(const QCborMap& msg) {
+    return QJsonDocument{toJsonObject(msg)}.toJson(QJsonDocument::Compact);
+}
+
+QByteArray encodeCbor(const QCborMap& msg) {
+    return toWireMap(msg).toCborValue().toCbor();
+}
+
+QCborMap decodeJson(const QByteArray& data) {
+    const auto json = QJsonDocument::fromJson(data);
+    if (!json.isObject()) {
+        throw Error("Not Json");
+    }
+
+    return fromJsonObject(json.object());
+}
+
+QCborMap decodeCbor(const QByteArray& data) {
+    QCborParserError error;
+    const auto cbor = QCborValue::fromCbor(data, &error);
+    if (error.error != QCborError::NoError || !cbor.isMap()) {
+        throw Error("Not a CBOR map");
+    }
+
+    return fromWireMap(cbor.toMap());
+}
+
+} // anonymous namespace
+
+QCborMap ControlCodec::create(const ControlCodec::Type type)
+{
+    QCborMap msg;
+    msg.insert(QStringLiteral("type"), static_cast<qint64>(type));
+    return msg;
+}
+
+ControlCodec::Type ControlCodec::getType(const QCborMap &msg)
+{
+    const auto type = msg.value(QStringLiteral("type")).toInteger();
+    if ((type <= 0) || (static_cast<size_t>(type) >= type_names.size())) {
+        return Type::UNKNOWN;
+    }
+    return static_cast<Type>(type);
+}
+
+QString ControlCodec::getTypeName(const ControlCodec::Type type)
+{
+    const auto ix = static_cast<size_t>(type);
+    if (ix >= type_names.size()) {
+        return {};
+    }
+    return type_names[ix];
+}
+
+QByteArray ControlCodec::encode(const QCborMap &msg, const ControlCodec::Encoding encoding)
+{
+    return encoding == Encoding::CBOR ? encodeCbor(msg) : encodeJson(msg);
+}
+
+QCborMap ControlCodec::decode(const char *data, const size_t size)
+{
+    if (size == 0) {
+        throw Error("Empty control message");
+    }
+
+    // fromJson() and fromCbor() make their own copies, so we don't need to.
+    const auto bytes = QByteArray::fromRawData(data, static_cast<int>(size));
+
+    // A Json object starts with '{'. A CBOR map has major type 5.
+    const auto first = static_cast<uint8_t>(data[0]);
+    if ((first & 0xe0) == 0xa0) {
+        return decodeCbor(bytes);
+    }
+
+    return decodeJson(bytes);
+}
+
+QString ControlCodec::toText(const QCborValue &value)
+{
+    if (value.isByteArray()) {
+        return value.toByteArray().toBase64();
+    }
+
+    if (value.isInteger()) {
+        return QString::number(value.toInteger());
+    }
+
+    return value.toVariant().toString();
+}
+
+}} // namespaces
@@ -2,6 +2,8 @@
 #include <QHostAddress>
 #include <QNetworkProxy>
 
+#include <chrono>
+#include <map>
 #include <vector>
 #include <sodium.h>
 #include "include/ds/dsclient.h"
@@ -12,10 +14,71 @@ namespace prot {
 
 using namespace  std;
 
+namespace {
+
+// Drops in a row, while we wait for the Olleh, before we fall back to version 1
+constexpr size_t legacy_peer_drops = 3;
+
+// The peer may be upgraded, so we offer the newer version again after a while
+constexpr auto legacy_peer_timeout = chrono::minutes(30);
+
+} // anonymous namespace
+
+bool LegacyPeers::isLegacy(const QByteArray &address)
+{
+    const auto it = peers_.find(address);
+    if ((it == peers_.end()) || (it->second.legacyUntil == clock_t::time_point{})) {
+        return false;
+    }
+
+    if (clock_t::now() >= it->second.legacyUntil) {
+        peers_.erase(it);
+        return false;
+    }
+
+    return true;
+}
+
+void LegacyPeers::onOlleh(const QByteArray &address, const uint8_t helloVersion,
+                          const uint8_t ollehVersion)
+{
+    if (ollehVersion > 1) {
+        peers_.erase(address);
+    } else if (helloVersion > 1) {
+        // It understood our Hello, and chose version 1
+        setLegacy(address, peers_[address]);
+    }
+}
+
+void LegacyPeers::onDropped(const QByteArray &address, const uint8_t helloVersion)
+{
+    if (helloVersion <= 1) {
+        return;
+    }
+
+    auto& entry = peers_[address];
+    if (++entry.drops >= legacy_peer_drops) {
+        LFLOG_DEBUG << "Connections to " << address << " were dropped " << entry.drops
+                    << " times in a row after we offered protocol version "
+                    << static_cast<unsigned int>(helloVersion) << '.';
+        setLegacy(address, entry);
+    }
+}
+
+void LegacyPeers::setLegacy(const QByteArray &address, LegacyPeers::Entry &entry)
+{
+    LFLOG_DEBUG << "Will use protocol version 1 with " << address << " for a while.";
+    entry.drops = {};
+    entry.legacyUntil = clock_t::now() + legacy_peer_timeout;
+}
+
 DsClient::DsClient(ConnectionSocket::ptr_t connection,
-                   core::ConnectData connectionData)
+                   core::ConnectData connectionData,
+                   LegacyPeers::ptr_t legacyPeers)
     : Peer{move(connection), move(connectionData)}
+    , legacyPeers_{move(legacyPeers)}
 {
+    assert(legacyPeers_);
     initConnections();
     startConnectRetryTimer();
 }
@@ -61,8 +124,11 @@ void DsClient::sayHello()
         return;
     }
 
+    // Announce the highest version we support, unless the server is known not to handle it
+    helloVersion_ = legacyPeers_->isLegacy(connectionData_.address) ? 1 : protocol_version;
+
     Hello hello;
-    hello.version.at(0) = '\1'; // Version of the hello structure
+    hello.version.at(0) = helloVersion_; // Version of the hello structure
 
     prepareEncryption(stateOut, hello.header, hello.key);
 
@@ -100,8 +166,9 @@ void DsClient::getHelloReply(const Peer::data_t &data)
         return;
     }
 
-    // Check version
-    if (olleh.version.at(0) != 1) {
+    // Check version. The server must reply with a version we announced support for.
+    const auto version = olleh.version.at(0);
+    if ((version < 1) || (version > helloVersion_)) {
         LFLOG_ERROR << "Unsupported Olleh version "
                     << static_cast<unsigned int>(olleh.version.at(0))
                     << " from " << connection_->getUuid().toString();
@@ -119,6 +186,9 @@ void DsClient::getHelloReply(const Peer::data_t &data)
         return;
     }
 
+    legacyPeers_->onOlleh(connectionData_.address, helloVersion_, version);
+    setProtocolVersion(version);
+
     // At this point, any further outbound data must be encrypted
     prepareDecryption(stateIn, olleh.header, olleh.key);
     state_ = State::ENCRYPTED_STREAM;
@@ -179,6 +249,21 @@ void DsClient::initConnections()
             this, [this](const auto& data) {
         advance(data);
     });
+
+    connect(connection_.get(), &QTcpSocket::disconnected,
+            this, [this]() {
+        onDisconnectedWhileNegotiating();
+    });
+}
+
+void DsClient::onDisconnectedWhileNegotiating()
+{
+    if ((state_ == State::GET_OLLEH) && (helloVersion_ > 1)) {
+        LFLOG_DEBUG << "Connection " << getConnectionId().toString()
+                    << " was dropped after we offered protocol version "
+                    << static_cast<unsigned int>(helloVersion_);
+        legacyPeers_->onDropped(connectionData_.address, helloVersion_);
+    }
 }
 
 }} // namespaces
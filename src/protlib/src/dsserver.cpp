@@ -41,7 +41,7 @@ void DsServer::authorize(bool authorize)
                 << " is authorized to proceed. Setting up secure streams.";
 
     Olleh olleh;
-    olleh.version.at(0) = '\1';
+    olleh.version.at(0) = protocolVersion_; // Negotiated in getHello()
     prepareEncryption(stateOut, olleh.header, olleh.key);
 
     // Sign the payload
@@ -101,8 +101,9 @@ void DsServer::getHello(const data_t& data)
         return;
     }
     
-    // Check version
-    if (hello.version.at(0) != 1) {
+    // Check version. The client announces the highest version it supports.
+    const auto version = hello.version.at(0);
+    if (version < 1) {
         LFLOG_ERROR << "Unsupported Hello version "
                     << static_cast<unsigned int>(hello.version.at(0))
                     << " from " << connection_->getUuid().toString();
@@ -123,6 +124,9 @@ void DsServer::getHello(const data_t& data)
 
     connectionData_.contactsCert = crypto::DsCert::createFromPubkey(hello.pubkey.toByteArray());
 
+    // Use the highest version we both support
+    setProtocolVersion(version < protocol_version ? version : protocol_version);
+
     // At this point, any further inbound data is assumed to be encrypted
     prepareDecryption(stateIn, hello.header, hello.key);
 
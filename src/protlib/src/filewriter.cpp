@@ -0,0 +1,194 @@
+
+#include <cstring>
+
+#include "ds/filewriter.h"
+
+#ifdef Q_OS_LINUX
+#   include <fcntl.h>
+#endif
+
+#include "logfault/logfault.h"
+
+using namespace std;
+
+namespace ds {
+namespace prot {
+
+FileWriter::FileWriter(QIODevice &device, decoder_t decoder)
+    : device_{device}, file_{qobject_cast<QFile *>(&device)}
+    , decoder_{move(decoder)}
+{
+    thread_ = thread{[this] {
+        run();
+    }};
+}
+
+FileWriter::~FileWriter()
+{
+    {
+        lock_guard<mutex> lock{mutex_};
+        if (!finishing_) {
+            queue_.clear();
+            done_ = true;
+        }
+    }
+
+    cond_.notify_all();
+    thread_.join();
+}
+
+void FileWriter::preallocate(const qint64 size)
+{
+#ifdef Q_OS_LINUX
+    // Keep the size, so the file's size still tells how much we have written
+    const auto fd = file_ ? file_->handle() : -1;
+    if ((fd >= 0) && (size > file_->size())
+            && (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) != 0)) {
+        LFLOG_DEBUG << "Cannot preallocate " << size << " bytes for \""
+                    << file_->fileName() << "\": " << strerror(errno);
+    }
+#else
+    Q_UNUSED(size);
+#endif
+}
+
+bool FileWriter::write(const void *data, const size_t bytes, const size_t weight)
+{
+    const auto queued = weight ? weight : bytes;
+
+    unique_lock<mutex> lock{mutex_};
+    cond_.wait(lock, [this] {
+        return (queuedBytes_ < maxQueuedBytes) || failed_;
+    });
+
+    if (failed_) {
+        return false;
+    }
+
+    queue_.push_back({QByteArray{reinterpret_cast<const char *>(data), static_cast<int>(bytes)},
+                      queued});
+    queuedBytes_ += queued;
+    if (queuedBytes_ > highWatermark) {
+        behind_ = true;
+    }
+
+    lock.unlock();
+    cond_.notify_all();
+    return true;
+}
+
+void FileWriter::finish()
+{
+    {
+        lock_guard<mutex> lock{mutex_};
+        finishing_ = true;
+    }
+    cond_.notify_all();
+}
+
+bool FileWriter::isBehind() const
+{
+    lock_guard<mutex> lock{mutex_};
+    return behind_;
+}
+
+size_t FileWriter::getQueuedBytes() const
+{
+    lock_guard<mutex> lock{mutex_};
+    return queuedBytes_;
+}
+
+QString FileWriter::getName() const
+{
+    return file_ ? file_->fileName() : device_.objectName();
+}
+
+void FileWriter::run()
+{
+    while(true) {
+        deque<Chunk> batch;
+        bool finishing = false;
+
+        {
+            unique_lock<mutex> lock{mutex_};
+            cond_.wait(lock, [this] {
+                return !queue_.empty() || finishing_ || done_;
+            });
+
+            if (done_) {
+                return;
+            }
+
+            // finish() is called after the last write(), so if we see
+            // finishing_ here, this batch is the rest of the file.
+            batch.swap(queue_);
+            finishing = finishing_;
+        }
+
+        size_t written = {}; // Bytes taken off the queue
+        qint64 bytesOut = {};
+        for(const auto& chunk : batch) {
+            QString reason;
+            const QByteArray *data = &chunk.data;
+            if (decoder_) {
+                decoded_.clear();
+                if (!decoder_(chunk.data, decoded_, reason)) {
+                    LFLOG_ERROR << "Failed to decode the data for \"" << getName()
+                                << "\": " << reason;
+                    data = nullptr;
+                } else {
+                    data = &decoded_;
+                }
+            }
+
+            if (data && (device_.write(*data) != data->size())) {
+                reason = device_.errorString();
+                LFLOG_ERROR << "Failed to write to \"" << getName()
+                            << "\": " << reason;
+                data = nullptr;
+            }
+
+            if (!data) {
+                {
+                    lock_guard<mutex> lock{mutex_};
+                    failed_ = true;
+                    queue_.clear();
+                }
+                cond_.notify_all();
+                emit failed(reason);
+                return;
+            }
+            written += chunk.weight;
+            bytesOut += data->size();
+        }
+
+        unflushed_ += bytesOut;
+        if (file_ && (finishing || (unflushed_ >= flushBytes))) {
+            file_->flush();
+            unflushed_ = {};
+        }
+
+        bool caughtUp = false;
+        {
+            lock_guard<mutex> lock{mutex_};
+            queuedBytes_ -= written;
+            if (behind_ && (queuedBytes_ < lowWatermark)) {
+                behind_ = false;
+                caughtUp = true;
+            }
+        }
+        cond_.notify_all();
+
+        if (caughtUp) {
+            emit drained();
+        }
+
+        if (finishing) {
+            device_.close();
+            emit finished();
+            return;
+        }
+    }
+}
+
+}} // namespaces
@@ -0,0 +1,196 @@
+
+#include <array>
+#include <chrono>
+#include <cmath>
+
+#include <QByteArray>
+#include <QtEndian>
+
+#include "ds/errors.h"
+#include "include/ds/framecompressor.h"
+
+#include "logfault/logfault.h"
+
+using namespace std;
+
+namespace ds {
+namespace prot {
+
+using namespace core;
+
+namespace {
+
+using clock_t = chrono::steady_clock;
+
+double elapsedMs(const clock_t::time_point& start) {
+    return chrono::duration<double, milli>(clock_t::now() - start).count();
+}
+
+// qCompress() prefix the data with the original size as a 32 bit big endian value
+constexpr size_t size_prefix_bytes = 4;
+
+// Channel 0 carries the control messages
+constexpr quint32 control_channel = 0;
+
+} // anonymous namespace
+
+bool FrameCompressor::compress(Frame &frame, const quint32 channel)
+{
+    auto& ch = channels_[channel];
+    auto payload = frame.payload();
+    const bool isControl = (channel == control_channel);
+
+    if (!ch.enabled && (--ch.framesUntilReprobe == 0)) {
+        LFLOG_TRACE << "Probing channel #" << channel << " for compression again.";
+        ch.enabled = true;
+        ch.probed = false;
+        ch.poorResults = 0;
+    }
+
+    if (!ch.enabled || (payload.size() < minPayloadBytes)) {
+        ++ch.stats.skippedFrames;
+        return false;
+    }
+
+    const auto start = clock_t::now();
+
+    if (!ch.probed || isControl) {
+        ch.probed = true;
+        const auto entropy = probeEntropy(payload.cdata(), payload.size());
+        if (entropy > maxEntropy) {
+            if (!isControl) {
+                LFLOG_TRACE << "Not compressing channel #" << channel
+                            << " for now. Entropy is " << entropy << " bits per byte.";
+                disable(ch);
+            }
+            ++ch.stats.skippedFrames;
+            ch.stats.cpuMs += elapsedMs(start);
+            return false;
+        }
+    }
+
+    const auto compressed = qCompress(payload.cdata(), static_cast<int>(payload.size()), level_);
+
+    // Only keep the result if it saves at least 1/16 of the payload
+    const auto wanted = payload.size() - (payload.size() / 16);
+    if (static_cast<size_t>(compressed.size()) > wanted) {
+        if (!isControl && (++ch.poorResults >= maxPoorResults)) {
+            LFLOG_TRACE << "Not compressing channel #" << channel
+                        << " for now. The data does not compress.";
+            disable(ch);
+        }
+        ++ch.stats.skippedFrames;
+        ch.stats.cpuMs += elapsedMs(start);
+        return false;
+    }
+
+    ch.poorResults = 0;
+    ch.reprobeInterval = minReprobeFrames;
+
+    auto out = frame.alike(static_cast<size_t>(compressed.size()));
+    memcpy(out.payload().data(), compressed.constData(), static_cast<size_t>(compressed.size()));
+    out.setCompressed(true);
+
+    ++ch.stats.compressedFrames;
+    ch.stats.bytesIn += payload.size();
+    ch.stats.bytesOut += static_cast<uint64_t>(compressed.size());
+
+    frame = move(out);
+    ch.stats.cpuMs += elapsedMs(start);
+    return true;
+}
+
+Frame::mview_t FrameCompressor::decompress(Frame &frame, const Frame::mview_t &payload,
+                                           const quint32 channel, const size_t maxBytes)
+{
+    if (payload.size() <= size_prefix_bytes) {
+        throw Error("Compressed payload is too small");
+    }
+
+    // Check the size before qUncompress() allocates memory for it
+    const auto size = qFromBigEndian<quint32>(payload.cdata());
+    if (size > maxBytes) {
+        LFLOG_WARN << "Compressed payload on channel #" << channel
+                   << " would expand to " << size << " bytes";
+        throw Error("Compressed payload is too large");
+    }
+
+    const auto start = clock_t::now();
+    const auto data = qUncompress(payload.cdata(), static_cast<int>(payload.size()));
+    if (static_cast<size_t>(data.size()) != size) {
+        throw Error("Invalid compressed payload");
+    }
+
+    frame = frame.alike(size);
+    auto out = frame.payload();
+    memcpy(out.data(), data.constData(), size);
+
+    auto& stats = channels_[channel].stats;
+    ++stats.decompressedFrames;
+    stats.cpuMs += elapsedMs(start);
+
+    return out;
+}
+
+FrameCompressor::Stats FrameCompressor::getStats(const quint32 channel) const
+{
+    const auto it = channels_.find(channel);
+    if (it == channels_.end()) {
+        return {};
+    }
+    return it->second.stats;
+}
+
+FrameCompressor::Stats FrameCompressor::getTotals() const
+{
+    Stats totals;
+    for(const auto& it : channels_) {
+        const auto& s = it.second.stats;
+        totals.compressedFrames += s.compressedFrames;
+        totals.skippedFrames += s.skippedFrames;
+        totals.bytesIn += s.bytesIn;
+        totals.bytesOut += s.bytesOut;
+        totals.decompressedFrames += s.decompressedFrames;
+        totals.cpuMs += s.cpuMs;
+    }
+    return totals;
+}
+
+void FrameCompressor::forget(const quint32 channel)
+{
+    channels_.erase(channel);
+}
+
+void FrameCompressor::disable(FrameCompressor::Channel &ch)
+{
+    ch.enabled = false;
+    ch.framesUntilReprobe = ch.reprobeInterval;
+    // Not std::min(), as it would take the static member by reference
+    const auto next = ch.reprobeInterval * 2;
+    ch.reprobeInterval = (next > maxReprobeFrames) ? maxReprobeFrames : next;
+}
+
+double FrameCompressor::probeEntropy(const uint8_t *data, const size_t size, const size_t maxBytes)
+{
+    const auto len = min(size, maxBytes);
+    if (!len) {
+        return 0.0;
+    }
+
+    array<size_t, 256> histogram = {};
+    for(size_t i = 0; i < len; ++i) {
+        ++histogram[data[i]];
+    }
+
+    double entropy = {};
+    for(const auto count : histogram) {
+        if (count) {
+            const auto p = static_cast<double>(count) / static_cast<double>(len);
+            entropy -= p * log2(p);
+        }
+    }
+
+    return entropy;
+}
+
+}} // namespaces
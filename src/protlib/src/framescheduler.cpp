@@ -0,0 +1,154 @@
+
+#include <algorithm>
+#include <cassert>
+
+#include "include/ds/framescheduler.h"
+
+using namespace std;
+
+namespace ds {
+namespace prot {
+
+void FrameScheduler::push(Frame &&frame, const quint32 channel, const bool final,
+                          const quint32 requests)
+{
+    auto& queue = queues_[channel];
+    auto& stats = stats_[channel];
+
+    if (channel && queue.items.empty()) {
+        active_.push_back(channel);
+    }
+
+    ++stats.queuedFrames;
+    stats.queuedBytes += frame.buffer().size();
+
+    Item item;
+    item.frame = move(frame);
+    item.channel = channel;
+    item.final = final;
+    item.requests = requests;
+    item.queued = clock_t::now();
+    queue.items.push_back(move(item));
+}
+
+bool FrameScheduler::pop(FrameScheduler::Item &item, const bool allowData)
+{
+    // Control channel first, always
+    auto control = queues_.find(0);
+    if ((control != queues_.end()) && !control->second.items.empty()) {
+        take(control->second, item);
+        return true;
+    }
+
+    if (!allowData) {
+        return false;
+    }
+
+    // Deficit round-robin. Each channel gets /quantum_/ bytes of credit
+    // per turn, and can send as long as the next frame fits in its credit.
+    while(!active_.empty()) {
+        const auto channel = active_.front();
+        auto& queue = queues_.at(channel);
+
+        if (queue.items.empty()) {
+            queue.deficit = 0;
+            active_.pop_front();
+            newTurn_ = true;
+            continue;
+        }
+
+        if (newTurn_) {
+            queue.deficit += quantum_;
+            newTurn_ = false;
+        }
+
+        const auto bytes = queue.items.front().frame.buffer().size();
+        if (bytes <= queue.deficit) {
+            queue.deficit -= bytes;
+            take(queue, item);
+
+            if (queue.items.empty()) {
+                queue.deficit = 0;
+                active_.pop_front();
+                newTurn_ = true;
+            }
+            return true;
+        }
+
+        // Not enough credit. Give the next channel a turn.
+        active_.pop_front();
+        active_.push_back(channel);
+        newTurn_ = true;
+    }
+
+    return false;
+}
+
+bool FrameScheduler::empty() const noexcept
+{
+    for(const auto& it : queues_) {
+        if (!it.second.items.empty()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool FrameScheduler::hasQueued(const quint32 channel) const
+{
+    const auto it = queues_.find(channel);
+    return (it != queues_.end()) && !it->second.items.empty();
+}
+
+FrameScheduler::ChannelStats FrameScheduler::getStats(const quint32 channel) const
+{
+    const auto it = stats_.find(channel);
+    if (it == stats_.end()) {
+        return {};
+    }
+    return it->second;
+}
+
+void FrameScheduler::forget(const quint32 channel)
+{
+    if (hasQueued(channel)) {
+        return; // Still in use
+    }
+
+    queues_.erase(channel);
+    stats_.erase(channel);
+}
+
+void FrameScheduler::clear()
+{
+    queues_.clear();
+    active_.clear();
+    newTurn_ = true;
+
+    for(auto& it : stats_) {
+        it.second.queuedFrames = 0;
+        it.second.queuedBytes = 0;
+    }
+}
+
+void FrameScheduler::take(FrameScheduler::Queue &queue, FrameScheduler::Item &item)
+{
+    assert(!queue.items.empty());
+    item = move(queue.items.front());
+    queue.items.pop_front();
+
+    const auto bytes = item.frame.buffer().size();
+    const auto waitMs = chrono::duration<double, milli>(clock_t::now() - item.queued).count();
+
+    auto& stats = stats_[item.channel];
+    assert(stats.queuedFrames > 0);
+    --stats.queuedFrames;
+    stats.queuedBytes -= bytes;
+    ++stats.sentFrames;
+    stats.sentBytes += bytes;
+    stats.avgWaitMs = stats.sentFrames == 1 ? waitMs : (stats.avgWaitMs * 0.9) + (waitMs * 0.1);
+    stats.maxWaitMs = max(stats.maxWaitMs, waitMs);
+}
+
+}} // namespaces
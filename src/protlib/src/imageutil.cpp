@@ -9,14 +9,13 @@ namespace prot {
 
 using namespace core;
 
-QJsonObject toJson(const QImage &image)
+void addImage(QCborMap& msg, const QImage &image)
 {
     if (image.isNull()) {
         // Remove avatar
-        return QJsonObject {
-            {"height", 0},
-            {"width", 0}
-        };
+        msg.insert(QStringLiteral("height"), 0);
+        msg.insert(QStringLiteral("width"), 0);
+        return;
     }
 
     const auto bytes = image.width() * image.height();
@@ -34,19 +33,17 @@ QJsonObject toJson(const QImage &image)
         }
     }
 
-    return QJsonObject {
-        {"height", image.height()},
-        {"width", image.width()},
-        { "r", QString{r.toBase64()}},
-        { "g", QString{g.toBase64()}},
-        { "b", QString{b.toBase64()}},
-    };
+    msg.insert(QStringLiteral("height"), image.height());
+    msg.insert(QStringLiteral("width"), image.width());
+    msg.insert(QStringLiteral("r"), r);
+    msg.insert(QStringLiteral("g"), g);
+    msg.insert(QStringLiteral("b"), b);
 }
 
-QImage toQimage(const QJsonObject &object)
+QImage toQimage(const QCborMap &msg)
 {
-    const auto height = object.value("height").toInt();
-    const auto width = object.value("width").toInt();
+    const auto height = static_cast<int>(msg.value(QStringLiteral("height")).toInteger());
+    const auto width = static_cast<int>(msg.value(QStringLiteral("width")).toInteger());
 
     if ((height == 0) && (width == 0)) {
         // Remove avatar
@@ -56,17 +53,17 @@ QImage toQimage(const QJsonObject &object)
     if ((height <= 0) || (width <= 0) || (height > 128) || (width > 128)) {
         LFLOG_WARN << "Invalid image size: height=" << height
                    << ", width=" << width;
-        throw Error("Invalid image size from json");
+        throw Error("Invalid image size from peer");
     }
 
-    const auto rd = QByteArray::fromBase64(object.value("r").toString().toUtf8());
-    const auto gd = QByteArray::fromBase64(object.value("g").toString().toUtf8());
-    const auto bd = QByteArray::fromBase64(object.value("b").toString().toUtf8());
+    const auto rd = msg.value(QStringLiteral("r")).toByteArray();
+    const auto gd = msg.value(QStringLiteral("g")).toByteArray();
+    const auto bd = msg.value(QStringLiteral("b")).toByteArray();
 
     const auto bytes = width * height;
 
     if ((rd.size() != bytes) || (gd.size() != bytes) || (bd.size() != bytes)) {
-        throw Error("Invalid rgb data from json");
+        throw Error("Invalid rgb data from peer");
     }
 
     auto img = QImage{width, height, QImage::Format_RGB32};
@@ -1,12 +1,22 @@
 #include <array>
 #include <algorithm>
+#include <limits>
 #include <vector>
 #include <cassert>
 #include <sodium.h>
 
-#include <QJsonDocument>
-#include <QJsonObject>
+#include <QCborArray>
 #include <QtEndian>
+#include <QTimer>
+#include <QCryptographicHash>
+#include <QDir>
+
+#ifdef Q_OS_UNIX
+#   include <csetjmp>
+#   include <signal.h>
+#   include <sys/mman.h>
+#   include <unistd.h>
+#endif
 
 #include "ds/peer.h"
 #include "ds/message.h"
@@ -15,6 +25,13 @@
 #include "ds/dsengine.h"
 #include "ds/imageutil.h"
 #include "ds/bytes.h"
+#include "ds/chunksizer.h"
+#include "ds/controlcodec.h"
+#include "ds/framecompressor.h"
+#include "ds/treehash.h"
+#include "ds/filewriter.h"
+#include "ds/dirarchive.h"
+#include "ds/delta.h"
 
 #include "logfault/logfault.h"
 
@@ -25,6 +42,130 @@ using namespace std;
 using namespace core;
 
 namespace  {
+// one byte version | four bytes channel | 8 bytes id
+constexpr size_t v1_header_bytes = 1 + 4 + 8;
+constexpr size_t max_v1_payload_bytes = std::numeric_limits<quint16>::max() - v1_header_bytes;
+
+// one byte flags | varint channel | varint id
+constexpr size_t v2_max_header_bytes = 1 + maxVarintBytes<quint32>() + maxVarintBytes<quint64>();
+constexpr size_t v2_min_header_bytes = 3;
+constexpr size_t v2_length_bytes = 4;
+constexpr size_t max_v2_payload_bytes = 1024 * 1024;
+constexpr uint8_t v2_flag_compressed = 0x01; // The payload is compressed with qCompress()
+constexpr uint8_t v2_known_flags = v2_flag_compressed;
+
+// Max bytes waiting in the connection before we stop handing it file data
+constexpr size_t max_data_backlog_bytes = 1024 * 128;
+
+// Upper limit for file chunks, so control messages don't have to wait too long behind them
+constexpr size_t max_file_chunk_bytes = 1024 * 256;
+
+// Outgoing files this large are mapped into memory, a window at the time
+constexpr qint64 min_mapped_file_bytes = 1024 * 1024 * 4;
+constexpr qint64 map_window_bytes = 1024 * 1024 * 16;
+
+#ifdef Q_OS_UNIX
+// Reading a page of a mapped file that was truncated raises SIGBUS.
+// copyMapped() turns that into an error, and leaves every other
+// SIGBUS to the handler that was there before us.
+thread_local sigjmp_buf *sigbus_jump = nullptr;
+struct sigaction previous_sigbus = {};
+
+void onSigbus(int sig, siginfo_t *info, void *context) {
+    if (sigbus_jump) {
+        siglongjmp(*sigbus_jump, 1);
+    }
+
+    // Not ours. The fault repeats when we return, and the previous handler gets it.
+    Q_UNUSED(info)
+    Q_UNUSED(context)
+    sigaction(sig, &previous_sigbus, nullptr);
+}
+
+bool installSigbusHandler() {
+    struct sigaction action = {};
+    action.sa_sigaction = onSigbus;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    return sigaction(SIGBUS, &action, &previous_sigbus) == 0;
+}
+
+// Returns false if the mapped source could not be read
+bool copyMapped(void *dst, const void *src, const size_t bytes) {
+    static const bool guarded = installSigbusHandler();
+    if (!guarded) {
+        memcpy(dst, src, bytes);
+        return true;
+    }
+
+    sigjmp_buf jump;
+    if (sigsetjmp(jump, 1)) {
+        sigbus_jump = nullptr;
+        return false;
+    }
+
+    sigbus_jump = &jump;
+    memcpy(dst, src, bytes);
+    sigbus_jump = nullptr;
+    return true;
+}
+#else
+bool copyMapped(void *dst, const void *src, const size_t bytes) {
+    memcpy(dst, src, bytes);
+    return true;
+}
+#endif
+
+// Features we announce to the peer in the "Features" control message
+const char *feature_cbor = "cbor";
+const char *feature_message_batch = "message-batch";
+const char *feature_message_acks = "message-acks";
+const char *feature_deflate = "deflate";
+const char *feature_file_batch = "file-batch";
+const char *feature_resume = "resume";
+const char *feature_tree_hash = "tree-hash";
+const char *feature_flow_control = "flow-control";
+const char *feature_inline_files = "inline-files";
+const char *feature_dir_archive = "dir-archive";
+const char *feature_delta = "delta";
+const std::array<const char *, 11> supported_features = {{
+    feature_cbor, feature_message_batch, feature_message_acks, feature_deflate,
+    feature_file_batch, feature_resume, feature_tree_hash, feature_flow_control,
+    feature_inline_files, feature_dir_archive, feature_delta
+}};
+
+// Files up to this size are sent with the offer, if the peer accepts
+// that much. Small enough to fit in a v1 frame.
+constexpr qint64 max_inline_file_bytes = 1024 * 16;
+
+// When resuming a transfer, the receiver sends a hash of this many bytes
+// in front of the resume-point, so the sender can verify that it is
+// resuming the same data.
+constexpr qint64 resume_hash_bytes = 1024 * 64;
+
+// Hash of up to resume_hash_bytes of the file in front of /offset/
+QByteArray hashBeforeOffset(QIODevice& io, const qint64 offset) {
+    const auto len = min(offset, resume_hash_bytes);
+    if (!io.seek(offset - len)) {
+        return {};
+    }
+
+    const auto data = io.read(len);
+    if (data.size() != len) {
+        return {};
+    }
+
+    return QCryptographicHash::hash(data, QCryptographicHash::Sha256);
+}
+
+// Max files in one "IncomingFiles" offer
+constexpr size_t max_files_in_offer = 64;
+
+// Delta signatures we keep for files the receiver has not asked for yet.
+// Each may be close to a full v2 payload.
+constexpr size_t max_peer_signatures = 16;
+constexpr auto peer_signature_timeout = std::chrono::minutes(2);
+
 const std::vector<QString> encoding_names = {"us-ascii", "utf-8"};
 const std::map<QString, Message::Encoding>  encoding_lookup = {
     {"us-ascii", Message::US_ACSII},
@@ -33,22 +174,145 @@ const std::map<QString, Message::Encoding>  encoding_lookup = {
 
 class IncomingFileChannel : public Peer::Channel {
 public:
-    IncomingFileChannel(const core::File::ptr_t& file)
+    IncomingFileChannel(const core::File::ptr_t& file, const bool allowResume,
+                        const bool allowDelta)
         : io_{file->getDownloadPath()}
         , file_{file}
+        , leafSize_{TreeHash::getLeafSize(file->getSize())}
     {
         assert(file->getDirection() == File::INCOMING);
-        if (!io_.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+
+        // The durable resume-point is bytes_transferred, but we can't
+        // trust more data than what is actually in the .part file.
+        // A directory is unpacked as it arrives, so it's always received
+        // from the start.
+        if (allowResume && !file->isDirectory() && (file->getBytesTransferred() > 0) && io_.exists()) {
+            rest_ = min(file->getBytesTransferred(), min(io_.size(), file->getSize()));
+
+            // Only complete leaves have been verified
+            if (!file->getTreeHash().isEmpty()) {
+                rest_ -= rest_ % leafSize_;
+            }
+        }
+
+        if (file->isDirectory()) {
+            const auto path = file->getDownloadPath();
+            QDir{path}.removeRecursively();
+            QFile::remove(path);
+
+            archive_ = make_unique<DirArchiveWriter>(path);
+            archive_->setObjectName(path);
+            if (!archive_->open(QIODevice::WriteOnly)) {
+                LFLOG_ERROR << "Failed to create \"" << path
+                            << "\" for write: " << archive_->errorString();
+                throw Error("Failed to open file");
+            }
+        } else if (rest_ > 0) {
+            if (!io_.open(QIODevice::ReadWrite) || !io_.resize(rest_)) {
+                LFLOG_ERROR << "Failed to open \"" << file->getDownloadPath()
+                            << "\" for write: " << io_.errorString();
+                throw Error("Failed to open file");
+            }
+
+            restHash_ = hashBeforeOffset(io_, rest_);
+            if (restHash_.isEmpty() || !io_.seek(rest_)) {
+                LFLOG_ERROR << "Failed to prepare \"" << file->getDownloadPath()
+                            << "\" for resume: " << io_.errorString();
+                throw Error("Failed to open file");
+            }
+        } else if (!io_.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
             LFLOG_ERROR << "Failed to open \"" << file->getDownloadPath()
                         << "\" for write: " << io_.errorString();
             throw Error("Failed to open file");
         }
 
-        file->setBytesTransferred(0);
+        file->clearBytesTransferred(rest_);
+        nextLeaf_ = rest_ / leafSize_;
+
+        // We have an earlier version of the file. Rebuild it from the sender's delta.
+        if (allowDelta && (rest_ == 0) && !archive_ && !file->getDeltaBasis().isEmpty()) {
+            delta_ = make_unique<DeltaDecoder>(file->getDeltaBasis(), file->getSize());
+            if (!delta_->open()) {
+                delta_.reset();
+                file->setDeltaBasis({});
+            }
+        }
+
+        if (archive_) {
+            writer_ = make_unique<FileWriter>(*archive_);
+        } else if (delta_) {
+            // The basis is read by the writer thread
+            writer_ = make_unique<FileWriter>(io_, [delta = delta_.get()](
+                                              const QByteArray& chunk, QByteArray& out, QString& error) {
+                if (!delta->decode(chunk.constData(), static_cast<size_t>(chunk.size()), out)) {
+                    error = delta->getError();
+                    return false;
+                }
+                return true;
+            });
+            writer_->preallocate(file->getSize());
+        } else {
+            writer_ = make_unique<FileWriter>(io_);
+            writer_->preallocate(file->getSize());
+        }
+
+        auto filePtr = file.get();
+        const bool delta = (delta_ != nullptr);
+        QObject::connect(writer_.get(), &FileWriter::failed, filePtr, [filePtr, delta](const QString& reason) {
+            if (filePtr->getState() != File::FS_TRANSFERRING) {
+                return;
+            }
+            if (delta) {
+                filePtr->setDeltaBasis({});
+                filePtr->transferFailed("Delta transfer failed: " + reason, File::FS_FAILED);
+            } else {
+                filePtr->transferFailed("Disk Write Error: " + reason);
+            }
+        });
+
+        // When we start from the beginning, the file hash is calculated as we
+        // write the data. A resumed file, or a file rebuilt from a delta on the
+        // writer thread, is hashed from disk when it's complete.
+        hashing_ = (rest_ == 0) && !delta_;
+        crypto_hash_sha256_init(&hashState_);
 
         LFLOG_DEBUG << "Opened file #" << file->getId()
                     << " with path \"" << file->getDownloadPath()
-                    << " for WRITE for incoming transfer";
+                    << " for WRITE for incoming transfer, starting at offset " << rest_;
+    }
+
+    qint64 getRest() const noexcept { return rest_; }
+    const QByteArray& getRestHash() const noexcept { return restHash_; }
+    const File::ptr_t& getFile() const noexcept { return file_; }
+    FileWriter& getWriter() noexcept { return *writer_; }
+    bool isDelta() const noexcept { return delta_ != nullptr; }
+
+    // The writer has caught up. Let the sender continue if we paused it.
+    void onWriterDrained(Peer& peer) {
+        if (paused_ && !failed_) {
+            paused_ = false;
+            sendFlowControl(peer, "Continue");
+        }
+    }
+
+    // The leaf hashes from the sender. Returns false if they don't match the tree hash.
+    bool setLeafHashes(const qint64 leafSize, const QByteArray& leaves) {
+        if ((leafSize != leafSize_)
+                || !TreeHash::isValid(leaves, file_->getTreeHash(), file_->getSize())) {
+            return false;
+        }
+
+        leaves_ = leaves;
+
+        // Check the leaves that arrived before the hashes
+        for(const auto& it : receivedLeaves_) {
+            if (!verifyLeaf(it.first, it.second)) {
+                break;
+            }
+        }
+        receivedLeaves_.clear();
+
+        return true;
     }
 
     // Channel interface
@@ -56,22 +320,25 @@ public:
     void onIncoming(Peer &peer, const quint64 id,
                     const Peer::mview_t& data,
                     const bool final) override {
-        Q_UNUSED(peer);
-        if (io_.write(reinterpret_cast<const char *>(data.cdata()),
-                      static_cast<qint64>(data.size())) != static_cast<qint64>(data.size())) {
-            LFLOG_ERROR << "Failed to write chunk "
-                        << id << " to \"" << file_->getDownloadPath()
-                        << "\" for write: " << io_.errorString();
-            throw Error("Failed to write to file");
+        if (failed_) {
+            return;
         }
 
-        file_->addBytesTransferred(data.size());
-
-        if (final) {
-            io_.flush();
-            io_.close();
-            file_->validateHash();
+        if (delta_) {
+            // The operations are checked here, and decoded by the writer
+            const auto bytes = delta_->measure(reinterpret_cast<const char *>(data.cdata()), data.size());
+            if ((bytes < 0) || (bytes > (file_->getSize() - rebuiltBytes_))) {
+                failed_ = true;
+                file_->setDeltaBasis({});
+                file_->transferFailed("Delta transfer failed: Invalid operations", File::FS_FAILED);
+                return;
+            }
+            rebuiltBytes_ += bytes;
+            onData(peer, id, data, final, bytes);
+            return;
         }
+
+        onData(peer, id, data, final, static_cast<qint64>(data.size()));
     }
 
     uint64_t onOutgoing(Peer &peer) override {
@@ -81,28 +348,187 @@ public:
     }
 
 private:
+    // /bytes/ is how much of the file the data covers
+    void onData(Peer &peer, const quint64 id,
+                const Peer::mview_t& data,
+                const bool final, const qint64 bytes) {
+
+        // Blocks if the queue is full, which only happens if the peer
+        // can't pause or ignores us.
+        if (!writer_->write(data.cdata(), data.size(), static_cast<size_t>(bytes))) {
+            LFLOG_ERROR << "Failed to queue chunk "
+                        << id << " for \"" << file_->getDownloadPath() << "\"";
+            failed_ = true;
+            return;
+        }
+
+        // The tree can't be checked before the delta is decoded. The file hash covers it.
+        if (!delta_ && !file_->getTreeHash().isEmpty() && !addToTree(data, final)) {
+            return;
+        }
+
+        if (hashing_) {
+            crypto_hash_sha256_update(&hashState_, data.cdata(), data.size());
+        }
+
+        file_->addBytesTransferred(static_cast<size_t>(bytes));
+
+        if (final) {
+            QByteArray hash;
+            if (hashing_) {
+                hash.resize(crypto_hash_sha256_BYTES);
+                crypto_hash_sha256_final(&hashState_, reinterpret_cast<uint8_t *>(hash.data()));
+            }
+
+            // The file is validated when all the data is on disk
+            auto file = file_;
+            QObject::connect(writer_.get(), &FileWriter::finished, file.get(), [file, hash] {
+                if (file->getState() != File::FS_TRANSFERRING) {
+                    return;
+                }
+                if (hash.isEmpty()) {
+                    file->validateHash();
+                } else {
+                    file->validateHash(hash);
+                }
+            });
+            writer_->finish();
+            return;
+        }
+
+        if (!paused_ && writer_->isBehind() && peer.canPauseTransfers()) {
+            LFLOG_DEBUG << "The disk is behind for file #" << file_->getId()
+                        << " (" << writer_->getQueuedBytes() << " bytes queued). Pausing the sender.";
+            paused_ = true;
+            sendFlowControl(peer, "Pause");
+        }
+    }
+
+    void sendFlowControl(Peer& peer, const QString& status) {
+        peer.sendAck("IncomingFile", status, QVariantMap{
+                         {"data", QString{file_->getFileId().toBase64()}},
+                         {"channel", file_->getChannel()}
+                     });
+    }
+
+    // Hash the data into the current leaf, and verify each leaf as it's completed.
+    bool addToTree(const Peer::mview_t& data, const bool final) {
+        auto ptr = data.cdata();
+        auto len = static_cast<qint64>(data.size());
+        while(len > 0) {
+            const auto bytes = min(len, leafSize_ - hasher_.getBytes());
+            hasher_.add(ptr, static_cast<size_t>(bytes));
+            ptr += bytes;
+            len -= bytes;
+            if ((hasher_.getBytes() == leafSize_) && !completeLeaf()) {
+                return false;
+            }
+        }
+
+        if (final && (hasher_.getBytes() || (file_->getSize() == 0))) {
+            return completeLeaf();
+        }
+
+        return true;
+    }
+
+    bool completeLeaf() {
+        const auto index = nextLeaf_++;
+        const auto hash = hasher_.finish();
+        if (leaves_.isEmpty()) {
+            // We don't have the leaf hashes (yet)
+            receivedLeaves_.emplace_back(index, hash);
+            return true;
+        }
+
+        return verifyLeaf(index, hash);
+    }
+
+    bool verifyLeaf(const qint64 index, const QByteArray& hash) {
+        if (TreeHash::getLeaf(leaves_, index) == hash) {
+            return true;
+        }
+
+        // Everything in front of this leaf is verified. Resume from there.
+        LFLOG_WARN << "Leaf #" << index << " of file #" << file_->getId()
+                   << " does not match the tree hash.";
+        failed_ = true;
+        file_->clearBytesTransferred(index * leafSize_);
+        file_->transferFailed("Received data does not match the tree hash", File::FS_FAILED);
+        return false;
+    }
+
     QFile io_;
     File::ptr_t file_;
+    qint64 rest_ = {};
+    QByteArray restHash_;
+    const qint64 leafSize_;
+    qint64 nextLeaf_ = {};
+    TreeHash::LeafHasher hasher_;
+    QByteArray leaves_;
+    std::vector<std::pair<qint64, QByteArray>> receivedLeaves_; // Before we got leaves_
+    bool failed_ = false;
+    bool hashing_ = false;
+    bool paused_ = false; // We have asked the sender to pause
+    crypto_hash_sha256_state hashState_ = {};
+    std::unique_ptr<DirArchiveWriter> archive_; // Used instead of io_ for a directory
+    std::unique_ptr<DeltaDecoder> delta_; // Used by the writer thread
+    qint64 rebuiltBytes_ = {}; // What the delta operations so far expand to
+    std::unique_ptr<FileWriter> writer_; // Must be destroyed before io_, archive_ and delta_
 };
 
 class OutgoingFileChannel : public Peer::Channel {
 public:
-    OutgoingFileChannel(const core::File::ptr_t& file)
+    OutgoingFileChannel(const core::File::ptr_t& file, const DeltaBasis& signature = {})
         : io_{file->getPath()}
         , file_{file}
     {
         assert(file->getDirection() == File::OUTGOING);
-        if (!io_.open(QIODevice::ReadOnly)) {
+        if (file->isDirectory()) {
+            archive_ = make_unique<DirArchiveReader>(file->getPath());
+        }
+
+        if (!source().open(QIODevice::ReadOnly)) {
             LFLOG_ERROR << "Failed to open \"" << file->getPath()
-                        << "\" for read: " << io_.errorString();
+                        << "\" for read: " << source().errorString();
             throw Error("Failed to open file");
         }
 
-        file->setBytesTransferred(0);
+        // The receiver asked us to resume from bytes_transferred
+        const auto rest = file->getBytesTransferred();
+        if (rest > 0) {
+            const auto& expected = file->getResumeHash();
+            if ((rest > source().size())
+                    || (!expected.isEmpty() && (hashBeforeOffset(source(), rest) != expected))
+                    || !source().seek(rest)) {
+                LFLOG_WARN << "Cannot resume file #" << file->getId()
+                           << " at offset " << rest << ". The data does not match.";
+                resumeFailed_ = true;
+            }
+        }
+
+        file->clearBytesTransferred(resumeFailed_ ? 0 : rest);
+        pos_ = file->getBytesTransferred();
+        size_ = source().size();
+        useMap_ = !archive_ && (size_ >= min_mapped_file_bytes);
+#ifdef Q_OS_UNIX
+        page_ = static_cast<qint64>(sysconf(_SC_PAGESIZE));
+#endif
+
+        // The receiver has an earlier version of the file
+        if (!signature.isEmpty() && !archive_ && (pos_ == 0) && !resumeFailed_) {
+            delta_ = make_unique<DeltaEncoder>(io_, signature.blockSize, signature.signature);
+            useMap_ = false;
+        }
 
         LFLOG_DEBUG << "Opened file #" << file->getId()
                     << " with path \"" << file->getPath()
-                    << " for READ for outgoing transfer";
+                    << " for READ for outgoing transfer, starting at offset "
+                    << file->getBytesTransferred();
+    }
+
+    ~OutgoingFileChannel() override {
+        unmapWindow();
     }
 
     // Channel interface
@@ -117,21 +543,62 @@ public:
     }
 
     uint64_t onOutgoing(Peer &peer) override {
+        if (resumeFailed_) {
+            // The receiver must start over
+            file_->transferFailed("Resume data mismatch", File::FS_FAILED);
+            return {};
+        }
+
+        sizer_.setMaxChunkSize(min(peer.getMaxFramePayload(), max_file_chunk_bytes));
+        if (sizer_.update(peer.getConnectionPtr()->getDrainRate())) {
+            LFLOG_DEBUG << "Chunk-size for file #" << file_->getId()
+                        << " is now " << sizer_.getChunkSize()
+                        << " bytes with " << sizer_.getChunksInFlight()
+                        << " chunks in flight. Drain-rate is "
+                        << static_cast<uint64_t>(peer.getConnectionPtr()->getDrainRate())
+                        << " bytes/sec on connection " << peer.getConnectionId().toString();
+        }
 
-        auto bytesRead = io_.read(buffer_.data(), static_cast<int>(buffer_.size()));
+        uint64_t rval = {};
+        bool finished = false;
+        for(size_t i = 0; i < sizer_.getChunksInFlight(); ++i) {
+            rval = sendChunk(peer, finished);
+            if (!rval || finished) {
+                break;
+            }
+        }
+
+        file_->setTransferStats(finished ? 0 : static_cast<int>(sizer_.getChunkSize()),
+                                finished ? 0 : static_cast<qlonglong>(sizer_.getThroughput()));
+        return rval;
+    }
+
+private:
+    uint64_t sendChunk(Peer &peer, bool& finished) {
+        if (delta_) {
+            return sendDelta(peer, finished);
+        }
+
+        // Fill the pooled frame, behind the space reserved for the header
+        auto frame = peer.createFrame(useMap_
+                                      ? min(sizer_.getChunkSize(), static_cast<size_t>(size_ - pos_))
+                                      : sizer_.getChunkSize());
+        auto payload = frame.payload();
+        const auto bytesRead = useMap_ ? copyFromMap(payload) : readChunk(payload);
         if (bytesRead < 0) {
             LFLOG_ERROR << "Failed to read chunk from file \"" << file_->getPath()
-                        << "\": " << io_.errorString();
+                        << "\": " << source().errorString();
             file_->transferFailed("Disk Read Error");
             return {};
         }
 
-        const bool finished = io_.atEnd();
+        pos_ += bytesRead;
+        finished = useMap_ ? (pos_ >= size_) : source().atEnd();
+        frame.resize(static_cast<size_t>(bytesRead));
 
-        auto rval = peer.send(buffer_.data(),
-                  static_cast<size_t>(bytesRead),
-                  file_->getChannel(), finished);
+        auto rval = peer.send(frame, file_->getChannel(), finished);
 
+        sizer_.addSent(static_cast<size_t>(bytesRead));
         file_->addBytesTransferred(static_cast<size_t>(bytesRead));
 
         if (finished) {
@@ -141,13 +608,152 @@ public:
         return rval;
     }
 
-private:
+    uint64_t sendDelta(Peer &peer, bool& finished) {
+        auto frame = peer.createFrame(sizer_.getChunkSize());
+        auto payload = frame.payload();
+        const auto bytes = delta_->encode(reinterpret_cast<char *>(payload.data()),
+                                          static_cast<qint64>(payload.size()), finished);
+        if (bytes < 0) {
+            LFLOG_ERROR << "Failed to read chunk from file \"" << file_->getPath()
+                        << "\": " << io_.errorString();
+            file_->transferFailed("Disk Read Error");
+            return {};
+        }
+
+        frame.resize(static_cast<size_t>(bytes));
+        auto rval = peer.send(frame, file_->getChannel(), finished);
+
+        // Progress is the part of the file we have covered
+        sizer_.addSent(static_cast<size_t>(bytes));
+        file_->addBytesTransferred(static_cast<size_t>(delta_->getEncodedBytes() - pos_));
+        pos_ = delta_->getEncodedBytes();
+
+        if (finished) {
+            LFLOG_DEBUG << "Sent file #" << file_->getId() << " as a delta with "
+                        << delta_->getLiteralBytes() << " literal bytes and "
+                        << delta_->getCopiedBytes() << " bytes from the receiver's earlier version";
+            file_->transferComplete();
+        }
+
+        return rval;
+    }
+
+    qint64 readChunk(Peer::mview_t& payload) {
+        return source().read(reinterpret_cast<char *>(payload.data()),
+                             static_cast<qint64>(payload.size()));
+    }
+
+    QIODevice& source() noexcept {
+        return archive_ ? static_cast<QIODevice&>(*archive_) : io_;
+    }
+
+    // The encryption needs the header and payload in one buffer, so we still
+    // copy the data into the frame. But there is no read() call per chunk, and
+    // only the current window of the file is mapped.
+    // If the file is truncated under us, reading the mapping raises SIGBUS.
+    // We check the size each time we map a new window, and copyMapped()
+    // catches a truncation in the middle of a window.
+    qint64 copyFromMap(Peer::mview_t& payload) {
+        const auto len = static_cast<qint64>(payload.size());
+        if (!len) {
+            return 0;
+        }
+
+        if (!window_ || (pos_ + len) > (windowOffset_ + windowSize_)) {
+            unmapWindow();
+
+            if (io_.size() < size_) {
+                LFLOG_WARN << "File \"" << file_->getPath() << "\" was truncated while we sent it.";
+                return -1;
+            }
+
+            // Page aligned, so that we can release the pages we have sent
+            windowOffset_ = (pos_ / page_) * page_;
+            windowSize_ = min(map_window_bytes, size_ - windowOffset_);
+            window_ = io_.map(windowOffset_, windowSize_, QFileDevice::MapPrivateOption);
+            if (!window_) {
+                LFLOG_DEBUG << "Cannot map \"" << file_->getPath() << "\": "
+                            << io_.errorString() << ". Reading it instead.";
+                useMap_ = false;
+                return io_.seek(pos_) ? readChunk(payload) : -1;
+            }
+#ifdef Q_OS_UNIX
+            posix_madvise(window_, static_cast<size_t>(windowSize_), POSIX_MADV_SEQUENTIAL);
+#endif
+        }
+
+        if (!copyMapped(payload.data(), window_ + (pos_ - windowOffset_), payload.size())) {
+            LFLOG_WARN << "File \"" << file_->getPath() << "\" was truncated while we sent it.";
+            unmapWindow();
+            return -1;
+        }
+
+#ifdef Q_OS_UNIX
+        // We won't need the pages we have sent again. glibc ignores
+        // POSIX_MADV_DONTNEED, so we use madvise() to drop them from our
+        // private mapping. The page-cache is left alone, as other
+        // transfers of the same file may still need it.
+        const auto sent = ((pos_ + len - windowOffset_) / page_) * page_;
+        if (sent > released_) {
+            madvise(window_ + released_, static_cast<size_t>(sent - released_), MADV_DONTNEED);
+            released_ = sent;
+        }
+#endif
+        return len;
+    }
+
+    void unmapWindow() {
+        if (window_) {
+            io_.unmap(window_);
+            window_ = nullptr;
+            released_ = {};
+        }
+    }
+
     QFile io_;
+    std::unique_ptr<DirArchiveReader> archive_; // Used instead of io_ for a directory
+    std::unique_ptr<DeltaEncoder> delta_; // Reads from io_
     File::ptr_t file_;
-    std::array<char, 1024 * 8> buffer_ = {};
+    ChunkSizer sizer_;
+    bool resumeFailed_ = false;
+    bool useMap_ = false;
+    qint64 pos_ = {};
+    qint64 size_ = {};
+    uchar *window_ = nullptr;
+    qint64 windowOffset_ = {};
+    qint64 windowSize_ = {};
+    qint64 released_ = {}; // Bytes at the start of the window we have told the kernel to drop
+    qint64 page_ = 4096; // The system's page size on Unix
 };
 
 
+// Read a small file to send it inline. Fails if it's not the file we hashed.
+bool readInlineContent(const File& file, QByteArray& content) {
+    QFile io{file.getPath()};
+    if (!io.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    content = io.read(file.getSize() + 1);
+    if (content.size() != file.getSize()) {
+        return false;
+    }
+
+    QByteArray hash(crypto_hash_sha256_BYTES, 0);
+    crypto_hash_sha256(reinterpret_cast<uint8_t *>(hash.data()),
+                       reinterpret_cast<const uint8_t *>(content.constData()),
+                       static_cast<unsigned long long>(content.size()));
+    return hash == file.getHash();
+}
+
+// Ack parameters are sent as text, except binary values like hashes
+QCborValue toAckValue(const QVariant& value) {
+    if (value.type() == QVariant::ByteArray) {
+        return value.toByteArray();
+    }
+    return value.toString();
+}
+
 Message::Encoding toEncoding(const QString& name) {
     const auto it = encoding_lookup.find(name);
     if (it == encoding_lookup.end()) {
@@ -178,72 +784,176 @@ Peer::Peer(ConnectionSocket::ptr_t connection,
             inChannels_.erase(id);
         } else {
             outChannels_.erase(id);
+            pausedChannels_.erase(id);
+            dropPeerSignatures(id);
+
+            const auto stats = scheduler_.getStats(id);
+            LFLOG_DEBUG << "Channel #" << id << " on connection " << getConnectionId().toString()
+                        << " sent " << stats.sentFrames << " frames (" << stats.sentBytes
+                        << " bytes). Average wait " << stats.avgWaitMs
+                        << " ms, max wait " << stats.maxWaitMs << " ms. "
+                        << stats.queuedFrames << " frames still queued.";
+            scheduler_.forget(id);
         }
+
+        const auto cstats = compressor_.getStats(id);
+        if (cstats.compressedFrames || cstats.decompressedFrames) {
+            LFLOG_DEBUG << "Channel #" << id << " on connection " << getConnectionId().toString()
+                        << " compressed " << cstats.compressedFrames << " frames to "
+                        << static_cast<int>(cstats.getRatio() * 100) << "% ("
+                        << cstats.bytesIn << " -> " << cstats.bytesOut << " bytes), skipped "
+                        << cstats.skippedFrames << ", decompressed " << cstats.decompressedFrames
+                        << " frames. Used " << cstats.cpuMs << " ms.";
+        }
+        compressor_.forget(id);
     }, Qt::QueuedConnection);
 }
 
-uint64_t Peer::send(const QJsonDocument &json)
+uint64_t Peer::send(const QCborMap &msg)
 {
     if (!connection_->isOpen()) {
         throw runtime_error("Connection is closed");
     }
 
-    auto jsonData = json.toJson(QJsonDocument::Compact);
+    const auto encoding = peerFeatures_.count(feature_cbor)
+            ? ControlCodec::Encoding::CBOR
+            : ControlCodec::Encoding::JSON;
+    const auto data = ControlCodec::encode(msg, encoding);
 
-    LFLOG_TRACE << "Sending json to "
+    LFLOG_TRACE << "Sending " << ControlCodec::getTypeName(ControlCodec::getType(msg))
+                << " to "
                 << connection_->getUuid().toString()
                 << ": "
-                << jsonData;
+                << (encoding == ControlCodec::Encoding::JSON ? data : data.toHex());
 
-    return send(jsonData.constData(),
-                static_cast<size_t>(jsonData.size()),
+    return send(data.constData(),
+                static_cast<size_t>(data.size()),
                 /* channel */ 0);
 }
 
 uint64_t Peer::send(const void *data, const size_t bytes,
-                    const quint32 ch, const bool eof )
+                    const quint32 ch, const bool eof, const quint32 requests)
+{
+    auto frame = createFrame(bytes);
+    assert(frame.payload().size() == bytes);
+    memcpy(frame.payload().data(), data, bytes);
+    return send(frame, ch, eof, requests);
+}
+
+Peer::Frame Peer::createFrame(const size_t payloadBytes)
+{
+    if (payloadBytes > getMaxFramePayload()) {
+        throw runtime_error("Payload is too large for one frame");
+    }
+
+    return {connection_->getBufferPoolPtr(),
+                protocolVersion_ >= 2 ? v2_max_header_bytes : v1_header_bytes,
+                payloadBytes};
+}
+
+size_t Peer::getMaxFramePayload() const noexcept
 {
-    const unsigned char tag = eof
-            ? crypto_secretstream_xchacha20poly1305_TAG_PUSH
-            : crypto_secretstream_xchacha20poly1305_TAG_MESSAGE;
+    return protocolVersion_ >= 2 ? max_v2_payload_bytes : max_v1_payload_bytes;
+}
 
+uint64_t Peer::send(Peer::Frame &frame, const quint32 ch, const bool eof,
+                    const quint32 requests)
+{
     if (!connection_->isOpen()) {
         throw runtime_error("Connection is closed");
     }
 
+    if ((protocolVersion_ >= 2) && peerFeatures_.count(feature_deflate)) {
+        compressor_.compress(frame, ch);
+    }
+
+    // The frame is encrypted when the scheduler gives it its turn
+    scheduler_.push(move(frame), ch, eof, requests);
+    pump();
+    return ++queued_;
+}
+
+FrameScheduler::ChannelStats Peer::getChannelStats(const quint32 channel) const
+{
+    return scheduler_.getStats(channel);
+}
+
+FrameCompressor::Stats Peer::getCompressionStats(const quint32 channel) const
+{
+    return compressor_.getStats(channel);
+}
+
+void Peer::pump()
+{
+    // File data is only handed over to the connection while it's backlog is
+    // small, so that control messages don't have to wait long behind it.
+    // bytesWritten() calls us again when the backlog is below the limit.
+    FrameScheduler::Item item;
+    while(connection_->isOpen()
+          && scheduler_.pop(item, (connection_->getOutputQueueBytes()
+                                   + static_cast<size_t>(connection_->bytesToWrite()))
+                            < max_data_backlog_bytes)) {
+
+        const unsigned char tag = item.final
+                ? crypto_secretstream_xchacha20poly1305_TAG_PUSH
+                : crypto_secretstream_xchacha20poly1305_TAG_MESSAGE;
+
+        // A batch reserves one id per item. The frame carries the first.
+        const auto id = static_cast<quint64>(request_id_ + 1);
+        request_id_ += item.requests;
+        auto out = (protocolVersion_ >= 2)
+                ? sealFrameV2(item.frame, item.channel, id, tag)
+                : sealFrameV1(item.frame, item.channel, id, tag);
+
+        item.frame.release();
+        connection_->write(move(out));
+    }
+}
+
+BufferPool::buffer_t Peer::sealFrameV1(Peer::Frame &frame, const quint32 ch,
+                                       const quint64 requestId, const unsigned char tag)
+{
     // Data format:
     // Two bytes length | one byte version | four bytes channel | 8 bytes id | data
 
     // The length is encrypted individually to allow the peer to read it before
     // fetching the payload.
 
-    const size_t len = 1 + 4 + 8 + static_cast<size_t>(bytes);
-    vector<uint8_t> payload_len(2),
-            buffer(len),
-            cipherlen(2 + crypt_bytes),
-            ciphertext(len + crypt_bytes);
-    mview_t version{buffer.data(), 1};
+    const auto& plaintext = frame.buffer();
+    const size_t len = plaintext.size();
+    assert(len >= v1_header_bytes);
+
+    if (len > std::numeric_limits<quint16>::max()) {
+        throw runtime_error("Frame is too large");
+    }
+
+    // Build the header in place, in front of the payload
+    auto header = frame.header();
+    mview_t version{header.data(), 1};
     mview_t channel{version.end(), 4};
     mview_t id{channel.end(), 8};
-    mview_t payload{id.end(), bytes};
 
-    assert(buffer.size() == (+ version.size()
+    assert(header.size() == (version.size()
                              + channel.size()
-                             + id.size()
-                             + payload.size()));
+                             + id.size()));
 
     static_assert(sizeof(decltype(qToBigEndian(static_cast<quint16>(len)))) == sizeof(quint16),
                   "qToBigEndian() must return the correct type");
 
+    array<uint8_t, 2> payload_len = {};
     valueToBytes(qToBigEndian(static_cast<quint16>(len)), payload_len);
 
     version.at(0) = '\1';
 
     valueToBytes(qToBigEndian(static_cast<quint32>(ch)), channel);
-    valueToBytes(qToBigEndian(static_cast<quint64>(++request_id_)), id);
+    valueToBytes(qToBigEndian(requestId), id);
 
-    assert(bytes == payload.size());
-    memcpy(payload.data(), data, payload.size());
+    // Both the encrypted length and the encrypted frame goes into one
+    // pooled buffer that is handed over to the socket as is.
+    auto out = connection_->getBufferPool().take(payload_len.size() + crypt_bytes
+                                                 + len + crypt_bytes);
+    mview_t cipherlen{out.data(), payload_len.size() + crypt_bytes};
+    mview_t ciphertext{cipherlen.end(), len + crypt_bytes};
 
     // encrypt length
     if (crypto_secretstream_xchacha20poly1305_push(&stateOut,
@@ -255,33 +965,85 @@ uint64_t Peer::send(const void *data, const size_t bytes,
         throw runtime_error("Stream encryption failed");
     }
 
-    connection_->write(cipherlen);
-
     LFLOG_TRACE << "Sending chunk #"
-                << request_id_
+                << requestId
                 << " with payload of "
-                << payload.size() << " bytes on channel #" << ch
+                << (len - v1_header_bytes) << " bytes on channel #" << ch
                 << " to connection "<< connection_->getUuid().toString();
 
     // Encrypt the payload
     if (crypto_secretstream_xchacha20poly1305_push(&stateOut,
                                                ciphertext.data(),
                                                nullptr,
-                                               buffer.data(),
-                                               buffer.size(),
+                                               plaintext.data(),
+                                               plaintext.size(),
                                                nullptr, 0, tag) != 0) {
         throw runtime_error("Stream encryption failed");
     }
 
-    connection_->write(ciphertext);
-    return request_id_;
+    return out;
+}
+
+BufferPool::buffer_t Peer::sealFrameV2(Peer::Frame &frame, const quint32 ch,
+                                       const quint64 requestId, const unsigned char tag)
+{
+    // Data format:
+    // Four bytes length | one byte flags | varint channel | varint id | data
+    //
+    // The length is sent in clear, but it is authenticated as additional
+    // data for the frame, so there is only one AEAD operation per frame.
+
+    const auto id = requestId;
+    array<uint8_t, v2_max_header_bytes> header_data = {};
+    size_t header_len = 0;
+    header_data[header_len++] = frame.isCompressed() ? v2_flag_compressed : 0; // flags
+    header_len += valueToVarint(ch, header_data.data() + header_len);
+    header_len += valueToVarint(id, header_data.data() + header_len);
+
+    // The header is variable length, so we put it right in front of the payload.
+    auto header = frame.header();
+    assert(header.size() == v2_max_header_bytes);
+    assert(header_len <= header.size());
+    const auto offset = header.size() - header_len;
+    memcpy(header.data() + offset, header_data.data(), header_len);
+
+    const auto plaintext = frame.view();
+    const size_t len = plaintext.size() - offset;
+
+    if (len > (v2_max_header_bytes + max_v2_payload_bytes)) {
+        throw runtime_error("Frame is too large");
+    }
+
+    auto out = connection_->getBufferPool().take(v2_length_bytes + len + crypt_bytes);
+    mview_t frame_len{out.data(), v2_length_bytes};
+    mview_t ciphertext{frame_len.end(), len + crypt_bytes};
+    valueToBytes(qToBigEndian(static_cast<quint32>(len)), frame_len);
+
+    LFLOG_TRACE << "Sending chunk #"
+                << id
+                << " with payload of "
+                << (len - header_len) << " bytes on channel #" << ch
+                << " to connection "<< connection_->getUuid().toString();
+
+    if (crypto_secretstream_xchacha20poly1305_push(&stateOut,
+                                               ciphertext.data(),
+                                               nullptr,
+                                               plaintext.cdata() + offset,
+                                               len,
+                                               frame_len.cdata(),
+                                               frame_len.size(),
+                                               tag) != 0) {
+        throw runtime_error("Stream encryption failed");
+    }
+
+    return out;
 }
 
 void Peer::onReceivedData(const quint32 channel, const quint64 id,
                           const Peer::mview_t& data, const bool final)
 {
     if (channel == 0) {
-        onReceivedJson(channel, data);
+        onReceivedControl(id, data);
     } else {
         auto it = inChannels_.find(channel);
         if (it == inChannels_.end()) {
@@ -309,98 +1071,417 @@ void Peer::onReceivedData(const quint32 channel, const quint64 id,
     }
 }
 
-void Peer::onReceivedJson(const quint64 id, const Peer::mview_t& data)
+void Peer::onReceivedControl(const quint64 id, const Peer::mview_t& data)
 {
     if (notificationsDisabled_) {
         return;
     }
 
-    // Control channel. Data is supposed to be Json.
-    QJsonDocument json = QJsonDocument::fromJson(data.toByteArray());
-    if (json.isNull()) {
+    // Control channel. Data is supposed to be Json or CBOR.
+    QCborMap msg;
+    try {
+        msg = ControlCodec::decode(reinterpret_cast<const char *>(data.cdata()), data.size());
+    } catch(const Error&) {
         LFLOG_ERROR << "Incoming data on " << getConnectionId().toString()
                     << " with id=" << id
-                    << " is supposed to be in Json format, but it is not.";
-        throw Error("Not Json");
+                    << " is supposed to be a control message, but it is not.";
+        throw;
     }
 
-    const auto type = json.object().value("type");
-
-    if (type == "AddMe") {
-        PeerAddmeReq req{shared_from_this(), getConnectionId(), id,
-                    json.object().value("nick").toString(),
-                    json.object().value("message").toString(),
-                    json.object().value("address").toString().toUtf8(),
-                    getPeerCert()->getB58PubKey()};
+    switch(ControlCodec::getType(msg)) {
+    case ControlCodec::Type::ADD_ME:
+        emitAddme(id, msg);
+        break;
+    case ControlCodec::Type::ACK:
+        emitAck(id, msg);
+        break;
+    case ControlCodec::Type::MESSAGE:
+        emitMessage(id, msg);
+        break;
+    case ControlCodec::Type::MESSAGE_BATCH:
+        emitMessageBatch(id, msg);
+        break;
+    case ControlCodec::Type::INCOMING_FILE:
+        emitFileOffer(id, msg);
+        break;
+    case ControlCodec::Type::INCOMING_FILES:
+        emitFileOffers(id, msg);
+        break;
+    case ControlCodec::Type::SET_AVATAR:
+        emitAvatar(id, msg);
+        break;
+    case ControlCodec::Type::USER_INFO:
+        emitUserInfo(id, msg);
+        break;
+    case ControlCodec::Type::FEATURES:
+        onReceivedFeatures(msg);
+        break;
+    case ControlCodec::Type::FILE_HASHES:
+        onReceivedFileHashes(msg);
+        break;
+    case ControlCodec::Type::FILE_SIGNATURES:
+        onReceivedFileSignatures(msg);
+        break;
+    case ControlCodec::Type::UNKNOWN:
+        LFLOG_WARN << "Unrecognized request from peer at connection "
+                   << getConnectionId().toString();
+        break;
+    }
+}
 
-        LFLOG_TRACE << "Emitting addmeRequest";
-        emit addmeRequest(req);
-    } else if (type == "Ack") {
+void Peer::emitAddme(const quint64 id, const QCborMap &msg)
+{
+    PeerAddmeReq req{shared_from_this(), getConnectionId(), id,
+                msg.value(QStringLiteral("nick")).toString(),
+                msg.value(QStringLiteral("message")).toString(),
+                msg.value(QStringLiteral("address")).toString().toUtf8(),
+                getPeerCert()->getB58PubKey()};
+
+    LFLOG_TRACE << "Emitting addmeRequest";
+    emit addmeRequest(req);
+}
 
-        QVariantMap params;
-        for(const auto& key : json.object().keys()) {
-            static const QRegExp irrelevant{"what|status|type"};
-            if (key.count(irrelevant)) {
+void Peer::emitAck(const quint64 id, const QCborMap &msg)
+{
+    // Several "IncomingFile" acks in one message. Each entry has the
+    // parameters for one ack.
+    if (msg.value(QStringLiteral("what")).toString() == QStringLiteral("IncomingFiles")) {
+        const auto files = msg.value(QStringLiteral("files")).toArray();
+        LFLOG_TRACE << "Received IncomingFiles ack for " << files.size() << " files";
+        for(const auto& entry : files) {
+            if (!entry.isMap()) {
                 continue;
             }
-            params.insert(key, json.object().value(key).toString());
-        }
-
-        PeerAck ack{shared_from_this(), getConnectionId(), id,
-                    json.object().value("what").toString().toUtf8(),
-                    json.object().value("status").toString().toUtf8(),
-                    params};
-
-        LFLOG_TRACE << "Emitting Ack";
-        emit receivedAck(ack);
-    } else if (type == "Message") {
-        PeerMessage msg{shared_from_this(), getConnectionId(), id,
-                    QByteArray::fromBase64(json.object().value("conversation").toString().toUtf8()),
-                    QByteArray::fromBase64(json.object().value("message-id").toString().toUtf8()),
-                    QDateTime::fromString(json.object().value("date").toString(), Qt::ISODate),
-                    json.object().value("content").toString(),
-                    QByteArray::fromBase64(json.object().value("from").toString().toUtf8()),
-                    toEncoding(json.object().value("encoding").toString()),
-                    QByteArray::fromBase64(json.object().value("signature").toString().toUtf8())};
-
-        LFLOG_TRACE << "Emitting PeerMessage";
-        emit receivedMessage(msg);
-    } else if (type == "IncomingFile") {
-        PeerFileOffer msg{shared_from_this(), getConnectionId(), id,
-                    QByteArray::fromBase64(json.object().value("conversation").toString().toUtf8()),
-                    QByteArray::fromBase64(json.object().value("file-id").toString().toUtf8()),
-                    json.object().value("name").toString(),
-                    json.object().value("size").toString().toLongLong(),
-                    json.object().value("rest").toString().toLongLong(),
-                    json.object().value("file-type").toString(),
-                    QByteArray::fromBase64(json.object().value("sha256").toString().toUtf8())};
-
-        LFLOG_TRACE << "Emitting PeerFileOffer";
-        emit receivedFileOffer(msg);
-    } else if (type == "SetAvatar") {
-        PeerSetAvatarReq avatar{shared_from_this(), getConnectionId(), id,
-                    toQimage(json.object())};
-
-        LFLOG_TRACE << "Emitting PeerSetAvatarReq";
-        emit receivedAvatar(avatar);
-    } else if (type == "UserInfo") {
-        PeerUserInfo uinfo{shared_from_this(), getConnectionId(), id,
-                    json.object().value("nick-name").toString()};
-
-        LFLOG_TRACE << "Emitting PeerUserInfo";
-        emit receivedUserInfo(uinfo);
-    } else {
-        LFLOG_WARN << "Unrecognized request from peer at connection "
-                   << getConnectionId().toString();
+            auto single = entry.toMap();
+            single.insert(QStringLiteral("what"), QStringLiteral("IncomingFile"));
+            single.insert(QStringLiteral("status"), msg.value(QStringLiteral("status")));
+            emitAck(id, single);
+        }
+        return;
+    }
+
+    // Flow control for a transfer is handled here. The Contact don't need to know.
+    if (msg.value(QStringLiteral("what")).toString() == QStringLiteral("IncomingFile")) {
+        const auto status = msg.value(QStringLiteral("status")).toString();
+        if ((status == QStringLiteral("Pause")) || (status == QStringLiteral("Continue"))) {
+            onReceivedFlowControl(msg);
+            return;
+        }
+    }
+
+    QVariantMap params;
+    for(auto it = msg.constBegin(); it != msg.constEnd(); ++it) {
+        const auto key = it.key().toString();
+        static const QRegExp irrelevant{"what|status|type"};
+        if (key.count(irrelevant)) {
+            continue;
+        }
+        if (it.value().isArray()) {
+            QStringList list;
+            for(const auto& v : it.value().toArray()) {
+                list << ControlCodec::toText(v);
+            }
+            params.insert(key, list);
+            continue;
+        }
+        if (it.value().isByteArray()) {
+            params.insert(key, it.value().toByteArray());
+            continue;
+        }
+        params.insert(key, ControlCodec::toText(it.value()));
+    }
+
+    PeerAck ack{shared_from_this(), getConnectionId(), id,
+                msg.value(QStringLiteral("what")).toString().toUtf8(),
+                msg.value(QStringLiteral("status")).toString().toUtf8(),
+                params};
+
+    LFLOG_TRACE << "Emitting Ack";
+    emit receivedAck(ack);
+}
+
+void Peer::emitMessage(const quint64 id, const QCborMap &msg)
+{
+    PeerMessage pm{shared_from_this(), getConnectionId(), id,
+                msg.value(QStringLiteral("conversation")).toByteArray(),
+                msg.value(QStringLiteral("message-id")).toByteArray(),
+                QDateTime::fromString(msg.value(QStringLiteral("date")).toString(), Qt::ISODate),
+                msg.value(QStringLiteral("content")).toString(),
+                msg.value(QStringLiteral("from")).toByteArray(),
+                toEncoding(msg.value(QStringLiteral("encoding")).toString()),
+                msg.value(QStringLiteral("signature")).toByteArray()};
+
+    LFLOG_TRACE << "Emitting PeerMessage";
+    emit receivedMessage(pm);
+}
+
+void Peer::emitMessageBatch(const quint64 id, const QCborMap &msg)
+{
+    const auto messages = msg.value(QStringLiteral("messages")).toArray();
+
+    LFLOG_TRACE << "Received MessageBatch with " << messages.size() << " messages";
+
+    // Each message has it's own request id, starting with the frame's id
+    auto requestId = id;
+    for(const auto& m : messages) {
+        const auto mid = requestId++;
+        if (!m.isMap()) {
+            LFLOG_WARN << "Ignoring invalid entry in MessageBatch from connection "
+                       << getConnectionId().toString();
+            continue;
+        }
+        emitMessage(mid, m.toMap());
+    }
+}
+
+void Peer::emitFileOffer(const quint64 id, const QCborMap &msg)
+{
+    PeerFileOffer offer{shared_from_this(), getConnectionId(), id,
+                msg.value(QStringLiteral("conversation")).toByteArray(),
+                msg.value(QStringLiteral("file-id")).toByteArray(),
+                msg.value(QStringLiteral("name")).toString(),
+                msg.value(QStringLiteral("size")).toInteger(),
+                msg.value(QStringLiteral("rest")).toInteger(),
+                msg.value(QStringLiteral("file-type")).toString(),
+                msg.value(QStringLiteral("sha256")).toByteArray()};
+
+    // The leaf-size is given by the file-size. If the peer disagrees, we can't use its tree.
+    if (msg.contains(QStringLiteral("tree-hash"))) {
+        if (msg.value(QStringLiteral("leaf-size")).toInteger() == TreeHash::getLeafSize(offer.size)) {
+            offer.treeHash = msg.value(QStringLiteral("tree-hash")).toByteArray();
+        } else {
+            LFLOG_WARN << "Ignoring the tree-hash for file " << offer.fileId.toBase64()
+                       << ". Unexpected leaf-size.";
+        }
+    }
+
+    if (msg.contains(QStringLiteral("file-content"))) {
+        offer.hasContent = true;
+        offer.content = msg.value(QStringLiteral("file-content")).toByteArray();
+    }
+
+    LFLOG_TRACE << "Emitting PeerFileOffer";
+    emit receivedFileOffer(offer);
+}
+
+void Peer::emitFileOffers(const quint64 id, const QCborMap &msg)
+{
+    const auto offers = msg.value(QStringLiteral("files")).toArray();
+
+    LFLOG_TRACE << "Received IncomingFiles with " << offers.size() << " offers";
+
+    auto requestId = id;
+    for(const auto& offer : offers) {
+        const auto oid = requestId++;
+        if (!offer.isMap()) {
+            LFLOG_WARN << "Ignoring invalid entry in IncomingFiles from connection "
+                       << getConnectionId().toString();
+            continue;
+        }
+        emitFileOffer(oid, offer.toMap());
+    }
+}
+
+void Peer::emitAvatar(const quint64 id, const QCborMap &msg)
+{
+    PeerSetAvatarReq avatar{shared_from_this(), getConnectionId(), id,
+                toQimage(msg)};
+
+    LFLOG_TRACE << "Emitting PeerSetAvatarReq";
+    emit receivedAvatar(avatar);
+}
+
+void Peer::emitUserInfo(const quint64 id, const QCborMap &msg)
+{
+    PeerUserInfo uinfo{shared_from_this(), getConnectionId(), id,
+                msg.value(QStringLiteral("nick-name")).toString()};
+
+    LFLOG_TRACE << "Emitting PeerUserInfo";
+    emit receivedUserInfo(uinfo);
+}
+
+void Peer::onReceivedFeatures(const QCborMap &msg)
+{
+    peerFeatures_.clear();
+    QStringList names;
+    for(const auto& feature : msg.value(QStringLiteral("features")).toArray()) {
+        peerFeatures_.insert(feature.toString());
+        names << feature.toString();
+    }
+
+    inlineFileBytes_ = {};
+    if (peerFeatures_.count(feature_inline_files)) {
+        // The peer tells how much it wants inline. We use the lower limit.
+        const auto limit = ControlCodec::toText(msg.value(QStringLiteral("inline-file-bytes"))).toLongLong();
+        inlineFileBytes_ = min(max(limit, qint64{0}), max_inline_file_bytes);
+    }
+
+    LFLOG_DEBUG << "Peer at connection " << getConnectionId().toString()
+                << " supports: " << names.join(", ");
+}
+
+void Peer::onReceivedFileHashes(const QCborMap &msg)
+{
+    const auto channelId = static_cast<quint32>(msg.value(QStringLiteral("channel")).toInteger());
+    const auto it = inChannels_.find(channelId);
+    if (it == inChannels_.end()) {
+        LFLOG_WARN << "FileHashes for unknown channel #" << channelId
+                   << " on connection " << getConnectionId().toString();
+        return;
+    }
+
+    auto channel = static_pointer_cast<IncomingFileChannel>(it->second);
+    auto file = channel->getFile();
+    if (file->getFileId() != msg.value(QStringLiteral("file-id")).toByteArray()) {
+        LFLOG_WARN << "FileHashes for channel #" << channelId
+                   << " on connection " << getConnectionId().toString()
+                   << " is for another file.";
+        return;
+    }
+
+    if (file->getTreeHash().isEmpty()) {
+        return;
+    }
+
+    if (!channel->setLeafHashes(msg.value(QStringLiteral("leaf-size")).toInteger(),
+                                msg.value(QStringLiteral("leaf-hashes")).toByteArray())) {
+        file->transferFailed("The leaf hashes does not match the tree hash", File::FS_FAILED);
+        return;
+    }
+
+    LFLOG_TRACE << "Received leaf hashes for file #" << file->getId()
+                << " on channel #" << channelId;
+}
+
+void Peer::onReceivedFileSignatures(const QCborMap &msg)
+{
+    // The file is not validated until the receiver asks for it, and
+    // createChannel() looks for its signature.
+    DeltaBasis signature;
+    signature.blockSize = msg.value(QStringLiteral("block-size")).toInteger();
+    signature.signature = msg.value(QStringLiteral("signatures")).toByteArray();
+    const auto fileId = msg.value(QStringLiteral("file-id")).toByteArray();
+    const auto channelId = static_cast<quint32>(msg.value(QStringLiteral("channel")).toInteger());
+
+    if (fileId.isEmpty() || (channelId == 0)
+            || (signature.blockSize < Delta::minBlockSize)
+            || (signature.blockSize > Delta::maxBlockSize)
+            || !Delta::isValidSignature(signature.signature)) {
+        LFLOG_WARN << "Invalid FileSignatures on connection " << getConnectionId().toString();
+        return;
+    }
+
+    LFLOG_TRACE << "Received delta signature with "
+                << (signature.signature.size() / Delta::signatureBytes)
+                << " blocks for channel #" << channelId;
+
+    const auto now = chrono::steady_clock::now();
+    for (auto it = peerSignatures_.begin(); it != peerSignatures_.end();) {
+        if ((now - it->second.received) > peer_signature_timeout) {
+            LFLOG_DEBUG << "Dropping expired delta signature for channel #" << it->second.channel
+                        << " on connection " << getConnectionId().toString();
+            it = peerSignatures_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    if ((peerSignatures_.size() >= max_peer_signatures)
+            && (peerSignatures_.find(fileId) == peerSignatures_.end())) {
+        const auto oldest = min_element(peerSignatures_.begin(), peerSignatures_.end(),
+                                        [](const auto& left, const auto& right) {
+            return left.second.received < right.second.received;
+        });
+        LFLOG_DEBUG << "Too many pending delta signatures. Dropping the one for channel #"
+                    << oldest->second.channel << " on connection "
+                    << getConnectionId().toString();
+        peerSignatures_.erase(oldest);
+    }
+
+    peerSignatures_[fileId] = {channelId, move(signature), now};
+}
+
+void Peer::dropPeerSignatures(const quint32 channelId)
+{
+    for (auto it = peerSignatures_.begin(); it != peerSignatures_.end();) {
+        if (it->second.channel == channelId) {
+            it = peerSignatures_.erase(it);
+        } else {
+            ++it;
+        }
     }
 }
 
+void Peer::onReceivedFlowControl(const QCborMap &msg)
+{
+    const auto channelId = static_cast<quint32>(
+                ControlCodec::toText(msg.value(QStringLiteral("channel"))).toUInt());
+    if (outChannels_.find(channelId) == outChannels_.end()) {
+        LFLOG_DEBUG << "Flow control for unknown channel #" << channelId
+                    << " on connection " << getConnectionId().toString();
+        return;
+    }
+
+    if (msg.value(QStringLiteral("status")).toString() == QStringLiteral("Pause")) {
+        LFLOG_DEBUG << "Peer asked us to pause channel #" << channelId
+                    << " on connection " << getConnectionId().toString();
+        pausedChannels_.insert(channelId);
+        return;
+    }
+
+    LFLOG_DEBUG << "Peer asked us to continue channel #" << channelId
+                << " on connection " << getConnectionId().toString();
+    pausedChannels_.erase(channelId);
+
+    // Let the Contact send more data
+    if (!notificationsDisabled_) {
+        emit outputBufferEmptied();
+    }
+}
+
+bool Peer::canPauseTransfers() const noexcept
+{
+    return peerFeatures_.count(feature_flow_control) > 0;
+}
+
+bool Peer::canReceiveDirectories() const noexcept
+{
+    return peerFeatures_.count(feature_dir_archive) > 0;
+}
+
+void Peer::sendFeatures()
+{
+    QCborArray features;
+    for(const auto& feature : supported_features) {
+        features.append(QString{feature});
+    }
+
+    auto msg = ControlCodec::create(ControlCodec::Type::FEATURES);
+    msg.insert(QStringLiteral("features"), features);
+    msg.insert(QStringLiteral("inline-file-bytes"), max_inline_file_bytes);
+
+    LFLOG_DEBUG << "Sending Features over connection " << getConnectionId().toString();
+
+    // Always Json, as we don't yet know what the peer understands
+    const auto data = ControlCodec::encode(msg, ControlCodec::Encoding::JSON);
+    send(data.constData(), static_cast<size_t>(data.size()), /* channel */ 0);
+}
+
 void Peer::onCloseLater()
 {
     if (connection_->isOpen()) {
         connection_->close();
     }
 
+    const auto cstats = compressor_.getTotals();
+    if (cstats.compressedFrames || cstats.decompressedFrames) {
+        LFLOG_DEBUG << "Connection " << getConnectionId().toString()
+                    << " compressed " << cstats.compressedFrames << " frames to "
+                    << static_cast<int>(cstats.getRatio() * 100) << "% ("
+                    << cstats.bytesIn << " -> " << cstats.bytesOut << " bytes), decompressed "
+                    << cstats.decompressedFrames << " frames. Used " << cstats.cpuMs << " ms.";
+    }
+
     if (!notificationsDisabled_) {
         emit disconnectedFromPeer(shared_from_this());
     }
@@ -414,6 +1495,9 @@ void Peer::enableEncryptedStream()
 
     assert(inState_ == InState::DISABLED);
     wantChunkSize();
+
+    // Tell the peer what we support. Older versions just ignore the message.
+    sendFeatures();
 }
 
 void Peer::wantChunkSize()
@@ -422,9 +1506,14 @@ void Peer::wantChunkSize()
         return;
     }
 
-    LFLOG_TRACE << "Want chunk-len bytes (2) on " << connection_->getUuid().toString();
     inState_ = InState::CHUNK_SIZE;
-    connection_->wantBytes(2 + crypt_bytes);
+    if (protocolVersion_ >= 2) {
+        LFLOG_TRACE << "Want chunk-len bytes (4) on " << connection_->getUuid().toString();
+        connection_->wantBytes(v2_length_bytes);
+    } else {
+        LFLOG_TRACE << "Want chunk-len bytes (2) on " << connection_->getUuid().toString();
+        connection_->wantBytes(2 + crypt_bytes);
+    }
 }
 
 void Peer::wantChunkData(const size_t bytes)
@@ -447,45 +1536,33 @@ void Peer::processStream(const Peer::data_t &ciphertext)
 
     bool final = {};
     if (inState_ == InState::CHUNK_SIZE) {
-        array<uint8_t, 2> bytes = {};
-        mview_t data{bytes};
-        decrypt(data, ciphertext, final);
-        wantChunkData(qFromBigEndian(bytesToValue<quint16>(bytes)));
+        if (protocolVersion_ >= 2) {
+            assert(ciphertext.size() == inFrameLen_.size());
+            copy(ciphertext.cbegin(), ciphertext.cend(), inFrameLen_.begin());
+            const size_t len = qFromBigEndian(bytesToValue<quint32>(inFrameLen_));
+            if ((len < v2_min_header_bytes) || (len > (v2_max_header_bytes + max_v2_payload_bytes))) {
+                LFLOG_WARN << "Invalid frame length " << len << " on "
+                           << connection_->getUuid().toString();
+                throw runtime_error("Invalid frame length");
+            }
+            wantChunkData(len);
+        } else {
+            array<uint8_t, 2> bytes = {};
+            mview_t data{bytes};
+            decrypt(data, ciphertext, final);
+            wantChunkData(qFromBigEndian(bytesToValue<quint16>(bytes)));
+        }
     } else if (inState_ == InState::CHUNK_DATA){
 
         static const QByteArray binary = {"[binary]"};
-            assert(ciphertext.size() >= crypt_bytes + 5);
-        std::vector<uint8_t> buffer(ciphertext.size() - crypt_bytes);
-        mview_t buffer_view{buffer};
-        mview_t version{buffer.data(), 1};
-        mview_t channel{version.end(), 4};
-        mview_t id{channel.end(), 8};
-
-        const int payload_size = static_cast<int>(buffer.size())
-                - static_cast<int>(version.size())
-                - static_cast<int>(channel.size())
-                - static_cast<int>(id.size());
-
-        if (payload_size < 0) {
-            throw runtime_error("Payload size underflow");
-        }
 
-        mview_t payload{id.end(), static_cast<size_t>(payload_size)};
-
-        assert(buffer.size() == (+ version.size()
-                                 + channel.size()
-                                 + id.size()
-                                 + payload.size()));
-
-        decrypt(buffer_view, ciphertext, final);
-
-        if (version.at(0) != '\1') {
-            LFLOG_WARN << "Unknown chunk version" << static_cast<unsigned int>(version.at(0));
-            throw runtime_error("Unknown chunk version");
-        }
-
-        const auto channel_id = qFromBigEndian(bytesToValue<quint32>(channel));
-        const auto chunk_id = qFromBigEndian(bytesToValue<quint64>(id));
+        // Decrypt into a pooled buffer. The frame is returned to the pool when it goes out of scope.
+        Frame frame;
+        quint32 channel_id = {};
+        quint64 chunk_id = {};
+        const auto payload = (protocolVersion_ >= 2)
+                ? openFrameV2(frame, ciphertext, channel_id, chunk_id, final)
+                : openFrameV1(frame, ciphertext, channel_id, chunk_id, final);
 
         LFLOG_TRACE << "Received chunk on "
                     << connection_->getUuid().toString()
@@ -511,6 +1588,87 @@ void Peer::processStream(const Peer::data_t &ciphertext)
     }
 }
 
+Peer::mview_t Peer::openFrameV1(Peer::Frame &frame, const Peer::data_t &ciphertext,
+                                quint32 &channel_id, quint64 &chunk_id, bool &final)
+{
+    if (ciphertext.size() < (crypt_bytes + v1_header_bytes)) {
+        throw runtime_error("Payload size underflow");
+    }
+
+    frame = Frame{connection_->getBufferPoolPtr(), v1_header_bytes,
+            ciphertext.size() - crypt_bytes - v1_header_bytes};
+    auto buffer_view = frame.view();
+    auto header = frame.header();
+    mview_t version{header.data(), 1};
+    mview_t channel{version.end(), 4};
+    mview_t id{channel.end(), 8};
+    const auto payload = frame.payload();
+
+    assert(buffer_view.size() == (version.size()
+                                  + channel.size()
+                                  + id.size()
+                                  + payload.size()));
+
+    decrypt(buffer_view, ciphertext, final);
+
+    if (version.at(0) != '\1') {
+        LFLOG_WARN << "Unknown chunk version" << static_cast<unsigned int>(version.at(0));
+        throw runtime_error("Unknown chunk version");
+    }
+
+    channel_id = qFromBigEndian(bytesToValue<quint32>(channel));
+    chunk_id = qFromBigEndian(bytesToValue<quint64>(id));
+    return payload;
+}
+
+Peer::mview_t Peer::openFrameV2(Peer::Frame &frame, const Peer::data_t &ciphertext,
+                                quint32 &channel_id, quint64 &chunk_id, bool &final)
+{
+    if (ciphertext.size() < (crypt_bytes + v2_min_header_bytes)) {
+        throw runtime_error("Payload size underflow");
+    }
+
+    frame = Frame{connection_->getBufferPoolPtr(), 0, ciphertext.size() - crypt_bytes};
+    auto plaintext = frame.view();
+    decrypt(plaintext, ciphertext, final, mview_t{inFrameLen_});
+
+    const auto flags = plaintext.at(0);
+    if (flags & ~v2_known_flags) {
+        LFLOG_WARN << "Unknown frame flags " << static_cast<unsigned int>(flags);
+        throw runtime_error("Unknown frame flags");
+    }
+
+    size_t offset = 1;
+    auto used = varintToValue(plaintext.cdata() + offset, plaintext.size() - offset, channel_id);
+    if (!used) {
+        throw runtime_error("Invalid channel in frame header");
+    }
+    offset += used;
+
+    used = varintToValue(plaintext.cdata() + offset, plaintext.size() - offset, chunk_id);
+    if (!used) {
+        throw runtime_error("Invalid id in frame header");
+    }
+    offset += used;
+
+    mview_t payload{plaintext.data() + offset, plaintext.size() - offset};
+    if (flags & v2_flag_compressed) {
+        return compressor_.decompress(frame, payload, channel_id, max_v2_payload_bytes);
+    }
+
+    return payload;
+}
+
+void Peer::setProtocolVersion(const uint8_t version)
+{
+    assert(version >= 1 && version <= protocol_version);
+    assert(inState_ == InState::DISABLED);
+
+    LFLOG_DEBUG << "Using frame format version " << static_cast<unsigned int>(version)
+                << " on connection " << getConnectionId().toString();
+    protocolVersion_ = version;
+}
+
 void Peer::prepareEncryption(Peer::stream_state_t &state,
                              mview_t& header,
                              Peer::mview_t &key)
@@ -533,7 +1691,8 @@ void Peer::prepareDecryption(Peer::stream_state_t &state,
     }
 }
 
-void Peer::decrypt(Peer::mview_t &data, const Peer::mview_t &ciphertext,  bool& final)
+void Peer::decrypt(Peer::mview_t &data, const Peer::mview_t &ciphertext,  bool& final,
+                   const mview_t& additionalData)
 {
     assert((data.size() + crypt_bytes) == ciphertext.size());
     unsigned char tag = {};
@@ -543,7 +1702,8 @@ void Peer::decrypt(Peer::mview_t &data, const Peer::mview_t &ciphertext,  bool&
                                                    &tag,
                                                    ciphertext.cdata(),
                                                    ciphertext.size(),
-                                                   nullptr, 0) != 0) {
+                                                   additionalData.cdata(),
+                                                   additionalData.size()) != 0) {
         throw runtime_error("Decryption of stream failed");
     }
 
@@ -562,31 +1722,53 @@ void Peer::decrypt(Peer::mview_t &data, const Peer::mview_t &ciphertext,  bool&
 
 QByteArray Peer::safePayload(const Peer::mview_t &data)
 {
-    const auto json_text = data.toByteArray();
-    QJsonDocument json = QJsonDocument::fromJson(json_text);
-    if (!json.isNull()) {
-        return json_text;
+    try {
+        const auto msg = ControlCodec::decode(reinterpret_cast<const char *>(data.cdata()),
+                                              data.size());
+        return ControlCodec::encode(msg, ControlCodec::Encoding::JSON);
+    } catch(const std::exception&) {
+        ;
     }
 
-    return "*** NOT Json ***";
+    return "*** NOT a control message ***";
 }
 
-quint32 Peer::createChannel(const File &file)
+quint32 Peer::createChannel(const File &file, const bool allowResume, const bool allowDelta)
 {
     quint32 channelId = 0;
     auto filePtr = core::DsEngine::instance().getFileManager()->getFile(file.getId());
     Channel::ptr_t ch;
     if (file.getDirection() == File::INCOMING) {
-        ch = make_shared<IncomingFileChannel>(filePtr);
+        auto incoming = make_shared<IncomingFileChannel>(filePtr, allowResume, allowDelta);
         assert(inChannels_.find(nextInchannel_) == inChannels_.end());
         channelId = nextInchannel_;
-        inChannels_[channelId] = ch;
+        inChannels_[channelId] = ch = incoming;
         ++nextInchannel_;
+
+        connect(&incoming->getWriter(), &FileWriter::drained, this, [this, channelId]() {
+            const auto it = inChannels_.find(channelId);
+            if (it != inChannels_.end()) {
+                static_pointer_cast<IncomingFileChannel>(it->second)->onWriterDrained(*this);
+            }
+        });
     } else {
         channelId = file.getChannel();
         assert(channelId > 0);
         assert(outChannels_.find(channelId) == outChannels_.end());
-        ch = make_shared<OutgoingFileChannel>(filePtr);
+
+        // The receiver sends its signature just before it asks for the file
+        DeltaBasis signature;
+        const auto sig = peerSignatures_.find(file.getFileId());
+        if (sig != peerSignatures_.end()) {
+            if ((sig->second.channel == channelId)
+                    && ((chrono::steady_clock::now() - sig->second.received)
+                        <= peer_signature_timeout)) {
+                signature = move(sig->second.basis);
+            }
+            peerSignatures_.erase(sig);
+        }
+
+        ch = make_shared<OutgoingFileChannel>(filePtr, signature);
         outChannels_[channelId] = ch;
     }
 
@@ -605,7 +1787,14 @@ quint32 Peer::createChannel(const File &file)
 
 uint64_t Peer::startReceive(File &file)
 {
-    auto channelId = createChannel(file);
+    // Only ask for a resume if the peer knows how to seek, and for a
+    // delta if the signature fits in one message.
+    const auto& basis = file.getDeltaBasis();
+    const bool allowDelta = peerFeatures_.count(feature_delta)
+            && !basis.isEmpty()
+            && (static_cast<size_t>(basis.signature.size() + 256) < getMaxFramePayload());
+    auto channelId = createChannel(file, peerFeatures_.count(feature_resume) > 0, allowDelta);
+    const auto& channel = static_cast<const IncomingFileChannel&>(*inChannels_.at(channelId));
 
     LFLOG_DEBUG << "Preparing to start receiving file #" << file.getId()
                 << " \"" << file.getName()
@@ -617,18 +1806,34 @@ uint64_t Peer::startReceive(File &file)
                 << " with channel #"
                 << channelId;
 
-    const auto params = QVariantMap {
-            {"rest", QString::number(0)},
+    auto params = QVariantMap {
+            {"rest", QString::number(channel.getRest())},
             {"data", QString{file.getFileId().toBase64()}},
             {"channel", channelId}
     };
 
+    if (channel.getRest() > 0) {
+        params.insert("rest-hash", channel.getRestHash());
+    }
+
+    if (channel.isDelta()) {
+        auto msg = ControlCodec::create(ControlCodec::Type::FILE_SIGNATURES);
+        msg.insert(QStringLiteral("file-id"), file.getFileId());
+        msg.insert(QStringLiteral("channel"), static_cast<qint64>(channelId));
+        msg.insert(QStringLiteral("block-size"), basis.blockSize);
+        msg.insert(QStringLiteral("signatures"), basis.signature);
+
+        LFLOG_DEBUG << "Asking for a delta against \"" << basis.path
+                    << "\" for file #" << file.getId();
+        send(msg);
+    }
+
     LFLOG_DEBUG << "Requesting File : " << file.getId()
                 << " with channel #" << channelId
+                << " from offset " << channel.getRest()
                 << " over connection " << getConnectionId().toString();
 
     const auto rval = sendAck("IncomingFile", "Proceed", params);
-    file.clearBytesTransferred();
     file.setState(File::FS_TRANSFERRING);
     file.setChannel(channelId);
     return rval;
@@ -637,7 +1842,21 @@ uint64_t Peer::startReceive(File &file)
 uint64_t Peer::startSend(File &file)
 {
     auto channelId = createChannel(file);
-    file.clearBytesTransferred();
+
+    // Control messages are sent before file data, so the receiver
+    // has the leaf hashes before the first chunk arrives.
+    if (peerFeatures_.count(feature_tree_hash) && !file.getLeafHashes().isEmpty()) {
+        auto msg = ControlCodec::create(ControlCodec::Type::FILE_HASHES);
+        msg.insert(QStringLiteral("file-id"), file.getFileId());
+        msg.insert(QStringLiteral("channel"), static_cast<qint64>(channelId));
+        msg.insert(QStringLiteral("leaf-size"), TreeHash::getLeafSize(file.getSize()));
+        msg.insert(QStringLiteral("leaf-hashes"), file.getLeafHashes());
+
+        LFLOG_DEBUG << "Sending FileHashes for file #" << file.getId()
+                    << " over connection " << getConnectionId().toString();
+        send(msg);
+    }
+
     file.setState(File::FS_TRANSFERRING);
     return outChannels_.at(channelId)->onOutgoing(*this);
 }
@@ -666,10 +1885,51 @@ void Peer::useConnection(ConnectionSocket *cc)
     connect(connection_.get(), &ConnectionSocket::outputBufferEmptied,
             this, [this]() {
 
+        if (!tryPump()) {
+            return;
+        }
+
         if (!notificationsDisabled_) {
             emit outputBufferEmptied();
         }
     }, Qt::QueuedConnection);
+
+    // Refill the connection as soon as the backlog is below the limit,
+    // not only when it's empty, so the pipe don't go idle between refills.
+    connect(connection_.get(), &ConnectionSocket::bytesWritten,
+            this, [this]() {
+
+        if (scheduler_.empty()
+                || ((connection_->getOutputQueueBytes()
+                     + static_cast<size_t>(connection_->bytesToWrite()))
+                    >= max_data_backlog_bytes)) {
+            return;
+        }
+
+        if (!tryPump()) {
+            return;
+        }
+
+        // The file channels can queue more while the connection still has data
+        if (scheduler_.empty() && !notificationsDisabled_) {
+            emit outputBufferEmptied();
+        }
+    });
+}
+
+bool Peer::tryPump()
+{
+    try {
+        pump();
+    } catch(const std::exception& ex) {
+        LFLOG_ERROR << "Caught exception while sending on connection "
+                    << getConnectionId().toString()
+                    << ": " << ex.what();
+        close();
+        return false;
+    }
+
+    return true;
 }
 
 QUuid Peer::getConnectionId() const
@@ -704,21 +1964,100 @@ uint64_t Peer::sendAck(const QString &what, const QString &status, const QString
 
 uint64_t Peer::sendAck(const QString &what, const QString &status, const QVariantMap &params)
 {
-    auto object = QJsonObject{
-        {"type", "Ack"},
-        {"what", what},
-        {"status", status},
-    };
+    if ((what == QStringLiteral("IncomingFile")) && peerFeatures_.count(feature_file_batch)) {
+        // Acks for files tend to come in bursts, when a batch is offered
+        // or accepted. Send all the acks from this round in the event-loop
+        // together.
+        QCborMap entry;
+        for(auto it = params.constBegin(); it != params.constEnd(); ++it) {
+            entry.insert(it.key(), toAckValue(it.value()));
+        }
+
+        if (pendingFileAcks_.empty()) {
+            QTimer::singleShot(0, this, [this]() {
+                flushFileAcks();
+            });
+        }
+
+        pendingFileAcks_.emplace_back(status, move(entry));
+        return 0;
+    }
+
+    auto msg = ControlCodec::create(ControlCodec::Type::ACK);
+    msg.insert(QStringLiteral("what"), what);
+    msg.insert(QStringLiteral("status"), status);
 
     for(auto it = params.constBegin(); it != params.constEnd(); ++it) {
-        object.insert(it.key(), it.value().toString());
+        msg.insert(it.key(), toAckValue(it.value()));
     }
 
     LFLOG_DEBUG << "Sending Ack: " << what
                 << " with status: " << status
                 << " over connection " << getConnectionId().toString();
 
-    return send(QJsonDocument{object});
+    return send(msg);
+}
+
+void Peer::flushFileAcks()
+{
+    auto pending = move(pendingFileAcks_);
+    pendingFileAcks_.clear();
+
+    if (!isConnected()) {
+        return;
+    }
+
+    // Keep the order. Consecutive acks with the same status go in one message.
+    for(auto it = pending.begin(); it != pending.end();) {
+        const auto& status = it->first;
+        QCborArray files;
+        for(; (it != pending.end()) && (it->first == status); ++it) {
+            files.append(it->second);
+        }
+
+        LFLOG_DEBUG << "Sending Ack: IncomingFiles for " << files.size()
+                    << " files with status: " << status
+                    << " over connection " << getConnectionId().toString();
+
+        auto msg = ControlCodec::create(ControlCodec::Type::ACK);
+        msg.insert(QStringLiteral("what"), QStringLiteral("IncomingFiles"));
+        msg.insert(QStringLiteral("status"), status);
+        msg.insert(QStringLiteral("files"), files);
+
+        try {
+            send(msg);
+        } catch(const std::exception& ex) {
+            LFLOG_WARN << "Failed to send file acks: " << ex.what();
+            return;
+        }
+    }
+}
+
+uint64_t Peer::sendMessageAcks(const QString &status, const std::vector<QByteArray> &messageIds)
+{
+    if (messageIds.size() == 1 || !peerFeatures_.count(feature_message_acks)) {
+        uint64_t rval = {};
+        for(const auto& id : messageIds) {
+            rval = sendAck("Message", status, id.toBase64());
+        }
+        return rval;
+    }
+
+    QCborArray ids;
+    for(const auto& id : messageIds) {
+        ids.append(id);
+    }
+
+    auto msg = ControlCodec::create(ControlCodec::Type::ACK);
+    msg.insert(QStringLiteral("what"), QStringLiteral("Messages"));
+    msg.insert(QStringLiteral("status"), status);
+    msg.insert(QStringLiteral("message-ids"), ids);
+
+    LFLOG_DEBUG << "Sending Ack: Messages for " << messageIds.size()
+                << " messages with status: " << status
+                << " over connection " << getConnectionId().toString();
+
+    return send(msg);
 }
 
 bool Peer::isConnected() const noexcept
@@ -728,71 +2067,190 @@ bool Peer::isConnected() const noexcept
 
 uint64_t Peer::sendUserInfo(const UserInfo &userInfo)
 {
-    auto json = QJsonDocument{
-        QJsonObject{
-            {"type", "UserInfo"},
-            {"nick-name", userInfo.nickName}
-        }
-    };
+    auto msg = ControlCodec::create(ControlCodec::Type::USER_INFO);
+    msg.insert(QStringLiteral("nick-name"), userInfo.nickName);
 
     LFLOG_DEBUG << "Sending UserInfo over connection " << getConnectionId().toString();
 
-    return send(json);
+    return send(msg);
 };
 
-uint64_t Peer::sendMessage(const core::Message &message)
+QCborMap Peer::toMessageMap(const Message &message) const
 {
-    auto json = QJsonDocument{
-        QJsonObject{
-            {"type", "Message"},
-            {"message-id", QString{message.getData().messageId.toBase64()}},
-            {"date", message.getData().composedTime.toString(Qt::ISODate)},
-            {"content", message.getData().content},
-            {"encoding", encoding_names.at(static_cast<size_t>(message.getData().encoding))},
-            {"conversation", QString{message.getData().conversation.toBase64()}},
-            {"from", QString{message.getData().sender.toBase64()}},
-            {"signature", QString{message.getData().signature.toBase64()}}
-        }
-    };
+    const auto& data = message.getData();
+    auto msg = ControlCodec::create(ControlCodec::Type::MESSAGE);
+    msg.insert(QStringLiteral("message-id"), data.messageId);
+    msg.insert(QStringLiteral("date"), data.composedTime.toString(Qt::ISODate));
+    msg.insert(QStringLiteral("content"), data.content);
+    msg.insert(QStringLiteral("encoding"), encoding_names.at(static_cast<size_t>(data.encoding)));
+    msg.insert(QStringLiteral("conversation"), data.conversation);
+    msg.insert(QStringLiteral("from"), data.sender);
+    msg.insert(QStringLiteral("signature"), data.signature);
+    return msg;
+}
 
+uint64_t Peer::sendMessage(const core::Message &message)
+{
     LFLOG_DEBUG << "Sending Message: " << message.getId()
                 << " over connection " << getConnectionId().toString();
 
-    return send(json);
+    return send(toMessageMap(message));
+}
+
+uint64_t Peer::sendMessages(const std::vector<Message::ptr_t> &messages)
+{
+    if (messages.size() == 1 || !peerFeatures_.count(feature_message_batch)) {
+        uint64_t sent = {};
+        for(const auto& message : messages) {
+            try {
+                sendMessage(*message);
+            } catch(const std::exception& ex) {
+                if (!sent) {
+                    throw;
+                }
+                LFLOG_WARN << "Sent only " << sent << " of " << messages.size()
+                           << " messages: " << ex.what();
+                break;
+            }
+            ++sent;
+        }
+        return sent;
+    }
+
+    QCborArray batch;
+    for(const auto& message : messages) {
+        batch.append(toMessageMap(*message));
+    }
+
+    LFLOG_DEBUG << "Sending MessageBatch with " << messages.size()
+                << " messages over connection " << getConnectionId().toString();
+
+    return sendBatch(ControlCodec::Type::MESSAGE_BATCH, QStringLiteral("messages"), batch);
+}
+
+size_t Peer::sendBatch(const ControlCodec::Type type, const QString& key,
+                       const QCborArray &items)
+{
+    auto msg = ControlCodec::create(type);
+    msg.insert(key, items);
+
+    const auto encoding = peerFeatures_.count(feature_cbor)
+            ? ControlCodec::Encoding::CBOR
+            : ControlCodec::Encoding::JSON;
+    const auto data = ControlCodec::encode(msg, encoding);
+
+    // The caller budgets on the raw size. If the encoded
+    // batch still don't fit in a frame, split it in two.
+    if ((static_cast<size_t>(data.size()) > getMaxFramePayload()) && (items.size() > 1)) {
+        const auto half = items.size() / 2;
+        QCborArray first, second;
+        for(auto i = decltype(half){0}; i < items.size(); ++i) {
+            (i < half ? first : second).append(items.at(i));
+        }
+
+        // If the first half was sent, the caller must know about it,
+        // even if the second half fails.
+        const auto sent = sendBatch(type, key, first);
+        if (sent < static_cast<size_t>(first.size())) {
+            return sent;
+        }
+        try {
+            return sent + sendBatch(type, key, second);
+        } catch(const std::exception& ex) {
+            LFLOG_WARN << "Sent only " << sent << " of " << items.size()
+                       << " items in a batch: " << ex.what();
+            return sent;
+        }
+    }
+
+    send(data.constData(), static_cast<size_t>(data.size()),
+         /* channel */ 0, /* final */ false, static_cast<quint32>(items.size()));
+    return static_cast<size_t>(items.size());
 }
 
 uint64_t Peer::sendAvatar(const QImage &avatar)
 {
-    auto obj = toJson(avatar);
-    obj.insert("type", "SetAvatar");
-    auto json = QJsonDocument{
-        QJsonObject{ move(obj) }
-    };
+    auto msg = ControlCodec::create(ControlCodec::Type::SET_AVATAR);
+    addImage(msg, avatar);
 
     LFLOG_DEBUG << "Sending Avatar over connection " << getConnectionId().toString();
 
-    return send(json);
+    return send(msg);
 }
 
-uint64_t Peer::offerFile(const File &file)
+QCborMap Peer::toFileOfferMap(File &file) const
 {
-    auto json = QJsonDocument{
-        QJsonObject{
-            {"type", "IncomingFile"},
-            {"sha256", QString{file.getHash().toBase64()}},
-            {"name", file.getName()},
-            {"size", QString::number(file.getSize())},
-            {"file-type", "binary"},
-            {"rest", QString::number(0)},
-            {"file-id", QString{file.getFileId().toBase64()}},
-            {"conversation", QString{file.getConversation()->getHash().toBase64()}},
-        }
-    };
+    auto msg = ControlCodec::create(ControlCodec::Type::INCOMING_FILE);
+    msg.insert(QStringLiteral("sha256"), file.getHash());
+    msg.insert(QStringLiteral("name"), file.getName());
+    msg.insert(QStringLiteral("size"), file.getSize());
+    msg.insert(QStringLiteral("file-type"), file.isDirectory()
+               ? QStringLiteral("directory") : QStringLiteral("binary"));
+    msg.insert(QStringLiteral("rest"), 0);
+    msg.insert(QStringLiteral("file-id"), file.getFileId());
+    msg.insert(QStringLiteral("conversation"), file.getConversation()->getHash());
+
+    if (peerFeatures_.count(feature_tree_hash) && !file.getTreeHash().isEmpty()) {
+        msg.insert(QStringLiteral("tree-hash"), file.getTreeHash());
+        msg.insert(QStringLiteral("leaf-size"), TreeHash::getLeafSize(file.getSize()));
+    }
+
+    // Small files are sent with the offer, so the receiver don't need to ask for them
+    QByteArray content;
+    const auto inlined = !file.isDirectory() && (file.getSize() <= inlineFileBytes_)
+            && readInlineContent(file, content);
+    if (inlined) {
+        LFLOG_TRACE << "Sending file #" << file.getId() << " inline with the offer";
+        msg.insert(QStringLiteral("file-content"), content);
+    }
+
+    // Only then can the receiver answer "Completed" right away
+    file.setSentInline(inlined);
+    return msg;
+}
 
+uint64_t Peer::offerFile(File &file)
+{
     LFLOG_DEBUG << "Sending File Offer for file: " << file.getId()
                 << " over connection " << getConnectionId().toString();
 
-    return send(json);
+    return send(toFileOfferMap(file));
+}
+
+uint64_t Peer::offerFiles(const std::vector<File::ptr_t> &files)
+{
+    if (files.size() == 1 || !peerFeatures_.count(feature_file_batch)) {
+        uint64_t sent = {};
+        for(const auto& file : files) {
+            try {
+                offerFile(*file);
+            } catch(const std::exception& ex) {
+                if (!sent) {
+                    throw;
+                }
+                LFLOG_WARN << "Offered only " << sent << " of " << files.size()
+                           << " files: " << ex.what();
+                break;
+            }
+            ++sent;
+        }
+        return sent;
+    }
+
+    QCborArray offers;
+    for(const auto& file : files) {
+        offers.append(toFileOfferMap(*file));
+    }
+
+    LFLOG_DEBUG << "Sending File Offers for " << files.size()
+                << " files over connection " << getConnectionId().toString();
+
+    return sendBatch(ControlCodec::Type::INCOMING_FILES, QStringLiteral("files"), offers);
+}
+
+size_t Peer::getMaxFilesInOffer() const noexcept
+{
+    return peerFeatures_.count(feature_file_batch) ? max_files_in_offer : 1;
 }
 
 uint64_t Peer::startTransfer(File &file)
@@ -821,8 +2279,24 @@ uint64_t Peer::sendSome(File &file)
         return {};
     }
 
+    const auto channel = file.getChannel();
+    const auto before = scheduler_.getStats(channel);
+    if (before.queuedFrames) {
+        // Wait until the scheduler has sent what we already have for this file
+        return before.queuedFrames;
+    }
+
+    if (pausedChannels_.count(channel)) {
+        // The receiver's disk is behind
+        return {};
+    }
+
     auto instance = it->second;
-    return instance->onOutgoing(*this);
+    instance->onOutgoing(*this);
+
+    // What we queued now, including what pump() already handed to the connection
+    const auto after = scheduler_.getStats(channel);
+    return (after.sentFrames - before.sentFrames) + after.queuedFrames;
 }
 
 void Peer::disableNotifications()
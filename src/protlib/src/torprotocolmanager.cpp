@@ -2,10 +2,8 @@
 #include <cassert>
 #include <array>
 
-#include <QJsonObject>
-#include <QJsonDocument>
-
 #include "ds/torprotocolmanager.h"
+#include "ds/controlcodec.h"
 #include "ds/errors.h"
 #include "logfault/logfault.h"
 
@@ -161,17 +159,13 @@ TorServiceInterface& TorProtocolManager::getService(const QUuid& service)
 
 uint64_t TorProtocolManager::sendAddme(const AddmeReq& req)
 {
-    auto json = QJsonDocument{
-        QJsonObject{
-            {"type", "AddMe"},
-            {"nick", req.nickName},
-            {"address", getService(req.service).getAddress()},
-            {"message", req.message}
-        }
-    };
+    auto msg = ControlCodec::create(ControlCodec::Type::ADD_ME);
+    msg.insert(QStringLiteral("nick"), req.nickName);
+    msg.insert(QStringLiteral("address"), getService(req.service).getAddress());
+    msg.insert(QStringLiteral("message"), req.message);
 
     if (auto peer = getService(req.service).getPeer(req.connection)) {
-        return peer->send(json);
+        return peer->send(msg);
     }
 
     throw runtime_error("Failed to access peer while sending addme");
@@ -224,7 +218,8 @@ void TorProtocolManager::startService(const QUuid& serviceId,
     sp.key_type = data["key_type"].toByteArray();
     sp.service_id = data["service_id"].toByteArray();
 
-    auto service = make_shared<TorServiceInterface>(cert, data["address"].toByteArray(), serviceId);
+    auto service = make_shared<TorServiceInterface>(cert, data["address"].toByteArray(),
+                                                    serviceId, legacyPeers_);
 
     // Add listening port
     auto properties = service->startService();
@@ -13,8 +13,10 @@ using namespace std;
 
 TorServiceInterface::TorServiceInterface(crypto::DsCert::ptr_t cert,
                                          const QByteArray& address,
-                                         const QUuid& identityId)
+                                         const QUuid& identityId,
+                                         LegacyPeers::ptr_t legacyPeers)
     : cert_{move(cert)}, address_{address}, identityId_{identityId}
+    , legacyPeers_{move(legacyPeers)}
 {
 }
 
@@ -74,7 +76,7 @@ TorServiceInterface::connectToService(const QByteArray &host, const uint16_t por
                 << host << ":" << port
                 << " with connection-id " << connection->getUuid().toString();
 
-    auto client = make_shared<DsClient>(connection, move(cd));
+    auto client = make_shared<DsClient>(connection, move(cd), legacyPeers_);
 
     connect(client.get(), &core::PeerConnection::disconnectedFromPeer,
             this, [this](const std::shared_ptr<core::PeerConnection>& peer) {
@@ -23,10 +23,10 @@ Page {
         }
     }
 
+    // The newest message is the first row, at the bottom of the list
     function scrollToEnd() {
-        var newIndex = list.count - 1; // last index
-        list.positionViewAtEnd();
-        list.currentIndex = newIndex;
+        list.positionViewAtBeginning();
+        list.currentIndex = 0;
     }
 
     Connections {
@@ -44,14 +44,16 @@ Page {
         anchors.top: parent.top
         anchors.topMargin: 4
         highlightRangeMode: ListView.NoHighlightRange
+        verticalLayoutDirection: ListView.BottomToTop
         spacing: 4
         clip: true
         ScrollBar.vertical: ScrollBar { id: scrollbar}
         model: messages
 
-        // Scroll to the end
+        // Scroll to the end when a new message is added below the current one.
+        // Older messages are added at the top when they are fetched.
         onCountChanged: {
-            if (currentIndex === -1 || currentIndex === (count -2)) {
+            if (currentIndex === -1 || currentIndex === 1) {
                 scrollToEnd()
             }
         }
@@ -110,7 +110,7 @@ Item {
         anchors.leftMargin: 0
         from: 0.0
         to: 1.0
-        value: cFile.progress
+        value: cFile.state === File.FS_HASHING ? cFile.hashProgress : cFile.progress
     }
 
     MouseArea {
@@ -3,6 +3,15 @@
 #include <iostream>
 #include "ds/crypto.h"
 #include "tst_dsengine.h"
+#include "tst_treehash.h"
+#include "tst_dirarchive.h"
+#include "tst_delta.h"
+#include "tst_statementcache.h"
+#include "tst_dirtytracker.h"
+#include "tst_dbexecutor.h"
+#include "tst_database.h"
+#include "tst_fileresume.h"
+#include "tst_hashcache.h"
 
 #include "logfault/logfault.h"
 
@@ -28,6 +37,51 @@ int main(int argc, char** argv)
          status |= QTest::qExec(&tc, argc, argv);
      }
 
+     {
+         TestTreeHash tc;
+         status |= QTest::qExec(&tc, argc, argv);
+     }
+
+     {
+         TestDirArchive tc;
+         status |= QTest::qExec(&tc, argc, argv);
+     }
+
+     {
+         TestDelta tc;
+         status |= QTest::qExec(&tc, argc, argv);
+     }
+
+     {
+         TestStatementCache tc;
+         status |= QTest::qExec(&tc, argc, argv);
+     }
+
+     {
+         TestDirtyTracker tc;
+         status |= QTest::qExec(&tc, argc, argv);
+     }
+
+     {
+         TestDbExecutor tc;
+         status |= QTest::qExec(&tc, argc, argv);
+     }
+
+     {
+         TestDatabase tc;
+         status |= QTest::qExec(&tc, argc, argv);
+     }
+
+     {
+         TestFileResume tc;
+         status |= QTest::qExec(&tc, argc, argv);
+     }
+
+     {
+         TestHashCache tc;
+         status |= QTest::qExec(&tc, argc, argv);
+     }
+
 
     return status;
 }
@@ -0,0 +1,17 @@
+#ifndef TEST_HELPERS_H
+#define TEST_HELPERS_H
+
+#include <memory>
+#include <QSettings>
+#include <QString>
+
+// Settings for a Database at /dbpath/, with everything else at the defaults
+inline std::unique_ptr<QSettings> makeSettings(const QString& dbpath = QStringLiteral(":memory:"))
+{
+    auto settings = std::make_unique<QSettings>();
+    settings->clear();
+    settings->setValue("dbpath", dbpath);
+    return settings;
+}
+
+#endif // TEST_HELPERS_H
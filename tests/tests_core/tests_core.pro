@@ -7,10 +7,29 @@ TEMPLATE = app
 
 SOURCES +=  \
     main.cpp \
-    tst_dsengine.cpp
+    tst_dsengine.cpp \
+    tst_treehash.cpp \
+    tst_dirarchive.cpp \
+    tst_delta.cpp \
+    tst_statementcache.cpp \
+    tst_dirtytracker.cpp \
+    tst_dbexecutor.cpp \
+    tst_database.cpp \
+    tst_fileresume.cpp \
+    tst_hashcache.cpp
 
 HEADERS += \
-    tst_dsengine.h
+    tst_dsengine.h \
+    tst_treehash.h \
+    tst_dirarchive.h \
+    tst_delta.h \
+    tst_statementcache.h \
+    tst_dirtytracker.h \
+    tst_dbexecutor.h \
+    tst_database.h \
+    tst_fileresume.h \
+    tst_hashcache.h \
+    test_helpers.h
 
 INCLUDEPATH += \
     $$PWD/../../dependencies/logfault/include \
@@ -0,0 +1,154 @@
+#include <QDateTime>
+#include <QSqlQuery>
+#include <QSqlRecord>
+#include <QTemporaryDir>
+
+#include "tst_database.h"
+#include "test_helpers.h"
+#include "ds/database.h"
+
+using namespace ds::core;
+
+namespace {
+
+const QStringList indexes = {
+    "ix_message_message_id",
+    "ix_file_file_id",
+    "ix_file_contact_state",
+    "ix_conversation_updated",
+    "ix_contact_auto_connect",
+    "ix_message_conversation_sort",
+    "ix_file_conversation_sort",
+    "ix_hash_cache_used"
+};
+
+bool hasIndex(QSqlDatabase& db, const QString& name)
+{
+    QSqlQuery query{db};
+    query.prepare("SELECT name FROM sqlite_master WHERE type='index' AND name=:name");
+    query.bindValue(":name", name);
+    return query.exec() && query.next();
+}
+
+} // anonymous namespace
+
+void TestDatabase::test_new_database_version()
+{
+    auto settings = makeSettings(":memory:");
+    Database db{*settings};
+
+    QCOMPARE(db.getVersion(), Database::getCurrentVersion());
+    for(const auto& name : indexes) {
+        QVERIFY2(hasIndex(db.getDb(), name), qPrintable(name));
+    }
+}
+
+void TestDatabase::test_upgrade()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    auto settings = makeSettings(dir.filePath("test.db"));
+
+    // The times as Qt writes local times, and as they may come from peers
+    const QStringList times = {
+        "2020-01-01T12:00:00.000",
+        "2020-01-01T11:00:00Z",
+        "2020-01-01T13:00:00.000+02:00"
+    };
+
+    // Make it look like a database from version 4
+    {
+        Database db{*settings};
+        QSqlQuery query{db.getDb()};
+        for(const auto& name : indexes) {
+            QVERIFY(query.exec(QStringLiteral("DROP INDEX %1").arg(name)));
+        }
+        if (!query.exec("ALTER TABLE message DROP COLUMN sort_time")) {
+            QSKIP("This version of SQLite can't drop columns");
+        }
+        QVERIFY(query.exec("ALTER TABLE file DROP COLUMN sort_time"));
+        QVERIFY(query.exec("ALTER TABLE hash_cache DROP COLUMN used"));
+
+        for(const auto& when : times) {
+            query.prepare("INSERT INTO message (direction, state, conversation_id, conversation, "
+                          "message_id, composed_time, content, signature, sender, encoding) "
+                          "VALUES (0, 0, 1, '', '', :time, '', '', '', 0)");
+            query.bindValue(":time", when);
+            QVERIFY(query.exec());
+        }
+        QVERIFY(query.exec("UPDATE ds SET version=4"));
+    }
+
+    Database db{*settings};
+    QCOMPARE(db.getVersion(), Database::getCurrentVersion());
+    for(const auto& name : indexes) {
+        QVERIFY2(hasIndex(db.getDb(), name), qPrintable(name));
+    }
+
+    // sort_time is the same instant in UTC seconds, whatever the format
+    QSqlQuery query{db.getDb()};
+    QVERIFY(query.exec("SELECT composed_time, sort_time FROM message"));
+    int rows = 0;
+    while(query.next()) {
+        const auto expected = QDateTime::fromString(query.value(0).toString(), Qt::ISODateWithMs);
+        QCOMPARE(query.value(1).toLongLong(), expected.toSecsSinceEpoch());
+        ++rows;
+    }
+    QCOMPARE(rows, times.size());
+}
+
+void TestDatabase::test_query_plans_data()
+{
+    QTest::addColumn<QString>("sql");
+    QTest::addColumn<QString>("index");
+
+    QTest::newRow("message by message-id")
+            << "SELECT id FROM message WHERE message_id=:a and direction=:b"
+            << "ix_message_message_id";
+    QTest::newRow("file by file-id")
+            << "SELECT id FROM file WHERE file_id=:a AND conversation_id=:b"
+            << "ix_file_file_id";
+    QTest::newRow("file queue")
+            << "SELECT id FROM file WHERE contact_id=:a AND direction=:b AND state=:c"
+            << "ix_file_contact_state";
+    QTest::newRow("conversations")
+            << "SELECT uuid FROM conversation WHERE identity=:a ORDER BY updated DESC"
+            << "ix_conversation_updated";
+    QTest::newRow("auto-connect contacts")
+            << "SELECT uuid FROM contact WHERE identity=:a AND auto_connect=1"
+            << "ix_contact_auto_connect";
+    QTest::newRow("message page")
+            << "SELECT id FROM message WHERE conversation_id=:a AND sort_time <= :b AND (sort_time < :b OR id < :c) ORDER BY sort_time DESC, id DESC LIMIT 100"
+            << "ix_message_conversation_sort";
+    QTest::newRow("file page")
+            << "SELECT id FROM file WHERE conversation_id=:a AND sort_time <= :b AND (sort_time < :b OR id < :c) ORDER BY sort_time DESC, id DESC LIMIT 100"
+            << "ix_file_conversation_sort";
+}
+
+void TestDatabase::test_query_plans()
+{
+    QFETCH(QString, sql);
+    QFETCH(QString, index);
+
+    auto settings = makeSettings(":memory:");
+    Database db{*settings};
+
+    QSqlQuery query{db.getDb()};
+    QVERIFY(query.prepare("EXPLAIN QUERY PLAN " + sql));
+    for(const auto& name : {":a", ":b", ":c"}) {
+        if (sql.contains(name)) {
+            query.bindValue(name, 1);
+        }
+    }
+    QVERIFY(query.exec());
+
+    QString plan;
+    const auto detail = query.record().indexOf("detail");
+    QVERIFY(detail >= 0);
+    while(query.next()) {
+        plan += query.value(detail).toString() + "\n";
+    }
+
+    QVERIFY2(plan.contains(index), qPrintable(plan));
+    QVERIFY2(!plan.contains("TEMP B-TREE"), qPrintable(plan));
+}
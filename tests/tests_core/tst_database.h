@@ -0,0 +1,19 @@
+#ifndef TST_DATABASE_H
+#define TST_DATABASE_H
+
+#include <QtTest>
+
+class TestDatabase : public QObject
+{
+    Q_OBJECT
+public:
+    TestDatabase() = default;
+
+private slots:
+    void test_new_database_version();
+    void test_upgrade();
+    void test_query_plans();
+    void test_query_plans_data();
+};
+
+#endif // TST_DATABASE_H
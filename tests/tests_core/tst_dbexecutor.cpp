@@ -0,0 +1,122 @@
+#include <QSqlQuery>
+#include <QTemporaryDir>
+
+#include "tst_dbexecutor.h"
+#include "test_helpers.h"
+#include "ds/database.h"
+#include "ds/dbexecutor.h"
+#include "ds/dirtytracker.h"
+#include "ds/errors.h"
+
+using namespace ds::core;
+
+namespace {
+
+int countRows(QSqlDatabase& conn)
+{
+    QSqlQuery query{conn};
+    if (!query.exec("SELECT COUNT(*) FROM hash_cache") || !query.next()) {
+        throw Error("Failed to count");
+    }
+    return query.value(0).toInt();
+}
+
+} // anonymous namespace
+
+void TestDbExecutor::test_read_write_data()
+{
+    QTest::addColumn<bool>("inMemory");
+
+    QTest::newRow("file") << false;
+    QTest::newRow("memory") << true;
+}
+
+void TestDbExecutor::test_read_write()
+{
+    QFETCH(bool, inMemory);
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    auto settings = makeSettings(inMemory ? QStringLiteral(":memory:") : dir.filePath("test.db"));
+    Database db{*settings};
+    auto& executor = db.getExecutor();
+    QCOMPARE(executor.isShared(), !inMemory);
+
+    for(int i = 0; i < 10; ++i) {
+        executor.write([i](QSqlDatabase& conn) {
+            QSqlQuery query{conn};
+            query.prepare("INSERT INTO hash_cache (path, size, mtime, inode, hash) "
+                          "VALUES (:path, 1, 1, 1, 'x')");
+            query.bindValue(":path", QStringLiteral("/tmp/%1").arg(i));
+            if (!query.exec()) {
+                throw Error("Insert failed");
+            }
+        });
+    }
+
+    int written = -1;
+    executor.write<int>(countRows, this, [&written](int rows) {
+        written = rows;
+    });
+    QTRY_COMPARE(written, 10);
+
+    // The readers see what the writer committed
+    int read = -1;
+    executor.read<int>(countRows, this, [&read](int rows) {
+        read = rows;
+    });
+    QTRY_COMPARE(read, 10);
+}
+
+void TestDbExecutor::test_failed_query()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    auto settings = makeSettings(dir.filePath("test.db"));
+    Database db{*settings};
+
+    bool called = false;
+    QString reason;
+    db.getExecutor().read<int>([](QSqlDatabase& conn) {
+        QSqlQuery query{conn};
+        if (!query.exec("INSERT INTO hash_cache (path, size, mtime, inode, hash) "
+                        "VALUES ('/tmp/x', 1, 1, 1, 'x')")) {
+            throw Error("The connection is read-only");
+        }
+        return 1;
+    }, this, [&called](int) {
+        called = true;
+    }, [&reason](const QString& why) {
+        reason = why;
+    });
+
+    QTRY_VERIFY(!reason.isEmpty());
+    QVERIFY(!called);
+}
+
+void TestDbExecutor::test_sees_unsaved_changes()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    auto settings = makeSettings(dir.filePath("test.db"));
+    Database db{*settings};
+
+    QSqlQuery query{db.getDb()};
+    QVERIFY(query.exec("INSERT INTO hash_cache (id, path, size, mtime, inode, hash) "
+                       "VALUES (1, '/tmp/x', 1, 1, 1, 'x')"));
+
+    db.getDirtyTracker().set("hash_cache", 1, "size", 42);
+
+    qint64 size = {};
+    db.getExecutor().read<qint64>([](QSqlDatabase& conn) {
+        QSqlQuery query{conn};
+        if (!query.exec("SELECT size FROM hash_cache WHERE id=1") || !query.next()) {
+            throw Error("Failed to read");
+        }
+        return query.value(0).toLongLong();
+    }, this, [&size](qint64 value) {
+        size = value;
+    });
+
+    QTRY_COMPARE(size, qint64{42});
+}
@@ -0,0 +1,19 @@
+#ifndef TST_DBEXECUTOR_H
+#define TST_DBEXECUTOR_H
+
+#include <QtTest>
+
+class TestDbExecutor : public QObject
+{
+    Q_OBJECT
+public:
+    TestDbExecutor() = default;
+
+private slots:
+    void test_read_write();
+    void test_read_write_data();
+    void test_failed_query();
+    void test_sees_unsaved_changes();
+};
+
+#endif // TST_DBEXECUTOR_H
@@ -0,0 +1,187 @@
+
+#include <QBuffer>
+#include <QTemporaryDir>
+
+#include "tst_delta.h"
+#include "ds/bytes.h"
+#include "ds/delta.h"
+
+using namespace ds::core;
+
+namespace {
+
+QByteArray randomBytes(const int len, quint32 seed) {
+    QByteArray bytes(len, 0);
+    for(int i = 0; i < len; ++i) {
+        seed = (seed * 1103515245) + 12345;
+        bytes[i] = static_cast<char>(seed >> 16);
+    }
+    return bytes;
+}
+
+DeltaBasis createBasis(const QString& path, const QByteArray& content) {
+    QFile file{path};
+    if (!file.open(QIODevice::WriteOnly) || (file.write(content) != content.size())) {
+        return {};
+    }
+    file.close();
+
+    DeltaBasis basis;
+    basis.path = path;
+    basis.size = content.size();
+    basis.blockSize = Delta::getBlockSize(basis.size);
+
+    QBuffer buffer;
+    buffer.setData(content);
+    buffer.open(QIODevice::ReadOnly);
+    basis.signature = Delta::createSignature(buffer, basis.blockSize);
+    return basis;
+}
+
+// Encode target against basis, and rebuild it. Returns false on error.
+bool transfer(const DeltaBasis& basis, const QByteArray& target, const int frameSize,
+              QByteArray& rebuilt, qint64& literal) {
+    QBuffer source;
+    source.setData(target);
+    source.open(QIODevice::ReadOnly);
+
+    DeltaEncoder encoder{source, basis.blockSize, basis.signature};
+    DeltaDecoder decoder{basis, target.size()};
+    if (!decoder.open()) {
+        return false;
+    }
+
+    QByteArray frame(frameSize, 0);
+    bool finished = false;
+    while(!finished) {
+        const auto bytes = encoder.encode(frame.data(), frame.size(), finished);
+        if ((bytes < 0) || !decoder.decode(frame.constData(), static_cast<size_t>(bytes), rebuilt)) {
+            return false;
+        }
+    }
+
+    literal = encoder.getLiteralBytes();
+    return encoder.getEncodedBytes() == target.size();
+}
+
+} // anonymous namespace
+
+void TestDelta::test_block_size()
+{
+    QCOMPARE(Delta::getBlockSize(0), qint64{Delta::minBlockSize});
+    QCOMPARE(Delta::getBlockSize(1024 * 1024), qint64{Delta::minBlockSize});
+    QCOMPARE(Delta::getBlockSize(1024 * 1024 * 16), qint64{1024 * 4});
+
+    const qint64 large = 1024LL * 1024 * 1024 * 4;
+    QVERIFY((large / Delta::getBlockSize(large)) <= Delta::maxBlocks);
+}
+
+void TestDelta::test_rolling_checksum()
+{
+    const auto data = randomBytes(10000, 1);
+    const int len = 2048;
+
+    Delta::RollingChecksum checksum;
+    checksum.init(data.constData(), len);
+    for(int i = 0; (i + len) < data.size(); ++i) {
+        checksum.roll(data.at(i), data.at(i + len));
+        QCOMPARE(checksum.value(), Delta::weakChecksum(data.constData() + i + 1, len));
+    }
+}
+
+void TestDelta::test_roundtrip_data()
+{
+    QTest::addColumn<QByteArray>("basis");
+    QTest::addColumn<QByteArray>("target");
+    QTest::addColumn<int>("frameSize");
+    QTest::addColumn<int>("maxLiteral");
+
+    const auto basis = randomBytes(1024 * 1024 * 3, 2);
+    const auto inserted = randomBytes(777, 3);
+    const auto modified = basis.left(1000000) + inserted + basis.mid(1000000, 1500000);
+
+    QTest::newRow("same") << basis << basis << 1024 * 64 << 1024 * 2;
+    QTest::newRow("modified") << basis << modified << 1024 * 64 << 1024 * 8;
+    QTest::newRow("small-frames") << basis << modified << 100 << 1024 * 8;
+    QTest::newRow("different") << basis << randomBytes(1000000, 4) << 1024 * 64 << 1000000;
+    QTest::newRow("empty") << basis << QByteArray{} << 1024 << 0;
+    QTest::newRow("tiny") << basis << randomBytes(100, 5) << 1024 << 100;
+}
+
+void TestDelta::test_roundtrip()
+{
+    QFETCH(QByteArray, basis);
+    QFETCH(QByteArray, target);
+    QFETCH(int, frameSize);
+    QFETCH(int, maxLiteral);
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const auto deltaBasis = createBasis(dir.path() + "/basis", basis);
+    QVERIFY(!deltaBasis.isEmpty());
+
+    QByteArray rebuilt;
+    qint64 literal = {};
+    QVERIFY(transfer(deltaBasis, target, frameSize, rebuilt, literal));
+    QCOMPARE(rebuilt, target);
+    QVERIFY(literal <= maxLiteral);
+}
+
+void TestDelta::test_changed_basis()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const auto content = randomBytes(1024 * 512, 6);
+    const auto basis = createBasis(dir.path() + "/basis", content);
+    QVERIFY(!basis.isEmpty());
+
+    // Same size, different content
+    QFile file{basis.path};
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    QVERIFY(file.seek(1000));
+    QCOMPARE(file.write("changed"), qint64{7});
+    file.close();
+
+    QByteArray rebuilt;
+    qint64 literal = {};
+    QVERIFY(!transfer(basis, content, 1024 * 64, rebuilt, literal));
+}
+
+void TestDelta::test_expansion_limits()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const auto basis = createBasis(dir.path() + "/basis", randomBytes(1024 * 1024, 7));
+    QVERIFY(!basis.isEmpty());
+    const auto blocks = basis.signature.size() / Delta::signatureBytes;
+
+    // Copy the whole basis, over and over, in one frame
+    QByteArray frame;
+    const auto copies = (Delta::maxExpandBytes / basis.size) + 1;
+    for(int i = 0; i < copies; ++i) {
+        uint8_t op[1 + (maxVarintBytes<quint64>() * 2)] = {Delta::COPY};
+        auto len = 1 + valueToVarint(quint64{0}, op + 1);
+        len += valueToVarint(static_cast<quint64>(blocks), op + len);
+        frame.append(reinterpret_cast<const char *>(op), static_cast<int>(len));
+    }
+
+    {
+        DeltaDecoder decoder{basis, basis.size * copies};
+        QVERIFY(decoder.open());
+        QCOMPARE(decoder.measure(frame.constData(), static_cast<size_t>(frame.size())), qint64{-1});
+        QByteArray out;
+        QVERIFY(!decoder.decode(frame.constData(), static_cast<size_t>(frame.size()), out));
+    }
+
+    // One copy is fine, but not if the offered file is smaller
+    const auto one = frame.left(frame.size() / static_cast<int>(copies));
+    {
+        DeltaDecoder decoder{basis, basis.size};
+        QVERIFY(decoder.open());
+        QCOMPARE(decoder.measure(one.constData(), static_cast<size_t>(one.size())), basis.size);
+        QByteArray out;
+        QVERIFY(decoder.decode(one.constData(), static_cast<size_t>(one.size()), out));
+        QCOMPARE(out.size(), static_cast<int>(basis.size));
+        QVERIFY(!decoder.decode(one.constData(), static_cast<size_t>(one.size()), out));
+    }
+}
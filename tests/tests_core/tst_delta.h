@@ -0,0 +1,21 @@
+#ifndef TST_DELTA_H
+#define TST_DELTA_H
+
+#include <QtTest>
+
+class TestDelta : public QObject
+{
+    Q_OBJECT
+public:
+    TestDelta() = default;
+
+private slots:
+    void test_block_size();
+    void test_rolling_checksum();
+    void test_roundtrip_data();
+    void test_roundtrip();
+    void test_changed_basis();
+    void test_expansion_limits();
+};
+
+#endif // TST_DELTA_H
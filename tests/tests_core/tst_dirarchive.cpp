@@ -0,0 +1,115 @@
+
+#include <QTemporaryDir>
+
+#include "tst_dirarchive.h"
+#include "ds/dirarchive.h"
+
+using namespace ds::core;
+
+namespace {
+
+void createFile(const QString& path, const QByteArray& content) {
+    QFile file{path};
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    QCOMPARE(file.write(content), qint64{content.size()});
+}
+
+QByteArray readFile(const QString& path) {
+    QFile file{path};
+    if (!file.open(QIODevice::ReadOnly)) {
+        return {};
+    }
+    return file.readAll();
+}
+
+QByteArray readStream(const QString& root) {
+    DirArchiveReader reader{root};
+    if (!reader.open(QIODevice::ReadOnly)) {
+        return {};
+    }
+    return reader.readAll();
+}
+
+} // anonymous namespace
+
+void TestDirArchive::test_safe_path()
+{
+    QVERIFY(DirArchive::isSafePath("a"));
+    QVERIFY(DirArchive::isSafePath("a/b/.hidden"));
+    QVERIFY(!DirArchive::isSafePath(""));
+    QVERIFY(!DirArchive::isSafePath("/etc/passwd"));
+    QVERIFY(!DirArchive::isSafePath("../a"));
+    QVERIFY(!DirArchive::isSafePath("a/../../b"));
+    QVERIFY(!DirArchive::isSafePath("a/./b"));
+    QVERIFY(!DirArchive::isSafePath("a//b"));
+}
+
+void TestDirArchive::test_manifest()
+{
+    const std::vector<DirArchive::Entry> entries = {
+        {"a", -1}, {"a/b.txt", 3}, {"c.txt", 0}
+    };
+
+    std::vector<DirArchive::Entry> decoded;
+    QVERIFY(DirArchive::decodeManifest(DirArchive::encodeManifest(entries), decoded));
+    QCOMPARE(decoded.size(), entries.size());
+    for(size_t i = 0; i < entries.size(); ++i) {
+        QCOMPARE(decoded[i].path, entries[i].path);
+        QCOMPARE(decoded[i].size, entries[i].size);
+    }
+
+    const std::vector<DirArchive::Entry> unsafe = {{"../evil", 1}};
+    QVERIFY(!DirArchive::decodeManifest(DirArchive::encodeManifest(unsafe), decoded));
+}
+
+void TestDirArchive::test_roundtrip()
+{
+    QTemporaryDir src, dst;
+    QVERIFY(src.isValid() && dst.isValid());
+
+    QVERIFY(QDir{src.path()}.mkpath("sub/empty"));
+    createFile(src.path() + "/a.txt", "Hello");
+    createFile(src.path() + "/sub/b.bin", QByteArray(100000, 'b'));
+    createFile(src.path() + "/sub/zero", {});
+
+    const auto stream = readStream(src.path());
+    QCOMPARE(qint64{stream.size()}, DirArchive::getStreamSize(src.path()));
+
+    // Unpack in odd-sized pieces to cross the segment boundaries
+    const auto root = dst.path() + "/out";
+    DirArchiveWriter writer{root};
+    QVERIFY(writer.open(QIODevice::WriteOnly));
+    for(int i = 0; i < stream.size(); i += 777) {
+        const auto piece = stream.mid(i, 777);
+        QCOMPARE(writer.write(piece), qint64{piece.size()});
+    }
+    QVERIFY(writer.isComplete());
+    writer.close();
+
+    QCOMPARE(readFile(root + "/a.txt"), QByteArray("Hello"));
+    QCOMPARE(readFile(root + "/sub/b.bin"), QByteArray(100000, 'b'));
+    QVERIFY(QFileInfo{root + "/sub/zero"}.isFile());
+    QVERIFY(QFileInfo{root + "/sub/empty"}.isDir());
+
+    // The unpacked tree gives the same stream
+    QCOMPARE(readStream(root), stream);
+}
+
+void TestDirArchive::test_corrupt_entry()
+{
+    QTemporaryDir src, dst;
+    QVERIFY(src.isValid() && dst.isValid());
+    createFile(src.path() + "/a.txt", "Hello");
+
+    auto stream = readStream(src.path());
+    QVERIFY(!stream.isEmpty());
+
+    // Flip a byte in the content, just before the entry's hash
+    const auto at = stream.size() - DirArchive::hashBytes - 1;
+    stream[at] = static_cast<char>(stream.at(at) ^ 1);
+
+    DirArchiveWriter writer{dst.path() + "/out"};
+    QVERIFY(writer.open(QIODevice::WriteOnly));
+    QVERIFY(writer.write(stream) < 0);
+    QVERIFY(!writer.isComplete());
+}
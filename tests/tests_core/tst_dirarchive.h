@@ -0,0 +1,19 @@
+#ifndef TST_DIRARCHIVE_H
+#define TST_DIRARCHIVE_H
+
+#include <QtTest>
+
+class TestDirArchive : public QObject
+{
+    Q_OBJECT
+public:
+    TestDirArchive() = default;
+
+private slots:
+    void test_safe_path();
+    void test_manifest();
+    void test_roundtrip();
+    void test_corrupt_entry();
+};
+
+#endif // TST_DIRARCHIVE_H
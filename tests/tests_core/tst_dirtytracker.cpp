@@ -0,0 +1,161 @@
+#include <QSqlQuery>
+
+#include "tst_dirtytracker.h"
+#include "test_helpers.h"
+#include "ds/database.h"
+#include "ds/dirtytracker.h"
+#include "ds/errors.h"
+
+using namespace ds::core;
+
+namespace {
+
+void createTable(Database& db)
+{
+    QSqlQuery query{db.getDb()};
+    QVERIFY(query.exec("CREATE TABLE test (id INTEGER PRIMARY KEY, name TEXT UNIQUE, value INTEGER)"));
+    QVERIFY(query.exec("INSERT INTO test (id, name, value) VALUES (1, 'first', 1)"));
+    QVERIFY(query.exec("INSERT INTO test (id, name, value) VALUES (2, 'second', 2)"));
+}
+
+QVariant getValue(Database& db, const int id, const char *column)
+{
+    QSqlQuery query{db.getDb()};
+    query.exec(QStringLiteral("SELECT %1 FROM test WHERE id=%2").arg(column).arg(id));
+    return query.next() ? query.value(0) : QVariant{};
+}
+
+} // anonymous namespace
+
+void TestDirtyTracker::test_coalesce()
+{
+    auto settings = makeSettings();
+    Database db{*settings};
+    createTable(db);
+    auto& tracker = DirtyTracker::instance();
+
+    tracker.set("test", 1, "value", 10);
+    tracker.set("test", 1, "value", 11);
+    tracker.set("test", 1, "name", "one");
+    tracker.set("test", 2, "value", 20);
+    QCOMPARE(tracker.getPendingCount(), size_t{3});
+
+    // Not written yet
+    QCOMPARE(getValue(db, 1, "value").toInt(), 1);
+
+    tracker.flush();
+    QVERIFY(tracker.isEmpty());
+    QCOMPARE(getValue(db, 1, "value").toInt(), 11);
+    QCOMPARE(getValue(db, 1, "name").toString(), QStringLiteral("one"));
+    QCOMPARE(getValue(db, 2, "value").toInt(), 20);
+
+    QCOMPARE(tracker.getStats().updates, quint64{4});
+    QCOMPARE(tracker.getStats().written, quint64{3});
+    QCOMPARE(tracker.getStats().flushes, quint64{1});
+
+    // Nothing to do
+    tracker.flush();
+    QCOMPARE(tracker.getStats().flushes, quint64{1});
+}
+
+void TestDirtyTracker::test_flush_on_event_loop()
+{
+    auto settings = makeSettings();
+    Database db{*settings};
+    createTable(db);
+    auto& tracker = DirtyTracker::instance();
+
+    tracker.set("test", 2, "name", "two");
+    QTRY_VERIFY(tracker.isEmpty());
+    QCOMPARE(getValue(db, 2, "name").toString(), QStringLiteral("two"));
+}
+
+void TestDirtyTracker::test_failed_row()
+{
+    auto settings = makeSettings();
+    Database db{*settings};
+    createTable(db);
+    auto& tracker = DirtyTracker::instance();
+
+    tracker.set("test", 1, "value", 10);
+    tracker.set("test", 1, "name", "second"); // Violates the UNIQUE constraint
+    tracker.set("test", 2, "value", 20);
+
+    tracker.flush();
+    QVERIFY(tracker.isEmpty());
+    QCOMPARE(getValue(db, 1, "value").toInt(), 10);
+    QCOMPARE(getValue(db, 1, "name").toString(), QStringLiteral("first"));
+    QCOMPARE(getValue(db, 2, "value").toInt(), 20);
+
+    QCOMPARE(tracker.getStats().written, quint64{2});
+    QCOMPARE(tracker.getStats().dropped, quint64{1});
+}
+
+void TestDirtyTracker::test_retry_failed()
+{
+    auto settings = makeSettings();
+    Database db{*settings};
+    createTable(db);
+    auto& tracker = DirtyTracker::instance();
+
+    tracker.set("test", 1, "value", 10);
+    tracker.set("later", 1, "value", 100); // The table don't exist yet
+
+    // The failed change is kept, not dropped
+    tracker.flush();
+    QCOMPARE(getValue(db, 1, "value").toInt(), 10);
+    QCOMPARE(tracker.getPendingCount(), size_t{1});
+    QVERIFY(tracker.isRetrying());
+    QCOMPARE(tracker.getStats().dropped, quint64{0});
+    QCOMPARE(tracker.getStats().retried, quint64{1});
+
+    QSqlQuery query{db.getDb()};
+    QVERIFY(query.exec("CREATE TABLE later (id INTEGER PRIMARY KEY, value INTEGER)"));
+    QVERIFY(query.exec("INSERT INTO later (id, value) VALUES (1, 1)"));
+
+    tracker.flush();
+    QVERIFY(tracker.isEmpty());
+    QVERIFY(!tracker.isRetrying());
+    QVERIFY(query.exec("SELECT value FROM later WHERE id=1"));
+    QVERIFY(query.next());
+    QCOMPARE(query.value(0).toInt(), 100);
+}
+
+void TestDirtyTracker::test_write_now()
+{
+    auto settings = makeSettings();
+    Database db{*settings};
+    createTable(db);
+    auto& tracker = DirtyTracker::instance();
+
+    tracker.set("test", 1, "name", "one");
+
+    // The caller gets the error, and the pending change is kept
+    QVERIFY_EXCEPTION_THROWN(tracker.write("test", 1, "name", "second"), Error);
+    QCOMPARE(tracker.getPendingCount(), size_t{1});
+    QCOMPARE(getValue(db, 1, "name").toString(), QStringLiteral("first"));
+
+    // A successful write replaces the pending change
+    tracker.write("test", 1, "name", "uno");
+    QVERIFY(tracker.isEmpty());
+    QCOMPARE(getValue(db, 1, "name").toString(), QStringLiteral("uno"));
+}
+
+void TestDirtyTracker::test_query_flushes()
+{
+    auto settings = makeSettings();
+    Database db{*settings};
+    createTable(db);
+    auto& tracker = DirtyTracker::instance();
+
+    tracker.set("test", 2, "value", 22);
+
+    // Statements from the cache see the pending change
+    auto query = db.getStatements().get("test", "value-by-id",
+        "SELECT value FROM test WHERE id=:id");
+    QVERIFY(tracker.isEmpty());
+    query->bindValue(":id", 2);
+    QVERIFY(query->exec());
+    QVERIFY(query->next());
+    QCOMPARE(query->value(0).toInt(), 22);
+}
@@ -0,0 +1,21 @@
+#ifndef TST_DIRTYTRACKER_H
+#define TST_DIRTYTRACKER_H
+
+#include <QtTest>
+
+class TestDirtyTracker : public QObject
+{
+    Q_OBJECT
+public:
+    TestDirtyTracker() = default;
+
+private slots:
+    void test_coalesce();
+    void test_flush_on_event_loop();
+    void test_failed_row();
+    void test_retry_failed();
+    void test_write_now();
+    void test_query_flushes();
+};
+
+#endif // TST_DIRTYTRACKER_H
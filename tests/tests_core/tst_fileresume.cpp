@@ -0,0 +1,63 @@
+#include <memory>
+
+#include "tst_fileresume.h"
+#include "ds/file.h"
+
+using namespace ds::core;
+
+namespace {
+
+std::unique_ptr<File> makeFile(QObject& parent, const File::Direction direction,
+                               const File::State state, const qlonglong bytesTransferred)
+{
+    auto data = std::make_unique<FileData>();
+    data->direction = direction;
+    data->state = state;
+    data->size = 1000;
+    data->bytesTransferred = bytesTransferred;
+    return std::make_unique<File>(parent, std::move(data));
+}
+
+} // anonymous namespace
+
+void TestFileResume::test_reoffer_action()
+{
+    QCOMPARE(File::getReofferAction(File::FS_OFFERED), File::ReofferAction::ACCEPT);
+    QCOMPARE(File::getReofferAction(File::FS_FAILED), File::ReofferAction::ACCEPT);
+    QCOMPARE(File::getReofferAction(File::FS_QUEUED), File::ReofferAction::IGNORE);
+    QCOMPARE(File::getReofferAction(File::FS_TRANSFERRING), File::ReofferAction::IGNORE);
+    QCOMPARE(File::getReofferAction(File::FS_HASHING), File::ReofferAction::IGNORE);
+    QCOMPARE(File::getReofferAction(File::FS_REJECTED), File::ReofferAction::REJECT);
+    QCOMPARE(File::getReofferAction(File::FS_CANCELLED), File::ReofferAction::ABORT);
+    QCOMPARE(File::getReofferAction(File::FS_DONE), File::ReofferAction::COMPLETE);
+}
+
+void TestFileResume::test_completed_ack()
+{
+    QObject parent;
+
+    // Offered, but nothing sent. An unsolicited "Completed" is a lie.
+    QVERIFY(!makeFile(parent, File::OUTGOING, File::FS_OFFERED, 0)->canAcceptCompleted());
+    QVERIFY(!makeFile(parent, File::OUTGOING, File::FS_WAITING, 0)->canAcceptCompleted());
+    QVERIFY(!makeFile(parent, File::OUTGOING, File::FS_WAITING, 999)->canAcceptCompleted());
+
+    // The content went with the offer
+    auto file = makeFile(parent, File::OUTGOING, File::FS_OFFERED, 0);
+    file->setSentInline(true);
+    QVERIFY(file->canAcceptCompleted());
+
+    // A later offer without the content
+    file->setSentInline(false);
+    QVERIFY(!file->canAcceptCompleted());
+
+    // The resume-point says that we sent it all before the connection broke
+    QVERIFY(makeFile(parent, File::OUTGOING, File::FS_WAITING, 1000)->canAcceptCompleted());
+
+    // Only for outgoing files with a pending offer
+    file = makeFile(parent, File::OUTGOING, File::FS_TRANSFERRING, 1000);
+    file->setSentInline(true);
+    QVERIFY(!file->canAcceptCompleted());
+    file = makeFile(parent, File::INCOMING, File::FS_OFFERED, 1000);
+    file->setSentInline(true);
+    QVERIFY(!file->canAcceptCompleted());
+}
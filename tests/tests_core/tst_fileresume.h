@@ -0,0 +1,17 @@
+#ifndef TST_FILERESUME_H
+#define TST_FILERESUME_H
+
+#include <QtTest>
+
+class TestFileResume : public QObject
+{
+    Q_OBJECT
+public:
+    TestFileResume() = default;
+
+private slots:
+    void test_reoffer_action();
+    void test_completed_ack();
+};
+
+#endif // TST_FILERESUME_H
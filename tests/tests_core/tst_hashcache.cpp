@@ -0,0 +1,92 @@
+#include <QFile>
+#include <QSqlQuery>
+#include <QTemporaryDir>
+
+#include "tst_hashcache.h"
+#include "test_helpers.h"
+#include "ds/database.h"
+#include "ds/hashcache.h"
+
+using namespace ds::core;
+
+namespace {
+
+constexpr qint64 now = 1600000000;
+
+bool addEntry(QSqlDatabase& db, const QString& path, const qint64 size, const qint64 used)
+{
+    QSqlQuery query{db};
+    query.prepare("INSERT INTO hash_cache (path, size, mtime, inode, hash, used) "
+                  "VALUES (:path, :size, 1, 1, 'x', :used)");
+    query.bindValue(":path", path);
+    query.bindValue(":size", size);
+    query.bindValue(":used", used);
+    return query.exec();
+}
+
+QStringList paths(QSqlDatabase& db)
+{
+    QStringList rval;
+    QSqlQuery query{db};
+    if (query.exec("SELECT path FROM hash_cache ORDER BY id")) {
+        while(query.next()) {
+            rval << query.value(0).toString();
+        }
+    }
+    return rval;
+}
+
+bool touch(const QString& path)
+{
+    QFile file{path};
+    return file.open(QIODevice::WriteOnly);
+}
+
+} // anonymous namespace
+
+void TestHashCache::test_prune_old_and_missing()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    auto settings = makeSettings();
+    Database db{*settings};
+
+    const auto recent = dir.filePath("recent");
+    const auto old = dir.filePath("old");
+    QVERIFY(touch(recent));
+    QVERIFY(touch(old));
+
+    QVERIFY(addEntry(db.getDb(), recent, 1, now - 60));
+    QVERIFY(addEntry(db.getDb(), old, 1, now - HashCache::maxAgeSecs - 1));
+    QVERIFY(addEntry(db.getDb(), dir.filePath("missing"), 1, now - 60));
+
+    QCOMPARE(HashCache::prune(db.getDb(), now), 2);
+    QCOMPARE(paths(db.getDb()), QStringList{recent});
+}
+
+void TestHashCache::test_prune_overflow()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    auto settings = makeSettings();
+    Database db{*settings};
+
+    const auto path = dir.filePath("file");
+    QVERIFY(touch(path));
+
+    // The first ones are the least recently used
+    constexpr int extra = 10;
+    QVERIFY(db.getDb().transaction());
+    for(int i = 0; i < HashCache::maxEntries + extra; ++i) {
+        QVERIFY(addEntry(db.getDb(), path, i, now - HashCache::maxEntries - extra + i));
+    }
+    QVERIFY(db.getDb().commit());
+
+    QCOMPARE(HashCache::prune(db.getDb(), now), extra);
+
+    QSqlQuery query{db.getDb()};
+    QVERIFY(query.exec("SELECT COUNT(*), MIN(size) FROM hash_cache"));
+    QVERIFY(query.next());
+    QCOMPARE(query.value(0).toInt(), static_cast<int>(HashCache::maxEntries));
+    QCOMPARE(query.value(1).toInt(), extra);
+}
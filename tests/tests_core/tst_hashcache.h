@@ -0,0 +1,17 @@
+#ifndef TST_HASHCACHE_H
+#define TST_HASHCACHE_H
+
+#include <QtTest>
+
+class TestHashCache : public QObject
+{
+    Q_OBJECT
+public:
+    TestHashCache() = default;
+
+private slots:
+    void test_prune_old_and_missing();
+    void test_prune_overflow();
+};
+
+#endif // TST_HASHCACHE_H
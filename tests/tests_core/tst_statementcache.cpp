@@ -0,0 +1,76 @@
+#include "tst_statementcache.h"
+#include "test_helpers.h"
+#include "ds/database.h"
+#include "ds/errors.h"
+#include "ds/statementcache.h"
+
+using namespace ds::core;
+
+void TestStatementCache::test_hits_and_misses()
+{
+    auto settings = makeSettings();
+    Database db{*settings};
+    auto& cache = StatementCache::instance();
+    QCOMPARE(&cache, &db.getStatements());
+
+    for(int i = 0; i < 3; ++i) {
+        auto query = cache.get("ds", "version", "SELECT version FROM ds");
+        QVERIFY(query->exec());
+        QVERIFY(query->next());
+    }
+
+    {
+        int built = 0;
+        for(int i = 0; i < 2; ++i) {
+            auto query = cache.get("ds", "count", [&built] {
+                ++built;
+                return QStringLiteral("SELECT COUNT(*) FROM ds");
+            });
+            QVERIFY(query->exec());
+        }
+        QCOMPARE(built, 1);
+    }
+
+    QCOMPARE(cache.getStats().misses, quint64{2});
+    QCOMPARE(cache.getStats().hits, quint64{3});
+    QCOMPARE(cache.getStats().busy, quint64{0});
+}
+
+void TestStatementCache::test_in_use()
+{
+    auto settings = makeSettings();
+    Database db{*settings};
+    auto& cache = StatementCache::instance();
+
+    {
+        auto outer = cache.get("ds", "version", "SELECT version FROM ds");
+        QVERIFY(outer->exec());
+        QVERIFY(outer->next());
+
+        auto inner = cache.get("ds", "version", "SELECT version FROM ds");
+        QVERIFY(&*inner != &*outer);
+        QVERIFY(inner->exec());
+        QVERIFY(inner->next());
+        QCOMPARE(inner->value(0), outer->value(0));
+    }
+
+    auto again = cache.get("ds", "version", "SELECT version FROM ds");
+    QVERIFY(again->exec());
+
+    QCOMPARE(cache.getStats().misses, quint64{1});
+    QCOMPARE(cache.getStats().busy, quint64{1});
+    QCOMPARE(cache.getStats().hits, quint64{1});
+}
+
+void TestStatementCache::test_invalid_sql()
+{
+    auto settings = makeSettings();
+    Database db{*settings};
+    auto& cache = StatementCache::instance();
+
+    QVERIFY_EXCEPTION_THROWN(cache.get("ds", "bad", "SELECT nothing FROM nowhere"), Error);
+
+    // The failed statement is not cached
+    QVERIFY_EXCEPTION_THROWN(cache.get("ds", "bad", "SELECT nothing FROM nowhere"), Error);
+    QCOMPARE(cache.getStats().hits, quint64{0});
+}
@@ -0,0 +1,18 @@
+#ifndef TST_STATEMENTCACHE_H
+#define TST_STATEMENTCACHE_H
+
+#include <QtTest>
+
+class TestStatementCache : public QObject
+{
+    Q_OBJECT
+public:
+    TestStatementCache() = default;
+
+private slots:
+    void test_hits_and_misses();
+    void test_in_use();
+    void test_invalid_sql();
+};
+
+#endif // TST_STATEMENTCACHE_H
@@ -0,0 +1,75 @@
+
+#include "tst_treehash.h"
+#include "ds/treehash.h"
+
+using namespace ds::core;
+
+namespace {
+
+QByteArray sha256(const QByteArray& data) {
+    return QCryptographicHash::hash(data, QCryptographicHash::Sha256);
+}
+
+QByteArray leaf(const char seed) {
+    return TreeHash::hashLeaf(QByteArray(100, seed));
+}
+
+QByteArray node(const QByteArray& left, const QByteArray& right) {
+    return sha256(QByteArray(1, 1) + left + right);
+}
+
+} // anonymous namespace
+
+void TestTreeHash::test_leaf_size()
+{
+    QCOMPARE(TreeHash::getLeafSize(0), qint64{TreeHash::minLeafSize});
+    QCOMPARE(TreeHash::getLeafCount(0), qint64{1});
+    QCOMPARE(TreeHash::getLeafCount(1), qint64{1});
+    QCOMPARE(TreeHash::getLeafCount(TreeHash::minLeafSize), qint64{1});
+    QCOMPARE(TreeHash::getLeafCount(TreeHash::minLeafSize + 1), qint64{2});
+
+    const qint64 large = TreeHash::minLeafSize * TreeHash::maxLeaves * 3;
+    QCOMPARE(TreeHash::getLeafSize(large), TreeHash::minLeafSize * 4);
+    QVERIFY(TreeHash::getLeafCount(large) <= TreeHash::maxLeaves);
+}
+
+void TestTreeHash::test_root()
+{
+    const auto a = leaf('a'), b = leaf('b'), c = leaf('c');
+
+    QCOMPARE(a, sha256(QByteArray(1, 0) + QByteArray(100, 'a')));
+    QCOMPARE(TreeHash::getRoot(a), a);
+    QCOMPARE(TreeHash::getRoot(a + b), node(a, b));
+
+    // The odd leaf is promoted to the next level
+    QCOMPARE(TreeHash::getRoot(a + b + c), node(node(a, b), c));
+
+    QVERIFY(TreeHash::getRoot({}).isEmpty());
+    QVERIFY(TreeHash::getRoot(a.left(10)).isEmpty());
+}
+
+void TestTreeHash::test_leaf_hasher()
+{
+    const QByteArray data(1000, 'x');
+    TreeHash::LeafHasher hasher;
+    hasher.add(data.constData(), 300);
+    hasher.add(data.constData() + 300, 700);
+    QCOMPARE(hasher.getBytes(), qint64{1000});
+    QCOMPARE(hasher.finish(), TreeHash::hashLeaf(data));
+
+    // Ready for the next leaf
+    QCOMPARE(hasher.getBytes(), qint64{0});
+    QCOMPARE(hasher.finish(), TreeHash::hashLeaf(nullptr, 0));
+}
+
+void TestTreeHash::test_validate()
+{
+    const auto size = TreeHash::minLeafSize * 2 + 10;
+    const auto leaves = leaf('a') + leaf('b') + leaf('c');
+    const auto root = TreeHash::getRoot(leaves);
+
+    QVERIFY(TreeHash::isValid(leaves, root, size));
+    QVERIFY(!TreeHash::isValid(leaves, root, TreeHash::minLeafSize));
+    QVERIFY(!TreeHash::isValid(leaf('a') + leaf('x') + leaf('c'), root, size));
+    QCOMPARE(TreeHash::getLeaf(leaves, 1), leaf('b'));
+}
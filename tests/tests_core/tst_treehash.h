@@ -0,0 +1,19 @@
+#ifndef TST_TREEHASH_H
+#define TST_TREEHASH_H
+
+#include <QtTest>
+
+class TestTreeHash : public QObject
+{
+    Q_OBJECT
+public:
+    TestTreeHash() = default;
+
+private slots:
+    void test_leaf_size();
+    void test_root();
+    void test_leaf_hasher();
+    void test_validate();
+};
+
+#endif // TST_TREEHASH_H
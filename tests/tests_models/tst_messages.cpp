@@ -1,12 +1,49 @@
 
+#include <algorithm>
 #include <memory>
+#include <tuple>
+#include <vector>
 #include <QSettings>
+#include <QSqlQuery>
 
 #include "tst_messages.h"
 #include "ds/crypto.h"
+#include "ds/database.h"
 #include "ds/dscert.h"
 #include "ds/dsengine.h"
 #include "ds/messagemodel.h"
+#include "ds/messagesmodel.h"
+
+using ds::models::MessagesModel;
+
+namespace {
+
+struct Key {
+    qint64 time;
+    int type;
+    int id;
+};
+
+int insertRow(QSqlDatabase& db, const int type, const int conversation, const qint64 time)
+{
+    const auto created = QDateTime::fromSecsSinceEpoch(time);
+    QSqlQuery query{db};
+    if (type == MessagesModel::MESSAGE) {
+        query.prepare("INSERT INTO message (direction, state, conversation_id, conversation, "
+                      "message_id, composed_time, content, signature, sender, encoding, sort_time) "
+                      "VALUES (0, 0, :cid, '', '', :created, '', '', '', 0, :time)");
+    } else {
+        query.prepare("INSERT INTO file (file_id, state, direction, identity_id, conversation_id, "
+                      "contact_id, name, size, created_time, sort_time) "
+                      "VALUES ('', 0, 0, 1, :cid, 1, 'file', 0, :created, :time)");
+    }
+    query.bindValue(":cid", conversation);
+    query.bindValue(":created", created);
+    query.bindValue(":time", time);
+    return query.exec() ? query.lastInsertId().toInt() : 0;
+}
+
+} // anonymous namespace
 
 
 TestMessagesModel::TestMessagesModel()
@@ -36,3 +73,71 @@ void TestMessagesModel::test_create_message()
 
     // TODO: get the message and test signature
 }
+
+void TestMessagesModel::test_page_boundaries()
+{
+    auto settings = std::make_unique<QSettings>();
+    settings->clear();
+    settings->setValue("dbpath", ":memory:");
+    ds::core::Database db{*settings};
+    QSqlQuery query{db.getDb()};
+    QVERIFY(query.exec("PRAGMA foreign_keys = OFF"));
+
+    // The times are rounded to minutes, so rows often have the same time.
+    // The first page ends with a file, and the second page starts with a
+    // message, at the same time.
+    const qint64 minute = 1577876400;
+    const std::vector<std::tuple<qint64, int, int>> groups = { // time, files, messages
+        {minute, 50, 50},
+        {minute + 60, 30, 50},
+        {minute + 120, 30, 40}
+    };
+
+    std::vector<Key> expected;
+    for(const auto& group : groups) {
+        const auto time = std::get<0>(group);
+        auto files = std::get<1>(group);
+        auto messages = std::get<2>(group);
+        while(files || messages) {
+            const int type = (messages && (!files || (messages % 2))) ? MessagesModel::MESSAGE : MessagesModel::FILE;
+            (type == MessagesModel::MESSAGE) ? --messages : --files;
+            const auto id = insertRow(db.getDb(), type, 1, time);
+            QVERIFY(id > 0);
+            expected.push_back({time, type, id});
+        }
+    }
+
+    // Rows in another conversation
+    QVERIFY(insertRow(db.getDb(), MessagesModel::MESSAGE, 2, minute + 60) > 0);
+    QVERIFY(insertRow(db.getDb(), MessagesModel::FILE, 2, minute + 60) > 0);
+
+    std::sort(expected.begin(), expected.end(), [](const Key& a, const Key& b) {
+        return std::tie(a.time, a.type, a.id) > std::tie(b.time, b.type, b.id);
+    });
+    QCOMPARE(expected.size(), size_t{250});
+    QCOMPARE(expected[99].time, expected[100].time);
+    QCOMPARE(expected[99].type, int{MessagesModel::FILE});
+    QCOMPARE(expected[100].type, int{MessagesModel::MESSAGE});
+
+    std::vector<Key> loaded;
+    MessagesModel::Cursor cursor;
+    std::vector<size_t> pages;
+    bool last = false;
+    while(!last) {
+        QVERIFY(pages.size() < 10);
+        auto page = MessagesModel::queryPage(db.getDb(), 1, cursor);
+        for(const auto& row : page.rows) {
+            loaded.push_back({0, row.type_, row.id});
+        }
+        pages.push_back(page.rows.size());
+        cursor = page.cursor;
+        last = page.last;
+    }
+
+    QCOMPARE(pages, (std::vector<size_t>{100, 100, 50}));
+    QCOMPARE(loaded.size(), expected.size());
+    for(size_t i = 0; i < expected.size(); ++i) {
+        QCOMPARE(loaded[i].type, expected[i].type);
+        QCOMPARE(loaded[i].id, expected[i].id);
+    }
+}
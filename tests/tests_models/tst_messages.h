@@ -12,6 +12,7 @@ public:
 
 private slots:
     void test_create_message();
+    void test_page_boundaries();
 };
 
 #endif // TST_MESAGES_H
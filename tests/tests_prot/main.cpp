@@ -0,0 +1,24 @@
+#include <QtTest>
+
+#include <iostream>
+#include "tst_controlcodec.h"
+
+#include "logfault/logfault.h"
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+
+    logfault::LogManager::Instance().AddHandler(
+                std::make_unique<logfault::StreamHandler>(
+                    std::clog, logfault::LogLevel::DEBUGGING));
+
+    int status = 0;
+
+     {
+         TestControlCodec tc;
+         status |= QTest::qExec(&tc, argc, argv);
+     }
+
+    return status;
+}
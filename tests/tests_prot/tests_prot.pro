@@ -0,0 +1,52 @@
+QT += testlib network core
+QT -= gui
+
+CONFIG += qt console warn_on depend_includepath testcase
+CONFIG -= app_bundle
+
+TEMPLATE = app
+
+unix {
+    CONFIG += c++14
+}
+
+SOURCES +=  \
+    main.cpp \
+    tst_controlcodec.cpp
+
+HEADERS += \
+    tst_controlcodec.h
+
+INCLUDEPATH += \
+    $$PWD/../../dependencies/logfault/include \
+    $$PWD/../../src/cryptolib/include \
+    $$PWD/../../src/corelib/include \
+    $$PWD/../../src/protlib/include
+
+win32:CONFIG(release, debug|release): LIBS += -L$$OUT_PWD/../../src/protlib/release/ -lprotlib
+else:win32:CONFIG(debug, debug|release): LIBS += -L$$OUT_PWD/../../src/protlib/debug/ -lprotlib
+else:unix: LIBS += -L$$OUT_PWD/../../src/protlib/ -lprotlib
+
+INCLUDEPATH += $$PWD/../../src/protlib
+DEPENDPATH += $$PWD/../../src/protlib
+
+win32-g++:CONFIG(release, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../../src/protlib/release/libprotlib.a
+else:win32-g++:CONFIG(debug, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../../src/protlib/debug/libprotlib.a
+else:win32:!win32-g++:CONFIG(release, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../../src/protlib/release/protlib.lib
+else:win32:!win32-g++:CONFIG(debug, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../../src/protlib/debug/protlib.lib
+else:unix: PRE_TARGETDEPS += $$OUT_PWD/../../src/protlib/libprotlib.a
+
+win32:CONFIG(release, debug|release): LIBS += -L$$OUT_PWD/../../src/corelib/release/ -lcorelib
+else:win32:CONFIG(debug, debug|release): LIBS += -L$$OUT_PWD/../../src/corelib/debug/ -lcorelib
+else:unix: LIBS += -L$$OUT_PWD/../../src/corelib/ -lcorelib
+
+INCLUDEPATH += $$PWD/../../src/corelib
+DEPENDPATH += $$PWD/../../src/corelib
+
+win32-g++:CONFIG(release, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../../src/corelib/release/libcorelib.a
+else:win32-g++:CONFIG(debug, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../../src/corelib/debug/libcorelib.a
+else:win32:!win32-g++:CONFIG(release, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../../src/corelib/release/corelib.lib
+else:win32:!win32-g++:CONFIG(debug, debug|release): PRE_TARGETDEPS += $$OUT_PWD/../../src/corelib/debug/corelib.lib
+else:unix: PRE_TARGETDEPS += $$OUT_PWD/../../src/corelib/libcorelib.a
+
+LIBS += -lsodium
@@ -0,0 +1,178 @@
+#include <QCborArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#include "tst_controlcodec.h"
+#include "logfault/logfault.h"
+#include "ds/controlcodec.h"
+
+using namespace ds::prot;
+
+namespace {
+
+QByteArray randomBytes(const int len, const char seed) {
+    QByteArray bytes(len, 0);
+    for(int i = 0; i < len; ++i) {
+        bytes[i] = static_cast<char>(seed + (i * 31));
+    }
+    return bytes;
+}
+
+// A typical chat message, like the one Peer::sendMessage() builds
+QCborMap createMessage() {
+    auto msg = ControlCodec::create(ControlCodec::Type::MESSAGE);
+    msg.insert(QStringLiteral("message-id"), randomBytes(32, 1));
+    msg.insert(QStringLiteral("date"), QStringLiteral("2019-03-12T12:14:55Z"));
+    msg.insert(QStringLiteral("content"), QStringLiteral("Hi there! Do you have time for a cup of coffee later today?"));
+    msg.insert(QStringLiteral("encoding"), QStringLiteral("utf-8"));
+    msg.insert(QStringLiteral("conversation"), randomBytes(32, 2));
+    msg.insert(QStringLiteral("from"), randomBytes(32, 3));
+    msg.insert(QStringLiteral("signature"), randomBytes(64, 4));
+    return msg;
+}
+
+QCborMap createMessageBatch() {
+    QCborArray messages;
+    for(int i = 0; i < 16; ++i) {
+        messages.append(createMessage());
+    }
+
+    auto msg = ControlCodec::create(ControlCodec::Type::MESSAGE_BATCH);
+    msg.insert(QStringLiteral("messages"), messages);
+    return msg;
+}
+
+QCborMap createFileOffer() {
+    auto msg = ControlCodec::create(ControlCodec::Type::INCOMING_FILE);
+    msg.insert(QStringLiteral("sha256"), randomBytes(32, 5));
+    msg.insert(QStringLiteral("name"), QStringLiteral("holiday.jpg"));
+    msg.insert(QStringLiteral("size"), 1234567);
+    msg.insert(QStringLiteral("file-type"), QStringLiteral("binary"));
+    msg.insert(QStringLiteral("rest"), 0);
+    msg.insert(QStringLiteral("file-id"), randomBytes(32, 6));
+    msg.insert(QStringLiteral("conversation"), randomBytes(32, 7));
+    return msg;
+}
+
+// A small file sent inline with the offer
+QCborMap createInlineFileOffer() {
+    auto msg = createFileOffer();
+    msg.insert(QStringLiteral("size"), 3000);
+    msg.insert(QStringLiteral("file-content"), randomBytes(3000, 9));
+    return msg;
+}
+
+// The receiver's delta signature for an earlier version of the file
+QCborMap createFileSignatures() {
+    auto msg = ControlCodec::create(ControlCodec::Type::FILE_SIGNATURES);
+    msg.insert(QStringLiteral("file-id"), randomBytes(32, 6));
+    msg.insert(QStringLiteral("block-size"), 4096);
+    msg.insert(QStringLiteral("signatures"), randomBytes(20 * 302, 10));
+    return msg;
+}
+
+QCborMap createAck() {
+    auto msg = ControlCodec::create(ControlCodec::Type::ACK);
+    msg.insert(QStringLiteral("what"), QStringLiteral("Message"));
+    msg.insert(QStringLiteral("status"), QStringLiteral("Received"));
+    msg.insert(QStringLiteral("data"), QString{randomBytes(32, 8).toBase64()});
+    return msg;
+}
+
+void addTestData() {
+    QTest::addColumn<QCborMap>("msg");
+    QTest::addColumn<bool>("cbor");
+
+    QTest::newRow("message-json") << createMessage() << false;
+    QTest::newRow("message-cbor") << createMessage() << true;
+    QTest::newRow("batch-json") << createMessageBatch() << false;
+    QTest::newRow("batch-cbor") << createMessageBatch() << true;
+    QTest::newRow("offer-json") << createFileOffer() << false;
+    QTest::newRow("offer-cbor") << createFileOffer() << true;
+    QTest::newRow("inline-offer-json") << createInlineFileOffer() << false;
+    QTest::newRow("inline-offer-cbor") << createInlineFileOffer() << true;
+    QTest::newRow("signatures-json") << createFileSignatures() << false;
+    QTest::newRow("signatures-cbor") << createFileSignatures() << true;
+    QTest::newRow("ack-json") << createAck() << false;
+    QTest::newRow("ack-cbor") << createAck() << true;
+}
+
+ControlCodec::Encoding toEncoding(const bool cbor) {
+    return cbor ? ControlCodec::Encoding::CBOR : ControlCodec::Encoding::JSON;
+}
+
+} // anonymous namespace
+
+void TestControlCodec::test_roundtrip_data()
+{
+    addTestData();
+}
+
+void TestControlCodec::test_roundtrip()
+{
+    QFETCH(QCborMap, msg);
+    QFETCH(bool, cbor);
+
+    const auto data = ControlCodec::encode(msg, toEncoding(cbor));
+    const auto decoded = ControlCodec::decode(data.constData(), static_cast<size_t>(data.size()));
+
+    QCOMPARE(ControlCodec::getType(decoded), ControlCodec::getType(msg));
+    QCOMPARE(decoded, msg);
+}
+
+void TestControlCodec::test_json_compatible()
+{
+    // Older versions expect base64 for binary fields and strings for sizes
+    const auto data = ControlCodec::encode(createFileOffer(), ControlCodec::Encoding::JSON);
+    const auto json = QJsonDocument::fromJson(data).object();
+
+    QCOMPARE(json.value("type").toString(), QString{"IncomingFile"});
+    QCOMPARE(json.value("size").toString(), QString{"1234567"});
+    QCOMPARE(json.value("rest").toString(), QString{"0"});
+    QCOMPARE(QByteArray::fromBase64(json.value("sha256").toString().toUtf8()), randomBytes(32, 5));
+}
+
+void TestControlCodec::test_wire_size()
+{
+    for(const auto& msg : {createMessage(), createMessageBatch(), createFileOffer(), createAck()}) {
+        const auto json = ControlCodec::encode(msg, ControlCodec::Encoding::JSON);
+        const auto cbor = ControlCodec::encode(msg, ControlCodec::Encoding::CBOR);
+
+        LFLOG_INFO << ControlCodec::getTypeName(ControlCodec::getType(msg))
+                   << ": Json " << json.size() << " bytes, CBOR " << cbor.size() << " bytes";
+
+        QVERIFY(cbor.size() < json.size());
+    }
+}
+
+void TestControlCodec::bench_encode_data()
+{
+    addTestData();
+}
+
+void TestControlCodec::bench_encode()
+{
+    QFETCH(QCborMap, msg);
+    QFETCH(bool, cbor);
+
+    const auto encoding = toEncoding(cbor);
+    QBENCHMARK {
+        ControlCodec::encode(msg, encoding);
+    }
+}
+
+void TestControlCodec::bench_decode_data()
+{
+    addTestData();
+}
+
+void TestControlCodec::bench_decode()
+{
+    QFETCH(QCborMap, msg);
+    QFETCH(bool, cbor);
+
+    const auto data = ControlCodec::encode(msg, toEncoding(cbor));
+    QBENCHMARK {
+        ControlCodec::decode(data.constData(), static_cast<size_t>(data.size()));
+    }
+}
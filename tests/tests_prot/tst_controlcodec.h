@@ -0,0 +1,23 @@
+#ifndef TST_CONTROLCODEC_H
+#define TST_CONTROLCODEC_H
+
+#include <QtTest>
+
+class TestControlCodec : public QObject
+{
+    Q_OBJECT
+public:
+    TestControlCodec() = default;
+
+private slots:
+    void test_roundtrip_data();
+    void test_roundtrip();
+    void test_json_compatible();
+    void test_wire_size();
+    void bench_encode_data();
+    void bench_encode();
+    void bench_decode_data();
+    void bench_decode();
+};
+
+#endif // TST_CONTROLCODEC_H